@@ -0,0 +1,217 @@
+#!/bin/bash
+#
+# Testbed of the CAM poisoner made of network namespaces
+#
+# A Linux bridge, in its own namespace, plays the switch: its FDB is the CAM
+# table, learnt from the source MACs and aged like on a real switch. Two
+# victims ping each other at a given rate, while the CAM poisoner and the
+# tester run in the attacker namespace:
+#
+#          victim A ---.                .--- victim B
+#        10.199.0.1     `-- bridge --'      10.199.0.2
+#                               |
+#                        attacker (cam_poisoning + tester)
+#                          10.199.0.3
+#
+# A first run without attack gives the reference, then each poisoning
+# frequency of the sweep runs on a fresh testbed and reports:
+#  - the interception ratio: frames sent to the tester by the poisoner, out of
+#    the frames the victims exchanged
+#  - the frame loss and the latency added to the round trips of the victims
+#  - the CPU used by the poisoner and the tester, over the run
+#
+# It must be run as root, with the programs of the build directory:
+#   make bench-netns BENCH_NETNS_ARGS="-c 2000 -i 0.005 1000 100 10"
+#   BUILDDIR=/path/to/build/src bench/netns.sh [options] [frequency...]
+#
+
+usage() {
+	cat <<EOF
+Usage: $0 [-c count] [-i interval] [-s size] [-w warmup]
+          [-a poisoner args] [-t tester args] [frequency (ms)...]
+  -c  number of pings exchanged by the victims (default: $COUNT)
+  -i  interval between the pings, in s (default: $INTERVAL)
+  -s  size of the ping payloads (default: $SIZE)
+  -w  time given to the poisoner before the pings, in s (default: $WARMUP)
+  -a  additional arguments of cam_poisoning (e.g. "-L -w 2")
+  -t  arguments of the tester (e.g. "--shm")
+Frequencies default to: $FREQUENCIES
+EOF
+	exit 1
+}
+
+BUILDDIR=${BUILDDIR:-$(dirname "$0")/../src}
+PREFIX=cpbench
+SUBNET=10.199.0
+COUNT=500
+INTERVAL=0.01
+SIZE=56
+WARMUP=3
+POISONER_ARGS=
+TESTER_ARGS=
+FREQUENCIES="1000 100 10"
+
+while getopts "c:i:s:w:a:t:h" opt; do
+	case $opt in
+		c) COUNT=$OPTARG ;;
+		i) INTERVAL=$OPTARG ;;
+		s) SIZE=$OPTARG ;;
+		w) WARMUP=$OPTARG ;;
+		a) POISONER_ARGS=$OPTARG ;;
+		t) TESTER_ARGS=$OPTARG ;;
+		*) usage ;;
+	esac
+done
+shift $((OPTIND - 1))
+[ $# -gt 0 ] && FREQUENCIES="$*"
+
+if [ "$(id -u)" -ne 0 ]; then
+	echo "$0: must be run as root" >&2
+	exit 1
+fi
+for prog in cam_poisoning cam_poisoning-stat tester; do
+	if [ ! -x "$BUILDDIR/$prog" ]; then
+		echo "$0: $BUILDDIR/$prog not found, set BUILDDIR" >&2
+		exit 1
+	fi
+done
+for prog in ip ping; do
+	if ! command -v $prog > /dev/null; then
+		echo "$0: $prog is required" >&2
+		exit 1
+	fi
+done
+
+WORKDIR=$(mktemp -d /tmp/cam_poisoning-bench.XXXXXX)
+HZ=$(getconf CLK_TCK)
+
+cleanup() {
+	local ns
+	for ns in sw a b m; do
+		ip netns del $PREFIX-$ns 2> /dev/null
+	done
+}
+
+trap 'cleanup; rm -rf "$WORKDIR"' EXIT
+trap 'exit 1' INT TERM
+
+#
+# Testbed: one namespace per host, a veth pair between each host and a port
+# of the bridge
+#
+setup() {
+	local ns i=1
+
+	cleanup
+	for ns in sw a b m; do
+		ip netns add $PREFIX-$ns || exit 1
+		ip -n $PREFIX-$ns link set lo up
+	done
+	ip -n $PREFIX-sw link add br0 type bridge
+	ip -n $PREFIX-sw link set br0 up
+	for ns in a b m; do
+		ip -n $PREFIX-sw link add port-$ns type veth \
+				peer name eth0 netns $PREFIX-$ns
+		ip -n $PREFIX-sw link set port-$ns master br0
+		ip -n $PREFIX-sw link set port-$ns up
+		ip -n $PREFIX-$ns link set eth0 address 02:00:00:00:00:0$i
+		ip -n $PREFIX-$ns addr add $SUBNET.$i/24 dev eth0
+		ip -n $PREFIX-$ns link set eth0 up
+		i=$((i + 1))
+	done
+}
+
+# user + system time of a process, in clock ticks
+cpu_ticks() {
+	awk '{ print $14 + $15 }' /proc/$1/stat 2> /dev/null || echo 0
+}
+
+# share of a CPU used between two cpu_ticks, over the elapsed seconds
+cpu_usage() {
+	awk -v a=$1 -v b=$2 -v t=$3 -v hz=$HZ \
+			'BEGIN { printf "%.1f%%", (b - a) * 100 / hz / t }'
+}
+
+# a counter of the live statistics of the poisoner
+ipc_sent() {
+	"$BUILDDIR/cam_poisoning-stat" -c 1 -i 100 2> /dev/null \
+			| awk '/IPC: sent/ { print $3 }'
+}
+
+now() {
+	date +%s.%N
+}
+
+#
+# A run: the victims ping each other, under attack when a frequency is given.
+# Sets LOSS, RTT, and under attack INTERCEPTED, CPU_POISONER, CPU_TESTER
+#
+run() {
+	local freq=$1 poisoner tester start elapsed sent cpu_p cpu_t i
+
+	setup
+	if [ -n "$freq" ]; then
+		ip netns exec $PREFIX-m "$BUILDDIR/tester" -p "$WORKDIR/tester.sock" \
+				$TESTER_ARGS > /dev/null 2>&1 &
+		tester=$!
+		for i in $(seq 50); do
+			[ -S "$WORKDIR/tester.sock" ] && break
+			sleep 0.1
+		done
+		ip netns exec $PREFIX-m "$BUILDDIR/cam_poisoning" -f $freq \
+				$POISONER_ARGS $SUBNET.1 $SUBNET.2 "$WORKDIR/tester.sock" \
+				> "$WORKDIR/poisoner-$freq.log" 2>&1 &
+		poisoner=$!
+		sleep $WARMUP
+		sent=$(ipc_sent)
+		cpu_p=$(cpu_ticks $poisoner)
+		cpu_t=$(cpu_ticks $tester)
+	fi
+
+	start=$(now)
+	ip netns exec $PREFIX-a ping -q -c $COUNT -i $INTERVAL -s $SIZE -W 1 \
+			$SUBNET.2 > "$WORKDIR/ping.log" 2>&1
+	elapsed=$(awk -v s=$start -v e=$(now) 'BEGIN { print e - s }')
+
+	if [ -n "$freq" ]; then
+		INTERCEPTED=$(awk -v a="$sent" -v b="$(ipc_sent)" -v n=$COUNT \
+				'BEGIN { printf "%.1f%%", (b - a) * 100 / (2 * n) }')
+		CPU_POISONER=$(cpu_usage $cpu_p $(cpu_ticks $poisoner) $elapsed)
+		CPU_TESTER=$(cpu_usage $cpu_t $(cpu_ticks $tester) $elapsed)
+		kill -TERM $poisoner
+		wait $poisoner
+		kill -TERM $tester
+		wait $tester
+		rm -f "$WORKDIR/tester.sock"
+	fi
+
+	# iputils: "x packets transmitted, y received, z% packet loss, ..."
+	# then "rtt min/avg/max/mdev = a/b/c/d ms"
+	LOSS=$(awk '/packet loss/ { for (i = 1; i <= NF; i++) \
+			if ($i ~ /%$/) print $i }' "$WORKDIR/ping.log")
+	RTT=$(awk -F '=' '/min\/avg/ { split($2, v, "/"); printf "%.3f", v[2] }' \
+			"$WORKDIR/ping.log")
+	LOSS=${LOSS:-100%}
+}
+
+# latency added to the reference, "-" without replies
+added() {
+	[ -z "$RTT" ] || [ -z "$REFERENCE" ] && echo "-" && return
+	awk -v a=$RTT -v b=$REFERENCE 'BEGIN { printf "%.3f", a - b }'
+}
+
+printf "%d pings of %d bytes every %ss between the victims\n\n" \
+		$COUNT $SIZE $INTERVAL
+printf "%-10s %12s %8s %10s %10s %10s %10s\n" "frequency" "intercepted" \
+		"loss" "rtt (ms)" "added (ms)" "poisoner" "tester"
+
+run
+REFERENCE=$RTT
+printf "%-10s %12s %8s %10s %10s %10s %10s\n" "none" "-" $LOSS ${RTT:--} \
+		"-" "-" "-"
+
+for freq in $FREQUENCIES; do
+	run $freq
+	printf "%-10s %12s %8s %10s %10s %10s %10s\n" "${freq}ms" \
+			$INTERCEPTED $LOSS ${RTT:--} $(added) $CPU_POISONER $CPU_TESTER
+done
@@ -0,0 +1,572 @@
+/*
+ * Client library for the consumers of the CAM poisoner
+ */
+#define _GNU_SOURCE	// for recvmmsg and sendmmsg
+
+#include <camclient.h>
+
+// standard headers
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/epoll.h>
+
+
+#define ETH_HDR_SIZE	14
+#define MAX_EVENTS		2
+// raw frames are received after room for a message header and a record
+#define RAW_OFFSET		(sizeof(struct ipc_msg_hdr) + sizeof(struct ipc_rec))
+#define RXBUF_SIZE		(IPC_MSG_MAX_SIZE + RAW_OFFSET)
+// raw frames read at once: each one in a slot of the reception buffer, with
+// room for its record
+#define RAW_BATCH		16
+#define RAW_SLOT_SIZE	((sizeof(struct ipc_rec) + CAMCLIENT_RAW_FRAME_MAX \
+			+ IPC_ALIGN - 1) & ~(size_t) (IPC_ALIGN - 1))
+
+static void set_mode(struct camclient *c, int mode) {
+	if (c->mode == mode)
+		return;
+	c->mode = mode;
+	if (c->hooks.mode != NULL)
+		c->hooks.mode(mode, c->hooks.arg);
+}
+
+/*
+ * Requests to the poisoner
+ */
+static int request_poisoner(struct camclient *c) {
+	uint8_t msg[sizeof(struct ipc_msg_hdr) + 2 * sizeof(struct ipc_rec)
+		+ sizeof(struct ipc_config) + IPC_ALIGN];
+	struct ipc_rec *rec;
+	struct ipc_config config = { IPC_MSG_MAX_SIZE, 0 };
+	ssize_t ret;
+
+	c->credits = 0;
+	c->frames = 0;
+	if (c->wanted == CAMCLIENT_SHM) {
+		ret = shm_send_handshake(c->sock, &c->poisoner, SHM_MAGIC_REQUEST,
+				NULL, 0);
+	} else {
+		ipc_msg_init(msg);
+		rec = ipc_msg_append(msg, sizeof(msg), IPC_REC_CONFIG, sizeof(config));
+		memcpy(IPC_REC_PAYLOAD(rec), &config, sizeof(config));
+		if (c->window > 0) {
+			rec = ipc_msg_append(msg, sizeof(msg), IPC_REC_CREDIT,
+					sizeof(c->window));
+			memcpy(IPC_REC_PAYLOAD(rec), &c->window, sizeof(c->window));
+		}
+		ret = sendto(c->sock, msg, ((struct ipc_msg_hdr *) msg)->len, 0,
+				(struct sockaddr *) &c->poisoner, sizeof(c->poisoner));
+	}
+	// the poisoner may not be started yet
+	if (ret == -1 && errno != ENOENT && errno != ECONNREFUSED)
+		return -1;
+	return 0;
+}
+
+static void detach_shm(struct camclient *c) {
+	if (c->shm.region == NULL)
+		return;
+	if (c->txmsg != NULL && c->txmsg != c->txbuf)
+		c->txmsg = NULL;
+	epoll_ctl(c->epollfd, EPOLL_CTL_DEL, c->shm.doorbells[SHM_TO_CONSUMER],
+			NULL);
+	shm_close(&c->shm);
+}
+
+int camclient_open(struct camclient *c, const char *path, int mode,
+		uint32_t window) {
+	struct epoll_event ev;
+	int err;
+
+	memset(c, 0, sizeof(struct camclient));
+	c->sock = -1;
+	c->epollfd = -1;
+	c->wanted = mode;
+	c->mode = CAMCLIENT_RAW;
+	c->window = mode != CAMCLIENT_RAW ? window : 0;
+	c->auto_credits = 1;
+	c->max_msg_size = IPC_MSG_MAX_SIZE;
+
+	c->addr.sun_family = AF_UNIX;
+	strncpy(c->addr.sun_path, path, sizeof(c->addr.sun_path) - 1);
+	c->poisoner.sun_family = AF_UNIX;
+	strncpy(c->poisoner.sun_path, CAMCLIENT_POISONER_PATH,
+			sizeof(c->poisoner.sun_path) - 1);
+
+	c->rxbuf = malloc(RXBUF_SIZE);
+	c->txbuf = malloc(IPC_MSG_MAX_SIZE);
+	if (c->rxbuf == NULL || c->txbuf == NULL)
+		goto error;
+
+	if ((c->sock = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0)) == -1)
+		goto error;
+	if (unlink(c->addr.sun_path) == -1 && errno != ENOENT)
+		goto error;
+	if (bind(c->sock, (struct sockaddr *) &c->addr, sizeof(c->addr)) == -1)
+		goto error;
+
+	// the poisoner wakes us up either on the socket or on the doorbell of
+	// the shared memory
+	if ((c->epollfd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+		goto error;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = c->sock;
+	if (epoll_ctl(c->epollfd, EPOLL_CTL_ADD, c->sock, &ev) == -1)
+		goto error;
+
+	if (mode != CAMCLIENT_RAW && request_poisoner(c) == -1)
+		goto error;
+	return 0;
+
+error:
+	err = errno;
+	if (c->epollfd != -1)
+		close(c->epollfd);
+	if (c->sock != -1)
+		close(c->sock);
+	free(c->rxbuf);
+	free(c->txbuf);
+	errno = err;
+	return -1;
+}
+
+void camclient_leave(struct camclient *c) {
+	uint8_t msg[sizeof(struct ipc_msg_hdr) + sizeof(struct ipc_rec)];
+
+	// let the poisoner give our flows to the other consumers
+	if (c->wanted == CAMCLIENT_RAW)
+		return;
+	ipc_msg_init(msg);
+	ipc_msg_append(msg, sizeof(msg), IPC_REC_LEAVE, 0);
+	sendto(c->sock, msg, sizeof(msg), 0, (struct sockaddr *) &c->poisoner,
+			sizeof(c->poisoner));
+}
+
+void camclient_close(struct camclient *c) {
+	camclient_leave(c);
+	detach_shm(c);
+	close(c->epollfd);
+	close(c->sock);
+	unlink(c->addr.sun_path);
+	free(c->rxbuf);
+	free(c->txbuf);
+	c->rxbuf = NULL;
+	c->txbuf = NULL;
+}
+
+void camclient_set_hooks(struct camclient *c,
+		const struct camclient_hooks *hooks) {
+	memcpy(&c->hooks, hooks, sizeof(struct camclient_hooks));
+}
+
+/*
+ * Reception
+ */
+static int accept_shm(struct camclient *c) {
+	struct sockaddr_un from;
+	struct epoll_event ev;
+	struct ipc_rec *rec;
+	void *slot;
+	int fds[3], nfds, i;
+
+	if (shm_recv_handshake(c->sock, &from, fds, &nfds) != SHM_MAGIC_ACCEPT
+			|| nfds != 3) {
+		for (i = 0; i < nfds; i++)
+			close(fds[i]);
+		return 0;
+	}
+	detach_shm(c);
+	if (!shm_attach(&c->shm, fds[0], &fds[1])) {
+		for (i = 0; i < nfds; i++)
+			close(fds[i]);
+		return -1;
+	}
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = c->shm.doorbells[SHM_TO_CONSUMER];
+	if (epoll_ctl(c->epollfd, EPOLL_CTL_ADD, ev.data.fd, &ev) == -1) {
+		shm_close(&c->shm);
+		return -1;
+	}
+
+	// grant the first credits: frames may be waiting for them
+	if (c->window > 0 &&
+			(slot = shm_reserve(&c->shm, SHM_FROM_CONSUMER)) != NULL) {
+		ipc_msg_init(slot);
+		rec = ipc_msg_append(slot, SHM_SLOT_SIZE, IPC_REC_CREDIT,
+				sizeof(c->window));
+		memcpy(IPC_REC_PAYLOAD(rec), &c->window, sizeof(c->window));
+		shm_commit(&c->shm, SHM_FROM_CONSUMER,
+				((struct ipc_msg_hdr *) slot)->len, 0);
+		shm_ring_doorbell(&c->shm, SHM_FROM_CONSUMER);
+	}
+	memcpy(&c->poisoner, &from, sizeof(from));
+	set_mode(c, CAMCLIENT_SHM);
+	return 0;
+}
+
+// read a batch of raw frames without waiting, when no other datagram is
+// expected. Return 1 if some were read
+static int recv_raw_batch(struct camclient *c) {
+	struct mmsghdr msgs[RAW_BATCH];
+	struct iovec iovs[RAW_BATCH];
+	struct sockaddr_un from = {0};
+	struct ipc_rec *rec;
+	uint8_t *slot;
+	int i, n;
+
+	// each frame is read after the room of its record, then moved down to
+	// follow the previous one
+	memset(msgs, 0, sizeof(msgs));
+	slot = c->rxbuf + sizeof(struct ipc_msg_hdr);
+	for (i = 0; i < RAW_BATCH; i++, slot += RAW_SLOT_SIZE) {
+		iovs[i].iov_base = slot + sizeof(struct ipc_rec);
+		iovs[i].iov_len = CAMCLIENT_RAW_FRAME_MAX;
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		// only the last sender matters
+		msgs[i].msg_hdr.msg_name = &from;
+		msgs[i].msg_hdr.msg_namelen = sizeof(from);
+	}
+	if ((n = recvmmsg(c->sock, msgs, RAW_BATCH, MSG_DONTWAIT, NULL)) == -1)
+		return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+	if (msgs[n - 1].msg_hdr.msg_namelen > sizeof(sa_family_t))
+		memcpy(&c->poisoner, &from, sizeof(from));
+
+	ipc_msg_init(c->rxbuf);
+	for (i = 0; i < n; i++) {
+		if (msgs[i].msg_len < ETH_HDR_SIZE ||
+				msgs[i].msg_hdr.msg_flags & MSG_TRUNC)
+			continue;
+		rec = ipc_msg_append(c->rxbuf, RXBUF_SIZE, IPC_REC_FRAME,
+				msgs[i].msg_len);
+		memmove(IPC_REC_PAYLOAD(rec), iovs[i].iov_base, msgs[i].msg_len);
+		rec->seq = c->raw_seq++;
+		rec->orig_len = msgs[i].msg_len;
+	}
+	c->rxmsg = c->rxbuf;
+	c->rxrec = ipc_msg_next(c->rxmsg, NULL);
+	return 1;
+}
+
+// read a datagram without waiting. Return 1 if one was read
+static int recv_socket(struct camclient *c) {
+	struct shm_handshake hs;
+	struct sockaddr_un from = {0};
+	socklen_t from_l = sizeof(from);
+	ssize_t len;
+
+	// only raw frames come to raw consumers
+	if (c->wanted == CAMCLIENT_RAW)
+		return recv_raw_batch(c);
+
+	// the answer to a shared memory request comes with file descriptors
+	len = recv(c->sock, &hs, sizeof(hs), MSG_PEEK | MSG_TRUNC | MSG_DONTWAIT);
+	if (len == -1)
+		return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+	if (len == sizeof(struct shm_handshake))
+		return accept_shm(c) == -1 ? -1 : 1;
+
+	len = recvfrom(c->sock, c->rxbuf, IPC_MSG_MAX_SIZE, MSG_DONTWAIT,
+			(struct sockaddr *) &from, &from_l);
+	if (len == -1)
+		return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+	if (from_l > sizeof(sa_family_t))
+		memcpy(&c->poisoner, &from, sizeof(from));
+
+	if (ipc_msg_check(c->rxbuf, len)) {
+		c->rxmsg = c->rxbuf;
+		c->rxrec = ipc_msg_next(c->rxmsg, NULL);
+	} else if (len >= ETH_HDR_SIZE) {
+		// a raw frame: give it a record, like batched ones
+		memmove(c->rxbuf + RAW_OFFSET, c->rxbuf, len);
+		ipc_msg_init(c->rxbuf);
+		c->rxrec = ipc_msg_append(c->rxbuf, RXBUF_SIZE, IPC_REC_FRAME, len);
+		c->rxrec->seq = c->raw_seq++;
+		c->rxrec->orig_len = len;
+		c->rxmsg = c->rxbuf;
+
+		// raw frames once configured: the poisoner restarted
+		if (c->mode != CAMCLIENT_RAW) {
+			detach_shm(c);
+			set_mode(c, CAMCLIENT_RAW);
+			if (request_poisoner(c) == -1)
+				return -1;
+		}
+	}
+	return 1;
+}
+
+// hand out the frames of the current message, handle the other records
+static int next_frames(struct camclient *c, struct ipc_rec **frames,
+		int max) {
+	struct ipc_rec *rec;
+	struct ipc_config config;
+	struct ipc_stats stats;
+	int n = 0;
+
+	while (c->rxrec != NULL && n < max) {
+		rec = c->rxrec;
+		c->rxrec = ipc_msg_next(c->rxmsg, rec);
+		switch (rec->type) {
+			case IPC_REC_FRAME:
+				frames[n++] = rec;
+				c->frames++;
+				break;
+			case IPC_REC_CONFIG:
+				if (rec->len < sizeof(config))
+					break;
+				memcpy(&config, IPC_REC_PAYLOAD(rec), sizeof(config));
+				c->max_msg_size = config.max_msg_size < IPC_MSG_MAX_SIZE ?
+					config.max_msg_size : IPC_MSG_MAX_SIZE;
+				if (c->mode == CAMCLIENT_RAW)
+					set_mode(c, CAMCLIENT_BATCH);
+				break;
+			case IPC_REC_STATS:
+				if (rec->len < sizeof(stats) || c->hooks.stats == NULL)
+					break;
+				memcpy(&stats, IPC_REC_PAYLOAD(rec), sizeof(stats));
+				c->hooks.stats(&stats, c->hooks.arg);
+				break;
+		}
+	}
+	return n;
+}
+
+static void end_message(struct camclient *c) {
+	if (c->rxmsg != NULL && c->rxmsg != c->rxbuf)
+		shm_release(&c->shm, SHM_TO_CONSUMER);
+	c->rxmsg = NULL;
+	c->rxrec = NULL;
+}
+
+int camclient_recv(struct camclient *c, struct ipc_rec **frames, int max,
+		int timeout) {
+	struct epoll_event events[MAX_EVENTS];
+	uint32_t len, flags;
+	void *msg;
+	int n, ret, wait, waited = 0;
+
+	for (;;) {
+		if ((n = next_frames(c, frames, max)) > 0)
+			return n;
+		end_message(c);
+
+		// the rings first, then the socket
+		if (c->shm.region != NULL &&
+				(msg = shm_peek(&c->shm, SHM_TO_CONSUMER, &len, &flags))
+				!= NULL) {
+			if (ipc_msg_check(msg, len)) {
+				c->rxmsg = msg;
+				c->rxrec = ipc_msg_next(msg, NULL);
+			} else {
+				shm_release(&c->shm, SHM_TO_CONSUMER);
+			}
+			continue;
+		}
+		if ((ret = recv_socket(c)) == -1)
+			return -1;
+		else if (ret > 0)
+			continue;
+
+		// nothing left: sleep, but only once
+		if (waited)
+			return 0;
+		if (c->shm.region != NULL &&
+				shm_prepare_wait(&c->shm, SHM_TO_CONSUMER, 1))
+			continue;
+		wait = timeout;
+		if (c->mode != c->wanted && (wait < 0 ||
+					wait > CAMCLIENT_REQUEST_INTERVAL))
+			wait = CAMCLIENT_REQUEST_INTERVAL;
+		ret = epoll_wait(c->epollfd, events, MAX_EVENTS, wait);
+		if (ret == -1) {
+			return errno == EINTR ? 0 : -1;
+		} else if (ret == 0) {
+			// no answer yet
+			if (c->mode != c->wanted && request_poisoner(c) == -1)
+				return -1;
+			return 0;
+		}
+		// we are awake: the poisoner does not need to ring
+		if (c->shm.region != NULL)
+			shm_prepare_wait(&c->shm, SHM_TO_CONSUMER, 0);
+		waited = 1;
+	}
+}
+
+/*
+ * Emission
+ */
+// send the frame records of the message as raw datagrams, by batch
+static int send_raw(struct camclient *c, struct ipc_msg_hdr *hdr) {
+	struct mmsghdr msgs[RAW_BATCH];
+	struct iovec iovs[RAW_BATCH];
+	struct ipc_rec *rec = ipc_msg_next(hdr, NULL);
+	int i, n, sent, ret = 0;
+
+	memset(msgs, 0, sizeof(msgs));
+	while (rec != NULL) {
+		for (n = 0; rec != NULL && n < RAW_BATCH;
+				rec = ipc_msg_next(hdr, rec)) {
+			if (rec->type != IPC_REC_FRAME)
+				continue;
+			iovs[n].iov_base = IPC_REC_PAYLOAD(rec);
+			iovs[n].iov_len = rec->len;
+			msgs[n].msg_hdr.msg_iov = &iovs[n];
+			msgs[n].msg_hdr.msg_iovlen = 1;
+			msgs[n].msg_hdr.msg_name = &c->poisoner;
+			msgs[n].msg_hdr.msg_namelen = sizeof(c->poisoner);
+			n++;
+		}
+		// on errors, skip the frame and send the next ones
+		for (i = 0; i < n; i += sent) {
+			if ((sent = sendmmsg(c->sock, msgs + i, n - i, 0)) == -1) {
+				ret = -1;
+				sent = 1;
+			}
+		}
+	}
+	return ret;
+}
+
+static int send_message(struct camclient *c) {
+	struct ipc_msg_hdr *hdr = c->txmsg;
+	int ret = 0;
+
+	if (hdr == NULL)
+		return 0;
+	c->txmsg = NULL;
+	if (hdr->count == 0) {
+		// nothing to send, give the slot back
+		return 0;
+	}
+
+	if ((void *) hdr != c->txbuf) {
+		c->doorbell |= shm_commit(&c->shm, SHM_FROM_CONSUMER, hdr->len, 0);
+	} else if (c->mode == CAMCLIENT_RAW) {
+		ret = send_raw(c, hdr);
+	} else if (sendto(c->sock, hdr, hdr->len, 0,
+				(struct sockaddr *) &c->poisoner, sizeof(c->poisoner))
+			== -1) {
+		ret = -1;
+	}
+	return ret;
+}
+
+static int begin_message(struct camclient *c) {
+	if (c->txmsg != NULL)
+		return 0;
+	if (c->mode == CAMCLIENT_SHM) {
+		// build the message in place
+		if ((c->txmsg = shm_reserve(&c->shm, SHM_FROM_CONSUMER)) == NULL) {
+			errno = ENOBUFS;
+			return -1;
+		}
+		c->txsize = SHM_SLOT_SIZE;
+	} else {
+		c->txmsg = c->txbuf;
+		c->txsize = c->mode == CAMCLIENT_RAW ? IPC_MSG_MAX_SIZE
+			: c->max_msg_size;
+	}
+	ipc_msg_init(c->txmsg);
+	return 0;
+}
+
+struct ipc_rec *camclient_reserve(struct camclient *c, uint16_t type,
+		uint32_t len) {
+	struct ipc_rec *rec;
+
+	if (begin_message(c) == -1)
+		return NULL;
+	if ((rec = ipc_msg_append(c->txmsg, c->txsize, type, len)) != NULL)
+		return rec;
+
+	// full: send it and start another one
+	if (((struct ipc_msg_hdr *) c->txmsg)->count == 0) {
+		errno = EMSGSIZE;
+		return NULL;
+	}
+	if (send_message(c) == -1 || begin_message(c) == -1)
+		return NULL;
+	if ((rec = ipc_msg_append(c->txmsg, c->txsize, type, len)) == NULL)
+		errno = EMSGSIZE;
+	return rec;
+}
+
+int camclient_send(struct camclient *c, const struct ipc_rec *meta,
+		const void *frame, uint32_t len) {
+	struct ipc_rec *rec;
+
+	if ((rec = camclient_reserve(c, IPC_REC_FRAME, len)) == NULL)
+		return -1;
+	if (meta != NULL) {
+		rec->seq = meta->seq;
+		rec->ts = meta->ts;
+		rec->orig_len = meta->orig_len;
+		rec->ifindex = meta->ifindex;
+	}
+	memcpy(IPC_REC_PAYLOAD(rec), frame, len);
+	return 0;
+}
+
+int camclient_verdict(struct camclient *c, const void *frame, uint32_t len,
+		uint32_t verdict, uint32_t ttl) {
+	struct ipc_verdict v = { verdict, ttl };
+	struct ipc_rec *rec;
+
+	if (c->mode == CAMCLIENT_RAW) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	if (len > IPC_VERDICT_HDR_LEN)
+		len = IPC_VERDICT_HDR_LEN;
+	if ((rec = camclient_reserve(c, IPC_REC_VERDICT, sizeof(v) + len)) == NULL)
+		return -1;
+	memcpy(IPC_REC_PAYLOAD(rec), &v, sizeof(v));
+	memcpy(IPC_REC_PAYLOAD(rec) + sizeof(v), frame, len);
+	return 0;
+}
+
+int camclient_request_stats(struct camclient *c) {
+	if (c->mode == CAMCLIENT_RAW) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	return camclient_reserve(c, IPC_REC_STATS, 0) == NULL ? -1 : 0;
+}
+
+void camclient_grant(struct camclient *c, uint32_t credits) {
+	c->credits += credits;
+}
+
+int camclient_flush(struct camclient *c) {
+	struct ipc_rec *rec;
+	int ret = 0;
+
+	if (c->auto_credits && c->window > 0)
+		c->credits += c->frames;
+	c->frames = 0;
+
+	// credits are piggybacked on the frames sent back
+	if (c->credits > 0 && c->mode != CAMCLIENT_RAW) {
+		if ((rec = camclient_reserve(c, IPC_REC_CREDIT,
+						sizeof(c->credits))) == NULL) {
+			ret = -1;
+		} else {
+			memcpy(IPC_REC_PAYLOAD(rec), &c->credits, sizeof(c->credits));
+			c->credits = 0;
+		}
+	}
+	if (send_message(c) == -1)
+		ret = -1;
+	if (c->doorbell) {
+		shm_ring_doorbell(&c->shm, SHM_FROM_CONSUMER);
+		c->doorbell = 0;
+	}
+	return ret;
+}
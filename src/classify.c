@@ -0,0 +1,150 @@
+/*
+ * Batch classification of the destination MAC addresses
+ *
+ * When the compiler supports it, the hot loop is compiled for several
+ * instruction sets (AVX2, SSE4.2 and the baseline) and the best one is
+ * selected at run time. Otherwise frames are classified one by one.
+ */
+
+#include <classify.h>
+
+// standard headers
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/socket.h>
+#include <linux/if_packet.h>
+
+// local headers
+#include <arp.h>
+#include <logger.h>
+
+
+void init_classifier(struct classifier *c, struct target_table *targets,
+		uint8_t local[ETH_ALEN]) {
+	size_t i;
+
+	c->targets = targets;
+	c->local = mac_to_key(local);
+	c->nkeys = targets->count;
+	c->keys = (uint64_t *) malloc(
+			(c->nkeys > 0 ? c->nkeys : 1) * sizeof(uint64_t)
+			);
+	if (c->keys == NULL) {
+		perror("Cannot allocate memory for the classifier");
+		exit(1);
+	}
+	for (i = 0; i < c->nkeys; i++)
+		c->keys[i] = mac_to_key(targets->targets[i].mac);
+
+#ifdef USE_SIMD_CLASSIFY
+	log_debug("Frames are classified with SIMD (%zu targets)\n", c->nkeys);
+#else
+	log_debug("Frames are classified one by one (%zu targets)\n", c->nkeys);
+#endif
+}
+
+void free_classifier(struct classifier *c) {
+	free(c->keys);
+	c->nkeys = 0;
+}
+
+#ifdef USE_SIMD_CLASSIFY
+/*
+ * Branchless loops over the whole batch, to let the compiler vectorize them
+ */
+__attribute__((target_clones("avx2", "sse4.2", "default")))
+void classify_lanes(const uint64_t *restrict lanes, size_t n,
+		const uint64_t *restrict keys, size_t nkeys, uint64_t local,
+		uint8_t *restrict routes, int32_t *restrict match) {
+	size_t i, j;
+	uint8_t route;
+
+	for (i = 0; i < n; i++)
+		match[i] = -1;
+
+	// compare all lanes against each target
+	for (j = 0; j < nkeys; j++) {
+		for (i = 0; i < n; i++)
+			match[i] = lanes[i] == keys[j] ? (int32_t) j : match[i];
+	}
+
+	for (i = 0; i < n; i++) {
+		route = (lanes[i] & MAC_LANE_MCAST) ? ROUTE_MULTICAST : ROUTE_QUEUE;
+		route = lanes[i] == local ? ROUTE_LOCAL : route;
+		routes[i] = match[i] >= 0 ? ROUTE_IPC : route;
+	}
+}
+
+void classify_batch(struct classifier *c, struct rx_batch *batch,
+		uint8_t *routes, int32_t *match) {
+	int i;
+	uint64_t lanes[RX_BATCH_SIZE];
+	struct target *target;
+	struct sockaddr_ll *addr;
+
+	// load the destination MAC addresses
+	for (i = 0; i < batch->count; i++) {
+		memcpy(&lanes[i], batch->bufs[i], sizeof(uint64_t));
+		lanes[i] &= MAC_LANE_MASK;
+	}
+
+	if (c->nkeys <= CLASSIFY_SIMD_MAX_TARGETS) {
+		classify_lanes(lanes, batch->count, c->keys, c->nkeys, c->local,
+				routes, match);
+	} else {
+		// too many targets to compare them all: look the lanes up instead
+		classify_lanes(lanes, batch->count, NULL, 0, c->local,
+				routes, match);
+		for (i = 0; i < batch->count; i++) {
+			target = target_table_lookup_key(c->targets, lanes[i]);
+			if (target != NULL) {
+				match[i] = target->index;
+				routes[i] = ROUTE_IPC;
+			}
+		}
+	}
+
+	// Only treat incoming ethernet frames (prevent OOB read too)
+	for (i = 0; i < batch->count; i++) {
+		addr = (struct sockaddr_ll *) &batch->addrs[i];
+		if (addr->sll_pkttype == PACKET_OUTGOING ||
+				batch->lens[i] < (ssize_t) sizeof(struct ether_header))
+			routes[i] = ROUTE_IGNORE;
+	}
+}
+
+#else /* USE_SIMD_CLASSIFY */
+void classify_batch(struct classifier *c, struct rx_batch *batch,
+		uint8_t *routes, int32_t *match) {
+	int i;
+	struct ether_header *eh;
+	struct sockaddr_ll *addr;
+	struct target *target;
+	uint8_t local[ETH_ALEN];
+
+	memcpy(local, &c->local, ETH_ALEN);
+	for (i = 0; i < batch->count; i++) {
+		eh = (struct ether_header *) batch->bufs[i];
+		addr = (struct sockaddr_ll *) &batch->addrs[i];
+		match[i] = -1;
+
+		// Only treat incoming ethernet frames (prevent OOB read too)
+		if (addr->sll_pkttype == PACKET_OUTGOING ||
+				batch->lens[i] < (ssize_t) sizeof(struct ether_header)) {
+			routes[i] = ROUTE_IGNORE;
+		} else if ((target = target_table_lookup(c->targets,
+						eh->ether_dhost)) != NULL) {
+			match[i] = target->index;
+			routes[i] = ROUTE_IPC;
+		} else if (ETHER_CMP(eh->ether_dhost, local)) {
+			routes[i] = ROUTE_LOCAL;
+		} else if ((eh->ether_dhost[0] & 0x01) == 0x00) {
+			routes[i] = ROUTE_QUEUE;
+		} else {
+			routes[i] = ROUTE_MULTICAST;
+		}
+	}
+}
+#endif /* USE_SIMD_CLASSIFY */
@@ -0,0 +1,158 @@
+/*
+ * Flows of the intercepted frames: canonical keys & cached verdicts
+ */
+
+#include <flow.h>
+
+// standard headers
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+
+// local headers
+#include <logger.h>
+
+
+int flow_key_from_frame(const void *buf, size_t len, struct flow_key *key) {
+	const struct ether_header *eh = buf;
+	const uint8_t *l3 = (const uint8_t *) buf + sizeof(struct ether_header);
+	const struct iphdr *ip;
+	const uint16_t *ports;
+	size_t ihl;
+	uint32_t ip_tmp;
+	uint16_t port_tmp;
+
+	if (len < sizeof(struct ether_header))
+		return 0;
+
+	memset(key, 0, sizeof(struct flow_key));
+	key->ethertype = ntohs(eh->ether_type);
+	len -= sizeof(struct ether_header);
+
+	if (key->ethertype == ETHERTYPE_IP && len >= sizeof(struct iphdr)) {
+		ip = (const struct iphdr *) l3;
+		ihl = ip->ihl * 4;
+		key->proto = ip->protocol;
+		key->ip[0] = ntohl(ip->saddr);
+		key->ip[1] = ntohl(ip->daddr);
+
+		// ports of the first fragment only
+		if ((key->proto == IPPROTO_TCP || key->proto == IPPROTO_UDP) &&
+				(ntohs(ip->frag_off) & 0x1fff) == 0 &&
+				ihl >= sizeof(struct iphdr) && len >= ihl + 4) {
+			ports = (const uint16_t *) (l3 + ihl);
+			key->port[0] = ntohs(ports[0]);
+			key->port[1] = ntohs(ports[1]);
+		}
+
+		if (key->ip[0] > key->ip[1] ||
+				(key->ip[0] == key->ip[1] && key->port[0] > key->port[1])) {
+			ip_tmp = key->ip[0];
+			key->ip[0] = key->ip[1];
+			key->ip[1] = ip_tmp;
+			port_tmp = key->port[0];
+			key->port[0] = key->port[1];
+			key->port[1] = port_tmp;
+		}
+	} else {
+		if (memcmp(eh->ether_shost, eh->ether_dhost, ETH_ALEN) < 0) {
+			memcpy(key->mac[0], eh->ether_shost, ETH_ALEN);
+			memcpy(key->mac[1], eh->ether_dhost, ETH_ALEN);
+		} else {
+			memcpy(key->mac[0], eh->ether_dhost, ETH_ALEN);
+			memcpy(key->mac[1], eh->ether_shost, ETH_ALEN);
+		}
+	}
+	return 1;
+}
+
+/*
+ * Flow table
+ */
+void flow_table_init(struct flow_table *t, size_t size) {
+	t->entries = (struct flow_entry *) calloc(size, sizeof(struct flow_entry));
+	if (t->entries == NULL) {
+		perror("Cannot allocate memory for the flow table");
+		exit(1);
+	}
+	t->size = size;
+	t->wheel = NULL;
+	t->passed = 0;
+	t->dropped = 0;
+	log_debug("Flow table initialized with %zu slots\n", size);
+}
+
+void flow_table_free(struct flow_table *t) {
+	size_t i;
+
+	if (t->wheel != NULL) {
+		for (i = 0; i < t->size; i++)
+			timer_cancel(t->wheel, &t->entries[i].timer);
+	}
+	free(t->entries);
+	t->entries = NULL;
+	t->size = 0;
+}
+
+void static flow_expired(void *data, void *args) {
+	struct flow_entry *entry = data;
+
+	entry->verdict = FLOW_VERDICT_NONE;
+}
+
+int flow_table_lookup(struct flow_table *t, const struct flow_key *key,
+		uint32_t hash, uint64_t now) {
+	size_t i, slot;
+	struct flow_entry *entry;
+
+	for (i = 0; i < FLOW_PROBES; i++) {
+		slot = (hash + i) & (t->size - 1);
+		entry = &t->entries[slot];
+		if (entry->verdict != FLOW_VERDICT_NONE &&
+				memcmp(&entry->key, key, sizeof(struct flow_key)) == 0) {
+			return entry->expires > now ? (int) entry->verdict
+				: FLOW_VERDICT_NONE;
+		}
+	}
+	return FLOW_VERDICT_NONE;
+}
+
+void flow_table_set(struct flow_table *t, const struct flow_key *key,
+		int verdict, uint32_t ttl, uint64_t now) {
+	size_t i, slot;
+	uint32_t hash = flow_hash(key);
+	struct flow_entry *entry, *victim = NULL, *free_slot = NULL;
+
+	for (i = 0; i < FLOW_PROBES; i++) {
+		slot = (hash + i) & (t->size - 1);
+		entry = &t->entries[slot];
+		if (entry->verdict != FLOW_VERDICT_NONE &&
+				memcmp(&entry->key, key, sizeof(struct flow_key)) == 0) {
+			free_slot = entry;
+			break;
+		}
+		// the first free or expired slot, else the live entry expiring
+		// first. The flow may still be further: go on
+		if (entry->verdict == FLOW_VERDICT_NONE || entry->expires <= now) {
+			if (free_slot == NULL)
+				free_slot = entry;
+		} else if (victim == NULL || entry->expires < victim->expires) {
+			victim = entry;
+		}
+	}
+	if (free_slot != NULL)
+		victim = free_slot;
+
+	memcpy(&victim->key, key, sizeof(struct flow_key));
+	victim->verdict = verdict;
+	victim->expires = now + (ttl > 0 ? ttl : FLOW_DEFAULT_TTL);
+	if (t->wheel != NULL) {
+		if (!timer_pending(&victim->timer))
+			timer_init(&victim->timer, &flow_expired, victim);
+		timer_add(t->wheel, &victim->timer, victim->expires);
+	}
+}
@@ -0,0 +1,172 @@
+/*
+ * Per-thread latency histograms of the stages of the pipeline
+ */
+
+#include <histo.h>
+
+// standard headers
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+// local headers
+#include <logger.h>
+#include <threadreg.h>
+#include <utils.h>
+
+
+struct histo_thread {
+	struct histo stages[STAGE_COUNT];
+};
+
+static const char *stage_names[STAGE_COUNT] = {
+	"Capture to IPC send",
+	"Consumer round-trip",
+	"Queued before retransmission",
+	"CAM restoration",
+	"Poison cadence error",
+	"Wire-to-wire residence",
+};
+
+// histograms of all threads, never freed: samples outlive their thread
+static void *thread_entries[HISTO_MAX_THREADS];
+static struct thread_registry threads =
+	THREAD_REGISTRY_INIT(thread_entries, HISTO_MAX_THREADS);
+static _Thread_local struct histo_thread *local;
+
+/*
+ * Buckets
+ */
+unsigned int static inline bucket_of(uint64_t ns) {
+	unsigned int exp;
+
+	if (ns < HISTO_SUB_COUNT)
+		return ns;
+	exp = 63 - __builtin_clzll(ns);
+	if (exp >= HISTO_MAX_BITS)
+		return HISTO_BUCKETS - 1;
+	// block exp - HISTO_SUB_BITS + 1, then the HISTO_SUB_BITS bits after the
+	// leading one
+	return (exp - HISTO_SUB_BITS + 1) * HISTO_SUB_COUNT
+		+ ((ns >> (exp - HISTO_SUB_BITS)) - HISTO_SUB_COUNT);
+}
+
+// middle of the bucket
+uint64_t static inline value_of(unsigned int bucket) {
+	unsigned int block = bucket / HISTO_SUB_COUNT;
+	uint64_t sub = bucket % HISTO_SUB_COUNT;
+
+	if (block == 0)
+		return sub;
+	return ((HISTO_SUB_COUNT + sub) << (block - 1))
+		+ ((1ULL << (block - 1)) >> 1);
+}
+
+/*
+ * Recording
+ */
+struct histo_thread static inline *local_histos(void) {
+	struct histo_thread *h;
+	int i, j;
+
+	if (local != NULL)
+		return local;
+
+	h = (struct histo_thread *) malloc(sizeof(struct histo_thread));
+	if (h == NULL) {
+		perror("Cannot allocate memory for the latency histograms");
+		exit(1);
+	}
+	for (i = 0; i < STAGE_COUNT; i++) {
+		for (j = 0; j < HISTO_BUCKETS; j++)
+			atomic_init(&h->stages[i].counts[j], 0);
+		atomic_init(&h->stages[i].max, 0);
+	}
+
+	if (!thread_registry_add(&threads, h)) {
+		log_warning("Too many threads: latencies are not recorded\n");
+		// keep the histograms, unreported, not to try again
+	}
+
+	local = h;
+	return h;
+}
+
+void histo_record(int stage, uint64_t ns) {
+	struct histo *h = &local_histos()->stages[stage];
+
+	counter_add(&h->counts[bucket_of(ns)], 1);
+	if (ns > atomic_load_explicit(&h->max, memory_order_relaxed))
+		atomic_store_explicit(&h->max, ns, memory_order_relaxed);
+}
+
+/*
+ * Reading
+ */
+void histo_merge(int stage, uint64_t counts[HISTO_BUCKETS], uint64_t *max) {
+	struct histo_thread *t;
+	struct histo *h;
+	uint64_t m;
+	int i, j, n = thread_registry_count(&threads);
+
+	memset(counts, 0, HISTO_BUCKETS * sizeof(uint64_t));
+	*max = 0;
+	for (i = 0; i < n; i++) {
+		t = threads.entries[i];
+		h = &t->stages[stage];
+		for (j = 0; j < HISTO_BUCKETS; j++)
+			counts[j] += atomic_load_explicit(&h->counts[j],
+					memory_order_relaxed);
+		m = atomic_load_explicit(&h->max, memory_order_relaxed);
+		if (m > *max)
+			*max = m;
+	}
+}
+
+uint64_t histo_percentile(const uint64_t counts[HISTO_BUCKETS],
+		double percentile) {
+	uint64_t total = 0, rank, seen = 0;
+	int i;
+
+	for (i = 0; i < HISTO_BUCKETS; i++)
+		total += counts[i];
+	if (total == 0)
+		return 0;
+
+	// rank of the sample, from 1 to total
+	rank = (uint64_t) (percentile / 100 * total + 0.5);
+	if (rank < 1)
+		rank = 1;
+	for (i = 0; i < HISTO_BUCKETS; i++) {
+		seen += counts[i];
+		if (seen >= rank)
+			return value_of(i);
+	}
+	return value_of(HISTO_BUCKETS - 1);
+}
+
+void histo_dump(void) {
+	static const double percentiles[] = { 50, 90, 99, 99.9, 99.99 };
+	uint64_t counts[HISTO_BUCKETS], max, total;
+	int i, j;
+
+	logger_print("Latency percentiles (us):\n");
+	for (i = 0; i < STAGE_COUNT; i++) {
+		histo_merge(i, counts, &max);
+		for (total = 0, j = 0; j < HISTO_BUCKETS; j++)
+			total += counts[j];
+		logger_print("  %-30s", stage_names[i]);
+		if (total == 0) {
+			logger_print(" no sample\n");
+			continue;
+		}
+		logger_print(" n=%-9lu", (unsigned long) total);
+		for (j = 0; j < sizeof(percentiles) / sizeof(percentiles[0]); j++) {
+			// the middle of the last bucket may be above the max
+			logger_print(" p%g=%.1f", percentiles[j], (double) MIN(max,
+						histo_percentile(counts, percentiles[j])) / 1000);
+		}
+		logger_print(" max=%.1f\n", (double) max / 1000);
+	}
+}
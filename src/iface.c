@@ -19,10 +19,14 @@
 #include <ifaddrs.h>
 #include <arpa/inet.h>
 #include <linux/if_packet.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
+#include <errno.h>
 
 // internal imports
 #include <logger.h>
 #include <utils.h>
+#include <vclock.h>
 
 /*
  * Init the network structure from the given interface using ioctls
@@ -122,14 +126,20 @@ int get_iface_by_ip(struct in_addr search_ip, struct iface *iface) {
 	return 0;
 }
 
+// raw sockets, unless a backend is set
+const struct pio_backend *pio_backend = NULL;
+
 /*
  * Create a promiscuous raw socket
  */
 int super_socket(struct iface *iface, int type, int protocol) {
-	int sock;
+	int sock, flags;
 	struct sockaddr_ll addr;
 	struct ifreq ifr;
 
+	if (pio_backend != NULL)
+		return pio_backend->socket(iface, type, protocol);
+
 	// open a raw socket to handle the ARP injections
 	if ((sock = socket(AF_PACKET, type, htons(protocol))) == -1) {
 		perror("Cannot open raw socket");
@@ -159,6 +169,128 @@ int super_socket(struct iface *iface, int type, int protocol) {
 		exit(1);
 	}
 
+	// timestamp received frames in the kernel. Transmissions are only
+	// timestamped when asked for, see super_socket_send_timestamped
+	flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE
+		| SOF_TIMESTAMPING_OPT_TSONLY;
+	if (setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPING,
+				&flags, sizeof(flags)) == -1) {
+		log_warning("Kernel timestamps are not supported: frames are "
+				"timestamped when read\n");
+	}
+
 	return sock;
 }
 
+int super_socket_tx_timestamps(int sock) {
+	uint32_t flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE
+		| SOF_TIMESTAMPING_OPT_TSONLY | SOF_TIMESTAMPING_OPT_ID;
+
+	if (pio_backend != NULL)
+		return 0;
+	// the key of the timestamps counts the frames asking for one: it starts
+	// at 0 when OPT_ID is enabled
+	if (setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPING,
+				&flags, sizeof(flags)) == -1) {
+		perror("Failed to enable transmission timestamps");
+		return 0;
+	}
+	return 1;
+}
+
+// the key of the transmission timestamp held by msg, if any
+int static inline cmsg_timestamp_key(struct msghdr *msg, uint32_t *key) {
+	struct cmsghdr *cmsg;
+	struct sock_extended_err *err;
+
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL;
+			cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_PACKET &&
+				cmsg->cmsg_type == PACKET_TX_TIMESTAMP) {
+			err = (struct sock_extended_err *) CMSG_DATA(cmsg);
+			if (err->ee_errno != ENOMSG ||
+					err->ee_origin != SO_EE_ORIGIN_TIMESTAMPING)
+				return 0;
+			*key = err->ee_data;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Send a frame and retrieve its transmission time from the kernel
+ * Without TX timestamps, ts is the time send returned
+ */
+ssize_t super_socket_send_timestamped(int sock, const void *buf, size_t len,
+		uint32_t *key, struct timespec *ts) {
+	struct iovec iov = { (void *) buf, len };
+	struct msghdr msg;
+	union {
+		struct cmsghdr align;
+		// timestamps & extended error on reception
+		char buf[256];
+	} control;
+	struct cmsghdr *cmsg;
+	uint32_t flags = SOF_TIMESTAMPING_TX_SOFTWARE, sent_key, tx_key;
+	ssize_t ret;
+
+	if (pio_backend != NULL) {
+		ret = send(sock, buf, len, 0);
+		clock_now(CLOCK_REALTIME, ts);
+		return ret;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	memset(&control, 0, sizeof(control));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = CMSG_SPACE(sizeof(flags));
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SO_TIMESTAMPING;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(flags));
+	memcpy(CMSG_DATA(cmsg), &flags, sizeof(flags));
+
+	if ((ret = sendmsg(sock, &msg, 0)) == -1)
+		return -1;
+	sent_key = (*key)++;
+
+	// the timestamp is queued on the error queue of the socket, usually
+	// before sendmsg returns. Those of the previous frames, which were not
+	// queued yet when they were sent, come first: skip them
+	while (1) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control.buf;
+		msg.msg_controllen = sizeof(control.buf);
+		if (recvmsg(sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1)
+			break;
+		if (cmsg_timestamp_key(&msg, &tx_key) && tx_key == sent_key &&
+				cmsg_timestamp(&msg, ts))
+			return ret;
+	}
+	clock_now(CLOCK_REALTIME, ts);
+	return ret;
+}
+
+/*
+ * Enable busy polling on a socket created by super_socket()
+ * Failures are not fatal: the socket still works without busy polling
+ */
+int super_socket_busy_poll(int sock, int usecs) {
+	int prefer = 1;
+
+	if (setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL,
+				&usecs, sizeof(usecs)) == -1) {
+		perror("Failed to enable busy polling");
+		return 0;
+	}
+	if (setsockopt(sock, SOL_SOCKET, SO_PREFER_BUSY_POLL,
+				&prefer, sizeof(prefer)) == -1) {
+		// only available since Linux 5.11
+		log_warning("Preferred busy polling is not supported\n");
+	}
+	log_debug("Busy polling enabled for %ius\n", usecs);
+	return 1;
+}
@@ -0,0 +1,154 @@
+#ifndef CAMCLIENT_H
+#define CAMCLIENT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <ipcmsg.h>
+#include <shmring.h>
+
+/*
+ * Client library for the third-party programs (the consumers) of the CAM
+ * poisoner. It hides the transports of the IPC: raw datagrams, batched
+ * messages and shared memory rings, and the flow control.
+ *
+ * Typical loop:
+ *
+ *   camclient_open(&c, path, CAMCLIENT_SHM, 256);
+ *   for (;;) {
+ *       n = camclient_recv(&c, frames, 64, -1);
+ *       for (i = 0; i < n; i++)
+ *           camclient_send(&c, frames[i], IPC_REC_PAYLOAD(frames[i]),
+ *                   frames[i]->len);
+ *       camclient_flush(&c);
+ *   }
+ *
+ * Received frames are records of ipcmsg.h, read in place: in the shared
+ * memory or in the reception buffer. They stay valid until the next call to
+ * camclient_recv. Records to send are written in place too (see
+ * camclient_reserve) and sent by camclient_flush.
+ *
+ * Functions returning an int return -1 on errors, with errno set. Nothing is
+ * printed and the process never exits.
+ */
+#define CAMCLIENT_POISONER_PATH	"/var/run/cam_poisoning/cam_poisoning.sock"
+#define CAMCLIENT_REQUEST_INTERVAL	1000	// in ms
+// larger raw frames are dropped: the poisoner sends at most MAX_PKT_SIZE
+#define CAMCLIENT_RAW_FRAME_MAX		2048
+
+// transports, from the slowest to the fastest
+#define CAMCLIENT_RAW		0	// one raw frame per datagram
+#define CAMCLIENT_BATCH		1	// batched messages over the socket
+#define CAMCLIENT_SHM		2	// batched messages in shared memory rings
+
+/*
+ * Optional hooks, called from camclient_recv
+ */
+struct camclient_hooks {
+	// the transport changed: the poisoner answered the request, or it
+	// restarted and sends raw frames again
+	void (*mode)(int mode, void *arg);
+	// answer to camclient_request_stats
+	void (*stats)(const struct ipc_stats *stats, void *arg);
+	void *arg;
+};
+
+struct camclient {
+	int sock;
+	int epollfd;				// socket & doorbell, see camclient_fd
+	int wanted;					// transport asked for
+	int mode;					// transport in use
+	struct sockaddr_un addr;	// our socket
+	struct sockaddr_un poisoner;
+	struct camclient_hooks hooks;
+	uint64_t raw_seq;			// to number raw frames
+
+	// flow control, see camclient_grant
+	uint32_t window;			// credits granted on start, 0 for none
+	int auto_credits;
+	uint32_t credits;			// not granted yet
+
+	// reception: the current message and the next record to hand out
+	uint8_t *rxbuf;
+	void *rxmsg;
+	struct ipc_rec *rxrec;
+	int rx_raw;					// the current message was a raw frame
+	int shm_held;				// the current message is a ring slot
+	uint32_t frames;			// frames handed out since the last flush
+
+	// emission
+	uint8_t *txbuf;
+	void *txmsg;				// message being built, NULL if none
+	size_t txsize;
+	uint32_t max_msg_size;		// of the poisoner
+	int doorbell;				// ring the poisoner's doorbell on flush
+
+	struct shm_channel shm;
+};
+
+/*
+ * Create the socket of the consumer at path and ask the poisoner for the
+ * given transport. With window set, the poisoner sends at most this number
+ * of frames in flight: credits are granted again automatically for the frames
+ * handed out by camclient_recv, on each flush (see camclient_grant).
+ * An existing socket file at path is replaced.
+ */
+int camclient_open(struct camclient *c, const char *path, int mode,
+		uint32_t window);
+// tell the poisoner we leave (safe from a signal handler)
+void camclient_leave(struct camclient *c);
+// leave, then close everything and delete the socket file
+void camclient_close(struct camclient *c);
+
+void camclient_set_hooks(struct camclient *c,
+		const struct camclient_hooks *hooks);
+
+// a file descriptor readable when camclient_recv has something, to embed the
+// client in another event loop
+static inline int camclient_fd(const struct camclient *c) {
+	return c->epollfd;
+}
+
+/*
+ * Reception. Store up to max frame records in frames and return their number.
+ * Wait at most timeout ms (-1 forever) for them. Return 0 on timeout, or when
+ * only control records were received.
+ * Until the poisoner answers, the request is sent again every
+ * CAMCLIENT_REQUEST_INTERVAL ms.
+ */
+int camclient_recv(struct camclient *c, struct ipc_rec **frames, int max,
+		int timeout);
+
+/*
+ * Emission. Records are appended to the message being built, sent on flush or
+ * when the message is full.
+ * camclient_reserve returns a record of type with len bytes of payload to
+ * fill in place (NULL if the ring is full). With raw frames, only the
+ * payloads of the frame records are sent.
+ */
+struct ipc_rec *camclient_reserve(struct camclient *c, uint16_t type,
+		uint32_t len);
+// send a frame, with the metadata of meta (may be NULL)
+int camclient_send(struct camclient *c, const struct ipc_rec *meta,
+		const void *frame, uint32_t len);
+// cache a verdict (IPC_VERDICT_*) for the flow of frame, for ttl ms
+int camclient_verdict(struct camclient *c, const void *frame, uint32_t len,
+		uint32_t verdict, uint32_t ttl);
+int camclient_request_stats(struct camclient *c);
+int camclient_flush(struct camclient *c);
+
+/*
+ * Flow control hook: grant credits for frames the consumer is done with.
+ * Disable the automatic credits to keep frames longer than a flush (e.g. to
+ * process them in other threads)
+ */
+void camclient_grant(struct camclient *c, uint32_t credits);
+static inline void camclient_auto_credits(struct camclient *c, int enable) {
+	c->auto_credits = enable;
+}
+
+#endif /* CAMCLIENT_H */
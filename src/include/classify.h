@@ -0,0 +1,57 @@
+#ifndef CLASSIFY_H
+#define CLASSIFY_H
+
+#include <config.h>
+
+#include <stdint.h>
+#include <endian.h>
+
+#include <target.h>
+#include <utils.h>
+
+/*
+ * Classification of the frames received from the network, by batch: each
+ * frame gets a route telling what to do with it
+ */
+#define ROUTE_IPC		0	// sent to one of the targets: intercept it
+#define ROUTE_QUEUE		1	// unicast to another host: retransmit it
+#define ROUTE_LOCAL		2	// for the local interface: drop it
+#define ROUTE_MULTICAST	3	// broadcast or multicast: drop it
+#define ROUTE_IGNORE	4	// outgoing or truncated frame: drop it
+
+/*
+ * The destination MAC address is loaded as a 64-bit lane (the 8 first bytes
+ * of the frame) whose 48 bits of the MAC are kept. Keys of the target table
+ * use the same layout
+ */
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+#define MAC_LANE_MASK	0x0000ffffffffffffULL
+#define MAC_LANE_MCAST	0x0000000000000001ULL
+#else
+#define MAC_LANE_MASK	0xffffffffffff0000ULL
+#define MAC_LANE_MCAST	0x0100000000000000ULL
+#endif
+
+// above this number of targets, lanes are looked up in the hash table
+#define CLASSIFY_SIMD_MAX_TARGETS 32
+
+struct classifier {
+	struct target_table *targets;
+	uint64_t local;				// key of the local interface
+	size_t nkeys;
+	uint64_t *keys;				// keys[i] is the key of targets[i]
+};
+
+void init_classifier(struct classifier *c, struct target_table *targets,
+		uint8_t local[ETH_ALEN]);
+void free_classifier(struct classifier *c);
+
+/*
+ * Classify a batch received from a packet socket
+ * routes[i] is the route of the frame i and match[i] the index of the target
+ * when the route is ROUTE_IPC
+ */
+void classify_batch(struct classifier *c, struct rx_batch *batch,
+		uint8_t *routes, int32_t *match);
+
+#endif /* CLASSIFY_H */
@@ -0,0 +1,96 @@
+#ifndef FLOW_H
+#define FLOW_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <net/ethernet.h>
+
+#include <timerwheel.h>
+
+/*
+ * Flows of the intercepted frames. The key is canonical: both directions of
+ * a flow give the same key (the lowest endpoint comes first).
+ * IPv4 frames are keyed by their 5-tuple (ports are 0 for other protocols
+ * than TCP & UDP), other frames by their pair of MAC addresses
+ */
+struct flow_key {
+	uint32_t ip[2];
+	uint16_t port[2];
+	uint16_t ethertype;
+	uint8_t proto;
+	uint8_t pad;
+	uint8_t mac[2][ETH_ALEN];	// only for non IPv4 frames
+};
+
+// build the key of a frame. Return 0 if the frame is too short
+int flow_key_from_frame(const void *buf, size_t len, struct flow_key *key);
+
+// FNV-1a followed by a final mix
+static inline uint32_t hash_bytes(const void *buf, size_t len, uint32_t seed) {
+	const uint8_t *p = buf;
+	uint32_t h = 2166136261u ^ seed;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		h ^= p[i];
+		h *= 16777619u;
+	}
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	return h;
+}
+
+static inline uint32_t flow_hash(const struct flow_key *key) {
+	return hash_bytes(key, sizeof(struct flow_key), 0);
+}
+
+/*
+ * Verdicts of the consumers on flows, cached with a TTL. Frames of a passed
+ * flow are retransmitted without going through the IPC, frames of a dropped
+ * flow are discarded.
+ *
+ * Open addressing: a flow lives in one of the FLOW_PROBES slots following
+ * its hash. Only when none is free or expired, the entry expiring first is
+ * replaced.
+ * With a timer wheel, entries are freed when they expire; lookups still
+ * check the TTL, as the wheel may be driven later
+ */
+// same values as IPC_VERDICT_*
+#define FLOW_VERDICT_NONE		0	// no cached verdict: send to the consumer
+#define FLOW_VERDICT_PASS		1
+#define FLOW_VERDICT_DROP		2
+#define FLOW_VERDICT_INTERCEPT	3	// keep sending to the consumer
+
+#define FLOW_TABLE_SIZE		65536	// must be a power of two
+#define FLOW_PROBES			8
+#define FLOW_DEFAULT_TTL	30000	// in ms
+
+struct flow_entry {
+	struct flow_key key;
+	uint32_t verdict;
+	uint64_t expires;			// CLOCK_MONOTONIC, in ms
+	struct timer timer;
+};
+
+struct flow_table {
+	size_t size;
+	struct flow_entry *entries;
+	struct timer_wheel *wheel;	// NULL to only expire on lookup
+	uint64_t passed;			// frames handled by the cached verdicts
+	uint64_t dropped;
+};
+
+void flow_table_init(struct flow_table *t, size_t size);
+void flow_table_free(struct flow_table *t);
+
+// return the verdict of the flow, FLOW_VERDICT_NONE if it expired
+int flow_table_lookup(struct flow_table *t, const struct flow_key *key,
+		uint32_t hash, uint64_t now);
+void flow_table_set(struct flow_table *t, const struct flow_key *key,
+		int verdict, uint32_t ttl, uint64_t now);
+
+#endif /* FLOW_H */
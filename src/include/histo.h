@@ -0,0 +1,55 @@
+#ifndef HISTO_H
+#define HISTO_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+/*
+ * Latency histograms of the stages of the pipeline, in ns
+ *
+ * Buckets are log-linear (like HDR histograms): values below HISTO_SUB_COUNT
+ * have their own bucket, then each power of two is split in HISTO_SUB_COUNT
+ * buckets of the same width. The relative error is below 1/HISTO_SUB_COUNT,
+ * from 1ns up to 2^HISTO_MAX_BITS ns (about 18 minutes); larger values go to
+ * the last bucket.
+ *
+ * Each thread records in its own histograms, allocated on first use: there
+ * is a single writer per histogram and no lock on the hot path. Readers merge
+ * the histograms of all threads, possibly while they are written: a sample
+ * may be missed, which is fine for reporting
+ */
+#define HISTO_SUB_BITS		5
+#define HISTO_SUB_COUNT		(1 << HISTO_SUB_BITS)
+#define HISTO_MAX_BITS		40
+#define HISTO_BUCKETS		((HISTO_MAX_BITS - HISTO_SUB_BITS + 1) \
+		* HISTO_SUB_COUNT)
+#define HISTO_MAX_THREADS	128
+
+// stages of the pipeline
+#define STAGE_CAPTURE_TO_IPC	0	// from the capture to the IPC send
+#define STAGE_CONSUMER_RTT		1	// from the IPC send to the frame's return
+#define STAGE_QUEUED			2	// in the queue, until taken by a worker
+#define STAGE_RESTORE			3	// duration of restore_mac()
+#define STAGE_CADENCE			4	// error of the poisoning cadence
+#define STAGE_RESIDENCE			5	// wire-to-wire, kernel timestamps
+#define STAGE_COUNT				6
+
+struct histo {
+	atomic_uint_fast64_t counts[HISTO_BUCKETS];
+	atomic_uint_fast64_t max;
+};
+
+// record a sample of the stage in the histograms of the calling thread
+void histo_record(int stage, uint64_t ns);
+
+// merge the histograms of all threads for the stage
+void histo_merge(int stage, uint64_t counts[HISTO_BUCKETS], uint64_t *max);
+
+// value of the given percentile (0 to 100) of merged counts
+uint64_t histo_percentile(const uint64_t counts[HISTO_BUCKETS],
+		double percentile);
+
+// print the percentiles of all stages
+void histo_dump(void);
+
+#endif /* HISTO_H */
@@ -1,6 +1,11 @@
 #ifndef IFACE_H
 #define IFACE_H
 
+#include <stdint.h>
+#include <time.h>
+
+#include <sys/types.h>
+
 #include <net/if.h>
 #include <net/ethernet.h>
 #include <netinet/in.h>
@@ -16,6 +21,17 @@ struct iface {
 	unsigned char hwaddr[ETH_ALEN];
 };
 
+/*
+ * Packet I/O backend. When one is set (see replay.h and switchemu.h),
+ * super_socket() returns its sockets instead of raw ones: frames are read and
+ * sent through them with the usual calls, but they have no kernel timestamps
+ */
+struct pio_backend {
+	const char *name;
+	int (*socket)(struct iface *iface, int type, int protocol);
+};
+extern const struct pio_backend *pio_backend;
+
 int get_iface_by_name(const char *ifname, struct iface *iface);
 int get_iface_by_ip(struct in_addr search_ip, struct iface *iface);
 
@@ -42,7 +58,22 @@ int get_iface_by_ip(struct in_addr search_ip, struct iface *iface);
 #define FIRST_IP(ipa, mask) ( ((ipa) & (mask)) + 1 )
 #define LAST_IP(ipa, mask) ( ((ipa) | ~(mask)) - 1 )
 
-// Create a promiscuous raw socket
+// Create a promiscuous raw socket, with kernel timestamps of received frames
 int super_socket(struct iface *iface, int type, int protocol);
 
+// enable the transmission timestamps on such a socket. Return 0 if they are
+// not supported: the frames are sent without them
+int super_socket_tx_timestamps(int sock);
+// send a frame on it and retrieve its kernel transmission time. key counts
+// the frames sent this way on the socket (0 first): it tells the timestamp
+// of the frame from the late ones of the previous frames
+ssize_t super_socket_send_timestamped(int sock, const void *buf, size_t len,
+		uint32_t *key, struct timespec *ts);
+
+// Enable busy polling on the socket (low-latency mode)
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+int super_socket_busy_poll(int sock, int usecs);
+
 #endif /* IFACE_H */
@@ -3,23 +3,166 @@
 
 #include <config.h>
 
+#include <stdint.h>
+
+#include <time.h>
+
 #include <sys/types.h>
 #include <sys/un.h>
 
+#include <flow.h>
+#include <ipcmsg.h>
+#include <shmring.h>
+#include <statpage.h>
+#include <utils.h>
+
 // path for the socket. This socket may be used for packet injection by any
 // application
 #define VAR_DIR_PATH	"/var/run/" PACKAGE_NAME
 #define SOCKET_PATH		VAR_DIR_PATH "/cam_poisoning.sock"
+// path of the live statistics (see statpage.h)
+#define STATS_PATH		VAR_DIR_PATH "/" STATPAGE_FILE
+
+// metadata of a frame sent through the IPC
+struct ipc_frame_info {
+	struct timespec ts;			// capture time (CLOCK_REALTIME)
+	uint32_t orig_len;
+	int32_t ifindex;
+	int32_t target;				// index of the target or -1
+	uint32_t hash;				// of the flow (see flow.h)
+};
+
+/*
+ * Third-party programs receiving the intercepted frames. Frames are spread
+ * over the consumers by flow, with a consistent hash: each consumer owns
+ * IPC_VNODES points on a ring and a flow goes to the next point of the ring.
+ * When a consumer joins or leaves, only the flows of its points move.
+ *
+ * Consumers given on the command line are permanent. Others join by sending
+ * a CONFIG record or a shared-memory request, and leave with a LEAVE record
+ * or when their socket disappears
+ */
+#define IPC_MAX_CONSUMERS	64
+#define IPC_VNODES			64
+
+// send times are kept for the last frames, to measure the round-trip time
+// of the consumers from the sequence numbers sent back
+#define IPC_RTT_WINDOW		4096	// must be a power of two
+
+/*
+ * What to do with a frame when its consumer cannot take it (no credits left,
+ * full ring or full socket buffer)
+ */
+#define IPC_OVERLOAD_BUFFER		0	// keep it up to the budget, then drop
+#define IPC_OVERLOAD_DROP		1	// drop it
+#define IPC_OVERLOAD_FORWARD	2	// retransmit it unmodified
+#define IPC_DEFAULT_BUDGET		1024	// in frames, per consumer
+
+// results of sendto_ipc
+#define IPC_ERROR		-1
+#define IPC_SENT		0
+#define IPC_BUFFERED	1
+#define IPC_DROPPED		2
+#define IPC_FORWARD		3		// the caller must retransmit the frame
+
+// a frame waiting for credits
+struct ipc_pending {
+	size_t len;
+	struct ipc_frame_info info;
+	uint8_t buf[MAX_PKT_SIZE];
+};
+
+struct ipc_consumer {
+	struct sockaddr_un remote;
+	int permanent;
+
+	// batched message format, once the consumer sent its configuration
+	int batched;
+	size_t max_msg_size;		// of the messages sent to the consumer
+	uint64_t seq;
+	uint64_t *sent;				// send times (ns) of the last frames, by seq
+	uint8_t *txbuf;				// message being built
+	int blocked;				// ... and found the socket buffer full
+	struct ipc_stats stats;
+
+	// flow control
+	int credit_based;			// the consumer sent credits
+	int64_t credits;
+	size_t backlog_head, backlog_count;
+	struct ipc_pending *backlog;	// allocated on first use
+
+	// shared-memory transport, once requested by the consumer. Slots always
+	// hold batched messages
+	int shm_active;
+	int shm_pending;			// the doorbell must be rung on flush
+	struct shm_channel shm;
+
+	// sent a LEAVE record: removed once its message is released, see
+	// reap_ipc_consumers
+	int leaving;
+};
+
+struct ipc_vnode {
+	uint32_t point;
+	uint32_t consumer;			// index in consumers
+};
 
 struct ipc {
 	int sock;
-	struct sockaddr_un remote;
+	uint8_t *rxbuf;
+	uint64_t drops;				// frames dropped for lack of consumers
+	struct ipc_stats departed;	// sum of the stats of the consumers gone
+
+	// overload policy
+	int policy;
+	size_t budget;
+
+	// where the verdicts of the consumers are cached, if any
+	struct flow_table *flows;
+
+	int count;
+	struct ipc_consumer *consumers[IPC_MAX_CONSUMERS];
+	size_t nvnodes;
+	struct ipc_vnode vnodes[IPC_MAX_CONSUMERS * IPC_VNODES];	// sorted
 };
 
 // open the IPC (it is a UNIX socket)
-void open_ipc(struct ipc *ipc, const char *path);
+void open_ipc(struct ipc *ipc);
+
+// consumers management. add_ipc_consumer returns the existing consumer if
+// the path is already known, NULL if there are too many consumers
+struct ipc_consumer *add_ipc_consumer(struct ipc *ipc, const char *path,
+		int permanent);
+void remove_ipc_consumer(struct ipc *ipc, struct ipc_consumer *consumer);
+// remove the consumers which left, with their last frames sent. Only once
+// done with their message: it may be in their shared memory
+void reap_ipc_consumers(struct ipc *ipc);
+struct ipc_consumer *find_ipc_consumer(struct ipc *ipc, const char *path);
+struct ipc_consumer *find_ipc_doorbell(struct ipc *ipc, int doorbell);
+
+// send a frame through IPC, to the consumer of its flow. With the batched
+// format or the shared-memory transport, the frame is only appended: call
+// flush_ipc at the end of a batch, and regularly to send buffered frames.
+// Return one of IPC_SENT, IPC_BUFFERED, IPC_DROPPED, IPC_FORWARD or IPC_ERROR
+int sendto_ipc(struct ipc *ipc, const void *buf, size_t length,
+		struct ipc_frame_info *info);
+void flush_ipc(struct ipc *ipc);
+
+/*
+ * Handle a message received from a consumer or any other program, either a
+ * batched message or a raw frame (an empty one being a flush request).
+ * Frames are given to frame_callback with their capture time, in ns since
+ * the epoch (0 for raw frames, which have none). Control records are
+ * answered. Return 1 if a flush was requested
+ */
+int handle_ipc_message(struct ipc *ipc, struct sockaddr_un *from,
+		void *buf, size_t length,
+		void (*frame_callback)(void *buf, size_t len, uint64_t ts,
+			void *args),
+		void *args);
 
-// send through IPC
-ssize_t sendto_ipc(struct ipc *ipc, const void *buf, size_t length);
+// answer a shared-memory request of a consumer. Return the doorbell to wait
+// on for frames sent back, or -1 on errors
+int accept_shm_ipc(struct ipc *ipc, struct ipc_consumer *consumer);
 
 #endif /* IPC_H */
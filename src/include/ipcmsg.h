@@ -0,0 +1,111 @@
+#ifndef IPCMSG_H
+#define IPCMSG_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Message format of the IPC, shared by the CAM poisoner and the third-party
+ * program. A message carries several records, each one with a small header:
+ *
+ *   struct ipc_msg_hdr | struct ipc_rec | payload | pad | struct ipc_rec | ...
+ *
+ * Records are aligned on IPC_ALIGN bytes. hdr_len gives the size of the
+ * record header so that fields can be appended in later versions. All fields
+ * are in the native byte order: both sides run on the same host.
+ *
+ * A message is a datagram, or a slot of the shared-memory rings.
+ */
+#define IPC_MAGIC			0x4d435043	// "CPCM"
+#define IPC_VERSION			1
+#define IPC_ALIGN			8
+#define IPC_MSG_MAX_SIZE	65536
+
+// types of records
+#define IPC_REC_FRAME		1	// an Ethernet frame
+#define IPC_REC_FLUSH		2	// retransmit the queued frames now
+#define IPC_REC_STATS		3	// request (empty) or reply (struct ipc_stats)
+#define IPC_REC_CONFIG		4	// struct ipc_config, see below
+#define IPC_REC_LEAVE		5	// the consumer stops receiving frames
+#define IPC_REC_CREDIT		6	// uint32_t: more frames the consumer accepts
+#define IPC_REC_VERDICT		7	// struct ipc_verdict, see below
+
+struct ipc_msg_hdr {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t count;				// number of records
+	uint32_t len;				// whole message, header included
+	uint32_t reserved;
+};
+
+struct ipc_rec {
+	uint16_t type;
+	uint16_t hdr_len;			// offset of the payload
+	uint32_t len;				// payload length (captured length of frames)
+	uint64_t seq;				// sequence number of the frame
+	uint64_t ts;				// capture time, in ns since the epoch
+	uint32_t orig_len;			// length of the frame on the wire
+	int32_t ifindex;			// interface the frame was captured on
+	int32_t target;				// index of the target it was sent to, or -1
+	uint32_t reserved;
+};
+
+#define IPC_REC_PAYLOAD(rec) ((uint8_t *) (rec) + (rec)->hdr_len)
+
+struct ipc_stats {
+	uint64_t frames_sent;		// frames sent to the third-party program
+	uint64_t frames_received;	// frames received from it
+	uint64_t messages_sent;
+	uint64_t messages_received;
+	uint64_t drops;				// frames which could not be sent
+	uint64_t overloads;			// frames which found the consumer overloaded
+	uint64_t buffered;			// ... and were kept until it catches up
+	uint64_t forwarded;			// ... and were retransmitted unmodified
+};
+
+/*
+ * Sent by the third-party program to switch the poisoner to this format (the
+ * poisoner answers with its own configuration). Until then, the poisoner
+ * sends one raw frame per datagram
+ *
+ * Flow control: once the third-party program sent a CREDIT record, the
+ * poisoner sends it at most as many frames as the credits granted so far.
+ * Credits are usually piggybacked on the messages sent back
+ */
+struct ipc_config {
+	uint32_t max_msg_size;		// largest message the sender can receive
+	uint32_t flags;				// reserved
+};
+
+/*
+ * Verdict of the consumer on the flow of a frame. The payload is followed by
+ * the beginning of any frame of the flow (at least up to the ports), from
+ * which the poisoner finds the flow. The verdict is cached for ttl ms
+ */
+#define IPC_VERDICT_PASS		1	// retransmit without the consumer
+#define IPC_VERDICT_DROP		2	// discard
+#define IPC_VERDICT_INTERCEPT	3	// keep sending to the consumer
+#define IPC_VERDICT_HDR_LEN		64	// enough for Ethernet, IPv4 & ports
+
+struct ipc_verdict {
+	uint32_t verdict;
+	uint32_t ttl;				// in ms, 0 for the default of the poisoner
+};
+
+// start an empty message in buf
+void ipc_msg_init(void *buf);
+
+// append a record with a payload of len bytes to the message in buf, whose
+// size is size. Return the record (its payload must be filled by the caller)
+// or NULL if it does not fit
+struct ipc_rec *ipc_msg_append(void *buf, size_t size, uint16_t type,
+		uint32_t len);
+
+// return 1 if buf holds a valid message of len bytes. Then the records can be
+// walked with ipc_msg_next without further checks
+int ipc_msg_check(const void *buf, size_t len);
+
+// first record with prev set to NULL, NULL after the last one
+struct ipc_rec *ipc_msg_next(const void *buf, struct ipc_rec *prev);
+
+#endif /* IPCMSG_H */
@@ -1,7 +1,10 @@
 #ifndef LOGGER_H
 #define LOGGER_H
 
+#include <config.h>
+
 #include <stdio.h>
+#include <stddef.h>
 
 
 // Logger levels
@@ -11,6 +14,12 @@
 #define LOGLVL_INFO		  1
 #define LOGLVL_DEBUG	  0
 
+// messages below this level are compiled out (see --with-log-level)
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL	LOGLVL_DEBUG
+#endif
+#define LOG_ENABLED(level)	((level) >= LOG_MIN_LEVEL && logLevel <= (level))
+
 // logger structure
 #ifdef  MAIN_FILE
 int logLevel;
@@ -25,89 +34,64 @@ extern FILE *logFacility, *logErrorFacility;
 		logLevel = LOGLVL_WARNING; \
 		logFacility = stdout; \
 		logErrorFacility = stderr; \
-		setbuf(logFacility, NULL); \
-		setbuf(logErrorFacility, NULL); \
 	} while(0)
 
+/*
+ * Asynchronous output: once the logger is started, messages are formatted in
+ * a ring of the calling thread and written by a background thread. Nothing
+ * blocks the caller: when its ring is full, the message is dropped (and
+ * counted). Before the start and after the stop, messages are written
+ * directly.
+ */
+#define LOGGER_SLOT_SIZE		256		// longer messages are truncated
+#define LOGGER_SLOTS			1024	// per thread, a power of two
+#define LOGGER_MAX_THREADS		128		// other threads write directly
+#define LOGGER_DRAIN_INTERVAL	10		// in ms, when the rings are empty
+
+// redirect the output to a file, appended. Return 0 on errors
+int logger_open_file(const char *path);
+// start the background writer (stopped at exit)
+void logger_start(void);
+// write all pending messages and stop the background writer
+void logger_stop(void);
+
+void logger_write(int error, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+// hexdump of a frame, one message per line
+void logger_pkt(const void *buf, size_t len);
 
-// logger functions
-#define logger_print(...) do { \
-	fprintf(logFacility, __VA_ARGS__); \
-	} while(0)
 
-#define logger_print_error(...) do { \
-	fprintf(logErrorFacility, __VA_ARGS__); \
-	} while(0)
+// logger functions
+#define logger_print(...) logger_write(0, __VA_ARGS__)
+#define logger_print_error(...) logger_write(1, __VA_ARGS__)
 
 #define log_critical(...) do { \
-	if (logLevel <= LOGLVL_CRITICAL) { \
+	if (LOG_ENABLED(LOGLVL_CRITICAL)) { \
 		logger_print_error(__VA_ARGS__); \
 	} } while(0)
 
 #define log_error(...) do { \
-	if (logLevel <= LOGLVL_ERROR) { \
+	if (LOG_ENABLED(LOGLVL_ERROR)) { \
 		logger_print_error(__VA_ARGS__); \
 	} } while(0)
 
 #define log_warning(...) do { \
-	if (logLevel <= LOGLVL_WARNING) { \
+	if (LOG_ENABLED(LOGLVL_WARNING)) { \
 		logger_print(__VA_ARGS__); \
 	} } while(0)
 
 #define log_info(...) do { \
-	if (logLevel <= LOGLVL_INFO) { \
+	if (LOG_ENABLED(LOGLVL_INFO)) { \
 		logger_print(__VA_ARGS__); \
 	} } while(0)
 
 #define log_debug(...) do { \
-	if (logLevel <= LOGLVL_DEBUG) { \
+	if (LOG_ENABLED(LOGLVL_DEBUG)) { \
 		logger_print(__VA_ARGS__); \
 	} } while(0)
 
-#define logger_pkt(buf, len) do { \
-	printf("|"); \
-	int _i_, _j_; \
-	unsigned char _c_; \
-	for (_i_=0; _i_<(len); _i_++){ \
-		if (_i_ % 16 == 0 && _i_ > 0) { \
-			printf("|    |"); \
-			for (_j_=0; _j_<16; _j_++) { \
-				if (_j_ == 8) \
-					printf(" "); \
-				_c_ = ((unsigned char *)(buf))[_i_-16+_j_]; \
-				if (_c_ >= 0x20 && _c_ < 0x7f) \
-					printf("%c", _c_); \
-				else \
-					printf("."); \
-			} \
-			printf("|\n|"); \
-		} else if (_i_ % 8 == 0 && _i_ > 0) \
-			printf("  "); \
-		else if (_i_ != 0) \
-			printf(" "); \
-		printf("%02x", ((unsigned char *)(buf))[_i_]); \
-	} \
-	for (_j_=0; _j_<16*3-(_i_%16)*3+(_i_%16>8?0:1); _j_++) { \
-		printf(" "); \
-	} \
-	printf("|    |"); \
-	for (int _j_=0; _j_<=((_i_-1)%16); _j_++) { \
-		if (_j_ == 8) \
-			printf(" "); \
-		_c_ = ((unsigned char *)(buf))[_i_-16+_j_]; \
-		if (_c_ >= 0x20 && _c_ < 0x7f) \
-			printf("%c", _c_); \
-		else \
-			printf("."); \
-	} \
-	for (_j_=0; _j_<16-(_i_%16)+(_i_%16>8?0:1); _j_++) { \
-		printf(" "); \
-	} \
-	printf("|\n"); \
-} while(0)
-
 #define log_pkt_debug(buf, len) do { \
-	if (logLevel <= LOGLVL_DEBUG) { \
+	if (LOG_ENABLED(LOGLVL_DEBUG)) { \
 		logger_pkt((buf), (len)); \
 	} } while(0)
 
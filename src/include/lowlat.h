@@ -0,0 +1,59 @@
+#ifndef LOWLAT_H
+#define LOWLAT_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+
+/*
+ * Low-latency mode: busy polling sockets, spinning receive loop, CPU pinning
+ * and real-time scheduling of the poisoning thread
+ */
+#define LOWLAT_MAX_CPUS 64
+#define LOWLAT_DEFAULT_BUSY_POLL 50		// in us
+#define LOWLAT_REPORT_INTERVAL 5000		// in ms
+
+struct lowlat_opts {
+	int enabled;
+	int busy_poll;			// SO_BUSY_POLL duration in us
+	int rt_priority;		// SCHED_FIFO priority, 0 to keep the default
+	// first CPU is for the capture & poisoning thread, the other ones are
+	// shared by the retransmission workers
+	int ncpus;
+	int cpus[LOWLAT_MAX_CPUS];
+};
+
+// parse a comma-separated list of CPUs. Return the number of CPUs or -1
+int parse_cpu_list(const char *list, int *cpus, int max);
+
+// pin a thread on a CPU
+int pin_thread(pthread_t thread, int cpu);
+
+// run the calling thread under SCHED_FIFO and lock the memory
+int set_realtime(int priority);
+
+/*
+ * Latency statistics, in ns. Each instance has a single writer: readers may
+ * see a slightly inconsistent snapshot, which is fine for reporting
+ */
+struct lat_stats {
+	atomic_uint_fast64_t count;
+	atomic_uint_fast64_t sum;
+	atomic_uint_fast64_t min;
+	atomic_uint_fast64_t max;
+};
+
+void lat_stats_init(struct lat_stats *s);
+void lat_stats_add(struct lat_stats *s, uint64_t ns);
+// merge src into dst (dst must not be concurrently written)
+void lat_stats_merge(struct lat_stats *dst, struct lat_stats *src);
+void lat_stats_report(const char *name, struct lat_stats *s);
+
+// an helper to retrieve the difference of two timespec into ns
+#define TS_DIFF_IN_NS(ts1, ts2) ( \
+		((int64_t)(ts1).tv_sec - (int64_t)(ts2).tv_sec) * 1000000000LL \
+		+ ((int64_t)(ts1).tv_nsec - (int64_t)(ts2).tv_nsec) \
+		)
+
+#endif /* LOWLAT_H */
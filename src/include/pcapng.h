@@ -0,0 +1,51 @@
+#ifndef PCAPNG_H
+#define PCAPNG_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+/*
+ * Recording of the intercepted and retransmitted frames in pcapng files
+ *
+ * Each thread builds the blocks of its frames in place in its own ring: the
+ * frame is copied once, and nothing blocks the caller (when its ring is full,
+ * the frame is dropped and counted). A background thread writes the rings to
+ * the file straight from their memory, and rotates the file when it grows
+ * over the given size.
+ *
+ * Files have one interface (the attacked one), nanosecond timestamps and the
+ * direction of each frame: inbound for the intercepted ones, outbound for the
+ * retransmitted ones.
+ */
+#define PCAPNG_RING_SIZE		(4 * 1024 * 1024)	// per thread, power of two
+#define PCAPNG_MAX_THREADS		64			// frames of other threads are lost
+#define PCAPNG_DRAIN_INTERVAL	1			// in ms, when the rings are empty
+
+#define PCAPNG_INBOUND			1			// epb_flags direction
+#define PCAPNG_OUTBOUND			2
+
+struct pcapng_opts {
+	const char *path;
+	const char *ifname;
+	size_t max_size;			// rotate over this size (bytes), 0 for never
+	int max_files;				// keep that many files, 0 for all
+};
+
+// set to 1 while recording: pcapng_record is then worth calling
+extern atomic_int pcapng_running;
+
+// start the background writer. Return 0 on errors
+int pcapng_start(const struct pcapng_opts *opts);
+// write the pending frames and close the file
+void pcapng_stop(void);
+
+// record a frame, ts in ns since the epoch
+void pcapng_record(const void *buf, uint32_t len, uint32_t orig_len,
+		uint64_t ts, int direction);
+
+static inline int pcapng_enabled(void) {
+	return atomic_load_explicit(&pcapng_running, memory_order_relaxed);
+}
+
+#endif /* PCAPNG_H */
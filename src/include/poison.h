@@ -8,13 +8,21 @@
 
 #include <sys/time.h>
 
+#include <classify.h>
 #include <ipc.h>
 #include <iface.h>
+#include <lowlat.h>
+#include <statpage.h>
+#include <target.h>
+#include <timerwheel.h>
+#include <utils.h>
 
 
 struct message {
 	size_t len;
 	void *buf;
+	struct timespec ts;		// when the frame was queued (CLOCK_MONOTONIC)
+	struct timespec rx_ts;	// when the kernel received it (CLOCK_REALTIME)
 };
 
 #define QLIST_MAX_SIZE 128
@@ -29,25 +37,32 @@ struct queue {
 	size_t count;
 	size_t size;
 	struct qlist *entries;
+	// counters (only updated by the capture thread)
+	uint64_t queued;
+	uint64_t drops;
 };
 
-/* the following inline functions are defined inside poison.c
-int inline init_queue(struct queue *q);
-struct qlist inline *queue_get_entry(struct queue *q,uint8_t sender[ETH_ALEN]);
-int inline queue_message(struct queue *q, void *buf, size_t buflen);
-int inline free_queue(struct queue *q);
-*/
+// message queue of the capture thread (also measured by the benchmarks)
+void init_queue(struct queue *q);
+struct qlist *queue_get_entry(struct queue *q, uint8_t dest[ETH_ALEN]);
+int queue_message(struct queue *q, void *buf, size_t buflen,
+		const struct timespec *rx_ts);
+void free_queue(struct queue *q);
 
 // structure for callback arg
+struct attack_opts;
 struct cb_args {
 	struct queue *queue;
+	struct stat_counters *stats;
 	union {
 		struct in_addr *ip;
 		struct {
-			uint8_t *h1;
-			uint8_t *h2;
-			uint8_t *local;
+			struct classifier *classifier;
 			struct ipc *ipc;
+			int epollfd;
+			int sock;					// to poison the targets
+			struct attack_opts *opts;
+			struct timer_wheel *wheel;
 		};
 	};
 };
@@ -56,13 +71,46 @@ struct cb_args {
 #define ARP_RESTORE_MAX_RETRY 3
 // launch attacks relies on inline function. The following callbacks are used
 // by these
-int receive_messages_callback(void *buf, ssize_t buflen,
-		struct sockaddr *addr, socklen_t addr_l, void *args);
+int receive_messages_callback(struct rx_batch *batch, void *args);
+int receive_ipc_callback(int fd, void *args);
 int restore_mac_callback(void *buf, ssize_t buflen,
 		struct sockaddr *addr, socklen_t addr_l, void *args);
 
+// Used by the retransmission workers. sock must only receive ARP frames.
+// restore_mac gives the number of ARP requests left without reply in
+// timeouts, retransmit_one the transmission time of the frame in tx_ts: from
+// the kernel with tx_key (see super_socket_send_timestamped), else the time
+// it was sent
+int restore_mac(int sock, struct iface *iface, uint8_t mac[ETH_ALEN],
+		int *timeouts);
+int retransmit_one(int sock, struct iface *iface, struct message *msg,
+		uint32_t *tx_key, struct timespec *tx_ts);
+
+
+/*
+ * Adaptive cadence: a target is poisoned again as soon as a frame from it is
+ * seen (the switch just learnt its MAC address back), at most once per floor.
+ * Otherwise, it is poisoned at the pace of its traffic, between the floor and
+ * the ceiling: the time since the last frame seen from or to it stands for
+ * the period of its frames, and it is poisoned POISON_RATE_FACTOR times as
+ * often. Frames to a target only reach us while it is poisoned: the pace is
+ * not taken from their rate, which would collapse with the interception
+ */
+#define POISON_DEFAULT_FLOOR	5		// in ms
+#define POISON_DEFAULT_CEILING	1000	// in ms
+#define POISON_RATE_FACTOR		10
+
+// attack settings given on the command line
+struct attack_opts {
+	int freq;
+	int workers;
+	struct lowlat_opts lowlat;
+	int adaptive;
+	int floor;					// in ms
+	int ceiling;				// in ms
+};
 
-void launch_attack(struct iface *iface, struct ipc *ipc, int freq,
-		struct in_addr h1, struct in_addr h2);
+void launch_attack(struct iface *iface, struct ipc *ipc,
+		struct attack_opts *opts, struct target_table *targets);
 
 #endif /* POISON_H */
@@ -0,0 +1,45 @@
+#ifndef PROBES_H
+#define PROBES_H
+
+#include <config.h>
+
+/*
+ * USDT probes of the provider cam_poisoning, for bpftrace, perf or systemtap.
+ * A probe is a nop until a tracer attaches to it; without sys/sdt.h (or with
+ * --disable-probes) they are compiled out and their arguments not evaluated.
+ *
+ * MACs are pointers to 6 bytes, times are in ns (CLOCK_REALTIME):
+ *   frame__batch(count)
+ *   frame__classified(dhost, shost, len, route, rx_ts)
+ *   frame__queued(dhost, len, rx_ts)
+ *   ipc__send(consumer path, seq, len, capture to send)
+ *   ipc__receive(consumer path or NULL, seq, len, rx_ts)
+ *   poison__sent(target ip, target mac, count)
+ *   restore__start(mac)
+ *   restore__done(mac, success, timeouts)
+ *   frame__retransmitted(dhost, shost, len, rx_ts, tx_ts)
+ *
+ * e.g. bpftrace -e 'usdt:./cam_poisoning:cam_poisoning:restore__start
+ *         { @t[tid] = nsecs }
+ *     usdt:./cam_poisoning:cam_poisoning:restore__done /@t[tid]/
+ *         { @us = hist((nsecs - @t[tid]) / 1000); delete(@t[tid]) }'
+ */
+#ifdef ENABLE_PROBES
+#include <sys/sdt.h>
+
+#define PROBE1(name, a) \
+	STAP_PROBE1(cam_poisoning, name, a)
+#define PROBE3(name, a, b, c) \
+	STAP_PROBE3(cam_poisoning, name, a, b, c)
+#define PROBE4(name, a, b, c, d) \
+	STAP_PROBE4(cam_poisoning, name, a, b, c, d)
+#define PROBE5(name, a, b, c, d, e) \
+	STAP_PROBE5(cam_poisoning, name, a, b, c, d, e)
+#else
+#define PROBE1(name, a) do { } while(0)
+#define PROBE3(name, a, b, c) do { } while(0)
+#define PROBE4(name, a, b, c, d) do { } while(0)
+#define PROBE5(name, a, b, c, d, e) do { } while(0)
+#endif
+
+#endif /* PROBES_H */
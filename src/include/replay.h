@@ -0,0 +1,42 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+#include <iface.h>
+
+/*
+ * Replay backend of the packet I/O: the frames of a capture file (pcap or
+ * pcapng) are fed to the capture socket of the poisoner, and the frames it
+ * sends are counted and discarded. It needs no privilege nor network, to
+ * measure the throughput of the engine alone.
+ *
+ * The sockets are UNIX socket pairs: the poisoner reads and sends with the
+ * usual calls. Frames are fed as fast as the poisoner reads them, or at the
+ * timing of the capture. Once fed, the poisoner is stopped with SIGTERM.
+ *
+ * The network behind is emulated from the capture: the hosts seen in it
+ * (ARP and IPv4 frames of the subnet) answer the ARP requests. The interface
+ * is REPLAY_IFNAME, in the /REPLAY_PREFIX subnet of the first target, with
+ * the highest address no host of the capture uses.
+ */
+#define REPLAY_IFNAME		"replay"
+#define REPLAY_PREFIX		24
+#define REPLAY_MAX_HOSTS	1024
+#define REPLAY_SOCKETS		64		// sockets opened at the same time
+#define REPLAY_GRACE		500		// in ms, for the last frames to be handled
+
+struct replay_opts {
+	const char *path;
+	int timing;					// at the timing of the capture
+	int loops;					// times the capture is fed
+};
+
+// load the capture and set the backend up. Return 0 on errors
+int replay_open(const struct replay_opts *opts, struct in_addr target,
+		struct iface *iface);
+// stop the backend and print the throughput
+void replay_close(void);
+
+#endif /* REPLAY_H */
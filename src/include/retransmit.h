@@ -0,0 +1,125 @@
+#ifndef RETRANSMIT_H
+#define RETRANSMIT_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include <net/ethernet.h>
+
+#include <iface.h>
+#include <lowlat.h>
+#include <poison.h>
+#include <statpage.h>
+
+/*
+ * Retransmission is handled by a pool of workers. The unit of work is a
+ * destination: restore its MAC address in the CAM tables, then flush all of
+ * its frames in order.
+ *
+ * A destination is either idle, waiting in exactly one worker's deque or
+ * being processed by exactly one worker. Frames submitted while it is queued
+ * or processed are appended to it, so frames of one destination are never
+ * reordered. Idle workers steal whole destinations from the other deques.
+ *
+ * The MAC address of a destination must not be poisoned again between its
+ * restoration and the retransmission of its frames: they would come back to
+ * us. The worker holds the busy lock of the destination meanwhile, and the
+ * capture thread only poisons a target if it can take it (see poison.c).
+ */
+#define RT_DEST_IDLE	0
+#define RT_DEST_QUEUED	1
+#define RT_DEST_RUNNING	2
+
+struct rt_dest {
+	uint8_t mac[ETH_ALEN];
+	int state;
+	pthread_mutex_t lock;
+	pthread_mutex_t busy;	// held from restoration to retransmission
+	// frames waiting for retransmission
+	size_t count;
+	size_t size;
+	struct message *messages;
+};
+
+// Double-ended queue of destinations: the owner pops from the head, thieves
+// steal from the tail
+#define RT_DEQUE_INIT_SIZE 64
+struct rt_deque {
+	pthread_mutex_t lock;
+	size_t head;
+	size_t count;
+	size_t size;
+	struct rt_dest **items;
+};
+
+// counters of a worker, only written by the worker
+struct rt_counters {
+	atomic_uint_fast64_t retransmitted;
+	atomic_uint_fast64_t errors;
+	atomic_uint_fast64_t lost;			// after a failed restoration
+	atomic_uint_fast64_t restores;		// calls to restore_mac()
+	atomic_uint_fast64_t restored;		// ... which succeeded
+	atomic_uint_fast64_t timeouts;		// ARP requests without reply
+};
+
+struct rt_pool;
+struct rt_worker {
+	pthread_t thread;
+	int id;
+	int sock;		// ARP-only socket: each worker sees all ARP replies
+	struct rt_pool *pool;
+	struct rt_deque deque;
+	struct lat_stats latency;	// from queueing to retransmission
+	struct lat_stats residence;	// wire-to-wire, from the kernel timestamps
+	int timestamped;			// retransmissions have kernel timestamps
+	uint32_t tx_key;			// see super_socket_send_timestamped
+	struct rt_counters counters;
+};
+
+#define RT_DEST_INIT_SIZE 64
+#define RT_MESSAGES_INIT_SIZE 16
+struct rt_pool {
+	struct iface *iface;
+	int nworkers;
+	struct rt_worker *workers;
+
+	// destinations ever submitted. Only used by the submitting thread
+	size_t dest_count;
+	size_t dest_size;
+	struct rt_dest **dests;
+
+	// number of destinations waiting in deques, idle workers sleep on cond
+	atomic_size_t pending;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int stop;
+	// idle workers, and those signaled but not yet awake (see vclock.h)
+	int idle;
+	int wakeups;
+};
+
+#define RETRANSMIT_DEFAULT_WORKERS 4
+
+// start and stop the pool of workers. With timestamps, the transmission time
+// of the retransmitted frames is taken from the kernel, for the residence
+// time and the recording
+void init_retransmit_pool(struct rt_pool *pool, struct iface *iface,
+		int nworkers, int timestamps);
+void free_retransmit_pool(struct rt_pool *pool);
+
+/*
+ * Hand all queued frames over to the pool. Ownership of the frame buffers is
+ * transferred to the pool and the queue is emptied (but not freed).
+ * Return the number of frames submitted
+ */
+size_t retransmit_submit(struct rt_pool *pool, struct queue *q);
+
+// the destination of the given MAC address, created if needed (NULL if out
+// of memory). Must only be called by the submitting thread
+struct rt_dest *retransmit_dest(struct rt_pool *pool, uint8_t mac[ETH_ALEN]);
+
+// sum the counters of the workers into the retransmission ones of stats
+void retransmit_counters(struct rt_pool *pool, struct stat_counters *stats);
+
+#endif /* RETRANSMIT_H */
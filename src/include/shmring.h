@@ -0,0 +1,128 @@
+#ifndef SHMRING_H
+#define SHMRING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/*
+ * Shared-memory transport between the CAM poisoner and the third-party
+ * program. The region is a memfd holding two single-producer single-consumer
+ * rings: one from the poisoner to the consumer, one back. Each ring entry has
+ * a fixed slot for the frame, so frames are read in place.
+ *
+ * Each ring has an eventfd doorbell. The consumer of a ring sets need_wakeup
+ * before sleeping on the doorbell, and the producer only rings it then.
+ *
+ * Handshake over the UNIX datagram sockets:
+ *   consumer -> poisoner: SHM_MAGIC_REQUEST
+ *   poisoner -> consumer: SHM_MAGIC_ACCEPT, with the memfd and the doorbells
+ *                         (to consumer, from consumer) as SCM_RIGHTS
+ * The handshake messages are shorter than an Ethernet header so they cannot
+ * be mistaken for frames.
+ *
+ * Each slot holds one message in the format of ipcmsg.h.
+ */
+#define SHM_VERSION			1
+#define SHM_MAGIC_REGION	0x47524d53	// "SMRG"
+#define SHM_MAGIC_REQUEST	0x51524d53	// "SMRQ"
+#define SHM_MAGIC_ACCEPT	0x43414d53	// "SMAC"
+
+#define SHM_RING_SLOTS		1024		// must be a power of two
+#define SHM_SLOT_SIZE		2048
+
+#define SHM_TO_CONSUMER		0
+#define SHM_FROM_CONSUMER	1
+
+struct shm_handshake {
+	uint32_t magic;
+	uint32_t version;
+};
+
+struct shm_desc {
+	uint32_t len;
+	uint32_t flags;				// reserved
+};
+
+struct shm_ring {
+	// producer & consumer indexes live on their own cache lines
+	_Alignas(64) atomic_uint head;		// written by the producer
+	_Alignas(64) atomic_uint tail;		// written by the consumer
+	_Alignas(64) atomic_uint need_wakeup;	// written by the consumer
+	_Alignas(64) uint32_t size;
+	uint32_t slot_size;
+	uint64_t descs_offset;		// from the start of the region
+	uint64_t slots_offset;		// from the start of the region
+};
+
+struct shm_region {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t size;
+	struct shm_ring rings[2];
+};
+
+// where a ring lies in the region
+struct shm_layout {
+	size_t descs_offset;
+	size_t slots_offset;
+	size_t slot_size;
+};
+
+/*
+ * A mapped region and its doorbells, as seen by one side. The other side can
+ * write anything in the region: the size and the layout of the rings are
+ * copied in private memory once checked, the region only gives the indexes
+ */
+struct shm_channel {
+	int memfd;
+	int doorbells[2];			// eventfds, indexed like rings
+	struct shm_region *region;
+	size_t size;				// of the mapping
+	struct shm_layout layout[2];
+};
+
+/*
+ * Region management
+ * shm_create is used by the poisoner, shm_attach by the consumer with the
+ * fds received during the handshake. Both return 0 on errors
+ */
+int shm_create(struct shm_channel *ch);
+int shm_attach(struct shm_channel *ch, int memfd, int doorbells[2]);
+void shm_close(struct shm_channel *ch);
+
+/*
+ * Producer side: reserve the next slot (NULL if the ring is full), fill it,
+ * then commit it. Return 1 from commit if the doorbell must be rung
+ */
+void *shm_reserve(struct shm_channel *ch, int ring);
+int shm_commit(struct shm_channel *ch, int ring, uint32_t len, uint32_t flags);
+void shm_ring_doorbell(struct shm_channel *ch, int ring);
+
+/*
+ * Consumer side: peek the next entry (NULL if the ring is empty), use it in
+ * place, then release it
+ */
+void *shm_peek(struct shm_channel *ch, int ring, uint32_t *len,
+		uint32_t *flags);
+void shm_release(struct shm_channel *ch, int ring);
+// clear the doorbell; with sleeping set, ask the producer to ring it again.
+// Return 1 if the ring is not empty (no need to sleep)
+int shm_prepare_wait(struct shm_channel *ch, int ring, int sleeping);
+
+/*
+ * Handshake helpers over a UNIX datagram socket
+ */
+ssize_t shm_send_handshake(int sock, struct sockaddr_un *addr, uint32_t magic,
+		int *fds, int nfds);
+// return the magic of the message or 0 if not a handshake. Received fds are
+// stored in fds (at most 3)
+uint32_t shm_recv_handshake(int sock, struct sockaddr_un *addr, int *fds,
+		int *nfds);
+uint32_t shm_parse_handshake(const void *buf, size_t len);
+
+#endif /* SHMRING_H */
@@ -0,0 +1,82 @@
+#ifndef STATPAGE_H
+#define STATPAGE_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+/*
+ * Live statistics of the CAM poisoner, published in a file mapped in memory
+ * by the poisoner and by any reader (see cam_poisoning-stat).
+ *
+ * The counters are gathered by the poisoning thread from the counters of each
+ * stage, then copied into the page under a seqlock: the sequence is odd while
+ * the page is written. Readers copy the page and retry if the sequence was
+ * odd or changed meanwhile. Nothing is locked on the hot path.
+ *
+ * All counters only grow since the start of the poisoner, except the gauges
+ * (marked as such)
+ */
+#define STATPAGE_FILE		"stats"		// in VAR_DIR_PATH
+#define STATPAGE_MAGIC		0x54534d43	// "CMST"
+#define STATPAGE_VERSION	1
+#define STATPAGE_INTERVAL	100			// publication period, in ms
+
+// routes of classify.h
+#define STATPAGE_ROUTES		5
+
+struct stat_counters {
+	// capture
+	uint64_t captured;				// frames read from the packet socket
+	uint64_t routes[STATPAGE_ROUTES];	// frames per route (ROUTE_*)
+	uint64_t kernel_packets;		// PACKET_STATISTICS of the socket
+	uint64_t kernel_drops;
+
+	// retransmission queue
+	uint64_t queued;
+	uint64_t queue_drops;			// queue full or out of memory
+
+	// IPC
+	uint64_t ipc_sent;				// frames sent to the consumers
+	uint64_t ipc_received;			// frames received from them
+	uint64_t ipc_drops;				// frames the consumers could not take
+	uint64_t ipc_no_consumer;		// frames dropped for lack of consumers
+	uint64_t ipc_forwarded;			// retransmitted unmodified (overload)
+	uint64_t verdict_passed;		// handled by the cached flow verdicts
+	uint64_t verdict_dropped;
+	uint64_t consumers;				// gauge
+
+	// retransmission
+	uint64_t retransmitted;
+	uint64_t retransmit_errors;
+	uint64_t restore_lost;			// frames lost because of failed restores
+	uint64_t restore_attempts;		// calls to restore_mac()
+	uint64_t restore_successes;
+	uint64_t restore_timeouts;		// ARP requests without reply
+
+	// poisoning
+	uint64_t poisoned;				// poisoning frames sent
+	uint64_t arp_cache;				// gauge: entries of the ARP cache
+};
+
+struct stat_page {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t pid;
+	uint64_t started;				// CLOCK_REALTIME, in ns
+	atomic_uint seq;
+	uint64_t updated;				// CLOCK_REALTIME, in ns
+	struct stat_counters counters;
+};
+
+// writer side: create the file (replaced if it exists) and map it. Return
+// NULL on errors, the poisoner keeps working without it
+struct stat_page *statpage_create(const char *path);
+void statpage_publish(struct stat_page *page,
+		const struct stat_counters *counters);
+void statpage_close(struct stat_page *page, const char *path);
+
+// reader side: map an existing page read-only, and take a consistent copy
+const struct stat_page *statpage_open(const char *path);
+void statpage_read(const struct stat_page *page, struct stat_page *copy);
+
+#endif /* STATPAGE_H */
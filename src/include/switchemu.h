@@ -0,0 +1,57 @@
+#ifndef SWITCHEMU_H
+#define SWITCHEMU_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+#include <iface.h>
+
+/*
+ * Switch emulator backend of the packet I/O: the poisoner is plugged on a
+ * port of an emulated switch, each other port has a simulated host. The
+ * switch learns the source MACs in its CAM table, ages the entries and floods
+ * the frames to unknown destinations. The hosts send frames to each other at
+ * a given rate and answer the ARP requests for their address.
+ *
+ * The engine runs on the virtual clock (see vclock.h) driven by the switch:
+ * hours of poisoning, restorations and traffic of thousands of hosts run in
+ * seconds, with results independent of the speed of the machine. Consumers
+ * of the IPC still answer in real time: for exact results, run without one
+ * (the intercepted frames are then lost instead of relayed).
+ *
+ * The hosts are the first addresses of the /SWITCHEMU_PREFIX subnet of the
+ * first target, the poisoner has the last one. The traffic starts with the
+ * attack and lasts for the given duration, then the poisoner is stopped and
+ * the interception ratio, the relayed frames and the frames held inside the
+ * poisoner are reported.
+ */
+#define SWITCHEMU_IFNAME		"switch"
+#define SWITCHEMU_PREFIX		16
+#define SWITCHEMU_MAX_HOSTS		65532		// the /16 but the poisoner
+#define SWITCHEMU_SOCKETS		64			// sockets opened at the same time
+#define SWITCHEMU_TICK			100000		// in ns, frames are switched by tick
+#define SWITCHEMU_REPLY_DELAY	20000		// in ns, for hosts to answer ARP
+#define SWITCHEMU_GRACE			1000		// in ms, without traffic at the end
+#define SWITCHEMU_FRAME_SIZE	128			// frames sent by the hosts
+#define SWITCHEMU_SEED			0x5eed		// of the traffic
+#define SWITCHEMU_REPORT_TARGETS	16
+
+#define SWITCHEMU_DEFAULT_RATE		10		// frames/s per host
+#define SWITCHEMU_DEFAULT_DURATION	10		// in s
+#define SWITCHEMU_DEFAULT_AGING		300		// in s, like most switches
+
+struct switchemu_opts {
+	int hosts;
+	int rate;					// frames/s sent by each host
+	int duration;				// of the traffic, in s of virtual time
+	int aging;					// of the CAM entries, in s
+};
+
+// create the network and start the virtual clock. Return 0 on errors
+int switchemu_open(const struct switchemu_opts *opts,
+		const struct in_addr *targets, size_t ntargets, struct iface *iface);
+// stop the backend and print the results
+void switchemu_close(void);
+
+#endif /* SWITCHEMU_H */
@@ -0,0 +1,99 @@
+#ifndef TARGET_H
+#define TARGET_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include <netinet/in.h>
+#include <net/ethernet.h>
+
+#include <arp.h>
+#include <iface.h>
+#include <timerwheel.h>
+
+/*
+ * Intercepted hosts (targets) are stored in an open-addressed hash table
+ * keyed by their 48-bit MAC address, so that classifying a frame costs the
+ * same whatever the number of targets.
+ */
+struct rt_dest;
+
+struct target {
+	uint8_t mac[ETH_ALEN];
+	struct in_addr ip;
+	int index;				// position of the target in the table
+
+	// crafted once at start-up
+	struct arp_pkt poison;	// ARP request with the target as the sender
+
+	// its frames in the retransmission pool, not poisoned while restored
+	struct rt_dest *dest;
+
+	// counters (only updated by the capture thread)
+	uint64_t poisoned;		// poisoning frames sent
+	uint64_t intercepted;	// frames sent to the IPC
+	uint64_t reclaimed;		// poisoned again on a frame from it
+
+	// cadence, see launch_attack (in ms of CLOCK_MONOTONIC)
+	struct timer timer;		// next poisoning
+	uint64_t last_poison;
+	uint64_t last_seen;		// last frame from or to it
+	uint32_t interval;		// between background poisonings
+};
+
+// a MAC address packed in the lower 48 bits. No MAC can be the empty key
+#define TARGET_EMPTY_KEY UINT64_MAX
+#define TARGET_TABLE_MIN_SIZE 16
+
+struct target_table {
+	// dense array of targets
+	size_t count;
+	size_t max;
+	struct target *targets;
+
+	// hash table: size is a power of two kept at least twice the count
+	size_t size;
+	uint64_t *keys;
+	uint32_t *slots;		// index of the target in targets
+};
+
+static inline uint64_t mac_to_key(const uint8_t mac[ETH_ALEN]) {
+	uint64_t key = 0;
+	memcpy(&key, mac, ETH_ALEN);
+	return key;
+}
+
+static inline size_t target_hash(uint64_t key, size_t size) {
+	// Fibonacci hashing: the vendor part of MAC addresses is often shared
+	return (size_t) ((key * 0x9e3779b97f4a7c15ULL) >> 32) & (size - 1);
+}
+
+static inline struct target *target_table_lookup_key(struct target_table *t,
+		uint64_t key) {
+	size_t i;
+
+	for (i = target_hash(key, t->size); t->keys[i] != TARGET_EMPTY_KEY;
+			i = (i + 1) & (t->size - 1)) {
+		if (t->keys[i] == key)
+			return &t->targets[t->slots[i]];
+	}
+	return NULL;
+}
+
+static inline struct target *target_table_lookup(struct target_table *t,
+		const uint8_t mac[ETH_ALEN]) {
+	return target_table_lookup_key(t, mac_to_key(mac));
+}
+
+void target_table_init(struct target_table *t, size_t count);
+void target_table_free(struct target_table *t);
+
+/*
+ * Add the host with the given IP, whose MAC address must be in the ARP cache,
+ * and craft its poisoning frame. Adding a host twice returns the existing
+ * target. Return NULL on errors
+ */
+struct target *target_table_add(struct target_table *t, struct iface *iface,
+		struct in_addr ip);
+
+#endif /* TARGET_H */
@@ -0,0 +1,46 @@
+#ifndef THREADREG_H
+#define THREADREG_H
+
+#include <stdatomic.h>
+#include <pthread.h>
+
+/*
+ * Registry of per-thread objects (log rings, histograms, recording rings):
+ * each thread allocates its own on first use and registers it, readers walk
+ * all of them without lock. Entries are never removed: what a thread wrote
+ * outlives it
+ */
+struct thread_registry {
+	pthread_mutex_t lock;		// between registering threads
+	atomic_int count;
+	int max;
+	void **entries;
+};
+
+#define THREAD_REGISTRY_INIT(entries, max) \
+	{ PTHREAD_MUTEX_INITIALIZER, 0, (max), (entries) }
+
+// register the object of the calling thread. Return 0 if the registry is full
+static inline int thread_registry_add(struct thread_registry *r,
+		void *entry) {
+	int n;
+
+	pthread_mutex_lock(&r->lock);
+	n = atomic_load(&r->count);
+	if (n == r->max) {
+		pthread_mutex_unlock(&r->lock);
+		return 0;
+	}
+	r->entries[n] = entry;
+	// published once the entry is set
+	atomic_store(&r->count, n + 1);
+	pthread_mutex_unlock(&r->lock);
+	return 1;
+}
+
+// number of registered objects, entries[0] to entries[count - 1]
+static inline int thread_registry_count(struct thread_registry *r) {
+	return atomic_load(&r->count);
+}
+
+#endif /* THREADREG_H */
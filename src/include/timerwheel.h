@@ -0,0 +1,73 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Timers of the capture thread: the poisoning deadlines of the targets and
+ * the TTLs of the flow verdicts
+ *
+ * Hashed hierarchical timing wheel, with a tick of 1ms: level 0 has a slot
+ * per tick for the next TIMERWHEEL_SLOTS ms, each slot of the next levels
+ * spans a whole turn of the previous one. A timer goes to the lowest level
+ * covering its deadline; when level 0 wraps, the slot of level 1 due next is
+ * spread over level 0, and so on. Adding and cancelling a timer are O(1) and
+ * timers are embedded in their owner: no allocation. Bitmaps of the used
+ * slots let the wheel skip the empty ones instead of scanning each tick.
+ *
+ * Not thread-safe: the wheel belongs to the thread driving it.
+ */
+#define TIMERWHEEL_BITS		8
+#define TIMERWHEEL_SLOTS	(1 << TIMERWHEEL_BITS)
+#define TIMERWHEEL_MASK		(TIMERWHEEL_SLOTS - 1)
+#define TIMERWHEEL_LEVELS	4		// 2^32 ms ahead (49 days)
+
+struct timer {
+	struct timer *next;
+	struct timer **pprev;		// NULL when not scheduled
+	uint64_t expires;			// in ms
+	uint16_t slot;				// level and index in the wheel
+	// called when the timer expires, with the args of timer_wheel_advance.
+	// It may add or cancel any timer, itself included
+	void (*callback)(void *data, void *args);
+	void *data;
+};
+
+struct timer_wheel {
+	uint64_t now;				// last tick handled, in ms
+	size_t count;				// scheduled timers
+	struct timer *slots[TIMERWHEEL_LEVELS][TIMERWHEEL_SLOTS];
+	uint64_t used[TIMERWHEEL_LEVELS][TIMERWHEEL_SLOTS / 64];
+};
+
+static inline void timer_init(struct timer *t,
+		void (*callback)(void *data, void *args), void *data) {
+	t->next = NULL;
+	t->pprev = NULL;
+	t->callback = callback;
+	t->data = data;
+}
+
+static inline int timer_pending(const struct timer *t) {
+	return t->pprev != NULL;
+}
+
+void timer_wheel_init(struct timer_wheel *w, uint64_t now);
+
+// schedule the timer at expires (in ms), or move it if already scheduled.
+// Past deadlines expire on the next tick
+void timer_add(struct timer_wheel *w, struct timer *t, uint64_t expires);
+void timer_cancel(struct timer_wheel *w, struct timer *t);
+
+// run the callbacks of the timers expired at now (in ms)
+void timer_wheel_advance(struct timer_wheel *w, uint64_t now, void *args);
+
+/*
+ * Time to wait for the next expiration, at most max ms: the timeout of the
+ * event loop. Deadlines beyond level 0 are not searched: the wait may end
+ * before them, never after
+ */
+int timer_wheel_timeout(const struct timer_wheel *w, int max);
+
+#endif /* TIMERWHEEL_H */
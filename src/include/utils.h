@@ -1,11 +1,15 @@
 #ifndef UTILS_H
 #define UTILS_H
 
+#include <stdint.h>
+#include <stdatomic.h>
+
 #include <netinet/in.h>
 #include <sys/time.h>
 #include <sys/socket.h>
 
 #define STR(x) #x
+#define XSTR(x) STR(x)
 
 char *inet_htoa(struct in_addr in);
 int inet_atoh(const char *cp, struct in_addr *inp);
@@ -27,6 +31,25 @@ void ntoha(struct in_addr *in, struct in_addr *out);
 		+ ((ts1).tv_nsec - (ts2).tv_nsec) / 1000000 \
 		)
 
+// an helper to transform a timespec into ms
+#define TS_TO_MS(ts) ((uint64_t) (ts).tv_sec * 1000 + (ts).tv_nsec / 1000000)
+
+// an helper to transform a timespec into ns
+#define TS_TO_NS(ts) ((uint64_t) (ts).tv_sec * 1000000000 + (ts).tv_nsec)
+
+// add to a counter written by a single thread and read by others: relaxed
+// load & store are enough, no atomic read-modify-write is needed
+void static inline counter_add(atomic_uint_fast64_t *c, uint64_t n) {
+	atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed)
+			+ n, memory_order_relaxed);
+}
+
+/*
+ * Retrieve the software timestamp (SO_TIMESTAMPING) from the control messages
+ * of a received message. Return 0 if there is none
+ */
+int cmsg_timestamp(struct msghdr *msg, struct timespec *ts);
+
 
 #define MAX_PKT_SIZE 1500
 #define MAX_EVENTS 5
@@ -42,14 +65,48 @@ void ntoha(struct in_addr *in, struct in_addr *out);
  * else the recvfrom is stopped here
  *
  * args can be used to share a structure/a variable with the callback
+ *
+ * If spin is set, recvfrom_multiple_with_timeout busy-polls the sockets
+ * instead of sleeping until the timeout
  */
 int recvfrom_with_timeout(int sock, const int timeout,
 		int (*callback)(void *buf, ssize_t buflen,
 			struct sockaddr *addr, socklen_t addr_l, void *args),
 		void *args);
 int recvfrom_multiple_with_timeout(int epollfd, const int timeout,
+		const int spin,
 		int (*callback)(void *buf, ssize_t buflen,
 			struct sockaddr *addr, socklen_t addr_l, void *args),
 		void *args);
 
+/*
+ * Batched version of recvfrom_multiple_with_timeout: frames are read with
+ * recvmmsg and the callback is called for each batch. All frames of a batch
+ * come from the same socket
+ *
+ * File descriptors which are not sockets (e.g. eventfds) are registered in
+ * the epoll with RX_EVENT_TAG set in data.u64: event_callback is called with
+ * the fd instead of reading them
+ *
+ * Each frame comes with its reception time given by the kernel, or the time
+ * it was read if the socket has no timestamps
+ */
+#define RX_BATCH_SIZE 32
+#define RX_EVENT_TAG (1ULL << 32)
+struct rx_batch {
+	int count;
+	ssize_t lens[RX_BATCH_SIZE];			// captured length
+	ssize_t orig_lens[RX_BATCH_SIZE];		// length on the wire
+	socklen_t addr_ls[RX_BATCH_SIZE];
+	struct sockaddr_storage addrs[RX_BATCH_SIZE];
+	struct timespec ts[RX_BATCH_SIZE];		// reception (CLOCK_REALTIME)
+	uint8_t bufs[RX_BATCH_SIZE][MAX_PKT_SIZE];
+};
+
+int recvmmsg_multiple_with_timeout(int epollfd, const int timeout,
+		const int spin, struct rx_batch *batch,
+		int (*callback)(struct rx_batch *batch, void *args),
+		int (*event_callback)(int fd, void *args),
+		void *args);
+
 #endif /* UTILS_H */
@@ -0,0 +1,77 @@
+#ifndef VCLOCK_H
+#define VCLOCK_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include <sys/epoll.h>
+
+/*
+ * Clock of the engine: the engine reads the time and waits for its sockets
+ * through clock_now() and clock_epoll_wait(). They are the system clocks and
+ * epoll_wait, unless a virtual clock is started (see switchemu.h).
+ *
+ * The virtual time only advances when every thread of the engine waits: it
+ * then jumps to the earliest deadline of the waits or to the next event of
+ * the source (e.g. the emulated network), whichever comes first. The
+ * schedule of the engine runs as it would in real time, but as fast as the
+ * machine allows and whatever its speed.
+ *
+ * A thread is busy from vclock_start() or vclock_hold() to vclock_release(),
+ * except while it waits. The thread which starts the clock is busy; the
+ * retransmission workers are while they have work.
+ */
+#define VCLOCK_NEVER	UINT64_MAX
+
+struct vclock_source {
+	// earliest event after now, in ns of virtual time, or VCLOCK_NEVER
+	uint64_t (*next)(void *arg);
+	// handle the events until now. Return the number of frames given to the
+	// engine: the time does not advance while they are not read
+	int (*run)(uint64_t now, void *arg);
+	void *arg;
+};
+
+// set once, before the engine starts its threads
+extern int vclock_enabled;
+
+// start the virtual clock at the current time
+void vclock_start(const struct vclock_source *source);
+// virtual ns since the start
+uint64_t vclock_now(void);
+// stop the clock at this time: SIGTERM is then raised to stop the engine
+void vclock_set_end(uint64_t end);
+// stop the clock now: the remaining waits return at once
+void vclock_stop(void);
+
+void vclock_gettime(clockid_t clock, struct timespec *ts);
+int vclock_epoll_wait(int epollfd, struct epoll_event *events, int max,
+		int timeout);
+void vclock_busy(int delta);
+
+static inline int clock_now(clockid_t clock, struct timespec *ts) {
+	if (vclock_enabled) {
+		vclock_gettime(clock, ts);
+		return 0;
+	}
+	return clock_gettime(clock, ts);
+}
+
+static inline int clock_epoll_wait(int epollfd, struct epoll_event *events,
+		int max, int timeout) {
+	if (vclock_enabled)
+		return vclock_epoll_wait(epollfd, events, max, timeout);
+	return epoll_wait(epollfd, events, max, timeout);
+}
+
+static inline void vclock_hold(void) {
+	if (vclock_enabled)
+		vclock_busy(1);
+}
+
+static inline void vclock_release(void) {
+	if (vclock_enabled)
+		vclock_busy(-1);
+}
+
+#endif /* VCLOCK_H */
@@ -3,17 +3,23 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <errno.h>
 
 #include <sys/socket.h>
 
+#include <flow.h>
+#include <histo.h>
 #include <logger.h>
+#include <probes.h>
+#include <utils.h>
+#include <vclock.h>
 
 /*
  * Initialize the UNIX Socket IPC
  */
-void open_ipc(struct ipc *ipc, const char *path) {
+void open_ipc(struct ipc *ipc) {
 	struct sockaddr_un addr;
 
 	// Ensure the base directory for the socket path exists
@@ -62,14 +68,605 @@ void open_ipc(struct ipc *ipc, const char *path) {
 		exit(1);
 	}
 
+	ipc->rxbuf = (uint8_t *) malloc(IPC_MSG_MAX_SIZE);
+	if (ipc->rxbuf == NULL) {
+		perror("Cannot allocate memory for the IPC");
+		exit(1);
+	}
+	ipc->drops = 0;
+	memset(&ipc->departed, 0, sizeof(ipc->departed));
+	ipc->policy = IPC_OVERLOAD_BUFFER;
+	ipc->budget = IPC_DEFAULT_BUDGET;
+	ipc->flows = NULL;
+	ipc->count = 0;
+	ipc->nvnodes = 0;
+}
+
+/*
+ * Consumers & consistent hashing
+ */
+int static compare_vnodes(const void *a, const void *b) {
+	const struct ipc_vnode *va = a, *vb = b;
+	return (va->point > vb->point) - (va->point < vb->point);
+}
+
+// the points of a consumer only depend on its path
+void static build_ring(struct ipc *ipc) {
+	int i;
+	uint32_t k, base;
+	const char *path;
+
+	ipc->nvnodes = 0;
+	for (i = 0; i < ipc->count; i++) {
+		path = ipc->consumers[i]->remote.sun_path;
+		base = hash_bytes(path, strlen(path), 0);
+		for (k = 0; k < IPC_VNODES; k++) {
+			ipc->vnodes[ipc->nvnodes].point = hash_bytes(&k, sizeof(k), base);
+			ipc->vnodes[ipc->nvnodes++].consumer = i;
+		}
+	}
+	qsort(ipc->vnodes, ipc->nvnodes, sizeof(struct ipc_vnode),
+			&compare_vnodes);
+}
+
+struct ipc_consumer static inline *consumer_for(struct ipc *ipc,
+		uint32_t hash) {
+	size_t lo, hi, mid;
+
+	if (ipc->count <= 1)
+		return ipc->count == 1 ? ipc->consumers[0] : NULL;
+
+	// first point after the hash, wrapping around the ring
+	lo = 0;
+	hi = ipc->nvnodes;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (ipc->vnodes[mid].point < hash)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == ipc->nvnodes)
+		lo = 0;
+	return ipc->consumers[ipc->vnodes[lo].consumer];
+}
+
+struct ipc_consumer *find_ipc_consumer(struct ipc *ipc, const char *path) {
+	int i;
+
+	for (i = 0; i < ipc->count; i++) {
+		if (strncmp(ipc->consumers[i]->remote.sun_path, path,
+					sizeof(ipc->consumers[i]->remote.sun_path)) == 0)
+			return ipc->consumers[i];
+	}
+	return NULL;
+}
+
+struct ipc_consumer *find_ipc_doorbell(struct ipc *ipc, int doorbell) {
+	int i;
+
+	for (i = 0; i < ipc->count; i++) {
+		if (ipc->consumers[i]->shm_active &&
+				ipc->consumers[i]->shm.doorbells[SHM_FROM_CONSUMER] == doorbell)
+			return ipc->consumers[i];
+	}
+	return NULL;
+}
+
+struct ipc_consumer *add_ipc_consumer(struct ipc *ipc, const char *path,
+		int permanent) {
+	struct ipc_consumer *consumer;
+
+	if ((consumer = find_ipc_consumer(ipc, path)) != NULL) {
+		// joined again in the message it left in
+		consumer->leaving = 0;
+		return consumer;
+	}
+	if (ipc->count == IPC_MAX_CONSUMERS) {
+		log_warning("Too many IPC consumers, %s is refused\n", path);
+		return NULL;
+	}
+
+	consumer = (struct ipc_consumer *) calloc(1, sizeof(struct ipc_consumer));
+	if (consumer == NULL ||
+			(consumer->txbuf = (uint8_t *) malloc(IPC_MSG_MAX_SIZE)) == NULL ||
+			(consumer->sent = (uint64_t *) calloc(IPC_RTT_WINDOW,
+				sizeof(uint64_t))) == NULL) {
+		perror("Cannot allocate memory for the IPC consumer");
+		exit(1);
+	}
 	// set the remote socket address
-	memset(&ipc->remote, 0, sizeof(ipc->remote));
-	ipc->remote.sun_family = AF_UNIX;
-	strncpy(ipc->remote.sun_path, path, sizeof(ipc->remote.sun_path) - 1);
+	consumer->remote.sun_family = AF_UNIX;
+	strncpy(consumer->remote.sun_path, path,
+			sizeof(consumer->remote.sun_path) - 1);
+	consumer->permanent = permanent;
+
+	// raw datagrams until the consumer asks for another format
+	consumer->max_msg_size = IPC_MSG_MAX_SIZE;
+	ipc_msg_init(consumer->txbuf);
+	consumer->shm.region = NULL;
+
+	ipc->consumers[ipc->count++] = consumer;
+	build_ring(ipc);
+	log_info("IPC consumer #%i joined: %s\n", ipc->count - 1, path);
+	return consumer;
+}
+
+void remove_ipc_consumer(struct ipc *ipc, struct ipc_consumer *consumer) {
+	int i;
+
+	for (i = 0; i < ipc->count && ipc->consumers[i] != consumer; i++);
+	if (i == ipc->count)
+		return;
+
+	log_info("IPC consumer left: %s (%llu frames sent, %llu dropped)\n",
+			consumer->remote.sun_path,
+			(unsigned long long) consumer->stats.frames_sent,
+			(unsigned long long) consumer->stats.drops);
+
+	ipc->departed.frames_sent += consumer->stats.frames_sent;
+	ipc->departed.frames_received += consumer->stats.frames_received;
+	ipc->departed.drops += consumer->stats.drops;
+	ipc->departed.forwarded += consumer->stats.forwarded;
+
+	// the closed doorbell leaves the epoll on its own
+	shm_close(&consumer->shm);
+	free(consumer->backlog);
+	free(consumer->sent);
+	free(consumer->txbuf);
+	free(consumer);
+
+	ipc->consumers[i] = ipc->consumers[--ipc->count];
+	build_ring(ipc);
+}
+
+// the socket of a dynamic consumer disappeared: forget it
+int static inline consumer_gone(struct ipc *ipc,
+		struct ipc_consumer *consumer) {
+	if (consumer->permanent || (errno != ENOENT && errno != ECONNREFUSED))
+		return 0;
+	remove_ipc_consumer(ipc, consumer);
+	return 1;
+}
+
+// internal results of send_frame
+#define IPC_OVERLOADED	4		// the consumer cannot take the frame now
+#define IPC_GONE		5		// the consumer was removed
+
+/*
+ * Batched messages
+ */
+void static inline fill_frame_record(struct ipc_consumer *consumer,
+		struct ipc_rec *rec, const void *buf, struct ipc_frame_info *info,
+		uint64_t now) {
+	consumer->sent[consumer->seq & (IPC_RTT_WINDOW - 1)] = now;
+	rec->seq = consumer->seq++;
+	rec->ts = TS_TO_NS(info->ts);
+	rec->orig_len = info->orig_len;
+	rec->ifindex = info->ifindex;
+	rec->target = info->target;
+	memcpy(IPC_REC_PAYLOAD(rec), buf, rec->len);
 }
 
-ssize_t sendto_ipc(struct ipc *ipc, const void *buf, size_t length) {
-	log_debug("Sending %i bytes through IPC\n");
-	return sendto(ipc->sock, buf, length, 0,
-			(struct sockaddr *) &ipc->remote, sizeof(struct sockaddr_un));
+// never block the capture on a slow consumer
+ssize_t static inline send_message(struct ipc *ipc,
+		struct ipc_consumer *consumer, void *msg) {
+	ssize_t ret;
+
+	ret = sendto(ipc->sock, msg, ((struct ipc_msg_hdr *) msg)->len,
+			MSG_DONTWAIT, (struct sockaddr *) &consumer->remote,
+			sizeof(struct sockaddr_un));
+	if (ret != -1)
+		consumer->stats.messages_sent++;
+	return ret;
+}
+
+// send a control record right away
+void static inline reply_control(struct ipc *ipc,
+		struct ipc_consumer *consumer, uint16_t type,
+		const void *payload, uint32_t len) {
+	uint8_t msg[sizeof(struct ipc_msg_hdr) + sizeof(struct ipc_rec)
+		+ sizeof(struct ipc_stats)];
+	struct ipc_rec *rec;
+
+	ipc_msg_init(msg);
+	if ((rec = ipc_msg_append(msg, sizeof(msg), type, len)) == NULL)
+		return;
+	memcpy(IPC_REC_PAYLOAD(rec), payload, len);
+	if (send_message(ipc, consumer, msg) == -1)
+		perror("Failed to answer through IPC");
+}
+
+// send the message being built for the consumer. Return 0 if the consumer
+// was removed
+int static inline flush_consumer(struct ipc *ipc,
+		struct ipc_consumer *consumer) {
+	struct ipc_msg_hdr *hdr = (struct ipc_msg_hdr *) consumer->txbuf;
+
+	// one wake-up per batch, and only if the consumer sleeps
+	if (consumer->shm_active && consumer->shm_pending) {
+		shm_ring_doorbell(&consumer->shm, SHM_TO_CONSUMER);
+		consumer->shm_pending = 0;
+	}
+
+	// one datagram per batch
+	if (hdr->count > 0) {
+		if (send_message(ipc, consumer, consumer->txbuf) == -1) {
+			if ((errno == EAGAIN || errno == EWOULDBLOCK) &&
+					ipc->policy != IPC_OVERLOAD_DROP) {
+				// keep the message for the next flush. The next frames go
+				// through the overload policy meanwhile, see send_frame
+				if (!consumer->blocked) {
+					consumer->blocked = 1;
+					consumer->stats.overloads += hdr->count;
+					consumer->stats.buffered += hdr->count;
+				}
+				return 1;
+			}
+			consumer->stats.drops += hdr->count;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				consumer->stats.overloads += hdr->count;
+			} else if (consumer_gone(ipc, consumer)) {
+				return 0;
+			} else {
+				perror("Failed to send frames through IPC");
+			}
+		} else {
+			consumer->stats.frames_sent += hdr->count;
+		}
+		consumer->blocked = 0;
+		ipc_msg_init(consumer->txbuf);
+	}
+	return 1;
+}
+
+/*
+ * Hand a frame to the consumer if it can take it
+ */
+int static send_frame(struct ipc *ipc, struct ipc_consumer *consumer,
+		const void *buf, size_t length, struct ipc_frame_info *info) {
+	struct ipc_rec *rec = NULL;
+	struct timespec now_t;
+	uint64_t now, capture;
+	void *slot;
+
+	if (consumer->credit_based && consumer->credits <= 0)
+		return IPC_OVERLOADED;
+	clock_now(CLOCK_REALTIME, &now_t);
+	now = TS_TO_NS(now_t);
+
+	if (consumer->shm_active) {
+		// one message in the next slot of the ring
+		if ((slot = shm_reserve(&consumer->shm, SHM_TO_CONSUMER)) == NULL)
+			return IPC_OVERLOADED;
+		ipc_msg_init(slot);
+		if ((rec = ipc_msg_append(slot, SHM_SLOT_SIZE, IPC_REC_FRAME,
+						length)) == NULL) {
+			consumer->stats.drops++;
+			return IPC_DROPPED;
+		}
+		fill_frame_record(consumer, rec, buf, info, now);
+		if (shm_commit(&consumer->shm, SHM_TO_CONSUMER,
+					((struct ipc_msg_hdr *) slot)->len, 0))
+			consumer->shm_pending = 1;
+		consumer->stats.frames_sent++;
+		consumer->stats.messages_sent++;
+	} else if (consumer->batched) {
+		// the current message waits for room in the socket buffer
+		if (consumer->blocked)
+			return IPC_OVERLOADED;
+		// append to the current message, send it first if it is full
+		rec = ipc_msg_append(consumer->txbuf, consumer->max_msg_size,
+				IPC_REC_FRAME, length);
+		if (rec == NULL &&
+				((struct ipc_msg_hdr *) consumer->txbuf)->count > 0) {
+			if (!flush_consumer(ipc, consumer))
+				return IPC_GONE;
+			if (consumer->blocked)
+				return IPC_OVERLOADED;
+			rec = ipc_msg_append(consumer->txbuf, consumer->max_msg_size,
+					IPC_REC_FRAME, length);
+		}
+		if (rec == NULL) {
+			consumer->stats.drops++;
+			return IPC_DROPPED;
+		}
+		fill_frame_record(consumer, rec, buf, info, now);
+	} else {
+		if (sendto(ipc->sock, buf, length, MSG_DONTWAIT,
+					(struct sockaddr *) &consumer->remote,
+					sizeof(struct sockaddr_un)) == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return IPC_OVERLOADED;
+			consumer->stats.drops++;
+			return consumer_gone(ipc, consumer) ? IPC_GONE : IPC_ERROR;
+		}
+		consumer->stats.frames_sent++;
+		consumer->stats.messages_sent++;
+	}
+
+	consumer->credits--;
+	capture = TS_TO_NS(info->ts);
+	histo_record(STAGE_CAPTURE_TO_IPC, now > capture ? now - capture : 0);
+	PROBE4(ipc__send, consumer->remote.sun_path, rec != NULL ? rec->seq : 0,
+			length, now > capture ? now - capture : 0);
+	return IPC_SENT;
+}
+
+/*
+ * Send the frames waiting for the consumer, in order. Return 0 if the
+ * consumer was removed
+ */
+int static drain_backlog(struct ipc *ipc, struct ipc_consumer *consumer) {
+	struct ipc_pending *pending;
+
+	while (consumer->backlog_count > 0) {
+		pending = &consumer->backlog[consumer->backlog_head];
+		switch (send_frame(ipc, consumer, pending->buf, pending->len,
+					&pending->info)) {
+			case IPC_OVERLOADED:
+				return 1;
+			case IPC_GONE:
+				return 0;
+		}
+		consumer->backlog_head = (consumer->backlog_head + 1) % ipc->budget;
+		consumer->backlog_count--;
+	}
+	return 1;
+}
+
+int static inline overload(struct ipc *ipc, struct ipc_consumer *consumer,
+		const void *buf, size_t length, struct ipc_frame_info *info) {
+	struct ipc_pending *pending;
+
+	consumer->stats.overloads++;
+	switch (ipc->policy) {
+		case IPC_OVERLOAD_BUFFER:
+			if (consumer->backlog == NULL) {
+				consumer->backlog = (struct ipc_pending *) malloc(
+						ipc->budget * sizeof(struct ipc_pending));
+				if (consumer->backlog == NULL) {
+					perror("Cannot allocate memory for the IPC backlog");
+					exit(1);
+				}
+			}
+			if (consumer->backlog_count < ipc->budget &&
+					length <= MAX_PKT_SIZE) {
+				pending = &consumer->backlog[(consumer->backlog_head
+						+ consumer->backlog_count++) % ipc->budget];
+				pending->len = length;
+				pending->info = *info;
+				memcpy(pending->buf, buf, length);
+				consumer->stats.buffered++;
+				log_debug("Consumer overloaded: frame buffered\n");
+				return IPC_BUFFERED;
+			}
+			// out of budget: drop the newest frame
+			consumer->stats.drops++;
+			log_debug("Consumer overloaded: frame dropped\n");
+			return IPC_DROPPED;
+		case IPC_OVERLOAD_FORWARD:
+			consumer->stats.forwarded++;
+			log_debug("Consumer overloaded: frame forwarded\n");
+			return IPC_FORWARD;
+		default:
+			consumer->stats.drops++;
+			log_debug("Consumer overloaded: frame dropped\n");
+			return IPC_DROPPED;
+	}
+}
+
+int sendto_ipc(struct ipc *ipc, const void *buf, size_t length,
+		struct ipc_frame_info *info) {
+	struct ipc_consumer *consumer;
+	int ret;
+
+	if ((consumer = consumer_for(ipc, info->hash)) == NULL) {
+		ipc->drops++;
+		return IPC_DROPPED;
+	}
+
+	log_debug("Sending %zu bytes through IPC to %s\n", length,
+			consumer->remote.sun_path);
+
+	// frames waiting for the consumer go first
+	if (consumer->backlog_count > 0 && !drain_backlog(ipc, consumer))
+		return IPC_DROPPED;
+	if (consumer->backlog_count == 0) {
+		ret = send_frame(ipc, consumer, buf, length, info);
+		if (ret == IPC_GONE)
+			return IPC_DROPPED;
+		if (ret != IPC_OVERLOADED)
+			return ret;
+	}
+	return overload(ipc, consumer, buf, length, info);
+}
+
+void flush_ipc(struct ipc *ipc) {
+	int i;
+
+	// backwards: flushing may remove the consumer
+	for (i = ipc->count - 1; i >= 0; i--) {
+		if (drain_backlog(ipc, ipc->consumers[i]))
+			flush_consumer(ipc, ipc->consumers[i]);
+	}
+}
+
+// a frame came back: its sequence number gives its send time, if recent
+void static inline record_rtt(struct ipc_consumer *consumer, uint64_t seq) {
+	struct timespec now_t;
+	uint64_t now, sent;
+
+	if (seq >= consumer->seq || consumer->seq - seq > IPC_RTT_WINDOW)
+		return;
+	sent = consumer->sent[seq & (IPC_RTT_WINDOW - 1)];
+	clock_now(CLOCK_REALTIME, &now_t);
+	now = TS_TO_NS(now_t);
+	if (sent != 0 && now > sent)
+		histo_record(STAGE_CONSUMER_RTT, now - sent);
+}
+
+int handle_ipc_message(struct ipc *ipc, struct sockaddr_un *from,
+		void *buf, size_t length,
+		void (*frame_callback)(void *buf, size_t len, uint64_t ts,
+			void *args),
+		void *args) {
+	struct ipc_consumer *consumer = find_ipc_consumer(ipc, from->sun_path);
+	struct ipc_rec *rec;
+	struct ipc_config config;
+	struct ipc_verdict verdict;
+	struct flow_key key;
+	struct timespec now;
+	uint32_t credits;
+	int flush = 0;
+
+	if (consumer != NULL)
+		consumer->stats.messages_received++;
+
+	// raw frames
+	if (!ipc_msg_check(buf, length)) {
+		if (length == 0) {
+			// Consider the empty datagram as flush request
+			log_debug("Received a flushing request\n");
+			return 1;
+		}
+		if (consumer != NULL)
+			consumer->stats.frames_received++;
+		PROBE4(ipc__receive, consumer != NULL ? consumer->remote.sun_path
+				: NULL, 0, length, 0);
+		frame_callback(buf, length, 0, args);
+		return 0;
+	}
+
+	for (rec = ipc_msg_next(buf, NULL); rec != NULL;
+			rec = ipc_msg_next(buf, rec)) {
+		switch (rec->type) {
+			case IPC_REC_FRAME:
+				if (consumer != NULL) {
+					consumer->stats.frames_received++;
+					record_rtt(consumer, rec->seq);
+				}
+				PROBE4(ipc__receive, consumer != NULL
+						? consumer->remote.sun_path : NULL, rec->seq, rec->len,
+						rec->ts);
+				frame_callback(IPC_REC_PAYLOAD(rec), rec->len, rec->ts, args);
+				break;
+			case IPC_REC_FLUSH:
+				log_debug("Received a flushing request\n");
+				flush = 1;
+				break;
+			case IPC_REC_STATS:
+				if (consumer != NULL)
+					reply_control(ipc, consumer, IPC_REC_STATS,
+							&consumer->stats, sizeof(consumer->stats));
+				break;
+			case IPC_REC_CONFIG:
+				if (rec->len < sizeof(config))
+					break;
+				if (consumer == NULL &&
+						(consumer = add_ipc_consumer(ipc, from->sun_path, 0))
+						== NULL)
+					break;
+				memcpy(&config, IPC_REC_PAYLOAD(rec), sizeof(config));
+				consumer->batched = 1;
+				consumer->max_msg_size = MIN(MAX(config.max_msg_size,
+							sizeof(struct ipc_msg_hdr)), IPC_MSG_MAX_SIZE);
+				log_info("IPC consumer %s switched to batched messages of up "
+						"to %zu bytes\n", consumer->remote.sun_path,
+						consumer->max_msg_size);
+
+				config.max_msg_size = IPC_MSG_MAX_SIZE;
+				config.flags = 0;
+				reply_control(ipc, consumer, IPC_REC_CONFIG,
+						&config, sizeof(config));
+				break;
+			case IPC_REC_CREDIT:
+				if (consumer == NULL || rec->len < sizeof(credits))
+					break;
+				memcpy(&credits, IPC_REC_PAYLOAD(rec), sizeof(credits));
+				if (!consumer->credit_based) {
+					log_info("IPC consumer %s uses credits\n",
+							consumer->remote.sun_path);
+					consumer->credit_based = 1;
+					consumer->credits = 0;
+				}
+				consumer->credits += credits;
+				break;
+			case IPC_REC_VERDICT:
+				if (ipc->flows == NULL || rec->len < sizeof(verdict) ||
+						!flow_key_from_frame(IPC_REC_PAYLOAD(rec)
+							+ sizeof(verdict), rec->len - sizeof(verdict),
+							&key))
+					break;
+				memcpy(&verdict, IPC_REC_PAYLOAD(rec), sizeof(verdict));
+				if (verdict.verdict < IPC_VERDICT_PASS ||
+						verdict.verdict > IPC_VERDICT_INTERCEPT)
+					break;
+				clock_now(CLOCK_MONOTONIC, &now);
+				flow_table_set(ipc->flows, &key, verdict.verdict, verdict.ttl,
+						TS_TO_MS(now));
+				log_debug("Verdict %u cached for %ums\n", verdict.verdict,
+						verdict.ttl);
+				break;
+			case IPC_REC_LEAVE:
+				// the message may be in its shared memory: keep it mapped
+				// until the caller is done with it
+				if (consumer != NULL) {
+					consumer->leaving = 1;
+					consumer = NULL;
+				}
+				break;
+			default:
+				log_debug("Unknown IPC record %i ignored\n", rec->type);
+				break;
+		}
+	}
+
+	// credits may have been granted: catch up
+	if (consumer != NULL && consumer->backlog_count > 0 &&
+			drain_backlog(ipc, consumer))
+		flush_consumer(ipc, consumer);
+	return flush;
+}
+
+void reap_ipc_consumers(struct ipc *ipc) {
+	int i;
+
+	// backwards: removing a consumer moves the last one in its place
+	for (i = ipc->count - 1; i >= 0; i--) {
+		if (ipc->consumers[i]->leaving &&
+				flush_consumer(ipc, ipc->consumers[i]))
+			remove_ipc_consumer(ipc, ipc->consumers[i]);
+	}
+}
+
+int accept_shm_ipc(struct ipc *ipc, struct ipc_consumer *consumer) {
+	int fds[3];
+
+	// the consumer restarted: forget the previous region
+	if (consumer->shm_active) {
+		log_info("Dropping the previous shared memory of %s\n",
+				consumer->remote.sun_path);
+		consumer->shm_active = 0;
+		shm_close(&consumer->shm);
+	}
+
+	if (!shm_create(&consumer->shm))
+		return -1;
+
+	fds[0] = consumer->shm.memfd;
+	fds[1] = consumer->shm.doorbells[SHM_TO_CONSUMER];
+	fds[2] = consumer->shm.doorbells[SHM_FROM_CONSUMER];
+	if (shm_send_handshake(ipc->sock, &consumer->remote, SHM_MAGIC_ACCEPT,
+				fds, 3) == -1) {
+		perror("Failed to send the shared memory to the IPC");
+		shm_close(&consumer->shm);
+		return -1;
+	}
+
+	consumer->shm_active = 1;
+	consumer->shm_pending = 0;
+	log_info("IPC consumer %s switched to shared memory\n",
+			consumer->remote.sun_path);
+	return consumer->shm.doorbells[SHM_FROM_CONSUMER];
 }
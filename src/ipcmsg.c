@@ -0,0 +1,86 @@
+/*
+ * Batched message format of the IPC
+ */
+
+#include <ipcmsg.h>
+
+// standard headers
+#include <string.h>
+
+
+#define IPC_PAD(len) (((len) + IPC_ALIGN - 1) & ~(size_t) (IPC_ALIGN - 1))
+
+void ipc_msg_init(void *buf) {
+	struct ipc_msg_hdr *hdr = buf;
+
+	hdr->magic = IPC_MAGIC;
+	hdr->version = IPC_VERSION;
+	hdr->count = 0;
+	hdr->len = sizeof(struct ipc_msg_hdr);
+	hdr->reserved = 0;
+}
+
+struct ipc_rec *ipc_msg_append(void *buf, size_t size, uint16_t type,
+		uint32_t len) {
+	struct ipc_msg_hdr *hdr = buf;
+	struct ipc_rec *rec;
+	size_t offset = IPC_PAD(hdr->len);
+
+	if (hdr->count == UINT16_MAX ||
+			offset + sizeof(struct ipc_rec) + len > size)
+		return NULL;
+
+	rec = (struct ipc_rec *) ((uint8_t *) buf + offset);
+	memset(rec, 0, sizeof(struct ipc_rec));
+	rec->type = type;
+	rec->hdr_len = sizeof(struct ipc_rec);
+	rec->len = len;
+	rec->target = -1;
+
+	hdr->count++;
+	hdr->len = offset + sizeof(struct ipc_rec) + len;
+	return rec;
+}
+
+int ipc_msg_check(const void *buf, size_t len) {
+	const struct ipc_msg_hdr *hdr = buf;
+	const struct ipc_rec *rec;
+	size_t offset;
+	int i;
+
+	if (len < sizeof(struct ipc_msg_hdr) || hdr->magic != IPC_MAGIC ||
+			hdr->version != IPC_VERSION || hdr->len != len)
+		return 0;
+
+	// every record must lie in the message
+	offset = sizeof(struct ipc_msg_hdr);
+	for (i = 0; i < hdr->count; i++) {
+		offset = IPC_PAD(offset);
+		if (offset + sizeof(struct ipc_rec) > len)
+			return 0;
+		rec = (const struct ipc_rec *) ((const uint8_t *) buf + offset);
+		if (rec->hdr_len < sizeof(struct ipc_rec) ||
+				offset + rec->hdr_len + rec->len > len)
+			return 0;
+		offset += rec->hdr_len + rec->len;
+	}
+	// and nothing may follow the last one
+	return offset == len;
+}
+
+struct ipc_rec *ipc_msg_next(const void *buf, struct ipc_rec *prev) {
+	const struct ipc_msg_hdr *hdr = buf;
+	size_t offset;
+
+	if (prev == NULL) {
+		if (hdr->count == 0)
+			return NULL;
+		offset = IPC_PAD(sizeof(struct ipc_msg_hdr));
+	} else {
+		offset = IPC_PAD((size_t) ((uint8_t *) prev - (uint8_t *) buf)
+				+ prev->hdr_len + prev->len);
+		if (offset >= hdr->len)
+			return NULL;
+	}
+	return (struct ipc_rec *) ((uint8_t *) buf + offset);
+}
@@ -0,0 +1,243 @@
+/*
+ * Asynchronous logger: per-thread rings drained by a background writer
+ */
+
+#include <logger.h>
+
+// standard headers
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+
+// internal imports
+#include <threadreg.h>
+#include <utils.h>
+
+
+struct log_slot {
+	uint16_t len;
+	uint8_t error;				// to logErrorFacility
+	char text[LOGGER_SLOT_SIZE - 3];
+};
+
+// single producer (its thread), single consumer (the writer)
+struct log_ring {
+	_Alignas(64) atomic_size_t head;	// next slot to fill
+	_Alignas(64) atomic_size_t tail;	// next slot to write
+	atomic_uint_fast64_t drops;
+	uint64_t reported;			// drops already reported, by the writer
+	struct log_slot slots[LOGGER_SLOTS];
+};
+
+// rings of all threads, never freed: messages outlive their thread
+static void *ring_entries[LOGGER_MAX_THREADS];
+static struct thread_registry rings =
+	THREAD_REGISTRY_INIT(ring_entries, LOGGER_MAX_THREADS);
+static _Thread_local struct log_ring *local;
+static _Thread_local int unregistered;	// write directly
+
+static atomic_int running;
+static pthread_t writer;
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Producers
+ */
+struct log_ring static inline *local_ring(void) {
+	struct log_ring *r;
+
+	if (local != NULL || unregistered)
+		return local;
+
+	r = (struct log_ring *) aligned_alloc(64, sizeof(struct log_ring));
+	if (r == NULL) {
+		unregistered = 1;
+		return NULL;
+	}
+	atomic_init(&r->head, 0);
+	atomic_init(&r->tail, 0);
+	atomic_init(&r->drops, 0);
+	r->reported = 0;
+
+	if (!thread_registry_add(&rings, r)) {
+		free(r);
+		unregistered = 1;
+		return NULL;
+	}
+
+	local = r;
+	return r;
+}
+
+void logger_write(int error, const char *fmt, ...) {
+	struct log_ring *r;
+	struct log_slot *slot;
+	size_t head;
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	if (!atomic_load_explicit(&running, memory_order_acquire)
+			|| (r = local_ring()) == NULL) {
+		// stdio locks the stream: the message is written at once
+		vfprintf(error ? logErrorFacility : logFacility, fmt, ap);
+		fflush(error ? logErrorFacility : logFacility);
+		va_end(ap);
+		return;
+	}
+
+	head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	if (head - atomic_load_explicit(&r->tail, memory_order_acquire)
+			== LOGGER_SLOTS) {
+		counter_add(&r->drops, 1);
+		va_end(ap);
+		return;
+	}
+	slot = &r->slots[head & (LOGGER_SLOTS - 1)];
+	n = vsnprintf(slot->text, sizeof(slot->text), fmt, ap);
+	va_end(ap);
+	if (n < 0)
+		return;
+	slot->len = n < sizeof(slot->text) ? n : sizeof(slot->text) - 1;
+	slot->error = error;
+	atomic_store_explicit(&r->head, head + 1, memory_order_release);
+}
+
+/*
+ * Writer
+ */
+// write the pending messages of all rings. Return the number written
+int static drain(void) {
+	struct log_ring *r;
+	struct log_slot *slot;
+	size_t head, tail;
+	uint64_t drops;
+	int i, n, written = 0;
+
+	pthread_mutex_lock(&drain_lock);
+	n = thread_registry_count(&rings);
+	for (i = 0; i < n; i++) {
+		r = rings.entries[i];
+		tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+		head = atomic_load_explicit(&r->head, memory_order_acquire);
+		for (; tail != head; tail++, written++) {
+			slot = &r->slots[tail & (LOGGER_SLOTS - 1)];
+			fwrite(slot->text, 1, slot->len,
+					slot->error ? logErrorFacility : logFacility);
+		}
+		atomic_store_explicit(&r->tail, tail, memory_order_release);
+
+		drops = atomic_load_explicit(&r->drops, memory_order_relaxed);
+		if (drops != r->reported) {
+			fprintf(logErrorFacility, "Logger: %lu messages dropped\n",
+					(unsigned long) (drops - r->reported));
+			r->reported = drops;
+			written++;
+		}
+	}
+	if (written > 0) {
+		fflush(logFacility);
+		fflush(logErrorFacility);
+	}
+	pthread_mutex_unlock(&drain_lock);
+	return written;
+}
+
+void static *writer_main(void *arg) {
+	struct timespec interval = { 0, LOGGER_DRAIN_INTERVAL * 1000000 };
+
+	while (atomic_load_explicit(&running, memory_order_acquire)) {
+		if (drain() == 0)
+			nanosleep(&interval, NULL);
+	}
+	drain();
+	return NULL;
+}
+
+/*
+ * Control
+ */
+int logger_open_file(const char *path) {
+	FILE *f;
+
+	if ((f = fopen(path, "a")) == NULL) {
+		perror("Cannot open the log file");
+		return 0;
+	}
+	logFacility = f;
+	logErrorFacility = f;
+	return 1;
+}
+
+void logger_start(void) {
+	static int registered = 0;
+	sigset_t signals, old_signals;
+
+	if (atomic_load(&running))
+		return;
+	atomic_store(&running, 1);
+
+	// the signals of the poisoner are not for the writer
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	sigaddset(&signals, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &signals, &old_signals);
+	errno = pthread_create(&writer, NULL, &writer_main, NULL);
+	pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+	if (errno != 0) {
+		perror("Cannot start the logger, messages are written directly");
+		atomic_store(&running, 0);
+		return;
+	}
+
+	// the program mostly stops with exit()
+	if (!registered && atexit(&logger_stop) == 0)
+		registered = 1;
+}
+
+void logger_stop(void) {
+	if (!atomic_exchange(&running, 0))
+		return;
+	pthread_join(writer, NULL);
+	// messages queued while the writer stopped
+	drain();
+}
+
+/*
+ * Hexdump
+ */
+void logger_pkt(const void *buf, size_t len) {
+	const unsigned char *bytes = buf;
+	char hex[16 * 3 + 2], ascii[16 + 2];
+	size_t i, j;
+	int h, a;
+
+	for (i = 0; i < len; i += 16) {
+		h = a = 0;
+		for (j = 0; j < 16; j++) {
+			if (j == 8) {
+				hex[h++] = ' ';
+				ascii[a++] = ' ';
+			}
+			if (i + j < len) {
+				h += sprintf(&hex[h], j == 0 ? "%02x" : " %02x", bytes[i + j]);
+				ascii[a++] = bytes[i + j] >= 0x20 && bytes[i + j] < 0x7f
+					? bytes[i + j] : '.';
+			} else {
+				h += sprintf(&hex[h], j == 0 ? "  " : "   ");
+				ascii[a++] = ' ';
+			}
+		}
+		hex[h] = '\0';
+		ascii[a] = '\0';
+		logger_print("|%s|    |%s|\n", hex, ascii);
+	}
+}
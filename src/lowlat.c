@@ -0,0 +1,127 @@
+#define _GNU_SOURCE	// for pthread_setaffinity_np
+
+/*
+ * Helpers for the low-latency mode
+ */
+
+#include <lowlat.h>
+
+// standard headers
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+
+#include <sys/mman.h>
+
+// local headers
+#include <logger.h>
+#include <utils.h>
+
+
+int parse_cpu_list(const char *list, int *cpus, int max) {
+	int n = 0;
+	long cpu;
+	char *end;
+
+	while (*list != '\0') {
+		if (n == max)
+			return -1;
+		errno = 0;
+		cpu = strtol(list, &end, 10);
+		if (errno != 0 || end == list || cpu < 0 || cpu >= CPU_SETSIZE)
+			return -1;
+		cpus[n++] = (int) cpu;
+
+		if (*end == ',')
+			end++;
+		else if (*end != '\0')
+			return -1;
+		list = end;
+	}
+	return n;
+}
+
+int pin_thread(pthread_t thread, int cpu) {
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	errno = pthread_setaffinity_np(thread, sizeof(set), &set);
+	if (errno != 0) {
+		perror("Failed to pin thread");
+		return 0;
+	}
+	log_debug("Thread pinned on CPU %i\n", cpu);
+	return 1;
+}
+
+int set_realtime(int priority) {
+	struct sched_param param;
+
+	memset(&param, 0, sizeof(param));
+	param.sched_priority = priority;
+	errno = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+	if (errno != 0) {
+		perror("Failed to switch to SCHED_FIFO");
+		return 0;
+	}
+
+	// avoid page faults on the hot path
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) == -1) {
+		perror("Failed to lock memory");
+		return 0;
+	}
+	log_debug("Running under SCHED_FIFO with priority %i\n", priority);
+	return 1;
+}
+
+/*
+ * Latency statistics
+ */
+void lat_stats_init(struct lat_stats *s) {
+	atomic_init(&s->count, 0);
+	atomic_init(&s->sum, 0);
+	atomic_init(&s->min, UINT64_MAX);
+	atomic_init(&s->max, 0);
+}
+
+void lat_stats_add(struct lat_stats *s, uint64_t ns) {
+	counter_add(&s->count, 1);
+	counter_add(&s->sum, ns);
+	if (ns < atomic_load_explicit(&s->min, memory_order_relaxed))
+		atomic_store_explicit(&s->min, ns, memory_order_relaxed);
+	if (ns > atomic_load_explicit(&s->max, memory_order_relaxed))
+		atomic_store_explicit(&s->max, ns, memory_order_relaxed);
+}
+
+void lat_stats_merge(struct lat_stats *dst, struct lat_stats *src) {
+	uint64_t min = atomic_load_explicit(&src->min, memory_order_relaxed);
+	uint64_t max = atomic_load_explicit(&src->max, memory_order_relaxed);
+
+	atomic_fetch_add_explicit(&dst->count,
+			atomic_load_explicit(&src->count, memory_order_relaxed),
+			memory_order_relaxed);
+	atomic_fetch_add_explicit(&dst->sum,
+			atomic_load_explicit(&src->sum, memory_order_relaxed),
+			memory_order_relaxed);
+	if (min < atomic_load_explicit(&dst->min, memory_order_relaxed))
+		atomic_store_explicit(&dst->min, min, memory_order_relaxed);
+	if (max > atomic_load_explicit(&dst->max, memory_order_relaxed))
+		atomic_store_explicit(&dst->max, max, memory_order_relaxed);
+}
+
+void lat_stats_report(const char *name, struct lat_stats *s) {
+	uint64_t count = atomic_load(&s->count);
+
+	if (count == 0) {
+		log_info("%s: no sample\n", name);
+		return;
+	}
+	log_info("%s: %lu samples, avg %.1fus, min %.1fus, max %.1fus\n", name,
+			(unsigned long) count,
+			(double) atomic_load(&s->sum) / count / 1000,
+			(double) atomic_load(&s->min) / 1000,
+			(double) atomic_load(&s->max) / 1000);
+}
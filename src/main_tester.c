@@ -1,3 +1,5 @@
+#define _GNU_SOURCE	// for recvmmsg
+
 // Common configuration file (autogenerated)
 #include <config.h>
 
@@ -9,15 +11,21 @@
 #include <string.h>
 #include <signal.h>
 #include <errno.h>
+#include <time.h>
+#include <pthread.h>
 
 #include <sys/stat.h>
-
-// network
 #include <sys/socket.h>
-#include <sys/un.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+
+#include <camclient.h>
 
-#include <logger.h>
 
+#define VAR_DIR_PATH	"/var/run/" PACKAGE_NAME
+#define SOCKET_PATH		VAR_DIR_PATH "/tester.sock"
 
 /*******************
  * Argument parser *
@@ -29,18 +37,60 @@ static char doc[] =
 "A client tester for the CAM poisoning application.\n"
 "Just launch this application before starting to poison. It only resend "
 "intercepted packets without modifying them. Intercepted packets can easily "
-"be monitored with packet dissector applications like Wireshark.";
+"be monitored with packet dissector applications like Wireshark.\n\n"
+"With --threads, each worker has its own socket: the first one at the given "
+"path, the others at path.1, path.2... Batched workers join the poisoner "
+"which spreads the flows between them, raw ones must be given to the poisoner "
+"with --consumer.\n\n"
+"With --probe, the tester also listens on the interface of the poisoner and "
+"measures the time until each frame it echoes is retransmitted: from its own "
+"reception, and from the capture by the poisoner when known (with --batch).";
 
 static char args_doc[] = "";
 static struct argp_option options[] = {
 	{ "verbose",	'v',	0,			0,	"Produce verbose output"},
+	{ "batch",		'b',	0,			0,
+		"Exchange frames by batch, with their metadata"},
+	{ "shm",		's',	0,			0,
+		"Exchange frames through shared memory rings instead of datagrams "
+		"(implies --batch)"},
+	{ "credits",	'C',	"frames",	0,
+		"Use flow control: accept at most this number of frames in flight "
+		"(implies --batch)"},
+	{ "delay",		'D',	"us",		0,
+		"Wait this long for each frame, to simulate a slow program"},
+	{ "pass",		'P',	"ttl",		OPTION_ARG_OPTIONAL,
+		"Ask the poisoner to retransmit each flow without us after its first "
+		"frame, for ttl ms (implies --batch)"},
+	{ "socket",		'p',	"path",		0,
+		"Path of the IPC socket, to run several testers. "
+		"Default: " SOCKET_PATH},
+	{ "threads",	'j',	"N",		0,
+		"Echo frames with N worker threads, each with its own socket"},
+	{ "interval",	'i',	"s",		0,
+		"Report the rates every s seconds, 0 for never. Default: 1"},
+	{ "probe",		'r',	"interface",	0,
+		"Measure the round trip of the frames: until they are retransmitted "
+		"on this interface"},
 	{ 0 }
 };
 
 struct arguments {
 	int verbose;
+	int batch;
+	int shm;
+	int credits;
+	int delay;
+	int pass;
+	uint32_t pass_ttl;
+	char *path;
+	int threads;
+	int interval;
+	char *probe;
 };
 
+#define MAX_THREADS 64
+
 /*
  * argp parser
  */
@@ -50,6 +100,43 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
 		case 'v':
 			arguments->verbose = 1;
 			break;
+		case 'b':
+			arguments->batch = 1;
+			break;
+		case 's':
+			arguments->shm = 1;
+			arguments->batch = 1;
+			break;
+		case 'C':
+			arguments->credits = atoi(arg);
+			arguments->batch = 1;
+			if (arguments->credits <= 0)
+				argp_error(state, "Invalid number of credits -- %s", arg);
+			break;
+		case 'D':
+			arguments->delay = atoi(arg);
+			break;
+		case 'P':
+			arguments->pass = 1;
+			arguments->batch = 1;
+			arguments->pass_ttl = arg == NULL ? 0 : atoi(arg);
+			break;
+		case 'p':
+			arguments->path = arg;
+			break;
+		case 'j':
+			arguments->threads = atoi(arg);
+			if (arguments->threads <= 0 || arguments->threads > MAX_THREADS)
+				argp_error(state, "Invalid number of threads -- %s", arg);
+			break;
+		case 'i':
+			arguments->interval = atoi(arg);
+			if (arguments->interval < 0)
+				argp_error(state, "Invalid interval -- %s", arg);
+			break;
+		case 'r':
+			arguments->probe = arg;
+			break;
 
 		case ARGP_KEY_ARG:
 			if (state->arg_num >= NB_ARGS)
@@ -72,23 +159,442 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
 
 static struct argp argp = { options, parse_opt, args_doc, doc, 0, 0, 0 };
 static void (*prev_handler)(int);
-static struct sockaddr_un svaddr;
 
-#define MAX_PKT_SIZE 1500
 #define ETH_HDR_SIZE 14
 #define MAC_ARG(x) (x)[0],(x)[1],(x)[2],(x)[3],(x)[4],(x)[5]
 
-#define VAR_DIR_PATH	"/var/run/" PACKAGE_NAME
-#define SOCKET_PATH		VAR_DIR_PATH "/tester.sock"
+#define MAX_FRAMES 64
+
+/*
+ * Workers: each one echoes the frames of its own client. The counters are
+ * only written by the worker and read by the main thread for the reports
+ */
+struct worker {
+	int id;
+	struct arguments *args;
+	struct camclient client;
+	pthread_t thread;
+	unsigned long frames;
+	unsigned long bytes;
+};
+
+static struct worker *workers;
+static int nworkers;
+
+void delete_socket_files() {
+	int i;
+
+	for (i = 0; i < nworkers; i++) {
+		if (unlink(workers[i].client.addr.sun_path) == -1) {
+			perror("Failed to delete the socket file");
+		}
+	}
+}
+
+void print_frame(struct worker *w, unsigned long count, unsigned char *buf) {
+	if (nworkers > 1)
+		printf("[%i] ", w->id);
+	printf("Received frame #%lu: "
+			"%02x:%02x:%02x:%02x:%02x:%02x -> "
+			"%02x:%02x:%02x:%02x:%02x:%02x\n", count,
+			MAC_ARG(&buf[6]), MAC_ARG(buf));
+}
+
+void fatal(const char *msg) {
+	perror(msg);
+	delete_socket_files();
+	exit(1);
+}
+
+/*
+ * Hooks of the client library
+ */
+void print_mode(int mode, void *arg) {
+	struct worker *w = arg;
+
+	if (nworkers > 1)
+		printf("[%i] ", w->id);
+	switch (mode) {
+		case CAMCLIENT_BATCH:
+			printf("Frames are exchanged by batch\n");
+			break;
+		case CAMCLIENT_SHM:
+			printf("Frames are exchanged through shared memory\n");
+			break;
+		default:
+			printf("The poisoner restarted: frames are exchanged raw\n");
+			break;
+	}
+}
+
+void print_stats(const struct ipc_stats *stats, void *arg) {
+	printf("Poisoner: %lu frames sent, %lu received, "
+			"%lu dropped, %lu overloaded\n",
+			(unsigned long) stats->frames_sent,
+			(unsigned long) stats->frames_received,
+			(unsigned long) stats->drops,
+			(unsigned long) stats->overloads);
+}
+
+/*
+ * Send a frame back as is, with its metadata
+ */
+void echo_frame(struct worker *w, struct ipc_rec *frame,
+		unsigned long count) {
+	struct arguments *args = w->args;
+	struct camclient *client = &w->client;
+	uint8_t *buf = IPC_REC_PAYLOAD(frame);
+
+	if (args->delay > 0)
+		usleep(args->delay);
+	if (args->verbose) {
+		print_frame(w, count, buf);
+		if (client->mode != CAMCLIENT_RAW) {
+			printf("  seq %lu, %u/%u bytes, target #%i, ifindex %i\n",
+					(unsigned long) frame->seq, frame->len, frame->orig_len,
+					frame->target, frame->ifindex);
+		}
+	}
+
+	// we don't modify anything: let the poisoner handle the flow
+	if (args->pass && client->mode != CAMCLIENT_RAW &&
+			camclient_verdict(client, buf, frame->len, IPC_VERDICT_PASS,
+				args->pass_ttl) == -1 && errno != ENOBUFS) {
+		fatal("Error while writing IPC");
+	}
+	if (camclient_send(client, frame, buf, frame->len) == -1) {
+		if (errno != ENOBUFS)
+			fatal("Error while writing IPC");
+		if (args->verbose)
+			printf("Frames dropped: ring full\n");
+	}
+}
+
+/*
+ * Round-trip probe: the frames are stamped on reception in a table, by a hash
+ * of their content, and matched when the poisoner retransmits them on the
+ * interface. The table is shared by the workers and the probe thread; a frame
+ * never retransmitted is evicted by newer ones
+ */
+#define PROBE_SLOTS			65536
+#define PROBE_WAYS			8			// slots tried for a frame
+#define PROBE_BATCH			64
+#define PROBE_SNAPLEN		2048		// above the frames of the poisoner
+#define PROBE_LAT_BUCKETS	100000		// 1us each: 100ms, then the last one
+#define NS_PER_S			1000000000ULL
+
+struct probe_entry {
+	uint64_t key;				// hash of the frame, 0 if free
+	uint64_t stamp;				// reception by the tester, ns since the epoch
+	uint64_t capture;			// by the poisoner, 0 if unknown
+	uint64_t seq;
+};
+
+struct probe_histo {
+	uint64_t count;
+	uint64_t lat[PROBE_LAT_BUCKETS];
+	uint64_t max;
+};
+
+static struct probe_entry *probe_table;
+static pthread_mutex_t probe_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long probe_evicted;
+static int probe_sock = -1;
+
+uint64_t now_ns(clockid_t clock) {
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return (uint64_t) ts.tv_sec * NS_PER_S + ts.tv_nsec;
+}
+
+// FNV-1a, never 0
+uint64_t frame_hash(const uint8_t *buf, uint32_t len) {
+	uint64_t h = 0xcbf29ce484222325ULL;
+	uint32_t i;
+
+	for (i = 0; i < len; i++) {
+		h ^= buf[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h != 0 ? h : 1;
+}
+
+static inline struct probe_entry *probe_ways(uint64_t key) {
+	return &probe_table[(key % (PROBE_SLOTS / PROBE_WAYS)) * PROBE_WAYS];
+}
+
+// stamp the frames received by a worker, before they are echoed
+void probe_stamp(struct ipc_rec **frames, int n) {
+	struct probe_entry *ways, *e;
+	uint64_t key, now = now_ns(CLOCK_REALTIME);
+	int i, j;
+
+	pthread_mutex_lock(&probe_lock);
+	for (i = 0; i < n; i++) {
+		key = frame_hash(IPC_REC_PAYLOAD(frames[i]), frames[i]->len);
+		ways = probe_ways(key);
+		// a free slot, else the oldest one
+		for (e = ways, j = 0; j < PROBE_WAYS; j++) {
+			if (ways[j].key == key)
+				break;
+			if (ways[j].key == 0 || (e->key != 0
+						&& ways[j].stamp < e->stamp))
+				e = &ways[j];
+		}
+		if (j < PROBE_WAYS)
+			// the same frame again: keep the first stamp
+			continue;
+		if (e->key != 0)
+			probe_evicted++;
+		e->key = key;
+		e->stamp = now;
+		e->capture = frames[i]->ts;
+		e->seq = frames[i]->seq;
+	}
+	pthread_mutex_unlock(&probe_lock);
+}
+
+// take the entry of a frame seen on the wire. Return 0 if not stamped
+int probe_match(uint64_t key, struct probe_entry *entry) {
+	struct probe_entry *ways = probe_ways(key);
+	int j, found = 0;
+
+	pthread_mutex_lock(&probe_lock);
+	for (j = 0; j < PROBE_WAYS; j++) {
+		if (ways[j].key == key) {
+			*entry = ways[j];
+			ways[j].key = 0;
+			found = 1;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&probe_lock);
+	return found;
+}
+
+void probe_record(struct probe_histo *h, uint64_t start, uint64_t end) {
+	// the clocks of the kernel and of the poisoner may be slightly apart
+	uint64_t lat = end > start ? end - start : 0;
+
+	h->count++;
+	h->max = lat > h->max ? lat : h->max;
+	if (lat / 1000 < PROBE_LAT_BUCKETS)
+		h->lat[lat / 1000]++;
+}
+
+// in us
+double probe_percentile(const struct probe_histo *h, double p) {
+	uint64_t rank = p * h->count, sum = 0;
+	int i;
+
+	for (i = 0; i < PROBE_LAT_BUCKETS; i++) {
+		if ((sum += h->lat[i]) > rank)
+			return i;
+	}
+	return (double) h->max / 1000;
+}
+
+void print_probe_histo(const char *name, const struct probe_histo *h) {
+	if (h->count == 0)
+		return;
+	printf("  %-14s p50 %.0fus, p90 %.0fus, p99 %.0fus, p99.9 %.0fus, "
+			"max %.1fus\n", name, probe_percentile(h, 0.5),
+			probe_percentile(h, 0.9), probe_percentile(h, 0.99),
+			probe_percentile(h, 0.999), (double) h->max / 1000);
+}
+
+int open_probe(const char *ifname) {
+	struct sockaddr_ll sll;
+	struct timeval tv = { 0, 100000 };
+	int sock, one = 1;
+
+	if ((sock = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL))) == -1) {
+		perror("Cannot open the packet socket");
+		exit(1);
+	}
+	memset(&sll, 0, sizeof(sll));
+	sll.sll_family = AF_PACKET;
+	sll.sll_protocol = htons(ETH_P_ALL);
+	if ((sll.sll_ifindex = if_nametoindex(ifname)) == 0) {
+		perror("Interface not found");
+		exit(1);
+	}
+	if (bind(sock, (struct sockaddr *) &sll, sizeof(sll)) == -1) {
+		perror("Cannot bind the packet socket");
+		exit(1);
+	}
+	if (setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, &one, sizeof(one)) == -1)
+		perror("Cannot enable the timestamps, the reading time is used");
+	// to report on time without traffic
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	if ((probe_table = calloc(PROBE_SLOTS, sizeof(struct probe_entry)))
+			== NULL) {
+		perror("Cannot allocate the probe table");
+		exit(1);
+	}
+	return sock;
+}
+
+/*
+ * Watch the frames sent on the interface, and report the round trips of
+ * the stamped ones every interval
+ */
+void *probe_loop(void *arg) {
+	struct arguments *args = arg;
+	static uint8_t bufs[PROBE_BATCH][PROBE_SNAPLEN];
+	static struct probe_histo echo, wire;
+	struct mmsghdr msgs[PROBE_BATCH];
+	struct iovec iovs[PROBE_BATCH];
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(struct timespec))];
+	} controls[PROBE_BATCH];
+	struct sockaddr_ll addrs[PROBE_BATCH];
+	struct probe_entry entry;
+	struct cmsghdr *cmsg;
+	struct timespec ts;
+	uint64_t tx_ts, now, report, evicted;
+	int i, n;
+
+	memset(msgs, 0, sizeof(msgs));
+	for (i = 0; i < PROBE_BATCH; i++) {
+		iovs[i].iov_base = bufs[i];
+		iovs[i].iov_len = sizeof(bufs[i]);
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_name = &addrs[i];
+	}
+
+	report = now_ns(CLOCK_MONOTONIC) + args->interval * NS_PER_S;
+	for (;;) {
+		now = now_ns(CLOCK_MONOTONIC);
+		if (args->interval > 0 && now >= report) {
+			pthread_mutex_lock(&probe_lock);
+			evicted = probe_evicted;
+			probe_evicted = 0;
+			pthread_mutex_unlock(&probe_lock);
+			printf("Round trip: %lu frames back on the wire, "
+					"%lu never seen\n", (unsigned long) echo.count,
+					(unsigned long) evicted);
+			print_probe_histo("tester to wire", &echo);
+			print_probe_histo("wire to wire", &wire);
+			fflush(stdout);
+			memset(&echo, 0, sizeof(echo));
+			memset(&wire, 0, sizeof(wire));
+			report += args->interval * NS_PER_S;
+		}
+
+		for (i = 0; i < PROBE_BATCH; i++) {
+			msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+			msgs[i].msg_hdr.msg_control = controls[i].buf;
+			msgs[i].msg_hdr.msg_controllen = sizeof(controls[i].buf);
+		}
+		if ((n = recvmmsg(probe_sock, msgs, PROBE_BATCH, MSG_WAITFORONE,
+						NULL)) == -1) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				fatal("Error while reading the interface");
+			continue;
+		}
+
+		now = 0;
+		for (i = 0; i < n; i++) {
+			// the retransmissions of the poisoner
+			if (addrs[i].sll_pkttype != PACKET_OUTGOING ||
+					!probe_match(frame_hash(bufs[i], msgs[i].msg_len), &entry))
+				continue;
+
+			tx_ts = 0;
+			for (cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cmsg != NULL;
+					cmsg = CMSG_NXTHDR(&msgs[i].msg_hdr, cmsg)) {
+				if (cmsg->cmsg_level == SOL_SOCKET
+						&& cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+					memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+					tx_ts = (uint64_t) ts.tv_sec * NS_PER_S + ts.tv_nsec;
+				}
+			}
+			if (tx_ts == 0) {
+				if (now == 0)
+					now = now_ns(CLOCK_REALTIME);
+				tx_ts = now;
+			}
+			probe_record(&echo, entry.stamp, tx_ts);
+			if (entry.capture != 0)
+				probe_record(&wire, entry.capture, tx_ts);
+			if (args->verbose) {
+				printf("Frame seq %lu back on the wire after %.1fus\n",
+						(unsigned long) entry.seq,
+						(double) ((int64_t) (tx_ts - entry.stamp)) / 1000);
+			}
+		}
+	}
+	return NULL;
+}
+
+void *worker_loop(void *arg) {
+	struct worker *w = arg;
+	struct ipc_rec *frames[MAX_FRAMES];
+	unsigned long count = 0, bytes;
+	int i, n;
 
-void delete_socket_file() {
-	if (unlink(svaddr.sun_path) == -1) {
-		perror("Failed to delete the socket file");
+	for (;;) {
+		// Read and directly retransmit all frames
+		if ((n = camclient_recv(&w->client, frames, MAX_FRAMES, -1)) == -1)
+			fatal("Error while reading IPC");
+		if (probe_sock != -1)
+			probe_stamp(frames, n);
+		bytes = 0;
+		for (i = 0; i < n; i++) {
+			if (frames[i]->len < ETH_HDR_SIZE)
+				continue;
+			echo_frame(w, frames[i], ++count);
+			bytes += frames[i]->len;
+		}
+		if (camclient_flush(&w->client) == -1 && errno != ENOBUFS)
+			fatal("Error while writing IPC");
+		__atomic_store_n(&w->frames, count, __ATOMIC_RELAXED);
+		__atomic_store_n(&w->bytes, w->bytes + bytes, __ATOMIC_RELAXED);
 	}
+	return NULL;
+}
+
+/*
+ * Rates of all the workers since the previous report
+ */
+void report_rates(int interval) {
+	static unsigned long prev_frames, prev_bytes;
+	static struct timespec prev;
+	struct timespec now;
+	unsigned long frames = 0, bytes = 0;
+	double elapsed;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	for (i = 0; i < nworkers; i++) {
+		frames += __atomic_load_n(&workers[i].frames, __ATOMIC_RELAXED);
+		bytes += __atomic_load_n(&workers[i].bytes, __ATOMIC_RELAXED);
+	}
+	elapsed = prev.tv_sec == 0 ? interval :
+		(now.tv_sec - prev.tv_sec) + (now.tv_nsec - prev.tv_nsec) / 1e9;
+	if (elapsed > 0) {
+		printf("%lu frames echoed, %.0f frames/s, %.1f Mbit/s\n", frames,
+				(frames - prev_frames) / elapsed,
+				(bytes - prev_bytes) * 8 / elapsed / 1e6);
+		fflush(stdout);
+	}
+	prev_frames = frames;
+	prev_bytes = bytes;
+	prev = now;
 }
 
 void sigint_handler(int sig) {
-	delete_socket_file();
+	int i;
+
+	// let the poisoner give our flows to the other consumers
+	for (i = 0; i < nworkers; i++)
+		camclient_leave(&workers[i].client);
+	delete_socket_files();
 
 	// restore the previous handler
 	signal(sig, prev_handler);
@@ -103,112 +609,88 @@ int main(int argc, char *argv[]) {
 	struct arguments args;
 	memset(&args, 0, sizeof(struct arguments));
 
+	args.path = SOCKET_PATH;
+	args.threads = 1;
+	args.interval = 1;
+
 	// parse cmdline arguments
 	argp_parse(&argp, argc, argv, 0, 0, &args);
 
 	// Ensure the base directory for the socket path exists
 	struct stat st = {0};
 	if (stat(VAR_DIR_PATH, &st) == -1) {
-		if (errno == ENOENT) {
-			if (mkdir(VAR_DIR_PATH, 0755) == -1) {
-				perror("Failed to create socket directory");
-				exit(1);
-			}
-		} else {
+		if (errno != ENOENT) {
 			perror("Failed to stat socket directory");
 			exit(1);
 		}
-	} else {
-		// Ensure the the socket is deleted if it exists
-		if (stat(SOCKET_PATH, &st) == -1) {
-			// The only accepted error is ENOENT (i.e. file doesn't exist)
-			if (errno != ENOENT) {
-				perror("Failed to stat the socket file");
-				exit(1);
-			}
-		} else {
-			// File exists => need to delete
-			if (unlink(SOCKET_PATH) == -1) {
-				perror("Failed to delete the socket file");
-			}
+		if (mkdir(VAR_DIR_PATH, 0755) == -1) {
+			perror("Failed to create socket directory");
+			exit(1);
 		}
 	}
 
-	// open the IPC socket
-	int ipc;
-	unsigned char buf[MAX_PKT_SIZE];
-	ssize_t buflen;
-	unsigned long pkt_count = 0;
-	struct sockaddr_un claddr = {0};
-	socklen_t claddr_l;
-
-	// create the socket and connect it to the file
-	if ( (ipc = socket(AF_UNIX, SOCK_DGRAM, 0)) == -1) {
-		perror("Cannot open UNIX socket");
-		exit(1);
+	if (args.probe != NULL) {
+		probe_sock = open_probe(args.probe);
+		printf("Round trips measured on %s\n", args.probe);
 	}
 
-	memset(&svaddr, 0, sizeof(struct sockaddr_un));
-	svaddr.sun_family = AF_UNIX;
-	strncpy(svaddr.sun_path, SOCKET_PATH, sizeof(svaddr.sun_path) - 1);
+	// open the IPC sockets, and ask the poisoner for the transport
+	char path[sizeof(((struct sockaddr_un *) NULL)->sun_path)];
+	int i, mode;
 
-
-	if (bind(ipc, (struct sockaddr*) &svaddr, sizeof(svaddr)) == -1) {
-		perror("Cannot bind UNIX socket");
+	mode = args.shm ? CAMCLIENT_SHM :
+		args.batch ? CAMCLIENT_BATCH : CAMCLIENT_RAW;
+	if ((workers = calloc(args.threads, sizeof(struct worker))) == NULL) {
+		perror("Cannot allocate the workers");
 		exit(1);
 	}
-	// print a message to notify of the socket path
-	printf("The IPC socket has been opened here: %s\n", SOCKET_PATH);
+	for (i = 0; i < args.threads; i++) {
+		struct worker *w = &workers[i];
+		struct camclient_hooks hooks = { print_mode, print_stats, w };
+
+		if (i == 0)
+			snprintf(path, sizeof(path), "%s", args.path);
+		else
+			snprintf(path, sizeof(path), "%s.%i", args.path, i);
+		w->id = i;
+		w->args = &args;
+		if (camclient_open(&w->client, path, mode, args.credits) == -1) {
+			perror("Cannot open the IPC socket");
+			delete_socket_files();
+			exit(1);
+		}
+		nworkers++;
+		camclient_set_hooks(&w->client, &hooks);
+		// print a message to notify of the socket path
+		printf("The IPC socket has been opened here: %s\n", path);
+	}
 
-	// register a signal handler on SIGINT to unlink the socket file
+	// register a signal handler on SIGINT to unlink the socket files
 	prev_handler = signal(SIGINT, sigint_handler);
 
 	printf("Wait for incoming packets\n");
+	fflush(stdout);
+	for (i = 0; i < nworkers; i++) {
+		if ((errno = pthread_create(&workers[i].thread, NULL, worker_loop,
+						&workers[i])) != 0)
+			fatal("Cannot start the worker");
+	}
+	pthread_t probe_thread;
+	if (probe_sock != -1 && (errno = pthread_create(&probe_thread, NULL,
+					probe_loop, &args)) != 0)
+		fatal("Cannot start the probe");
 	for (;;) {
-		// Read and directly retransmit all packets
-		// Read
-		claddr_l = sizeof(claddr);
-		buflen = recvfrom(ipc, buf, MAX_PKT_SIZE, 0,
-				(struct sockaddr *)&claddr, &claddr_l);
-		if (buflen == -1) {
-			// case error
-			if (!args.verbose)
-				printf("\n");
-			perror("Error while reading IPC");
-			delete_socket_file();
-			exit(1);
-		} else if (buflen >= ETH_HDR_SIZE) {
-			// case a packet was received
-
-			// print info about the received packet
-			if (args.verbose) {
-				printf("Received frame #%i: "
-						"%02x:%02x:%02x:%02x:%02x:%02x -> "
-						"%02x:%02x:%02x:%02x:%02x:%02x\n", ++pkt_count,
-						MAC_ARG(&buf[6]), MAC_ARG(buf));
-			} else {
-				printf("\rReceived frame #%i", ++pkt_count);
-				fflush(stdout);
-			}
-
-			// Send the packet back
-			if (sendto(ipc, buf, buflen, 0,
-						(struct sockaddr *)&claddr, claddr_l) == -1) {
-				if (!args.verbose)
-					printf("\n");
-				perror("Error while writing IPC");
-				delete_socket_file();
-				exit(1);
-			}
+		if (args.interval == 0) {
+			pause();
+			continue;
 		}
+		sleep(args.interval);
+		report_rates(args.interval);
 	}
 
 	// should not be reached
-	// close the IPC socket
-	close(ipc);
-
-	// delete the socket file
-	delete_socket_file();
+	for (i = 0; i < nworkers; i++)
+		camclient_close(&workers[i].client);
 
 	return 0;
 }
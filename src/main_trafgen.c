@@ -0,0 +1,703 @@
+#define _GNU_SOURCE	// for sendmmsg and recvmmsg
+
+// Common configuration file (autogenerated)
+#include <config.h>
+
+// System headers
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <argp.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <net/ethernet.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+#include <linux/if_packet.h>
+
+
+/*
+ * Frames: UDP over IPv4, the flow being the source port. The payload starts
+ * with the stream (a random number per run of the sender), the sequence
+ * number and the sending time, and is padded to the size of the frame
+ */
+#define TRAFGEN_MAGIC		0x54524146	// "TRAF"
+#define TRAFGEN_PORT		9			// discard
+#define TRAFGEN_BASE_PORT	10000		// + flow
+#define TRAFGEN_MIN_SIZE	64			// without the FCS
+#define TRAFGEN_MAX_SIZE	1514
+#define TRAFGEN_MAX_BATCH	256
+#define TRAFGEN_MAX_MIX		1024		// sum of the weights of the sizes
+#define TRAFGEN_LAT_BUCKETS	100000		// 1us each: 100ms, then the last one
+#define TRAFGEN_LOST_RANGES	64			// printed in verbose mode
+
+struct trafgen_payload {
+	uint32_t magic;
+	uint16_t stream;
+	uint64_t seq;
+	uint64_t ts;				// CLOCK_REALTIME, in ns
+} __attribute__((packed));
+
+struct trafgen_frame {
+	struct ether_header eh;
+	struct iphdr ip;
+	struct udphdr udp;
+	struct trafgen_payload payload;
+} __attribute__((packed));
+
+/*******************
+ * Argument parser *
+ *******************/
+#define NB_ARGS 1
+const char *argp_program_version = PACKAGE_STRING;
+const char *argp_program_bug_address = PACKAGE_BUGREPORT;
+static char doc[] =
+"A traffic generator for the CAM poisoning application.\n"
+"Send unicast frames to a MAC address at a given rate, with a mix of frame "
+"sizes over several flows. Each frame carries a sequence number and its "
+"sending time: run it with --receive on the destination host to report the "
+"frames lost, reordered or duplicated, and the one-way latency (the clocks "
+"of both hosts must be synchronized, e.g. the same host in a testbed).";
+
+static char args_doc[] = "INTERFACE";
+
+#define OPT_SRC_IP	256
+#define OPT_DST_IP	257
+static struct argp_option options[] = {
+	{ 0, 0, 0, 0, "Sender options:" },
+	{ "dst",		'd',	"mac",		0,
+		"Destination MAC address (required to send)"},
+	{ "src",		's',	"mac",		0,
+		"Source MAC address. Default: the one of the interface"},
+	{ "src-ip",		OPT_SRC_IP,	"ip",	0,	"Default: 198.18.0.1"},
+	{ "dst-ip",		OPT_DST_IP,	"ip",	0,	"Default: 198.18.0.2"},
+	{ "rate",		'r',	"pps",		0,
+		"Frames per second, 0 for as fast as possible. Default: 1000"},
+	{ "sizes",		'l',	"mix",		0,
+		"Comma-separated sizes of the frames (without FCS), each with an "
+		"optional weight, e.g. 64:7,576:4,1500:1. Default: 64"},
+	{ "flows",		'F',	"n",		0,
+		"Number of flows (UDP source ports). Default: 1"},
+	{ "batch",		'b',	"frames",	0,
+		"Frames per system call. Default: 32"},
+	{ 0, 0, 0, 0, "Receiver options:" },
+	{ "receive",	'R',	0,			0,
+		"Receive the frames instead of sending them"},
+	{ "verbose",	'v',	0,			0,
+		"List the sequence numbers of the lost frames"},
+	{ 0, 0, 0, 0, "Common options:" },
+	{ "count",		'c',	"frames",	0,
+		"Stop after this number of frames. Default: never"},
+	{ "duration",	't',	"s",		0,
+		"Stop after this time. Default: never"},
+	{ "interval",	'i',	"ms",		0,
+		"Report period. Default: 1000"},
+	{ 0 }
+};
+
+struct arguments {
+	char *ifname;
+	int receive;
+	int verbose;
+	int has_dst;
+	uint8_t dst[ETH_ALEN];
+	int has_src;
+	uint8_t src[ETH_ALEN];
+	struct in_addr src_ip;
+	struct in_addr dst_ip;
+	long rate;
+	int flows;
+	int batch;
+	uint64_t count;
+	int duration;
+	int interval;
+	// frame sizes, by sequence number
+	int nmix;
+	uint16_t mix[TRAFGEN_MAX_MIX];
+};
+
+int static parse_mac(const char *s, uint8_t mac[ETH_ALEN]) {
+	return sscanf(s, "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx", &mac[0], &mac[1],
+			&mac[2], &mac[3], &mac[4], &mac[5]) == ETH_ALEN;
+}
+
+// sizes interleaved by weight, e.g. 64:2,1500 -> 64,1500,64
+int static parse_mix(const char *s, struct arguments *arguments) {
+	int sizes[TRAFGEN_MAX_MIX], weights[TRAFGEN_MAX_MIX], left[TRAFGEN_MAX_MIX];
+	int n = 0, total = 0, i, best;
+	const char *p = s;
+	char *end;
+
+	while (*p != '\0' && n < TRAFGEN_MAX_MIX) {
+		sizes[n] = strtol(p, &end, 10);
+		weights[n] = 1;
+		if (*end == ':')
+			weights[n] = strtol(end + 1, &end, 10);
+		if (end == p || (*end != ',' && *end != '\0')
+				|| sizes[n] < TRAFGEN_MIN_SIZE || sizes[n] > TRAFGEN_MAX_SIZE
+				|| weights[n] < 1 || (total += weights[n]) > TRAFGEN_MAX_MIX)
+			return 0;
+		left[n] = weights[n];
+		n++;
+		p = *end == ',' ? end + 1 : end;
+	}
+	if (n == 0 || *p != '\0')
+		return 0;
+
+	// the size with the most weight left goes next
+	for (arguments->nmix = 0; arguments->nmix < total; arguments->nmix++) {
+		for (best = 0, i = 1; i < n; i++) {
+			if ((long) left[i] * weights[best] > (long) left[best] * weights[i])
+				best = i;
+		}
+		arguments->mix[arguments->nmix] = sizes[best];
+		left[best]--;
+	}
+	return 1;
+}
+
+/*
+ * argp parser
+ */
+static error_t parse_opt(int key, char *arg, struct argp_state *state) {
+	struct arguments *arguments = state->input;
+	switch (key) {
+		case 'd':
+			if (!parse_mac(arg, arguments->dst))
+				argp_error(state, "Invalid MAC address -- %s", arg);
+			arguments->has_dst = 1;
+			break;
+		case 's':
+			if (!parse_mac(arg, arguments->src))
+				argp_error(state, "Invalid MAC address -- %s", arg);
+			arguments->has_src = 1;
+			break;
+		case OPT_SRC_IP:
+			if (inet_aton(arg, &arguments->src_ip) == 0)
+				argp_error(state, "Invalid IP address -- %s", arg);
+			break;
+		case OPT_DST_IP:
+			if (inet_aton(arg, &arguments->dst_ip) == 0)
+				argp_error(state, "Invalid IP address -- %s", arg);
+			break;
+		case 'r':
+			arguments->rate = atol(arg);
+			if (arguments->rate < 0)
+				argp_error(state, "Invalid rate -- %s", arg);
+			break;
+		case 'l':
+			if (!parse_mix(arg, arguments))
+				argp_error(state, "Invalid frame sizes (%d to %d) -- %s",
+						TRAFGEN_MIN_SIZE, TRAFGEN_MAX_SIZE, arg);
+			break;
+		case 'F':
+			arguments->flows = atoi(arg);
+			if (arguments->flows < 1 || arguments->flows > 65535
+					- TRAFGEN_BASE_PORT)
+				argp_error(state, "Invalid number of flows -- %s", arg);
+			break;
+		case 'b':
+			arguments->batch = atoi(arg);
+			if (arguments->batch < 1 || arguments->batch > TRAFGEN_MAX_BATCH)
+				argp_error(state, "Invalid batch (1 to %d) -- %s",
+						TRAFGEN_MAX_BATCH, arg);
+			break;
+		case 'R':
+			arguments->receive = 1;
+			break;
+		case 'v':
+			arguments->verbose = 1;
+			break;
+		case 'c':
+			arguments->count = strtoull(arg, NULL, 10);
+			if (arguments->count == 0)
+				argp_error(state, "Invalid count -- %s", arg);
+			break;
+		case 't':
+			arguments->duration = atoi(arg);
+			if (arguments->duration <= 0)
+				argp_error(state, "Invalid duration -- %s", arg);
+			break;
+		case 'i':
+			arguments->interval = atoi(arg);
+			if (arguments->interval <= 0)
+				argp_error(state, "Invalid interval -- %s", arg);
+			break;
+
+		case ARGP_KEY_ARG:
+			if (state->arg_num >= NB_ARGS)
+				// Too many arguments
+				argp_usage(state);
+			arguments->ifname = arg;
+			break;
+
+		case ARGP_KEY_END:
+			// check argument number
+			if (state->arg_num < NB_ARGS)
+				/* Not enough arguments. */
+				argp_usage(state);
+			if (!arguments->receive && !arguments->has_dst)
+				argp_error(state, "The destination MAC is required to send");
+			break;
+
+		default:
+			return ARGP_ERR_UNKNOWN;
+	}
+	return 0;
+}
+
+static struct argp argp = { options, parse_opt, args_doc, doc, 0, 0, 0 };
+static volatile sig_atomic_t stop = 0;
+
+void static sigint_handler(int sig) {
+	stop = 1;
+}
+
+#define MAC_ARG(x) (x)[0],(x)[1],(x)[2],(x)[3],(x)[4],(x)[5]
+#define NS_PER_S 1000000000ULL
+
+uint64_t static now_ns(clockid_t clock) {
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return (uint64_t) ts.tv_sec * NS_PER_S + ts.tv_nsec;
+}
+
+/*
+ * Packet socket bound to the interface
+ */
+int static open_socket(struct arguments *args, int protocol) {
+	struct sockaddr_ll sll;
+	struct ifreq ifr;
+	int sock, one = 1;
+
+	if ((sock = socket(AF_PACKET, SOCK_RAW, htons(protocol))) == -1) {
+		perror("Cannot open the packet socket");
+		exit(1);
+	}
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, args->ifname, IFNAMSIZ - 1);
+	if (ioctl(sock, SIOCGIFINDEX, &ifr) == -1) {
+		perror("Interface not found");
+		exit(1);
+	}
+	memset(&sll, 0, sizeof(sll));
+	sll.sll_family = AF_PACKET;
+	sll.sll_protocol = htons(protocol);
+	sll.sll_ifindex = ifr.ifr_ifindex;
+	if (bind(sock, (struct sockaddr *) &sll, sizeof(sll)) == -1) {
+		perror("Cannot bind the packet socket");
+		exit(1);
+	}
+
+	if (!args->has_src) {
+		if (ioctl(sock, SIOCGIFHWADDR, &ifr) == -1) {
+			perror("Cannot get the MAC address of the interface");
+			exit(1);
+		}
+		memcpy(args->src, ifr.ifr_hwaddr.sa_data, ETH_ALEN);
+	}
+	// the sender does not need the traffic control layer
+	setsockopt(sock, SOL_PACKET, PACKET_QDISC_BYPASS, &one, sizeof(one));
+	return sock;
+}
+
+/*******************
+ * Sender          *
+ *******************/
+uint16_t static ip_checksum(const void *buf, size_t len) {
+	const uint16_t *p = buf;
+	uint32_t sum = 0;
+
+	for (; len > 1; len -= 2)
+		sum += *p++;
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	return ~sum;
+}
+
+void static build_frame(struct arguments *args, uint8_t *buf, uint16_t stream,
+		uint64_t seq, uint64_t ts, size_t *len) {
+	struct trafgen_frame *f = (struct trafgen_frame *) buf;
+	size_t size = args->mix[seq % args->nmix];
+
+	f->ip.tot_len = htons(size - sizeof(struct ether_header));
+	f->ip.id = htons(seq);
+	f->ip.check = 0;
+	f->ip.check = ip_checksum(&f->ip, sizeof(struct iphdr));
+	f->udp.source = htons(TRAFGEN_BASE_PORT + seq % args->flows);
+	f->udp.len = htons(size - sizeof(struct ether_header)
+			- sizeof(struct iphdr));
+	f->payload.stream = stream;
+	f->payload.seq = seq;
+	f->payload.ts = ts;
+	*len = size;
+}
+
+void static send_traffic(struct arguments *args) {
+	static uint8_t bufs[TRAFGEN_MAX_BATCH][TRAFGEN_MAX_SIZE];
+	struct mmsghdr msgs[TRAFGEN_MAX_BATCH];
+	struct iovec iovs[TRAFGEN_MAX_BATCH];
+	struct trafgen_frame *f;
+	struct timespec next;
+	uint64_t start, now, end, report, seq = 0, prev = 0, errors = 0, due;
+	uint16_t stream;
+	int sock, i, n;
+
+	sock = open_socket(args, ETH_P_ALL);
+	srand(now_ns(CLOCK_REALTIME));
+	stream = rand();
+
+	// the constant part of the frames
+	memset(bufs, 0, sizeof(bufs));
+	memset(msgs, 0, sizeof(msgs));
+	for (i = 0; i < args->batch; i++) {
+		f = (struct trafgen_frame *) bufs[i];
+		memcpy(f->eh.ether_dhost, args->dst, ETH_ALEN);
+		memcpy(f->eh.ether_shost, args->src, ETH_ALEN);
+		f->eh.ether_type = htons(ETHERTYPE_IP);
+		f->ip.version = 4;
+		f->ip.ihl = 5;
+		f->ip.ttl = 64;
+		f->ip.protocol = IPPROTO_UDP;
+		f->ip.saddr = args->src_ip.s_addr;
+		f->ip.daddr = args->dst_ip.s_addr;
+		f->udp.dest = htons(TRAFGEN_PORT);
+		f->payload.magic = htonl(TRAFGEN_MAGIC);
+		iovs[i].iov_base = bufs[i];
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	printf("Sending to %02x:%02x:%02x:%02x:%02x:%02x from "
+			"%02x:%02x:%02x:%02x:%02x:%02x, stream %u, %ld frames/s\n",
+			MAC_ARG(args->dst), MAC_ARG(args->src), stream, args->rate);
+
+	start = now_ns(CLOCK_MONOTONIC);
+	end = args->duration > 0 ? start + args->duration * NS_PER_S : UINT64_MAX;
+	report = start + args->interval * 1000000ULL;
+	while (!stop && (args->count == 0 || seq < args->count)) {
+		now = now_ns(CLOCK_MONOTONIC);
+		if (now >= end)
+			break;
+		if (now >= report) {
+			printf("%8.1fs: %lu frames sent (%.0f/s), %lu errors\n",
+					(double) (now - start) / NS_PER_S, (unsigned long) seq,
+					(double) (seq - prev) * 1000 / args->interval,
+					(unsigned long) errors);
+			fflush(stdout);
+			prev = seq;
+			report += args->interval * 1000000ULL;
+		}
+
+		// frames due by now, on the schedule of the rate
+		n = args->batch;
+		if (args->rate > 0) {
+			due = (now - start) * args->rate / NS_PER_S + 1 - seq;
+			if ((int64_t) due <= 0) {
+				due = start + (seq * NS_PER_S) / args->rate;
+				next.tv_sec = due / NS_PER_S;
+				next.tv_nsec = due % NS_PER_S;
+				clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+				continue;
+			}
+			n = due < (uint64_t) n ? (int) due : n;
+		}
+		if (args->count > 0 && args->count - seq < (uint64_t) n)
+			n = args->count - seq;
+
+		now = now_ns(CLOCK_REALTIME);
+		for (i = 0; i < n; i++)
+			build_frame(args, bufs[i], stream, seq + i, now, &iovs[i].iov_len);
+		if ((n = sendmmsg(sock, msgs, n, 0)) == -1) {
+			if (errno != ENOBUFS && errno != EAGAIN && errno != EINTR) {
+				perror("Error while sending frames");
+				exit(1);
+			}
+			errors++;
+			continue;
+		}
+		seq += n;
+	}
+
+	now = now_ns(CLOCK_MONOTONIC);
+	printf("Sent %lu frames in %.3fs (%.0f/s), %lu errors\n",
+			(unsigned long) seq, (double) (now - start) / NS_PER_S,
+			now > start ? (double) seq * NS_PER_S / (now - start) : 0,
+			(unsigned long) errors);
+	close(sock);
+}
+
+/*******************
+ * Receiver        *
+ *******************/
+struct rx_stats {
+	int started;
+	uint16_t stream;
+	uint64_t received;			// unique frames
+	uint64_t duplicates;
+	uint64_t reordered;			// received after a higher sequence number
+	uint64_t highest;
+	uint64_t *seen;				// bitmap of the sequence numbers
+	uint64_t seen_size;			// in bits
+	uint64_t lat[TRAFGEN_LAT_BUCKETS];
+	uint64_t lat_sum, lat_max;
+	uint64_t late;				// beyond the last bucket
+};
+
+void static reset_stats(struct rx_stats *s, uint16_t stream) {
+	free(s->seen);
+	memset(s, 0, sizeof(struct rx_stats));
+	s->started = 1;
+	s->stream = stream;
+	s->seen_size = 1 << 20;
+	if ((s->seen = calloc(s->seen_size / 64, sizeof(uint64_t))) == NULL) {
+		perror("Cannot allocate memory for the sequence numbers");
+		exit(1);
+	}
+}
+
+// Return 0 if the sequence number was already seen
+int static mark_seen(struct rx_stats *s, uint64_t seq) {
+	uint64_t *seen, size = s->seen_size;
+
+	while (seq >= size)
+		size *= 2;
+	if (size != s->seen_size) {
+		if ((seen = realloc(s->seen, size / 8)) == NULL) {
+			perror("Cannot allocate memory for the sequence numbers");
+			exit(1);
+		}
+		memset(seen + s->seen_size / 64, 0, (size - s->seen_size) / 8);
+		s->seen = seen;
+		s->seen_size = size;
+	}
+	if (s->seen[seq / 64] & (1ULL << (seq % 64)))
+		return 0;
+	s->seen[seq / 64] |= 1ULL << (seq % 64);
+	return 1;
+}
+
+void static record(struct rx_stats *s, const struct trafgen_payload *p,
+		uint64_t rx_ts) {
+	uint64_t lat;
+
+	if (!s->started || p->stream != s->stream) {
+		if (s->started)
+			printf("New stream %u: statistics reset\n", p->stream);
+		reset_stats(s, p->stream);
+	}
+	if (!mark_seen(s, p->seq)) {
+		s->duplicates++;
+		return;
+	}
+	if (s->received > 0 && p->seq < s->highest)
+		s->reordered++;
+	s->highest = s->received == 0 ? p->seq : (p->seq > s->highest
+			? p->seq : s->highest);
+	s->received++;
+
+	// the clocks may be slightly apart
+	lat = rx_ts > p->ts ? rx_ts - p->ts : 0;
+	s->lat_sum += lat;
+	s->lat_max = lat > s->lat_max ? lat : s->lat_max;
+	if (lat / 1000 < TRAFGEN_LAT_BUCKETS)
+		s->lat[lat / 1000]++;
+	else
+		s->late++;
+}
+
+// in us
+double static lat_percentile(const struct rx_stats *s, double p) {
+	uint64_t rank = p * s->received, sum = 0;
+	int i;
+
+	for (i = 0; i < TRAFGEN_LAT_BUCKETS; i++) {
+		if ((sum += s->lat[i]) > rank)
+			return i;
+	}
+	return (double) s->lat_max / 1000;
+}
+
+void static report_lost(const struct rx_stats *s, uint64_t expected) {
+	uint64_t seq, first;
+	int ranges = 0;
+
+	for (seq = 0; seq < expected && ranges < TRAFGEN_LOST_RANGES; seq++) {
+		if (seq < s->seen_size && (s->seen[seq / 64] & (1ULL << (seq % 64))))
+			continue;
+		for (first = seq; seq + 1 < expected && !(seq + 1 < s->seen_size
+					&& (s->seen[(seq + 1) / 64] & (1ULL << ((seq + 1) % 64))));
+				seq++);
+		if (first == seq)
+			printf("  lost: #%lu\n", (unsigned long) first);
+		else
+			printf("  lost: #%lu to #%lu (%lu frames)\n", (unsigned long) first,
+					(unsigned long) seq, (unsigned long) (seq - first + 1));
+		ranges++;
+	}
+	if (ranges == TRAFGEN_LOST_RANGES)
+		printf("  ...\n");
+}
+
+void static receive_traffic(struct arguments *args) {
+	static struct rx_stats stats;
+	static uint8_t bufs[TRAFGEN_MAX_BATCH][128];
+	struct mmsghdr msgs[TRAFGEN_MAX_BATCH];
+	struct iovec iovs[TRAFGEN_MAX_BATCH];
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(struct timespec))];
+	} controls[TRAFGEN_MAX_BATCH];
+	struct sockaddr_ll addrs[TRAFGEN_MAX_BATCH];
+	const struct trafgen_frame *f;
+	struct cmsghdr *cmsg;
+	struct timeval tv = { 0, 100000 };
+	uint64_t start, now, end, report, prev = 0, rx_ts, expected;
+	int sock, i, n, one = 1;
+
+	sock = open_socket(args, ETH_P_IP);
+	if (setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, &one, sizeof(one)) == -1)
+		perror("Cannot enable the timestamps, the reading time is used");
+	// to report and stop on time without traffic
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	memset(msgs, 0, sizeof(msgs));
+	for (i = 0; i < TRAFGEN_MAX_BATCH; i++) {
+		iovs[i].iov_base = bufs[i];
+		iovs[i].iov_len = sizeof(bufs[i]);
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_name = &addrs[i];
+	}
+	printf("Receiving on %s (%02x:%02x:%02x:%02x:%02x:%02x)\n", args->ifname,
+			MAC_ARG(args->src));
+
+	start = now_ns(CLOCK_MONOTONIC);
+	end = args->duration > 0 ? start + args->duration * NS_PER_S : UINT64_MAX;
+	report = start + args->interval * 1000000ULL;
+	while (!stop && (args->count == 0 || stats.received < args->count)) {
+		now = now_ns(CLOCK_MONOTONIC);
+		if (now >= end)
+			break;
+		if (now >= report) {
+			printf("%8.1fs: %lu frames received (%.0f/s), %lu lost, "
+					"%lu reordered, latency p50 %.0fus p99 %.0fus\n",
+					(double) (now - start) / NS_PER_S,
+					(unsigned long) stats.received,
+					(double) (stats.received - prev) * 1000 / args->interval,
+					(unsigned long) (stats.received > 0 ? stats.highest + 1
+						- stats.received : 0),
+					(unsigned long) stats.reordered,
+					lat_percentile(&stats, 0.5), lat_percentile(&stats, 0.99));
+			fflush(stdout);
+			prev = stats.received;
+			report += args->interval * 1000000ULL;
+		}
+
+		for (i = 0; i < args->batch; i++) {
+			msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+			msgs[i].msg_hdr.msg_control = controls[i].buf;
+			msgs[i].msg_hdr.msg_controllen = sizeof(controls[i].buf);
+		}
+		if ((n = recvmmsg(sock, msgs, args->batch, MSG_WAITFORONE, NULL))
+				== -1) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+				perror("Error while receiving frames");
+				exit(1);
+			}
+			continue;
+		}
+
+		now = 0;
+		for (i = 0; i < n; i++) {
+			f = (const struct trafgen_frame *) bufs[i];
+			if (addrs[i].sll_pkttype == PACKET_OUTGOING
+					|| msgs[i].msg_len < sizeof(struct trafgen_frame)
+					|| f->ip.protocol != IPPROTO_UDP
+					|| f->udp.dest != htons(TRAFGEN_PORT)
+					|| f->payload.magic != htonl(TRAFGEN_MAGIC))
+				continue;
+
+			rx_ts = 0;
+			for (cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cmsg != NULL;
+					cmsg = CMSG_NXTHDR(&msgs[i].msg_hdr, cmsg)) {
+				if (cmsg->cmsg_level == SOL_SOCKET
+						&& cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+					struct timespec ts;
+					memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+					rx_ts = (uint64_t) ts.tv_sec * NS_PER_S + ts.tv_nsec;
+				}
+			}
+			if (rx_ts == 0) {
+				if (now == 0)
+					now = now_ns(CLOCK_REALTIME);
+				rx_ts = now;
+			}
+			record(&stats, &f->payload, rx_ts);
+		}
+	}
+
+	// the frames after the last one received are not known, unless counted
+	expected = stats.received > 0 ? stats.highest + 1 : 0;
+	if (args->count > 0 && args->count > expected)
+		expected = args->count;
+	printf("Received %lu frames of stream %u: %lu lost (%.3f%%), "
+			"%lu reordered, %lu duplicated\n", (unsigned long) stats.received,
+			stats.stream, (unsigned long) (expected - stats.received),
+			expected > 0 ? (double) (expected - stats.received) * 100
+				/ expected : 0,
+			(unsigned long) stats.reordered, (unsigned long) stats.duplicates);
+	if (stats.received > 0) {
+		printf("One-way latency (us): avg %.1f, p50 %.0f, p90 %.0f, p99 %.0f, "
+				"p99.9 %.0f, max %.1f (%lu above %dms)\n",
+				(double) stats.lat_sum / stats.received / 1000,
+				lat_percentile(&stats, 0.5), lat_percentile(&stats, 0.9),
+				lat_percentile(&stats, 0.99), lat_percentile(&stats, 0.999),
+				(double) stats.lat_max / 1000, (unsigned long) stats.late,
+				TRAFGEN_LAT_BUCKETS / 1000);
+	}
+	if (args->verbose)
+		report_lost(&stats, expected);
+	free(stats.seen);
+	close(sock);
+}
+
+
+/********
+ * Main *
+ ********/
+int main(int argc, char *argv[]) {
+	struct arguments args;
+	struct sigaction sa;
+
+	memset(&args, 0, sizeof(struct arguments));
+	args.rate = 1000;
+	args.flows = 1;
+	args.batch = 32;
+	args.interval = 1000;
+	args.nmix = 1;
+	args.mix[0] = TRAFGEN_MIN_SIZE;
+	inet_aton("198.18.0.1", &args.src_ip);
+	inet_aton("198.18.0.2", &args.dst_ip);
+	argp_parse(&argp, argc, argv, 0, 0, &args);
+
+	// interrupt the blocking calls to stop
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = &sigint_handler;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	if (args.receive)
+		receive_traffic(&args);
+	else
+		send_traffic(&args);
+	return 0;
+}
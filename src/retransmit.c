@@ -0,0 +1,542 @@
+/*
+ * Pool of retransmission workers with per-destination work items and work
+ * stealing. See retransmit.h for the ordering guarantees.
+ */
+
+#include <retransmit.h>
+
+// standard headers
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+
+#include <sys/socket.h>
+
+// local headers
+#include <arp.h>
+#include <histo.h>
+#include <logger.h>
+#include <utils.h>
+#include <vclock.h>
+
+
+/*****************************
+ * Deque of destinations     *
+ *****************************/
+void static inline init_deque(struct rt_deque *d) {
+	d->items = (struct rt_dest **) malloc(
+			RT_DEQUE_INIT_SIZE * sizeof(struct rt_dest *)
+			);
+	if (d->items == NULL) {
+		perror("Cannot allocate memory for the retransmission deque");
+		exit(1);
+	}
+	d->head = 0;
+	d->count = 0;
+	d->size = RT_DEQUE_INIT_SIZE;
+	pthread_mutex_init(&d->lock, NULL);
+}
+
+void static inline free_deque(struct rt_deque *d) {
+	free(d->items);
+	d->count = 0;
+	d->size = 0;
+	pthread_mutex_destroy(&d->lock);
+}
+
+int static inline deque_push(struct rt_deque *d, struct rt_dest *dest) {
+	size_t i;
+	struct rt_dest **items;
+
+	pthread_mutex_lock(&d->lock);
+	if (d->count == d->size) {
+		// increase the size of the deque, unwrapping the ring
+		items = (struct rt_dest **) malloc(
+				2 * d->size * sizeof(struct rt_dest *)
+				);
+		if (items == NULL) {
+			pthread_mutex_unlock(&d->lock);
+			log_warning("Cannot allocate memory to extend "
+					"retransmission deque\n");
+			return 0;
+		}
+		for (i = 0; i < d->count; i++)
+			items[i] = d->items[(d->head + i) % d->size];
+		free(d->items);
+		d->items = items;
+		d->head = 0;
+		d->size *= 2;
+	}
+	d->items[(d->head + d->count++) % d->size] = dest;
+	pthread_mutex_unlock(&d->lock);
+	return 1;
+}
+
+// pop from the head: used by the owner of the deque
+struct rt_dest static inline *deque_pop(struct rt_deque *d) {
+	struct rt_dest *dest = NULL;
+
+	pthread_mutex_lock(&d->lock);
+	if (d->count > 0) {
+		dest = d->items[d->head];
+		d->head = (d->head + 1) % d->size;
+		d->count--;
+	}
+	pthread_mutex_unlock(&d->lock);
+	return dest;
+}
+
+// steal from the tail: used by the other workers
+struct rt_dest static inline *deque_steal(struct rt_deque *d) {
+	struct rt_dest *dest = NULL;
+
+	pthread_mutex_lock(&d->lock);
+	if (d->count > 0) {
+		dest = d->items[(d->head + --d->count) % d->size];
+	}
+	pthread_mutex_unlock(&d->lock);
+	return dest;
+}
+
+/*****************************
+ * Destinations              *
+ *****************************/
+/*
+ * Find the destination for the given MAC address or create one
+ * Must only be called by the submitting thread
+ */
+struct rt_dest static inline *pool_get_dest(struct rt_pool *pool,
+		uint8_t mac[ETH_ALEN]) {
+	size_t i;
+	struct rt_dest *dest;
+	struct rt_dest **dests;
+
+	// try to find the destination
+	for (i = 0; i < pool->dest_count; i++) {
+		if (ETHER_CMP(mac, pool->dests[i]->mac))
+			return pool->dests[i];
+	}
+
+	// increase the size of the table if needed
+	if (pool->dest_count == pool->dest_size) {
+		dests = (struct rt_dest **) realloc(pool->dests,
+				2 * pool->dest_size * sizeof(struct rt_dest *));
+		if (dests == NULL) {
+			log_warning("Cannot reallocate memory to extend "
+					"retransmission destinations\n");
+			return NULL;
+		}
+		pool->dests = dests;
+		pool->dest_size *= 2;
+	}
+
+	// initialize the new destination
+	dest = (struct rt_dest *) malloc(sizeof(struct rt_dest));
+	if (dest == NULL) {
+		log_warning("Cannot allocate memory for a retransmission "
+				"destination\n");
+		return NULL;
+	}
+	memcpy(dest->mac, mac, ETH_ALEN);
+	dest->state = RT_DEST_IDLE;
+	dest->count = 0;
+	dest->size = 0;
+	dest->messages = NULL;
+	pthread_mutex_init(&dest->lock, NULL);
+	pthread_mutex_init(&dest->busy, NULL);
+
+	pool->dests[pool->dest_count++] = dest;
+	return dest;
+}
+
+/*
+ * Append messages to a destination
+ * Return the number of messages the destination took ownership of
+ */
+size_t static inline dest_append(struct rt_dest *dest,
+		struct message *messages, size_t count) {
+	size_t size;
+	struct message *msgs;
+
+	if (dest->count + count > dest->size) {
+		size = dest->size ? dest->size : RT_MESSAGES_INIT_SIZE;
+		while (size < dest->count + count)
+			size *= 2;
+		msgs = (struct message *) realloc(dest->messages,
+				size * sizeof(struct message));
+		if (msgs == NULL) {
+			log_warning("Cannot reallocate memory to extend "
+					"retransmission messages\n");
+			return 0;
+		}
+		dest->messages = msgs;
+		dest->size = size;
+	}
+	memcpy(&dest->messages[dest->count], messages,
+			count * sizeof(struct message));
+	dest->count += count;
+	return count;
+}
+
+/*
+ * Queue a destination in a worker's deque and wake up idle workers
+ */
+void static inline pool_schedule(struct rt_pool *pool,
+		struct rt_worker *worker, struct rt_dest *dest) {
+	if (!deque_push(&worker->deque, dest)) {
+		// cannot happen unless memory is exhausted: let the frames wait for
+		// the next submission to this destination
+		pthread_mutex_lock(&dest->lock);
+		dest->state = RT_DEST_IDLE;
+		pthread_mutex_unlock(&dest->lock);
+		return;
+	}
+	atomic_fetch_add(&pool->pending, 1);
+
+	pthread_mutex_lock(&pool->lock);
+	// on the virtual clock, the woken up worker is busy from now on: the
+	// time must not advance before it runs
+	if (pool->idle > pool->wakeups) {
+		pool->wakeups++;
+		vclock_hold();
+	}
+	pthread_cond_signal(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/*****************************
+ * Workers                   *
+ *****************************/
+/*
+ * Drop ARP frames received while the worker was idle, otherwise an old reply
+ * may be mistaken for the restoration one
+ */
+void static inline drain_socket(int sock) {
+	uint8_t buf[MAX_PKT_SIZE];
+	while (recv(sock, buf, sizeof(buf), MSG_DONTWAIT) > 0);
+}
+
+/*
+ * Restore the destination, then flush all of its frames. Frames appended in
+ * the meantime are handled by rescheduling the destination
+ */
+void static inline process_dest(struct rt_worker *worker,
+		struct rt_dest *dest) {
+	size_t i, count;
+	struct message *messages;
+	struct timespec now, tx_ts, restore_t;
+	int restored, timeouts;
+
+	// take the frames out of the destination
+	pthread_mutex_lock(&dest->lock);
+	dest->state = RT_DEST_RUNNING;
+	messages = dest->messages;
+	count = dest->count;
+	dest->messages = NULL;
+	dest->count = 0;
+	dest->size = 0;
+	pthread_mutex_unlock(&dest->lock);
+
+	log_debug("Worker #%i: retransmit %zu frames to "
+			"%02x:%02x:%02x:%02x:%02x:%02x\n", worker->id, count,
+			dest->mac[0], dest->mac[1], dest->mac[2],
+			dest->mac[3], dest->mac[4], dest->mac[5]);
+
+	clock_now(CLOCK_MONOTONIC, &restore_t);
+	for (i = 0; i < count; i++)
+		histo_record(STAGE_QUEUED,
+				MAX(TS_DIFF_IN_NS(restore_t, messages[i].ts), 0));
+
+	// first restore MAC, then retransmit all frames. The capture thread does
+	// not poison the destination meanwhile
+	pthread_mutex_lock(&dest->busy);
+	drain_socket(worker->sock);
+	restored = restore_mac(worker->sock, worker->pool->iface, dest->mac,
+			&timeouts);
+	clock_now(CLOCK_MONOTONIC, &now);
+	histo_record(STAGE_RESTORE, TS_DIFF_IN_NS(now, restore_t));
+	counter_add(&worker->counters.restores, 1);
+	counter_add(&worker->counters.timeouts, timeouts);
+	if (!restored) {
+		log_error("Skip retransmission: packets will be lost\n");
+		counter_add(&worker->counters.lost, count);
+	} else {
+		counter_add(&worker->counters.restored, 1);
+		for (i = 0; i < count; i++) {
+			if (!retransmit_one(worker->sock, worker->pool->iface,
+						&messages[i], worker->timestamped ? &worker->tx_key
+						: NULL, &tx_ts)) {
+				log_warning("Could not retransmit one message\n");
+				counter_add(&worker->counters.errors, 1);
+				continue;
+			}
+			counter_add(&worker->counters.retransmitted, 1);
+			clock_now(CLOCK_MONOTONIC, &now);
+			lat_stats_add(&worker->latency,
+					TS_DIFF_IN_NS(now, messages[i].ts));
+			if (!worker->timestamped)
+				continue;
+			lat_stats_add(&worker->residence,
+					MAX(TS_DIFF_IN_NS(tx_ts, messages[i].rx_ts), 0));
+			histo_record(STAGE_RESIDENCE,
+					MAX(TS_DIFF_IN_NS(tx_ts, messages[i].rx_ts), 0));
+		}
+	}
+	pthread_mutex_unlock(&dest->busy);
+	for (i = 0; i < count; i++)
+		free(messages[i].buf);
+	free(messages);
+
+	// reschedule the destination if frames were appended
+	pthread_mutex_lock(&dest->lock);
+	if (dest->count > 0) {
+		dest->state = RT_DEST_QUEUED;
+		pthread_mutex_unlock(&dest->lock);
+		pool_schedule(worker->pool, worker, dest);
+	} else {
+		dest->state = RT_DEST_IDLE;
+		pthread_mutex_unlock(&dest->lock);
+	}
+}
+
+/*
+ * Get the next destination: from the own deque first, then steal from others
+ */
+struct rt_dest static inline *worker_next_dest(struct rt_worker *worker) {
+	int i;
+	struct rt_pool *pool = worker->pool;
+	struct rt_dest *dest;
+
+	if ((dest = deque_pop(&worker->deque)) != NULL)
+		return dest;
+
+	for (i = 1; i < pool->nworkers; i++) {
+		dest = deque_steal(
+				&pool->workers[(worker->id + i) % pool->nworkers].deque);
+		if (dest != NULL) {
+			log_debug("Worker #%i: stole a destination\n", worker->id);
+			return dest;
+		}
+	}
+	return NULL;
+}
+
+void *worker_main(void *args) {
+	struct rt_worker *worker = args;
+	struct rt_pool *pool = worker->pool;
+	struct rt_dest *dest;
+
+	log_debug("Retransmission worker #%i started\n", worker->id);
+	while (1) {
+		if ((dest = worker_next_dest(worker)) != NULL) {
+			atomic_fetch_sub(&pool->pending, 1);
+			process_dest(worker, dest);
+			continue;
+		}
+
+		// nothing to do: wait for new destinations
+		pthread_mutex_lock(&pool->lock);
+		if (atomic_load(&pool->pending) == 0 && !pool->stop) {
+			pool->idle++;
+			vclock_release();
+			while (1) {
+				pthread_cond_wait(&pool->cond, &pool->lock);
+				// busy again: the waker already accounted for it, unless it
+				// is a spurious wakeup or the stop
+				if (pool->wakeups > 0)
+					pool->wakeups--;
+				else
+					vclock_hold();
+				// another worker may have taken the destination
+				if (atomic_load(&pool->pending) > 0 || pool->stop)
+					break;
+				vclock_release();
+			}
+			pool->idle--;
+		}
+		if (pool->stop && atomic_load(&pool->pending) == 0) {
+			pthread_mutex_unlock(&pool->lock);
+			break;
+		}
+		pthread_mutex_unlock(&pool->lock);
+	}
+	vclock_release();
+	log_debug("Retransmission worker #%i stopped\n", worker->id);
+	return NULL;
+}
+
+/*****************************
+ * Pool management           *
+ *****************************/
+void init_retransmit_pool(struct rt_pool *pool, struct iface *iface,
+		int nworkers, int timestamps) {
+	int i;
+	sigset_t signals, old_signals;
+
+	pool->iface = iface;
+	pool->nworkers = nworkers;
+	pool->stop = 0;
+	pool->idle = 0;
+	pool->wakeups = 0;
+	atomic_init(&pool->pending, 0);
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+
+	pool->dests = (struct rt_dest **) malloc(
+			RT_DEST_INIT_SIZE * sizeof(struct rt_dest *)
+			);
+	pool->workers = (struct rt_worker *) malloc(
+			nworkers * sizeof(struct rt_worker)
+			);
+	if (pool->dests == NULL || pool->workers == NULL) {
+		perror("Cannot allocate memory for the retransmission pool");
+		exit(1);
+	}
+	pool->dest_count = 0;
+	pool->dest_size = RT_DEST_INIT_SIZE;
+
+	// every deque must exist before any worker may steal from it
+	for (i = 0; i < nworkers; i++) {
+		pool->workers[i].id = i;
+		pool->workers[i].pool = pool;
+		// open an ARP socket (error are handle by super_socket)
+		pool->workers[i].sock = super_socket(iface, SOCK_RAW, ETH_P_ARP);
+		pool->workers[i].timestamped = timestamps &&
+			super_socket_tx_timestamps(pool->workers[i].sock);
+		pool->workers[i].tx_key = 0;
+		init_deque(&pool->workers[i].deque);
+		lat_stats_init(&pool->workers[i].latency);
+		lat_stats_init(&pool->workers[i].residence);
+		memset(&pool->workers[i].counters, 0, sizeof(struct rt_counters));
+	}
+	// the signals of the poisoner are handled by the poisoning thread: the
+	// workers inherit a mask blocking them
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	sigaddset(&signals, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &signals, &old_signals);
+	for (i = 0; i < nworkers; i++) {
+		vclock_hold();
+		errno = pthread_create(&pool->workers[i].thread, NULL,
+				&worker_main, &pool->workers[i]);
+		if (errno != 0) {
+			perror("Cannot start a retransmission worker");
+			exit(1);
+		}
+	}
+	pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+	log_debug("Retransmission pool started with %i workers\n", nworkers);
+}
+
+void free_retransmit_pool(struct rt_pool *pool) {
+	size_t i, j;
+
+	// let the workers flush the pending destinations, then stop them
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 0; i < pool->nworkers; i++) {
+		pthread_join(pool->workers[i].thread, NULL);
+		free_deque(&pool->workers[i].deque);
+		close(pool->workers[i].sock);
+	}
+	free(pool->workers);
+
+	for (i = 0; i < pool->dest_count; i++) {
+		for (j = 0; j < pool->dests[i]->count; j++)
+			free(pool->dests[i]->messages[j].buf);
+		free(pool->dests[i]->messages);
+		pthread_mutex_destroy(&pool->dests[i]->lock);
+		pthread_mutex_destroy(&pool->dests[i]->busy);
+		free(pool->dests[i]);
+	}
+	free(pool->dests);
+	pool->dest_count = 0;
+	pool->dest_size = 0;
+
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->lock);
+	log_debug("Retransmission pool stopped\n");
+}
+
+size_t retransmit_submit(struct rt_pool *pool, struct queue *q) {
+	size_t i, j, submitted = 0;
+	int schedule;
+	struct qlist *entry;
+	struct rt_dest *dest;
+
+	for (i = 0; i < q->count; i++) {
+		entry = &q->entries[i];
+		if (entry->count == 0)
+			continue;
+
+		dest = pool_get_dest(pool, entry->dest);
+		schedule = 0;
+		if (dest != NULL) {
+			pthread_mutex_lock(&dest->lock);
+			if (dest_append(dest, entry->messages, entry->count)) {
+				submitted += entry->count;
+				entry->count = 0;
+				// a destination already queued or running will pick the
+				// frames up, an idle one must be scheduled
+				if (dest->state == RT_DEST_IDLE) {
+					dest->state = RT_DEST_QUEUED;
+					schedule = 1;
+				}
+			}
+			pthread_mutex_unlock(&dest->lock);
+		}
+		// frames which could not be handed over are lost
+		for (j = 0; j < entry->count; j++)
+			free(entry->messages[j].buf);
+		entry->count = 0;
+
+		// home the destination on a worker derived from its MAC address so
+		// that the same worker keeps handling it, unless stolen
+		if (schedule) {
+			pool_schedule(pool,
+					&pool->workers[(dest->mac[4] ^ dest->mac[5])
+						% pool->nworkers], dest);
+		}
+	}
+	q->count = 0;
+	return submitted;
+}
+
+struct rt_dest *retransmit_dest(struct rt_pool *pool, uint8_t mac[ETH_ALEN]) {
+	return pool_get_dest(pool, mac);
+}
+
+void retransmit_counters(struct rt_pool *pool, struct stat_counters *stats) {
+	int i;
+	struct rt_counters *c;
+
+	stats->retransmitted = 0;
+	stats->retransmit_errors = 0;
+	stats->restore_lost = 0;
+	stats->restore_attempts = 0;
+	stats->restore_successes = 0;
+	stats->restore_timeouts = 0;
+	for (i = 0; i < pool->nworkers; i++) {
+		c = &pool->workers[i].counters;
+		stats->retransmitted += atomic_load_explicit(&c->retransmitted,
+				memory_order_relaxed);
+		stats->retransmit_errors += atomic_load_explicit(&c->errors,
+				memory_order_relaxed);
+		stats->restore_lost += atomic_load_explicit(&c->lost,
+				memory_order_relaxed);
+		stats->restore_attempts += atomic_load_explicit(&c->restores,
+				memory_order_relaxed);
+		stats->restore_successes += atomic_load_explicit(&c->restored,
+				memory_order_relaxed);
+		stats->restore_timeouts += atomic_load_explicit(&c->timeouts,
+				memory_order_relaxed);
+	}
+}
@@ -0,0 +1,327 @@
+/*
+ * Shared-memory rings between the CAM poisoner and the third-party program
+ */
+
+#define _GNU_SOURCE	// for memfd_create
+
+#include <shmring.h>
+
+// standard headers
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+
+
+#define SHM_RING_MASK (SHM_RING_SLOTS - 1)
+
+/*
+ * Region management
+ */
+int shm_create(struct shm_channel *ch) {
+	int i;
+	size_t size, offset;
+	struct shm_region *region;
+
+	// header, then for each ring its descriptors and its slots
+	offset = (sizeof(struct shm_region) + 4095) & ~(size_t) 4095;
+	size = offset + 2 * SHM_RING_SLOTS
+		* (sizeof(struct shm_desc) + SHM_SLOT_SIZE);
+
+	if ((ch->memfd = memfd_create("cam_poisoning", MFD_CLOEXEC)) == -1) {
+		perror("Cannot create the shared memory");
+		return 0;
+	}
+	if (ftruncate(ch->memfd, size) == -1) {
+		perror("Cannot size the shared memory");
+		close(ch->memfd);
+		return 0;
+	}
+	region = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			ch->memfd, 0);
+	if (region == MAP_FAILED) {
+		perror("Cannot map the shared memory");
+		close(ch->memfd);
+		return 0;
+	}
+
+	region->magic = SHM_MAGIC_REGION;
+	region->version = SHM_VERSION;
+	region->size = size;
+	for (i = 0; i < 2; i++) {
+		atomic_init(&region->rings[i].head, 0);
+		atomic_init(&region->rings[i].tail, 0);
+		atomic_init(&region->rings[i].need_wakeup, 1);
+		region->rings[i].size = SHM_RING_SLOTS;
+		region->rings[i].slot_size = SHM_SLOT_SIZE;
+		region->rings[i].descs_offset = offset;
+		ch->layout[i].descs_offset = offset;
+		offset += SHM_RING_SLOTS * sizeof(struct shm_desc);
+		region->rings[i].slots_offset = offset;
+		ch->layout[i].slots_offset = offset;
+		ch->layout[i].slot_size = SHM_SLOT_SIZE;
+		offset += SHM_RING_SLOTS * SHM_SLOT_SIZE;
+
+		ch->doorbells[i] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (ch->doorbells[i] == -1) {
+			perror("Cannot create the shared memory doorbell");
+			if (i > 0)
+				close(ch->doorbells[0]);
+			munmap(region, size);
+			close(ch->memfd);
+			return 0;
+		}
+	}
+	ch->region = region;
+	ch->size = size;
+	return 1;
+}
+
+// check the layout of a ring fits in the region, and copy it
+int static check_layout(struct shm_channel *ch, int i,
+		const struct shm_ring *r, size_t size) {
+	size_t descs = SHM_RING_SLOTS * sizeof(struct shm_desc);
+
+	if (r->size != SHM_RING_SLOTS || r->slot_size < SHM_SLOT_SIZE ||
+			r->descs_offset % _Alignof(struct shm_desc) != 0 ||
+			r->descs_offset > size || descs > size - r->descs_offset ||
+			r->slots_offset > size ||
+			r->slot_size > (size - r->slots_offset) / SHM_RING_SLOTS)
+		return 0;
+	ch->layout[i].descs_offset = r->descs_offset;
+	ch->layout[i].slots_offset = r->slots_offset;
+	ch->layout[i].slot_size = r->slot_size;
+	return 1;
+}
+
+int shm_attach(struct shm_channel *ch, int memfd, int doorbells[2]) {
+	struct shm_region *region;
+	struct stat st;
+	size_t size;
+	int i;
+
+	// map the header first to learn the size of the region
+	region = mmap(NULL, sizeof(struct shm_region), PROT_READ, MAP_SHARED,
+			memfd, 0);
+	if (region == MAP_FAILED) {
+		perror("Cannot map the shared memory");
+		return 0;
+	}
+	if (region->magic != SHM_MAGIC_REGION || region->version != SHM_VERSION) {
+		fprintf(stderr, "Unsupported shared memory region\n");
+		munmap(region, sizeof(struct shm_region));
+		return 0;
+	}
+	size = region->size;
+	munmap(region, sizeof(struct shm_region));
+	// beyond the file, the pages of the mapping would fault
+	if (fstat(memfd, &st) == -1 || size < sizeof(struct shm_region) ||
+			size > (uint64_t) st.st_size) {
+		fprintf(stderr, "Invalid shared memory region size\n");
+		return 0;
+	}
+
+	region = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+	if (region == MAP_FAILED) {
+		perror("Cannot map the shared memory");
+		return 0;
+	}
+	for (i = 0; i < 2; i++) {
+		if (!check_layout(ch, i, &region->rings[i], size)) {
+			fprintf(stderr, "Invalid shared memory ring layout\n");
+			munmap(region, size);
+			return 0;
+		}
+	}
+	ch->memfd = memfd;
+	ch->size = size;
+	ch->doorbells[0] = doorbells[0];
+	ch->doorbells[1] = doorbells[1];
+	ch->region = region;
+	return 1;
+}
+
+void shm_close(struct shm_channel *ch) {
+	if (ch->region == NULL)
+		return;
+	munmap(ch->region, ch->size);
+	close(ch->memfd);
+	close(ch->doorbells[0]);
+	close(ch->doorbells[1]);
+	ch->region = NULL;
+}
+
+/*
+ * Ring operations
+ */
+// from the private layout: indexes are masked, offsets were checked
+static inline struct shm_desc *ring_desc(struct shm_channel *ch,
+		int ring, unsigned int idx) {
+	return (struct shm_desc *) ((uint8_t *) ch->region
+			+ ch->layout[ring].descs_offset) + (idx & SHM_RING_MASK);
+}
+
+static inline void *ring_slot(struct shm_channel *ch,
+		int ring, unsigned int idx) {
+	return (uint8_t *) ch->region + ch->layout[ring].slots_offset
+		+ (size_t) (idx & SHM_RING_MASK) * ch->layout[ring].slot_size;
+}
+
+void *shm_reserve(struct shm_channel *ch, int ring) {
+	struct shm_ring *r = &ch->region->rings[ring];
+	unsigned int head = atomic_load_explicit(&r->head, memory_order_relaxed);
+
+	if (head - atomic_load_explicit(&r->tail, memory_order_acquire)
+			>= SHM_RING_SLOTS)
+		return NULL;	// full
+	return ring_slot(ch, ring, head);
+}
+
+int shm_commit(struct shm_channel *ch, int ring, uint32_t len,
+		uint32_t flags) {
+	struct shm_ring *r = &ch->region->rings[ring];
+	unsigned int head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	struct shm_desc *desc = ring_desc(ch, ring, head);
+
+	desc->len = len;
+	desc->flags = flags;
+	// publish the entry, then check whether the consumer sleeps
+	atomic_store(&r->head, head + 1);
+	return atomic_load(&r->need_wakeup) != 0;
+}
+
+void shm_ring_doorbell(struct shm_channel *ch, int ring) {
+	uint64_t one = 1;
+	if (write(ch->doorbells[ring], &one, sizeof(one)) == -1 &&
+			errno != EAGAIN) {
+		perror("Failed to ring the shared memory doorbell");
+	}
+}
+
+void *shm_peek(struct shm_channel *ch, int ring, uint32_t *len,
+		uint32_t *flags) {
+	struct shm_ring *r = &ch->region->rings[ring];
+	unsigned int tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	struct shm_desc *desc;
+
+	if (tail == atomic_load_explicit(&r->head, memory_order_acquire))
+		return NULL;	// empty
+
+	desc = ring_desc(ch, ring, tail);
+	// never trust the other side with lengths
+	*len = desc->len <= ch->layout[ring].slot_size ? desc->len
+		: ch->layout[ring].slot_size;
+	*flags = desc->flags;
+	return ring_slot(ch, ring, tail);
+}
+
+void shm_release(struct shm_channel *ch, int ring) {
+	struct shm_ring *r = &ch->region->rings[ring];
+	unsigned int tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+}
+
+int shm_prepare_wait(struct shm_channel *ch, int ring, int sleeping) {
+	struct shm_ring *r = &ch->region->rings[ring];
+	uint64_t value;
+
+	// clear the doorbell
+	if (read(ch->doorbells[ring], &value, sizeof(value)) == -1 &&
+			errno != EAGAIN) {
+		perror("Failed to read the shared memory doorbell");
+	}
+	atomic_store(&r->need_wakeup, sleeping ? 1 : 0);
+	// the producer may have committed before seeing need_wakeup
+	return atomic_load(&r->tail) != atomic_load(&r->head);
+}
+
+/*
+ * Handshake
+ */
+uint32_t shm_parse_handshake(const void *buf, size_t len) {
+	struct shm_handshake hs;
+
+	if (len != sizeof(hs))
+		return 0;
+	memcpy(&hs, buf, sizeof(hs));
+	if (hs.version != SHM_VERSION)
+		return 0;
+	switch (hs.magic) {
+		case SHM_MAGIC_REQUEST:
+		case SHM_MAGIC_ACCEPT:
+			return hs.magic;
+		default:
+			return 0;
+	}
+}
+
+ssize_t shm_send_handshake(int sock, struct sockaddr_un *addr, uint32_t magic,
+		int *fds, int nfds) {
+	struct shm_handshake hs = { magic, SHM_VERSION };
+	struct iovec iov = { &hs, sizeof(hs) };
+	struct msghdr msg;
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(3 * sizeof(int))];
+	} control;
+	struct cmsghdr *cmsg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = addr;
+	msg.msg_namelen = sizeof(struct sockaddr_un);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	if (nfds > 0) {
+		memset(&control, 0, sizeof(control));
+		msg.msg_control = control.buf;
+		msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+		memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+	}
+	return sendmsg(sock, &msg, 0);
+}
+
+uint32_t shm_recv_handshake(int sock, struct sockaddr_un *addr, int *fds,
+		int *nfds) {
+	struct shm_handshake hs;
+	struct iovec iov = { &hs, sizeof(hs) };
+	struct msghdr msg;
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(3 * sizeof(int))];
+	} control;
+	struct cmsghdr *cmsg;
+	ssize_t len;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = addr;
+	msg.msg_namelen = sizeof(struct sockaddr_un);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	*nfds = 0;
+	if ((len = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) == -1)
+		return 0;
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+			cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+			*nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			if (*nfds > 3)
+				*nfds = 3;
+			memcpy(fds, CMSG_DATA(cmsg), *nfds * sizeof(int));
+		}
+	}
+	return shm_parse_handshake(&hs, len);
+}
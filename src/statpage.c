@@ -0,0 +1,102 @@
+/*
+ * Live statistics page, shared with the readers through a mapped file
+ */
+
+#include <statpage.h>
+
+// standard headers
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include <sys/mman.h>
+
+
+struct stat_page *statpage_create(const char *path) {
+	struct stat_page *page;
+	struct timespec now;
+	int fd;
+
+	// a new file: readers of the previous one keep their own mapping
+	unlink(path);
+	if ((fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644))
+			== -1) {
+		perror("Cannot create the statistics file");
+		return NULL;
+	}
+	if (ftruncate(fd, sizeof(struct stat_page)) == -1) {
+		perror("Cannot size the statistics file");
+		close(fd);
+		return NULL;
+	}
+	page = mmap(NULL, sizeof(struct stat_page), PROT_READ | PROT_WRITE,
+			MAP_SHARED, fd, 0);
+	close(fd);
+	if (page == MAP_FAILED) {
+		perror("Cannot map the statistics file");
+		return NULL;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	page->pid = getpid();
+	page->started = (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+	page->updated = page->started;
+	atomic_init(&page->seq, 0);
+	page->version = STATPAGE_VERSION;
+	// the magic last: readers check it
+	atomic_thread_fence(memory_order_release);
+	page->magic = STATPAGE_MAGIC;
+	return page;
+}
+
+void statpage_publish(struct stat_page *page,
+		const struct stat_counters *counters) {
+	struct timespec now;
+	unsigned int seq = atomic_load_explicit(&page->seq, memory_order_relaxed);
+
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	// odd while writing
+	atomic_store_explicit(&page->seq, seq + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	page->updated = (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+	memcpy(&page->counters, counters, sizeof(struct stat_counters));
+	atomic_store_explicit(&page->seq, seq + 2, memory_order_release);
+}
+
+void statpage_close(struct stat_page *page, const char *path) {
+	if (page == NULL)
+		return;
+	munmap(page, sizeof(struct stat_page));
+	unlink(path);
+}
+
+const struct stat_page *statpage_open(const char *path) {
+	struct stat_page *page;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+		return NULL;
+	page = mmap(NULL, sizeof(struct stat_page), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (page == MAP_FAILED)
+		return NULL;
+	if (page->magic != STATPAGE_MAGIC || page->version != STATPAGE_VERSION) {
+		munmap(page, sizeof(struct stat_page));
+		return NULL;
+	}
+	return page;
+}
+
+void statpage_read(const struct stat_page *page, struct stat_page *copy) {
+	unsigned int before, after;
+
+	do {
+		before = atomic_load_explicit(&page->seq, memory_order_acquire);
+		memcpy(copy, page, sizeof(struct stat_page));
+		atomic_thread_fence(memory_order_acquire);
+		after = atomic_load_explicit(&page->seq, memory_order_relaxed);
+	} while ((before & 1) || before != after);
+}
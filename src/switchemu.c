@@ -0,0 +1,778 @@
+/*
+ * Switch emulator backend of the packet I/O: a CAM table and simulated hosts
+ * around the poisoner, on the virtual clock
+ */
+
+#include <switchemu.h>
+
+// standard headers
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <arpa/inet.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+#include <net/if_arp.h>
+
+// local headers
+#include <arp.h>
+#include <logger.h>
+#include <lowlat.h>
+#include <target.h>
+#include <utils.h>
+#include <vclock.h>
+
+
+#define PAYLOAD_MAGIC		0x454d5543	// "CUME"
+
+// what happened to the frames sent by the hosts
+#define FRAME_INTERCEPTED	1		// a copy reached the port of the poisoner
+#define FRAME_DELIVERED		2		// reached its destination directly
+#define FRAME_RELAYED		4		// reached its destination from the poisoner
+
+struct cam_entry {
+	uint64_t key;				// MAC address, 0 for free entries
+	int port;
+	uint64_t seen;				// last frame from the MAC, in virtual ns
+};
+
+struct emu_payload {
+	uint32_t magic;
+	uint32_t src;				// sending host
+	uint64_t id;
+	uint64_t sent;				// in virtual ns
+} __attribute__((packed));
+
+struct emu_frame {
+	struct ether_header eh;
+	struct iphdr ip;
+	struct udphdr udp;
+	struct emu_payload payload;
+} __attribute__((packed));
+
+// ARP replies of the hosts, waiting for their time
+struct emu_reply {
+	uint64_t time;
+	int port;
+	struct arp_pkt pkt;
+};
+
+struct emu_peer {
+	int fd;						// our end, -1 if the slot is free
+	int protocol;
+};
+
+struct emu_target {
+	struct in_addr ip;
+	uint64_t sent;				// frames sent to the target
+	uint64_t intercepted;		// switched to the poisoner
+	uint64_t flooded;			// to an unknown destination
+	uint64_t relayed;			// received from the poisoner
+};
+
+static struct switchemu_opts options;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+// network: host i is at first_ip + i, behind port i
+static in_addr_t first_ip;
+static int nhosts, poisoner_port;
+static int *target_of;			// per host: index in targets, or -1
+static struct emu_target *targets;
+static size_t ntargets;
+
+// CAM table
+static struct cam_entry *cam;
+static size_t cam_size, cam_count;
+static uint64_t aging;
+static uint64_t cam_moves, floods;
+
+// traffic: each host sends a frame per period, at its own phase
+static uint64_t period;
+static uint64_t *phases;
+static int *order;				// hosts by phase
+static int cursor;
+static uint64_t round_start;
+static uint64_t traffic_start = VCLOCK_NEVER, traffic_end;
+static uint64_t rng = SWITCHEMU_SEED;
+static uint8_t *states;			// per frame sent (FRAME_*)
+static uint64_t nsent, states_size;
+
+static struct emu_reply *replies;
+static size_t replies_head, replies_count, replies_size;
+
+// port of the poisoner
+static struct emu_peer peers[SWITCHEMU_SOCKETS];
+static int epollfd = -1;
+static atomic_int running;
+static pthread_t collector_thread;
+static uint64_t to_poisoner, port_drops;
+
+// results
+static uint64_t inflight, inflight_max, inflight_area, last_sample;
+static struct lat_stats relay_delay;
+static struct timespec real_start;
+
+/*
+ * Hosts
+ */
+void static host_mac(int host, uint8_t mac[ETH_ALEN]) {
+	in_addr_t ip = htonl(first_ip + host);
+
+	mac[0] = 0x02;				// locally administered
+	mac[1] = 0x00;
+	memcpy(mac + 2, &ip, sizeof(ip));
+}
+
+int static mac_host(const uint8_t mac[ETH_ALEN]) {
+	in_addr_t ip;
+
+	if (mac[0] != 0x02 || mac[1] != 0x00)
+		return -1;
+	memcpy(&ip, mac + 2, sizeof(ip));
+	ip = ntohl(ip) - first_ip;
+	return ip < (in_addr_t) nhosts ? (int) ip : -1;
+}
+
+// xorshift64*: the same traffic on each run
+uint64_t static inline random_next(void) {
+	rng ^= rng >> 12;
+	rng ^= rng << 25;
+	rng ^= rng >> 27;
+	return rng * 0x2545f4914f6cdd1dULL;
+}
+
+uint16_t static ip_checksum(const void *buf, size_t len) {
+	const uint16_t *p = buf;
+	uint32_t sum = 0;
+
+	for (; len > 1; len -= 2)
+		sum += *p++;
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	return ~sum;
+}
+
+/*
+ * CAM table: open addressing, entries are never removed but age
+ */
+int static cam_lookup(uint64_t key, uint64_t t) {
+	size_t i;
+
+	for (i = target_hash(key, cam_size); cam[i].key != 0;
+			i = (i + 1) & (cam_size - 1)) {
+		if (cam[i].key == key)
+			return t - cam[i].seen < aging ? cam[i].port : -1;
+	}
+	return -1;
+}
+
+void static cam_learn(uint64_t key, int port, uint64_t t) {
+	size_t i;
+
+	for (i = target_hash(key, cam_size); cam[i].key != 0 && cam[i].key != key;
+			i = (i + 1) & (cam_size - 1));
+	if (cam[i].key == 0) {
+		// full table: unknown MACs are not learnt anymore
+		if (cam_count == cam_size - 1)
+			return;
+		cam[i].key = key;
+		cam_count++;
+	} else if (cam[i].port != port && t - cam[i].seen < aging) {
+		cam_moves++;
+	}
+	cam[i].port = port;
+	cam[i].seen = t;
+}
+
+/*
+ * Frames
+ */
+struct emu_payload static *payload_of(const uint8_t *buf, size_t len) {
+	const struct emu_frame *f = (const struct emu_frame *) buf;
+
+	if (len < sizeof(struct emu_frame)
+			|| f->eh.ether_type != htons(ETHERTYPE_IP)
+			|| f->payload.magic != PAYLOAD_MAGIC
+			|| f->payload.id >= nsent)
+		return NULL;
+	return (struct emu_payload *) &f->payload;
+}
+
+void static mark_intercepted(const struct emu_payload *p) {
+	if (!(states[p->id] & FRAME_INTERCEPTED)) {
+		states[p->id] |= FRAME_INTERCEPTED;
+		inflight++;
+	}
+}
+
+// to all sockets of the poisoner for the protocol
+void static poisoner_receive(const void *buf, size_t len) {
+	const struct ether_header *eh = buf;
+	int i, arp = eh->ether_type == htons(ETHERTYPE_ARP);
+
+	for (i = 0; i < SWITCHEMU_SOCKETS; i++) {
+		if (peers[i].fd == -1 || (peers[i].protocol != ETH_P_ALL
+					&& !(arp && peers[i].protocol == ETH_P_ARP)))
+			continue;
+		if (send(peers[i].fd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL) != -1) {
+			to_poisoner++;
+		} else if (peers[i].protocol == ETH_P_ALL) {
+			// idle workers do not read their ARP sockets: not a drop
+			port_drops++;
+		}
+	}
+}
+
+void static queue_reply(uint64_t t, int port, const struct arp_pkt *pkt) {
+	struct emu_reply *r;
+	size_t i;
+
+	if (replies_count == replies_size) {
+		r = (struct emu_reply *) malloc(
+				2 * replies_size * sizeof(struct emu_reply));
+		if (r == NULL) {
+			log_warning("Cannot allocate memory for the emulated replies\n");
+			return;
+		}
+		for (i = 0; i < replies_count; i++)
+			r[i] = replies[(replies_head + i) % replies_size];
+		free(replies);
+		replies = r;
+		replies_head = 0;
+		replies_size *= 2;
+	}
+	r = &replies[(replies_head + replies_count++) % replies_size];
+	r->time = t;
+	r->port = port;
+	r->pkt = *pkt;
+}
+
+void static host_receive(int host, const uint8_t *buf, size_t len,
+		int in_port, uint64_t t) {
+	const struct ether_header *eh = (const struct ether_header *) buf;
+	const struct arp_pkt *req = (const struct arp_pkt *) buf;
+	const struct emu_payload *p;
+	struct arp_pkt rep;
+	in_addr_t tpa;
+
+	// ARP requests for the host are answered
+	if (eh->ether_type == htons(ETHERTYPE_ARP)) {
+		if (len < sizeof(struct arp_pkt)
+				|| req->ah.arp_op != htons(ARPOP_REQUEST))
+			return;
+		memcpy(&tpa, req->ah.arp_tpa, sizeof(tpa));
+		if (ntohl(tpa) != first_ip + host)
+			return;
+		memcpy(&rep, req, sizeof(rep));
+		memcpy(rep.eh.ether_dhost, req->ah.arp_sha, ETH_ALEN);
+		host_mac(host, rep.eh.ether_shost);
+		rep.ah.arp_op = htons(ARPOP_REPLY);
+		memcpy(rep.ah.arp_sha, rep.eh.ether_shost, ETH_ALEN);
+		memcpy(rep.ah.arp_spa, req->ah.arp_tpa, sizeof(tpa));
+		memcpy(rep.ah.arp_tha, req->ah.arp_sha, ETH_ALEN);
+		memcpy(rep.ah.arp_tpa, req->ah.arp_spa, sizeof(tpa));
+		queue_reply(t + SWITCHEMU_REPLY_DELAY, host, &rep);
+		return;
+	}
+
+	if ((p = payload_of(buf, len)) == NULL || mac_host(eh->ether_dhost) != host)
+		return;
+	if (in_port != poisoner_port) {
+		states[p->id] |= FRAME_DELIVERED;
+		return;
+	}
+	// relayed: once per frame, duplicates are ignored
+	if (states[p->id] & FRAME_RELAYED)
+		return;
+	states[p->id] |= FRAME_RELAYED;
+	if (states[p->id] & FRAME_INTERCEPTED)
+		inflight--;
+	lat_stats_add(&relay_delay, t - p->sent);
+	if (target_of[host] >= 0)
+		targets[target_of[host]].relayed++;
+}
+
+/*
+ * The switch: learn the source, forward to the port of the destination or
+ * flood the frame
+ */
+void static switch_frame(const uint8_t *buf, size_t len, int in_port,
+		uint64_t t) {
+	const struct ether_header *eh = (const struct ether_header *) buf;
+	const struct arp_pkt *arp = (const struct arp_pkt *) buf;
+	const struct emu_payload *p = NULL;
+	in_addr_t tpa;
+	int host, out;
+
+	if (len < sizeof(struct ether_header))
+		return;
+	if (!(eh->ether_shost[0] & 1))
+		cam_learn(mac_to_key(eh->ether_shost), in_port, t);
+
+	// broadcast & multicast: only ARP requests matter to the hosts
+	if (eh->ether_dhost[0] & 1) {
+		if (in_port != poisoner_port)
+			poisoner_receive(buf, len);
+		if (eh->ether_type == htons(ETHERTYPE_ARP)
+				&& len >= sizeof(struct arp_pkt)) {
+			memcpy(&tpa, arp->ah.arp_tpa, sizeof(tpa));
+			host = ntohl(tpa) - first_ip;
+			if (ntohl(tpa) >= first_ip && host < nhosts && host != in_port)
+				host_receive(host, buf, len, in_port, t);
+		}
+		return;
+	}
+
+	// frames of the hosts are followed
+	if (in_port != poisoner_port)
+		p = payload_of(buf, len);
+	host = mac_host(eh->ether_dhost);
+	out = cam_lookup(mac_to_key(eh->ether_dhost), t);
+
+	if (out == -1) {
+		floods++;
+		if (p != NULL && target_of[host] >= 0)
+			targets[target_of[host]].flooded++;
+		if (in_port != poisoner_port) {
+			poisoner_receive(buf, len);
+			if (p != NULL)
+				mark_intercepted(p);
+		}
+		if (host >= 0 && host != in_port)
+			host_receive(host, buf, len, in_port, t);
+	} else if (out == poisoner_port) {
+		poisoner_receive(buf, len);
+		if (p != NULL) {
+			mark_intercepted(p);
+			if (target_of[host] >= 0)
+				targets[target_of[host]].intercepted++;
+		}
+	} else if (out != in_port) {
+		host_receive(out, buf, len, in_port, t);
+	}
+}
+
+/*
+ * Traffic of the hosts
+ */
+uint64_t static traffic_next(void) {
+	uint64_t t;
+
+	if (traffic_start == VCLOCK_NEVER)
+		return VCLOCK_NEVER;
+	t = round_start + phases[order[cursor]];
+	return t < traffic_end ? t : VCLOCK_NEVER;
+}
+
+void static traffic_send(uint64_t t) {
+	uint8_t buf[SWITCHEMU_FRAME_SIZE];
+	struct emu_frame *f = (struct emu_frame *) buf;
+	uint8_t *s;
+	int src, dst;
+
+	src = order[cursor];
+	if (++cursor == nhosts) {
+		cursor = 0;
+		round_start += period;
+	}
+	dst = random_next() % (nhosts - 1);
+	if (dst >= src)
+		dst++;
+
+	if (nsent == states_size) {
+		s = (uint8_t *) realloc(states, 2 * states_size);
+		if (s == NULL) {
+			log_warning("Cannot allocate memory for the emulated frames\n");
+			return;
+		}
+		memset(s + states_size, 0, states_size);
+		states = s;
+		states_size *= 2;
+	}
+
+	memset(buf, 0, sizeof(buf));
+	host_mac(dst, f->eh.ether_dhost);
+	host_mac(src, f->eh.ether_shost);
+	f->eh.ether_type = htons(ETHERTYPE_IP);
+	f->ip.version = 4;
+	f->ip.ihl = 5;
+	f->ip.ttl = 64;
+	f->ip.protocol = IPPROTO_UDP;
+	f->ip.tot_len = htons(sizeof(buf) - sizeof(struct ether_header));
+	f->ip.saddr = htonl(first_ip + src);
+	f->ip.daddr = htonl(first_ip + dst);
+	f->ip.check = ip_checksum(&f->ip, sizeof(struct iphdr));
+	f->udp.source = htons(1024 + src % 1024);
+	f->udp.dest = htons(9);		// discard
+	f->udp.len = htons(sizeof(buf) - sizeof(struct ether_header)
+			- sizeof(struct iphdr));
+	f->payload.magic = PAYLOAD_MAGIC;
+	f->payload.src = src;
+	f->payload.id = nsent++;
+	f->payload.sent = t;
+
+	if (target_of[dst] >= 0)
+		targets[target_of[dst]].sent++;
+	switch_frame(buf, sizeof(buf), src, t);
+}
+
+/*
+ * Clock source
+ */
+void static remove_peer(int fd) {
+	int i;
+
+	for (i = 0; i < SWITCHEMU_SOCKETS; i++) {
+		if (peers[i].fd == fd)
+			peers[i].fd = -1;
+	}
+	epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, NULL);
+	close(fd);
+}
+
+// frames sent by the poisoner, switched at the current time
+void static collect(int fd, uint64_t t) {
+	uint8_t buf[MAX_PKT_SIZE];
+	ssize_t len;
+
+	while ((len = recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0)
+		switch_frame(buf, len, poisoner_port, t);
+	// the poisoner closed its end
+	if (len == 0 || (len == -1 && errno != EAGAIN))
+		remove_peer(fd);
+}
+
+uint64_t static switch_next(void *arg) {
+	uint64_t t;
+
+	pthread_mutex_lock(&lock);
+	t = traffic_next();
+	if (replies_count > 0)
+		t = MIN(t, replies[replies_head].time);
+	pthread_mutex_unlock(&lock);
+	if (t == VCLOCK_NEVER)
+		return t;
+	return (t + SWITCHEMU_TICK - 1) / SWITCHEMU_TICK * SWITCHEMU_TICK;
+}
+
+int static switch_run(uint64_t now, void *arg) {
+	uint64_t before, t;
+	int i;
+
+	pthread_mutex_lock(&lock);
+	before = to_poisoner;
+	for (i = 0; i < SWITCHEMU_SOCKETS; i++) {
+		if (peers[i].fd != -1)
+			collect(peers[i].fd, now);
+	}
+
+	// replies and traffic, in the order of their time
+	while (1) {
+		t = traffic_next();
+		if (replies_count > 0 && replies[replies_head].time <= t) {
+			t = replies[replies_head].time;
+			if (t > now)
+				break;
+			switch_frame((uint8_t *) &replies[replies_head].pkt,
+					sizeof(struct arp_pkt), replies[replies_head].port, t);
+			replies_head = (replies_head + 1) % replies_size;
+			replies_count--;
+		} else if (t <= now) {
+			traffic_send(t);
+		} else {
+			break;
+		}
+	}
+
+	// frames inside the poisoner, over the traffic
+	if (traffic_start != VCLOCK_NEVER && now > last_sample) {
+		inflight_area += inflight * (now - last_sample);
+		last_sample = now;
+	}
+	inflight_max = MAX(inflight_max, inflight);
+	pthread_mutex_unlock(&lock);
+	return to_poisoner - before;
+}
+
+static const struct vclock_source switch_source = {
+	.next = &switch_next,
+	.run = &switch_run,
+};
+
+/*
+ * The frames sent while the engine runs are switched at once: the socket
+ * buffers are not enough for the bursts of retransmissions
+ */
+void static *collector_main(void *arg) {
+	struct epoll_event events[16];
+	int i, n;
+
+	while (atomic_load(&running)) {
+		if ((n = epoll_wait(epollfd, events, 16, 100)) == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("Error while polling the emulated switch");
+			return NULL;
+		}
+		pthread_mutex_lock(&lock);
+		for (i = 0; i < n; i++) {
+			if (events[i].data.fd != -1)
+				collect(events[i].data.fd, vclock_now());
+		}
+		pthread_mutex_unlock(&lock);
+	}
+	return NULL;
+}
+
+/*
+ * Backend
+ */
+int static switch_socket(struct iface *iface, int type, int protocol) {
+	struct epoll_event ev;
+	uint64_t end = VCLOCK_NEVER;
+	int sv[2], i, size = 4 * 1024 * 1024;
+
+	// message boundaries like raw sockets, and a hang-up on close
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1) {
+		perror("Cannot open emulated socket");
+		exit(1);
+	}
+	for (i = 0; i < 2; i++) {
+		setsockopt(sv[i], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+		setsockopt(sv[i], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	}
+
+	pthread_mutex_lock(&lock);
+	for (i = 0; i < SWITCHEMU_SOCKETS && peers[i].fd != -1; i++);
+	if (i == SWITCHEMU_SOCKETS) {
+		pthread_mutex_unlock(&lock);
+		log_critical("Too many emulated sockets\n");
+		exit(1);
+	}
+	peers[i].fd = sv[1];
+	peers[i].protocol = protocol;
+
+	// the traffic starts with the attack, i.e. its capture socket
+	if (protocol == ETH_P_ALL && traffic_start == VCLOCK_NEVER) {
+		traffic_start = (vclock_now() + SWITCHEMU_TICK - 1)
+			/ SWITCHEMU_TICK * SWITCHEMU_TICK;
+		traffic_end = traffic_start + (uint64_t) options.duration * 1000000000;
+		round_start = traffic_start;
+		last_sample = traffic_start;
+		end = traffic_end + (uint64_t) SWITCHEMU_GRACE * 1000000;
+	}
+	pthread_mutex_unlock(&lock);
+
+	memset(&ev, 0, sizeof(struct epoll_event));
+	ev.events = EPOLLIN;
+	ev.data.fd = sv[1];
+	if (epoll_ctl(epollfd, EPOLL_CTL_ADD, sv[1], &ev) == -1) {
+		perror("Failed to add the emulated socket to the epoll");
+		exit(1);
+	}
+	if (end != VCLOCK_NEVER) {
+		vclock_set_end(end);
+		log_info("Traffic of %d hosts for %ds\n", nhosts, options.duration);
+	}
+	return sv[0];
+}
+
+static const struct pio_backend switch_backend = {
+	.name = "switch",
+	.socket = &switch_socket,
+};
+
+int static compare_phases(const void *a, const void *b) {
+	uint64_t pa = phases[*(const int *) a], pb = phases[*(const int *) b];
+
+	return pa < pb ? -1 : pa > pb;
+}
+
+int switchemu_open(const struct switchemu_opts *opts,
+		const struct in_addr *hosts, size_t nhosts_, struct iface *iface) {
+	sigset_t signals, old_signals;
+	in_addr_t mask;
+	size_t i;
+	int h;
+
+	options = *opts;
+	nhosts = opts->hosts;
+	poisoner_port = nhosts;
+	mask = ~0U << (32 - SWITCHEMU_PREFIX);
+	first_ip = FIRST_IP(hosts[0].s_addr, mask);
+	aging = (uint64_t) opts->aging * 1000000000;
+	period = 1000000000 / opts->rate;
+
+	target_of = (int *) malloc(nhosts * sizeof(int));
+	targets = (struct emu_target *) calloc(nhosts_,
+			sizeof(struct emu_target));
+	phases = (uint64_t *) malloc(nhosts * sizeof(uint64_t));
+	order = (int *) malloc(nhosts * sizeof(int));
+	for (cam_size = 1024; cam_size < 2 * (size_t) (nhosts + 1);
+			cam_size *= 2);
+	cam = (struct cam_entry *) calloc(cam_size, sizeof(struct cam_entry));
+	states_size = MAX((uint64_t) nhosts * opts->rate * opts->duration, 1024);
+	states = (uint8_t *) calloc(states_size, 1);
+	replies_size = 256;
+	replies = (struct emu_reply *) malloc(
+			replies_size * sizeof(struct emu_reply));
+	if (target_of == NULL || targets == NULL || phases == NULL
+			|| order == NULL || cam == NULL || states == NULL
+			|| replies == NULL) {
+		perror("Cannot allocate memory for the emulated switch");
+		exit(1);
+	}
+
+	// the targets must be emulated hosts
+	for (h = 0; h < nhosts; h++)
+		target_of[h] = -1;
+	for (i = 0; i < nhosts_; i++) {
+		h = hosts[i].s_addr - first_ip;
+		if (hosts[i].s_addr < first_ip || h >= nhosts) {
+			log_error("%s is not an emulated host (%s to %s)\n",
+					inet_htoa(hosts[i]), inet_htoa((struct in_addr)
+						{ first_ip }), inet_htoa((struct in_addr)
+						{ first_ip + nhosts - 1 }));
+			return 0;
+		}
+		targets[i].ip = hosts[i];
+		target_of[h] = i;
+	}
+	ntargets = nhosts_;
+
+	// hosts send at random phases of the period
+	for (h = 0; h < nhosts; h++) {
+		phases[h] = random_next() % period;
+		order[h] = h;
+	}
+	qsort(order, nhosts, sizeof(int), &compare_phases);
+
+	// the interface: the last address of the subnet
+	memset(iface, 0, sizeof(struct iface));
+	strncpy(iface->ifname, SWITCHEMU_IFNAME, IFNAMSIZ - 1);
+	iface->ifindex = 1;
+	iface->mask.s_addr = mask;
+	iface->ip.s_addr = LAST_IP(first_ip, mask);
+	iface->hwaddr[0] = 0x02;	// locally administered, not a host
+	iface->hwaddr[1] = 0x01;
+	iface->hwaddr[5] = 0x01;
+
+	for (h = 0; h < SWITCHEMU_SOCKETS; h++)
+		peers[h].fd = -1;
+	if ((epollfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+		perror("Failed to create the epoll of the emulated switch");
+		return 0;
+	}
+	lat_stats_init(&relay_delay);
+	atomic_store(&running, 1);
+
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	sigaddset(&signals, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &signals, &old_signals);
+	errno = pthread_create(&collector_thread, NULL, &collector_main, NULL);
+	pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+	if (errno != 0) {
+		perror("Cannot start the emulated switch");
+		return 0;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &real_start);
+	vclock_start(&switch_source);
+	pio_backend = &switch_backend;
+	log_info("%d hosts emulated behind a switch, %d frames/s each\n",
+			nhosts, opts->rate);
+	return 1;
+}
+
+void static report(void) {
+	struct timespec real_end;
+	uint64_t sent = 0, intercepted = 0, flooded = 0, relayed = 0;
+	uint64_t count = atomic_load(&relay_delay.count);
+	double real, traffic;
+	size_t i;
+
+	clock_gettime(CLOCK_MONOTONIC, &real_end);
+	real = (double) TS_DIFF_IN_NS(real_end, real_start) / 1e9;
+	traffic = traffic_start == VCLOCK_NEVER ? 0
+		: (double) (MIN(last_sample, traffic_end) - traffic_start) / 1e9;
+	for (i = 0; i < ntargets; i++) {
+		sent += targets[i].sent;
+		intercepted += targets[i].intercepted;
+		flooded += targets[i].flooded;
+		relayed += targets[i].relayed;
+	}
+
+	logger_print("Emulation: %d hosts, %d frames/s each: %.1fs of virtual "
+			"time (%.1fs of traffic) in %.3fs\n", nhosts, options.rate,
+			(double) vclock_now() / 1e9, traffic, real);
+	logger_print("Emulation: %lu frames to the targets: %lu intercepted "
+			"(%.1f%%), %lu flooded, %lu relayed\n", (unsigned long) sent,
+			(unsigned long) intercepted,
+			sent > 0 ? (double) intercepted * 100 / sent : 0,
+			(unsigned long) flooded, (unsigned long) relayed);
+	for (i = 0; i < ntargets && i < SWITCHEMU_REPORT_TARGETS; i++) {
+		logger_print("  %-15s %8lu sent, %8lu intercepted (%5.1f%%), "
+				"%8lu flooded, %8lu relayed\n", inet_htoa(targets[i].ip),
+				(unsigned long) targets[i].sent,
+				(unsigned long) targets[i].intercepted,
+				targets[i].sent > 0 ? (double) targets[i].intercepted * 100
+					/ targets[i].sent : 0,
+				(unsigned long) targets[i].flooded,
+				(unsigned long) targets[i].relayed);
+	}
+	logger_print("Emulation: %lu frames sent by the hosts, %lu relayed by "
+			"the poisoner", (unsigned long) nsent, (unsigned long) count);
+	if (count > 0) {
+		logger_print(" in %.3fms on average (%.3f to %.3f)",
+				(double) atomic_load(&relay_delay.sum) / count / 1e6,
+				(double) atomic_load(&relay_delay.min) / 1e6,
+				(double) atomic_load(&relay_delay.max) / 1e6);
+	}
+	logger_print("\n");
+	logger_print("Emulation: frames inside the poisoner: %lu at most, %.1f on "
+			"average, %lu never relayed\n", (unsigned long) inflight_max,
+			last_sample > traffic_start && traffic_start != VCLOCK_NEVER
+				? (double) inflight_area / (last_sample - traffic_start) : 0,
+			(unsigned long) inflight);
+	logger_print("Emulation: CAM table of %zu entries, %lu moves, %lu floods; "
+			"%lu frames to the poisoner, %lu dropped at its port\n",
+			cam_count, (unsigned long) cam_moves, (unsigned long) floods,
+			(unsigned long) to_poisoner, (unsigned long) port_drops);
+}
+
+void switchemu_close(void) {
+	int i;
+
+	if (pio_backend != &switch_backend)
+		return;
+	pio_backend = NULL;
+	vclock_stop();
+	atomic_store(&running, 0);
+	pthread_join(collector_thread, NULL);
+
+	report();
+
+	for (i = 0; i < SWITCHEMU_SOCKETS; i++) {
+		if (peers[i].fd != -1)
+			close(peers[i].fd);
+	}
+	close(epollfd);
+	free(target_of);
+	free(targets);
+	free(phases);
+	free(order);
+	free(cam);
+	free(states);
+	free(replies);
+}
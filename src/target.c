@@ -0,0 +1,131 @@
+/*
+ * Table of the intercepted hosts
+ */
+
+#include <target.h>
+
+// standard headers
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// local headers
+#include <arp.h>
+#include <logger.h>
+#include <utils.h>
+
+
+void static inline alloc_slots(struct target_table *t, size_t size) {
+	size_t i;
+
+	t->keys = (uint64_t *) malloc(size * sizeof(uint64_t));
+	t->slots = (uint32_t *) malloc(size * sizeof(uint32_t));
+	if (t->keys == NULL || t->slots == NULL) {
+		perror("Cannot allocate memory for the target table");
+		exit(1);
+	}
+	for (i = 0; i < size; i++)
+		t->keys[i] = TARGET_EMPTY_KEY;
+	t->size = size;
+}
+
+void static inline insert_slot(struct target_table *t, uint64_t key,
+		uint32_t index) {
+	size_t i;
+
+	for (i = target_hash(key, t->size); t->keys[i] != TARGET_EMPTY_KEY;
+			i = (i + 1) & (t->size - 1));
+	t->keys[i] = key;
+	t->slots[i] = index;
+}
+
+void target_table_init(struct target_table *t, size_t count) {
+	size_t size = TARGET_TABLE_MIN_SIZE;
+
+	while (size < 2 * count)
+		size *= 2;
+	alloc_slots(t, size);
+
+	t->max = count > 0 ? count : 1;
+	t->targets = (struct target *) malloc(t->max * sizeof(struct target));
+	if (t->targets == NULL) {
+		perror("Cannot allocate memory for the targets");
+		exit(1);
+	}
+	t->count = 0;
+	log_debug("Target table initialized with %zu slots\n", t->size);
+}
+
+void target_table_free(struct target_table *t) {
+	free(t->keys);
+	free(t->slots);
+	free(t->targets);
+	t->count = 0;
+	t->max = 0;
+	t->size = 0;
+	log_debug("Target table freed\n");
+}
+
+struct target *target_table_add(struct target_table *t, struct iface *iface,
+		struct in_addr ip) {
+	size_t i;
+	uint8_t *mac;
+	uint64_t *keys;
+	uint32_t *slots;
+	size_t size;
+	struct target *targets, *cur;
+
+	if ((mac = arp_cache_search_mac(ip)) == NULL) {
+		log_error("Host %s is not in the ARP cache\n", inet_htoa(ip));
+		return NULL;
+	}
+	if ((cur = target_table_lookup(t, mac)) != NULL) {
+		log_warning("Host %s is already a target\n", inet_htoa(ip));
+		return cur;
+	}
+
+	// increase the size of the targets array if needed
+	if (t->count == t->max) {
+		targets = (struct target *) realloc(t->targets,
+				2 * t->max * sizeof(struct target));
+		if (targets == NULL) {
+			log_warning("Cannot reallocate memory to extend targets\n");
+			return NULL;
+		}
+		t->targets = targets;
+		t->max *= 2;
+	}
+
+	// keep the load factor under 1/2
+	if (2 * (t->count + 1) > t->size) {
+		keys = t->keys;
+		slots = t->slots;
+		size = t->size;
+		alloc_slots(t, 2 * size);
+		for (i = 0; i < size; i++) {
+			if (keys[i] != TARGET_EMPTY_KEY)
+				insert_slot(t, keys[i], slots[i]);
+		}
+		free(keys);
+		free(slots);
+	}
+
+	// initialize the target and craft its poisoning frame
+	cur = &t->targets[t->count];
+	memset(cur, 0, sizeof(struct target));
+	memcpy(cur->mac, mac, ETH_ALEN);
+	cur->ip = ip;
+	cur->index = t->count;
+	if (!arp_poison(iface, cur->mac, &cur->poison, sizeof(cur->poison))) {
+		log_error("Failed to craft the frame of host %s\n", inet_htoa(ip));
+		return NULL;
+	}
+
+	insert_slot(t, mac_to_key(mac), t->count++);
+
+	log_info("Target #%i: %-16s at %02x:%02x:%02x:%02x:%02x:%02x\n",
+			cur->index, inet_htoa(ip),
+			cur->mac[0], cur->mac[1], cur->mac[2],
+			cur->mac[3], cur->mac[4], cur->mac[5]);
+	return cur;
+}
@@ -0,0 +1,178 @@
+/*
+ * Hashed hierarchical timing wheel, see timerwheel.h
+ */
+
+#include <timerwheel.h>
+
+// standard headers
+#include <string.h>
+
+
+#define SLOT(level, index)	((uint16_t) ((level) << TIMERWHEEL_BITS | (index)))
+#define SLOT_LEVEL(slot)	((slot) >> TIMERWHEEL_BITS)
+#define SLOT_INDEX(slot)	((slot) & TIMERWHEEL_MASK)
+
+void timer_wheel_init(struct timer_wheel *w, uint64_t now) {
+	memset(w, 0, sizeof(struct timer_wheel));
+	w->now = now;
+}
+
+static inline void set_used(struct timer_wheel *w, int level, int index) {
+	w->used[level][index / 64] |= 1ULL << (index % 64);
+}
+
+static inline void clear_used(struct timer_wheel *w, int level, int index) {
+	w->used[level][index / 64] &= ~(1ULL << (index % 64));
+}
+
+// first used slot of the level from index, -1 if none up to the last one
+static int next_used(const struct timer_wheel *w, int level, int index) {
+	uint64_t bits;
+	int word = index / 64;
+
+	bits = w->used[level][word] & (~0ULL << (index % 64));
+	for (;;) {
+		if (bits != 0)
+			return word * 64 + __builtin_ctzll(bits);
+		if (++word == TIMERWHEEL_SLOTS / 64)
+			return -1;
+		bits = w->used[level][word];
+	}
+}
+
+/*
+ * Place the timer after the current tick. A slot is visited again a whole turn
+ * after the current tick: each level holds the deadlines up to a turn ahead
+ */
+static void place(struct timer_wheel *w, struct timer *t) {
+	uint64_t expires = t->expires > w->now ? t->expires : w->now + 1;
+	uint64_t delta = expires - w->now;
+	int level, index;
+
+	for (level = 0; level < TIMERWHEEL_LEVELS - 1; level++) {
+		if (delta <= 1ULL << (TIMERWHEEL_BITS * (level + 1)))
+			break;
+	}
+	// beyond the last level: wait there for a turn, then be placed again
+	if (delta > 1ULL << (TIMERWHEEL_BITS * TIMERWHEEL_LEVELS))
+		expires = w->now + (1ULL << (TIMERWHEEL_BITS * TIMERWHEEL_LEVELS));
+	index = (expires >> (TIMERWHEEL_BITS * level)) & TIMERWHEEL_MASK;
+
+	t->slot = SLOT(level, index);
+	t->next = w->slots[level][index];
+	if (t->next != NULL)
+		t->next->pprev = &t->next;
+	t->pprev = &w->slots[level][index];
+	w->slots[level][index] = t;
+	set_used(w, level, index);
+	w->count++;
+}
+
+void timer_cancel(struct timer_wheel *w, struct timer *t) {
+	int level = SLOT_LEVEL(t->slot), index = SLOT_INDEX(t->slot);
+
+	if (t->pprev == NULL)
+		return;
+	*t->pprev = t->next;
+	if (t->next != NULL)
+		t->next->pprev = t->pprev;
+	t->next = NULL;
+	t->pprev = NULL;
+	w->count--;
+	// the expiring timers are in a list of their own, see run_slot
+	if (w->slots[level][index] == NULL)
+		clear_used(w, level, index);
+}
+
+void timer_add(struct timer_wheel *w, struct timer *t, uint64_t expires) {
+	timer_cancel(w, t);
+	t->expires = expires;
+	place(w, t);
+}
+
+// spread the slot of the level over the lower ones
+static void cascade(struct timer_wheel *w, int level, int index) {
+	struct timer *t, *next;
+
+	t = w->slots[level][index];
+	w->slots[level][index] = NULL;
+	clear_used(w, level, index);
+	for (; t != NULL; t = next) {
+		next = t->next;
+		w->count--;
+		place(w, t);
+	}
+}
+
+// expire the timers of the slot of level 0, at the tick now
+static void run_slot(struct timer_wheel *w, int index, uint64_t now,
+		void *args) {
+	struct timer *expired, *t;
+
+	// the callbacks may cancel the next timers: they are unlinked from a list
+	// of their own, one at a time
+	if ((expired = w->slots[0][index]) == NULL)
+		return;
+	w->slots[0][index] = NULL;
+	clear_used(w, 0, index);
+	expired->pprev = &expired;
+	while ((t = expired) != NULL) {
+		timer_cancel(w, t);
+		if (t->expires > now)
+			// moved beyond the last level, not due yet
+			timer_add(w, t, t->expires);
+		else
+			t->callback(t->data, args);
+	}
+}
+
+void timer_wheel_advance(struct timer_wheel *w, uint64_t now, void *args) {
+	uint64_t tick;
+	int level, index;
+
+	while (w->now < now) {
+		if (w->count == 0) {
+			w->now = now;
+			break;
+		}
+
+		// a turn of level 0 begins: bring the next slots down, from the
+		// highest level
+		tick = w->now + 1;
+		for (level = 1; level < TIMERWHEEL_LEVELS && (tick
+					& ((1ULL << (TIMERWHEEL_BITS * level)) - 1)) == 0; level++);
+		while (--level > 0) {
+			cascade(w, level, (tick >> (TIMERWHEEL_BITS * level))
+					& TIMERWHEEL_MASK);
+		}
+
+		// skip the empty slots, up to the end of the turn
+		if ((index = next_used(w, 0, tick & TIMERWHEEL_MASK)) == -1) {
+			w->now = tick | TIMERWHEEL_MASK;
+			if (w->now > now)
+				w->now = now;
+			continue;
+		}
+		tick = (tick & ~(uint64_t) TIMERWHEEL_MASK) + index;
+		if (tick > now) {
+			w->now = now;
+			break;
+		}
+		w->now = tick;
+		run_slot(w, index, tick, args);
+	}
+}
+
+int timer_wheel_timeout(const struct timer_wheel *w, int max) {
+	uint64_t tick = w->now + 1, timeout;
+	int index;
+
+	if (w->count == 0)
+		return max;
+	if ((index = next_used(w, 0, tick & TIMERWHEEL_MASK)) != -1)
+		timeout = (tick & ~(uint64_t) TIMERWHEEL_MASK) + index - w->now;
+	else
+		// the next turn of level 0, which may bring timers down
+		timeout = (tick | TIMERWHEEL_MASK) + 1 - w->now;
+	return timeout < (uint64_t) max ? (int) timeout : max;
+}
@@ -1,15 +1,21 @@
 
+#define _GNU_SOURCE	// for recvmmsg
+
 #include <utils.h>
 
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
 #include <time.h>
 
 #include <sys/epoll.h>
 #include <arpa/inet.h>
+#include <linux/errqueue.h>
+#include <linux/if_packet.h>
 
 #include <logger.h>
+#include <vclock.h>
 
 // Similar to inet_ntoa but with host endiannes as input
 char *inet_htoa(struct in_addr in) {
@@ -35,6 +41,25 @@ void ntoha(struct in_addr *in, struct in_addr *out) {
 	out->s_addr = ntohl(in->s_addr);
 }
 
+int cmsg_timestamp(struct msghdr *msg, struct timespec *ts) {
+	struct cmsghdr *cmsg;
+	struct scm_timestamping *tss;
+
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL;
+			cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET &&
+				cmsg->cmsg_type == SCM_TIMESTAMPING) {
+			// software timestamp first, hardware ones are not enabled
+			tss = (struct scm_timestamping *) CMSG_DATA(cmsg);
+			if (tss->ts[0].tv_sec == 0 && tss->ts[0].tv_nsec == 0)
+				return 0;
+			*ts = tss->ts[0];
+			return 1;
+		}
+	}
+	return 0;
+}
+
 // Helpers to make recvfrom calls with timeouts
 int recvfrom_with_timeout(int sock, const int timeout,
 		int (*callback)(void *buf, ssize_t buflen,
@@ -61,7 +86,7 @@ int recvfrom_with_timeout(int sock, const int timeout,
 	}
 
 	// do the delegation
-	ret = recvfrom_multiple_with_timeout(epollfd, timeout, callback, args);
+	ret = recvfrom_multiple_with_timeout(epollfd, timeout, 0, callback, args);
 
 	// clear the epoll
 	if (epoll_ctl(epollfd, EPOLL_CTL_DEL, sock, &ev) == -1) {
@@ -75,6 +100,7 @@ int recvfrom_with_timeout(int sock, const int timeout,
 }
 
 int recvfrom_multiple_with_timeout(int epollfd, const int timeout,
+		const int spin,
 		int (*callback)(void *buf, ssize_t buflen,
 			struct sockaddr *addr, socklen_t addr_l, void *args),
 		void *args) {
@@ -91,7 +117,7 @@ int recvfrom_multiple_with_timeout(int epollfd, const int timeout,
 	int nfds, i;
 
 	// retrieve the current time
-	if (clock_gettime(CLOCK_MONOTONIC_COARSE, &start_t) == -1) {
+	if (clock_now(CLOCK_MONOTONIC, &start_t) == -1) {
 		perror("Failed to get the initial clock time");
 		return -1;
 	}
@@ -101,14 +127,17 @@ int recvfrom_multiple_with_timeout(int epollfd, const int timeout,
 
 	// read response when available
 	while (1) {
-		// poll all given fd
-		nfds = epoll_wait(epollfd, events, MAX_EVENTS, timeout);
+		// poll all given fd. When spinning, never sleep in the kernel
+		nfds = clock_epoll_wait(epollfd, events, MAX_EVENTS, spin ? 0 : remaining_t);
 
 		// handle case of timeout & errors
 		if (nfds == -1) {
-			perror("Error while polling sockets");
-			return -1;
-		} else if (nfds == 0) {
+			if (errno != EINTR) {
+				perror("Error while polling sockets");
+				return -1;
+			}
+			nfds = 0;	// interrupted by a signal: go on until the timeout
+		} else if (nfds == 0 && !spin) {
 			// timeout
 			return 0;
 		}
@@ -133,14 +162,137 @@ int recvfrom_multiple_with_timeout(int epollfd, const int timeout,
 		}
 
 		// Compute the remaining time for the timeout
-		if (clock_gettime(CLOCK_MONOTONIC_COARSE, &current_t) == -1) {
+		if (clock_now(CLOCK_MONOTONIC, &current_t) == -1) {
 			perror("Failed to get the current clock time");
 			return -1;
 		}
 		remaining_t = timeout - TS_DIFF_IN_MS(current_t, start_t);
-		if (remaining_t < 0)
-			remaining_t = 0;
+		if (remaining_t <= 0)
+			return 0;	// timeout, even if frames keep coming
+
+	}
+	// never reached
+}
+
+int recvmmsg_multiple_with_timeout(int epollfd, const int timeout,
+		const int spin, struct rx_batch *batch,
+		int (*callback)(struct rx_batch *batch, void *args),
+		int (*event_callback)(int fd, void *args),
+		void *args) {
+
+	struct mmsghdr msgs[RX_BATCH_SIZE];
+	struct iovec iovs[RX_BATCH_SIZE];
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(struct scm_timestamping))];
+	} controls[RX_BATCH_SIZE];
+	struct timespec read_t;
+
+	struct timespec current_t, start_t;
+	int remaining_t;
+
+	struct epoll_event events[MAX_EVENTS];
+	int nfds, i, j, n;
+
+	// the message headers point to the buffers of the batch
+	memset(msgs, 0, sizeof(msgs));
+	for (j=0; j<RX_BATCH_SIZE; j++) {
+		iovs[j].iov_base = batch->bufs[j];
+		iovs[j].iov_len = MAX_PKT_SIZE;
+		msgs[j].msg_hdr.msg_iov = &iovs[j];
+		msgs[j].msg_hdr.msg_iovlen = 1;
+		msgs[j].msg_hdr.msg_name = &batch->addrs[j];
+		msgs[j].msg_hdr.msg_control = controls[j].buf;
+	}
+
+	// retrieve the current time
+	if (clock_now(CLOCK_MONOTONIC, &start_t) == -1) {
+		perror("Failed to get the initial clock time");
+		return -1;
+	}
+	remaining_t = timeout;
+
+	log_debug("Receiving messages for %ims\n", timeout);
+
+	// read response when available
+	while (1) {
+		// poll all given fd. When spinning, never sleep in the kernel
+		nfds = clock_epoll_wait(epollfd, events, MAX_EVENTS, spin ? 0 : remaining_t);
 
+		// handle case of timeout & errors
+		if (nfds == -1) {
+			if (errno != EINTR) {
+				perror("Error while polling sockets");
+				return -1;
+			}
+			nfds = 0;	// interrupted by a signal: go on until the timeout
+		} else if (nfds == 0 && !spin) {
+			// timeout
+			return 0;
+		}
+
+		// read a batch from all available fd
+		for (i=0; i<nfds; i++) {
+			// not a socket: let the caller handle the event
+			if (events[i].data.u64 & RX_EVENT_TAG) {
+				if (event_callback != NULL &&
+						event_callback((int) events[i].data.u64, args)) {
+					log_debug("Receive loop interrupted\n");
+					return 1;
+				}
+				continue;
+			}
+
+			for (j=0; j<RX_BATCH_SIZE; j++) {
+				msgs[j].msg_hdr.msg_namelen = sizeof(batch->addrs[j]);
+				msgs[j].msg_hdr.msg_controllen = sizeof(controls[j].buf);
+			}
+
+			// with MSG_TRUNC, the real length of truncated frames is given
+			n = recvmmsg(events[i].data.fd, msgs, RX_BATCH_SIZE,
+					MSG_DONTWAIT | MSG_TRUNC, NULL);
+
+			// handle errors
+			if (n == -1) {
+				if (errno == EAGAIN || errno == EWOULDBLOCK)
+					continue;
+				perror("Error while reading sockets");
+				return -1;
+			}
+
+			batch->count = n;
+			read_t.tv_sec = 0;
+			for (j=0; j<n; j++) {
+				batch->orig_lens[j] = msgs[j].msg_len;
+				batch->lens[j] = MIN(msgs[j].msg_len, MAX_PKT_SIZE);
+				batch->addr_ls[j] = msgs[j].msg_hdr.msg_namelen;
+				// no link-layer address (replayed frames): an incoming one
+				if (batch->addr_ls[j] == 0)
+					memset(&batch->addrs[j], 0, sizeof(struct sockaddr_ll));
+				if (!cmsg_timestamp(&msgs[j].msg_hdr, &batch->ts[j])) {
+					// no timestamp from the kernel: use the reading time
+					if (read_t.tv_sec == 0)
+						clock_now(CLOCK_REALTIME, &read_t);
+					batch->ts[j] = read_t;
+				}
+			}
+
+			// delegate to the callback
+			if (callback(batch, args)) {
+				// the callback return something different to 0, stop here
+				log_debug("Receive loop interrupted\n");
+				return 1;
+			}
+		}
+
+		// Compute the remaining time for the timeout
+		if (clock_now(CLOCK_MONOTONIC, &current_t) == -1) {
+			perror("Failed to get the current clock time");
+			return -1;
+		}
+		remaining_t = timeout - TS_DIFF_IN_MS(current_t, start_t);
+		if (remaining_t <= 0)
+			return 0;	// timeout, even if frames keep coming
 	}
 	// never reached
 }
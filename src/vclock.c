@@ -0,0 +1,140 @@
+/*
+ * Virtual clock of the engine, see vclock.h
+ */
+
+#include <vclock.h>
+
+// standard headers
+#include <stdatomic.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+
+// local headers
+#include <utils.h>
+
+
+int vclock_enabled = 0;
+
+static const struct vclock_source *source;
+static struct timespec base_mono, base_real;
+static atomic_uint_fast64_t now;	// written under the lock only
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static int busy, waiting, stopped;
+static uint64_t generation;
+static uint64_t deadline = VCLOCK_NEVER;	// earliest one of the waiting threads
+static uint64_t end = VCLOCK_NEVER;
+
+void vclock_start(const struct vclock_source *src) {
+	clock_gettime(CLOCK_MONOTONIC, &base_mono);
+	clock_gettime(CLOCK_REALTIME, &base_real);
+	source = src;
+	busy = 1;
+	vclock_enabled = 1;
+}
+
+uint64_t vclock_now(void) {
+	return atomic_load_explicit(&now, memory_order_acquire);
+}
+
+void static inline ts_add(struct timespec *ts, const struct timespec *base,
+		uint64_t ns) {
+	ts->tv_sec = base->tv_sec + ns / 1000000000;
+	ts->tv_nsec = base->tv_nsec + ns % 1000000000;
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+void vclock_gettime(clockid_t clock, struct timespec *ts) {
+	ts_add(ts, clock == CLOCK_REALTIME ? &base_real : &base_mono,
+			vclock_now());
+}
+
+/*
+ * Every thread waits: wake them up, after moving the time to the next
+ * deadline or event unless frames are already waiting to be read.
+ * Called with the lock held
+ */
+void static advance(void) {
+	uint64_t t, cur = vclock_now();
+
+	if (!stopped && source->run(cur, source->arg) == 0) {
+		t = MIN(deadline, source->next(source->arg));
+		if (t >= end) {
+			// the last events, then the engine is asked to stop
+			t = end;
+			stopped = 1;
+		}
+		if (t > cur && t != VCLOCK_NEVER) {
+			atomic_store_explicit(&now, t, memory_order_release);
+			source->run(t, source->arg);
+		}
+		if (stopped)
+			kill(getpid(), SIGTERM);
+	}
+
+	busy += waiting;
+	waiting = 0;
+	deadline = VCLOCK_NEVER;
+	generation++;
+	pthread_cond_broadcast(&cond);
+}
+
+int vclock_epoll_wait(int epollfd, struct epoll_event *events, int max,
+		int timeout) {
+	uint64_t until, gen;
+	int n;
+
+	pthread_mutex_lock(&lock);
+	until = timeout < 0 ? VCLOCK_NEVER
+		: vclock_now() + (uint64_t) timeout * 1000000;
+	while (1) {
+		pthread_mutex_unlock(&lock);
+		n = epoll_wait(epollfd, events, max, 0);
+		pthread_mutex_lock(&lock);
+		if (n != 0 || stopped || vclock_now() >= until)
+			break;
+
+		// nothing to read: the thread waits for the time to move
+		busy--;
+		waiting++;
+		deadline = MIN(deadline, until);
+		if (busy == 0) {
+			advance();
+		} else {
+			gen = generation;
+			while (gen == generation)
+				pthread_cond_wait(&cond, &lock);
+		}
+	}
+	pthread_mutex_unlock(&lock);
+	return n;
+}
+
+void vclock_busy(int delta) {
+	pthread_mutex_lock(&lock);
+	busy += delta;
+	if (busy == 0 && waiting > 0)
+		advance();
+	pthread_mutex_unlock(&lock);
+}
+
+void vclock_set_end(uint64_t t) {
+	pthread_mutex_lock(&lock);
+	end = t;
+	pthread_mutex_unlock(&lock);
+}
+
+void vclock_stop(void) {
+	pthread_mutex_lock(&lock);
+	stopped = 1;
+	busy += waiting;
+	waiting = 0;
+	generation++;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+}